@@ -0,0 +1,418 @@
+/* alog.c - buffered access log
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#ifdef TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include "alog.h"
+
+
+/* Defines. */
+#ifndef ACCESS_LOG_BUFSIZE
+#define ACCESS_LOG_BUFSIZE 65536	/* Per log file */
+#endif
+#ifndef ACCESS_LOG_MAX_VHOSTS
+#define ACCESS_LOG_MAX_VHOSTS 32	/* The rest go to the default log */
+#endif
+#ifndef ACCESS_LOG_FLUSH_SIZE
+#define ACCESS_LOG_FLUSH_SIZE (ACCESS_LOG_BUFSIZE / 2)
+#endif
+#define LINE_MAX_LEN 2048
+
+/* The Log struct, data queued in buf wraps around at ACCESS_LOG_BUFSIZE. */
+typedef struct {
+	char *host;		/* Virtual host, NULL for the default log */
+	char *path;
+	int fd;
+	size_t head;		/* Offset of oldest queued byte */
+	size_t len;		/* Number of queued bytes */
+	char *buf;
+} Log;
+
+/* Globals. */
+static char *template;		/* Path, possibly with a %s for the vhost */
+static Log logs[ACCESS_LOG_MAX_VHOSTS + 1];
+static int log_count = 0;
+static long line_count = 0, byte_count = 0, overflow_count = 0, drop_count = 0;
+
+
+/* Open a file, or connect to a UNIX socket, sockets never block */
+static int open_log(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd >= 0 || errno != ENXIO)
+		goto done;
+
+	/* Opening a UNIX socket fails with ENXIO */
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+done:
+	if (fd >= 0)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+/* Expand the template, only once, ASCII hostnames are allowed */
+static char *expand(const char *host, size_t hostlen)
+{
+	const char *ptr;
+	size_t i, len;
+	char *path;
+
+	if (!hostlen || host[0] == '.')
+		return NULL;
+	for (i = 0; i < hostlen; i++) {
+		if (!strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_", host[i]))
+			return NULL;
+	}
+
+	ptr = strstr(template, "%s");
+	len = strlen(template) - 2 + hostlen + 1;
+	path = malloc(len);
+	if (!path)
+		return NULL;
+
+	snprintf(path, len, "%.*s%.*s%s", (int)(ptr - template), template, (int)hostlen, host, ptr + 2);
+
+	return path;
+}
+
+static Log *find(const char *host)
+{
+	size_t len;
+	Log *l;
+	int i;
+
+	if (!host || !strstr(template, "%s"))
+		return &logs[0];
+
+	/* Same log regardless of port number */
+	len = strcspn(host, ":");
+	for (i = 1; i < log_count; i++) {
+		if (!strncmp(logs[i].host, host, len) && logs[i].host[len] == 0)
+			return &logs[i];
+	}
+
+	if (log_count > ACCESS_LOG_MAX_VHOSTS)
+		return &logs[0];
+
+	l = &logs[log_count];
+	l->path = expand(host, len);
+	if (!l->path)
+		return &logs[0];
+
+	l->host = strndup(host, len);
+	l->buf = malloc(ACCESS_LOG_BUFSIZE);
+	l->fd = open_log(l->path);
+	if (!l->host || !l->buf || l->fd < 0) {
+		syslog(LOG_ERR, "Failed opening access log %s: %s", l->path, strerror(errno));
+		if (l->fd >= 0)
+			close(l->fd);
+		free(l->host);
+		free(l->buf);
+		free(l->path);
+		memset(l, 0, sizeof(*l));
+		return &logs[0];
+	}
+	l->head = l->len = 0;
+	log_count++;
+
+	return l;
+}
+
+/* Write as much as possible of the queued data, the rest is kept for later */
+static void flush(Log *l)
+{
+	struct iovec iov[2];
+	ssize_t num;
+	size_t first;
+	int cnt;
+
+	while (l->len > 0 && l->fd >= 0) {
+		cnt   = 1;
+		first = ACCESS_LOG_BUFSIZE - l->head;
+		if (first > l->len)
+			first = l->len;
+
+		iov[0].iov_base = &l->buf[l->head];
+		iov[0].iov_len  = first;
+		if (first < l->len) {
+			iov[1].iov_base = l->buf;
+			iov[1].iov_len  = l->len - first;
+			cnt = 2;
+		}
+
+		num = writev(l->fd, iov, cnt);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				syslog(LOG_ERR, "Failed writing access log %s: %s", l->path, strerror(errno));
+			break;
+		}
+
+		l->head = (l->head + num) % ACCESS_LOG_BUFSIZE;
+		l->len -= num;
+	}
+
+	if (l->len == 0)
+		l->head = 0;
+}
+
+static void queue(Log *l, const char *line, size_t len)
+{
+	size_t tail, first;
+
+	/* Writer cannot keep up, e.g. a log socket backing up */
+	if (l->len + len > ACCESS_LOG_BUFSIZE) {
+		overflow_count++;
+		flush(l);
+		if (l->len + len > ACCESS_LOG_BUFSIZE) {
+			drop_count++;
+			return;
+		}
+	}
+
+	tail  = (l->head + l->len) % ACCESS_LOG_BUFSIZE;
+	first = ACCESS_LOG_BUFSIZE - tail;
+	if (first > len)
+		first = len;
+	memcpy(&l->buf[tail], line, first);
+	memcpy(l->buf, &line[first], len - first);
+	l->len += len;
+
+	line_count++;
+	byte_count += len;
+
+	/* Write in batches, or on the next alog_flush() tick */
+	if (l->len >= ACCESS_LOG_FLUSH_SIZE)
+		flush(l);
+}
+
+int alog_init(char *path)
+{
+	Log *l = &logs[0];
+
+	template = path;
+	if (strstr(template, "%s")) {
+		/* Default log, for requests without a (valid) vhost */
+		l->path = expand("default", 7);
+	} else
+		l->path = strdup(template);
+
+	l->buf = malloc(ACCESS_LOG_BUFSIZE);
+	if (!l->path || !l->buf) {
+		syslog(LOG_ERR, "Out of memory allocating access log");
+		return -1;
+	}
+
+	l->fd = open_log(l->path);
+	if (l->fd < 0) {
+		syslog(LOG_ERR, "Failed opening access log %s: %s", l->path, strerror(errno));
+		return -1;
+	}
+	l->head = l->len = 0;
+	log_count = 1;
+
+	return 0;
+}
+
+int alog_enabled(void)
+{
+	return log_count > 0;
+}
+
+const char *alog_date(void)
+{
+	static time_t prev = (time_t)-1;
+	static char date[40];
+	time_t now;
+
+	/* Only format the date when the second changes */
+	now = time(NULL);
+	if (now != prev) {
+		prev = now;
+		strftime(date, sizeof(date), "[%d/%b/%Y:%H:%M:%S +0000]", gmtime(&now));
+	}
+
+	return date;
+}
+
+void alog_printf(const char *host, const char *fmt, ...)
+{
+	char line[LINE_MAX_LEN];
+	size_t len;
+	va_list ap;
+	int num;
+
+	if (!log_count)
+		return;
+
+	va_start(ap, fmt);
+	num = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (num < 0)
+		return;
+
+	len = num;
+	if (len > sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	queue(find(host), line, len);
+}
+
+void alog_flush(void)
+{
+	int i;
+
+	for (i = 0; i < log_count; i++)
+		flush(&logs[i]);
+}
+
+/* Strip root from a path below it, keeping the slash, "/srv/www/x"
+** becomes "/x" for root "/srv/www/".  Returns -1 for paths outside.
+*/
+static int strip(char *path, const char *root)
+{
+	size_t len = strlen(root);
+
+	if (path[0] != '/')
+		return 0;	/* Relative to the webroot, same in the chroot */
+	if (strncmp(path, root, len))
+		return -1;
+
+	memmove(path, &path[len - 1], strlen(path) - len + 2);
+	return 0;
+}
+
+void alog_chroot(const char *root)
+{
+	int i;
+
+	if (!log_count)
+		return;
+
+	if (strip(template, root))
+		syslog(LOG_WARNING, "Access log %s is outside the chroot, you may not be able to re-open it", template);
+
+	for (i = 0; i < log_count; i++)
+		strip(logs[i].path, root);
+}
+
+void alog_reopen(void)
+{
+	int fd, i;
+
+	for (i = 0; i < log_count; i++) {
+		Log *l = &logs[i];
+
+		flush(l);
+
+		/* Keep the old file, if we cannot access the new one */
+		fd = open_log(l->path);
+		if (fd < 0) {
+			syslog(LOG_ERR, "Failed re-opening access log %s: %s", l->path, strerror(errno));
+			continue;
+		}
+
+		close(l->fd);
+		l->fd = fd;
+	}
+}
+
+void alog_exit(void)
+{
+	int i;
+
+	for (i = 0; i < log_count; i++) {
+		Log *l = &logs[i];
+
+		/* Last chance, wait for a slow socket reader */
+		if (l->fd >= 0)
+			fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL, 0) & ~O_NONBLOCK);
+		flush(l);
+		close(l->fd);
+		free(l->host);
+		free(l->path);
+		free(l->buf);
+		memset(l, 0, sizeof(*l));
+	}
+	log_count = 0;
+}
+
+void alog_getstats(struct alog_stats *st)
+{
+	st->lines     = line_count;
+	st->bytes     = byte_count;
+	st->overflows = overflow_count;
+	st->drops     = drop_count;
+
+	line_count = byte_count = overflow_count = drop_count = 0;
+}
@@ -0,0 +1,79 @@
+/* alog.h - buffered access log
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ALOG_H_
+#define ALOG_H_
+
+/* Open the access log, instead of sending each request to syslog().  If
+** path contains "%s" it is a template, each virtual host then gets its
+** own file, with "%s" replaced by the hostname, opened on first use.
+** A path that is a UNIX socket is connected to, as a stream.  Returns
+** -1 if the default log cannot be opened.
+*/
+extern int alog_init(char *path);
+
+/* Returns non-zero if an access log is set up with alog_init(). */
+extern int alog_enabled(void);
+
+/* Returns the current time as a CERN style date, for log lines,
+** "[10/Oct/2018:13:55:36 +0000]", only formatted once per second.
+*/
+extern const char *alog_date(void);
+
+/* Queue a log line for the given virtual host, or the default log if
+** host is NULL.  A newline is appended.
+*/
+extern void alog_printf(const char *host, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+/* Write out all queued log lines, call at least once per second.  A
+** full buffer is also flushed, on the spot, by alog_printf().
+*/
+extern void alog_flush(void);
+
+/* Make log paths below root relative to it, call after chroot(root),
+** or log files could not be re-opened.  Per-vhost logs are opened in
+** the chroot, so the template must be below root as well.
+*/
+extern void alog_chroot(const char *root);
+
+/* Flush and re-open all log files, for log rotation, e.g. on SIGHUP. */
+extern void alog_reopen(void);
+
+/* Flush and close all log files, usually in preparation for exitting. */
+extern void alog_exit(void);
+
+/* Counters, since the last call, for merecat_logstats() */
+struct alog_stats {
+	long lines;
+	long bytes;
+	long overflows;		/* Buffer full, flushed before the interval */
+	long drops;		/* Lines lost, buffer could not be flushed */
+};
+extern void alog_getstats(struct alog_stats *st);
+
+#endif /* ALOG_H_ */
@@ -70,11 +70,26 @@ static int read_config(char *fn)
 		CFG_BOOL("check-referer", cfg_false, CFGF_NONE),
 		CFG_STR ("charset", charset, CFGF_NONE),
 		CFG_INT ("cgi-limit", cgi_limit, CFGF_NONE),
+		CFG_INT ("workers", workers, CFGF_NONE),
 		CFG_STR ("cgi-pattern", cgi_pattern, CFGF_NONE),
+		CFG_STR ("fastcgi", fastcgi, CFGF_NONE),
+		CFG_INT ("fastcgi-pool", fastcgi_pool, CFGF_NONE),
+		CFG_INT ("send-buffer", send_buffer, CFGF_NONE), /* 0: Kernel default */
+		CFG_INT ("listen-backlog", listen_backlog, CFGF_NONE),
+		CFG_INT ("defer-accept", defer_accept, CFGF_NONE), /* 0: Disabled */
+		CFG_INT ("tcp-fastopen", tcp_fastopen, CFGF_NONE), /* 0: Disabled */
+		CFG_INT ("cache-size", cache_size, CFGF_NONE),
+		CFG_STR ("cache-manifest", cache_manifest, CFGF_NONE),
 		CFG_BOOL("list-dotfiles", cfg_false, CFGF_NONE),
 		CFG_STR ("local-pattern", NULL, CFGF_NONE),
 		CFG_STR ("url-pattern", NULL, CFGF_NONE),
 		CFG_INT ("max-age", DEFAULT_MAX_AGE, CFGF_NONE), /* 0: Disabled */
+		CFG_INT ("etag-limit", DEFAULT_ETAG_LIMIT, CFGF_NONE), /* -1: Always MD5 */
+		CFG_STR ("stats-path", stats_path, CFGF_NONE),
+		CFG_STR ("stats-allow", stats_allow, CFGF_NONE),
+		CFG_STR ("access-log", access_log, CFGF_NONE),
+		CFG_BOOL("access-log-timing", log_timing, CFGF_NONE),
+		CFG_INT ("slow-request", slow_request, CFGF_NONE), /* 0: Disabled */
 		CFG_STR ("username", user, CFGF_NONE),
 		CFG_STR ("hostname", hostname, CFGF_NONE),
 		CFG_BOOL("virtual-host", do_vhost, CFGF_NONE),
@@ -82,6 +97,10 @@ static int read_config(char *fn)
 		CFG_STR ("certfile", certfile, CFGF_NONE),
 		CFG_STR ("keyfile", keyfile, CFGF_NONE),
 		CFG_STR ("dhfile", dhfile, CFGF_NONE),
+		CFG_INT ("ssl-session-cache", ssl_session_cache, CFGF_NONE), /* 0: Per process */
+		CFG_INT ("ssl-session-timeout", ssl_session_timeout, CFGF_NONE),
+		CFG_BOOL("ssl-tickets", ssl_tickets, CFGF_NONE),
+		CFG_BOOL("http2", do_http2, CFGF_NONE),
 		CFG_END()
 	};
 
@@ -124,6 +143,27 @@ static int read_config(char *fn)
 	user = cfg_getstr(cfg, "username");
 	cgi_pattern = cfg_getstr(cfg, "cgi-pattern");
 	cgi_limit = cfg_getint(cfg, "cgi-limit");
+	fastcgi = cfg_getstr(cfg, "fastcgi");
+	fastcgi_pool = cfg_getint(cfg, "fastcgi-pool");
+	if (fastcgi_pool < 1)
+		fastcgi_pool = 1;
+	send_buffer = cfg_getint(cfg, "send-buffer");
+	if (send_buffer < 0)
+		send_buffer = 0;
+	listen_backlog = cfg_getint(cfg, "listen-backlog");
+	if (listen_backlog < 1)
+		listen_backlog = LISTEN_BACKLOG;
+	defer_accept = cfg_getint(cfg, "defer-accept");
+	if (defer_accept < 0)
+		defer_accept = 0;
+	tcp_fastopen = cfg_getint(cfg, "tcp-fastopen");
+	if (tcp_fastopen < 0)
+		tcp_fastopen = 0;
+	cache_size = cfg_getint(cfg, "cache-size");
+	cache_manifest = cfg_getstr(cfg, "cache-manifest");
+	workers = cfg_getint(cfg, "workers");
+	if (workers < 1)
+		workers = 1;
 	url_pattern = cfg_getstr(cfg, "url-pattern");
 	local_pattern = cfg_getstr(cfg, "local-pattern");
 
@@ -136,6 +176,14 @@ static int read_config(char *fn)
 
 	charset = cfg_getstr(cfg, "charset");
 	max_age = cfg_getint(cfg, "max-age");
+	etag_limit = cfg_getint(cfg, "etag-limit");
+	stats_path = cfg_getstr(cfg, "stats-path");
+	stats_allow = cfg_getstr(cfg, "stats-allow");
+	access_log = cfg_getstr(cfg, "access-log");
+	log_timing = cfg_getbool(cfg, "access-log-timing");
+	slow_request = cfg_getint(cfg, "slow-request");
+	if (slow_request < 0)
+		slow_request = 0;
 
 	do_ssl = cfg_getbool(cfg, "ssl");
 	if (do_ssl) {
@@ -150,8 +198,24 @@ static int read_config(char *fn)
 			syslog(LOG_ERR, "Missing SSL certificate file(s)");
 			goto error;
 		}
+
+		ssl_session_cache = cfg_getint(cfg, "ssl-session-cache");
+		if (ssl_session_cache < 0)
+			ssl_session_cache = 0;
+		ssl_session_timeout = cfg_getint(cfg, "ssl-session-timeout");
+		if (ssl_session_timeout < 1)
+			ssl_session_timeout = SSL_SESSION_TIMEOUT;
+		ssl_tickets = cfg_getbool(cfg, "ssl-tickets");
 	}
 
+	do_http2 = cfg_getbool(cfg, "http2");
+#ifndef ENABLE_HTTP2
+	if (do_http2) {
+		syslog(LOG_ERR, "%s is not built with HTTP/2 support", PACKAGE_NAME);
+		goto error;
+	}
+#endif
+
 #ifdef HAVE_ZLIB_H
 	compression_level = cfg_getint(cfg, "compression-level");
 	if (compression_level < Z_DEFAULT_COMPRESSION)
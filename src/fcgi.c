@@ -0,0 +1,646 @@
+/* fcgi.c - FastCGI client, and streams to forked CGI programs
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "fcgi.h"
+
+
+/* Defines. */
+#ifndef FASTCGI_BUFSIZE
+#define FASTCGI_BUFSIZE 65536	/* Response data buffered per connection */
+#endif
+
+#define FCGI_VERSION_1      1
+#define FCGI_BEGIN_REQUEST  1
+#define FCGI_ABORT_REQUEST  2
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS         4
+#define FCGI_STDIN          5
+#define FCGI_STDOUT         6
+#define FCGI_STDERR         7
+
+#define FCGI_RESPONDER      1
+#define FCGI_KEEP_CONN      1
+#define FCGI_REQUEST_COMPLETE 0
+
+#define FCGI_HEADER_LEN     8
+#define FCGI_MAX_CONTENT    65535
+#define FCGI_REQUEST_ID     1	/* No multiplexing, one request at a time */
+#define FCGI_RECORD_MAX     (FCGI_HEADER_LEN + FCGI_MAX_CONTENT + 255)
+
+struct backend {
+	int    fd;		/* -1 when not connected */
+	int    busy;
+	int    ended;		/* FCGI_END_REQUEST received */
+	int    keep;		/* Request completed, connection reusable */
+	int    raw;		/* CGI program, from backend_open() */
+	int    shut;		/* Raw: 1 shutdown() when sent, 2 done */
+
+	char  *obuf;		/* Records queued for the backend */
+	size_t osize, olen, ooff;
+
+	char  *ibuf;		/* Partial record from the backend */
+	size_t ilen;
+
+	char  *out;		/* FCGI_STDOUT data, not yet passed on */
+	size_t outsize, outlen, outoff;
+};
+
+/* Globals. */
+static struct backend *pool;
+static int pool_max = 0;
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static char *server_name;
+static long request_count = 0, connect_count = 0, error_count = 0;
+
+
+static void grow(char **buf, size_t *size, size_t need)
+{
+	size_t len = *size;
+
+	if (need <= len)
+		return;
+
+	if (!len)
+		len = 512;
+	while (len < need)
+		len *= 2;
+
+	*buf = realloc(*buf, len);
+	if (!*buf) {
+		syslog(LOG_CRIT, "Out of memory growing FastCGI buffer to %zu bytes", len);
+		exit(1);
+	}
+	*size = len;
+}
+
+/* Queue one record, content is at most FCGI_MAX_CONTENT bytes */
+static void record(struct backend *b, int type, const char *data, size_t len)
+{
+	size_t pad = (8 - (len % 8)) % 8;
+	unsigned char *hdr;
+
+	grow(&b->obuf, &b->osize, b->olen + FCGI_HEADER_LEN + len + pad);
+	hdr = (unsigned char *)&b->obuf[b->olen];
+	hdr[0] = FCGI_VERSION_1;
+	hdr[1] = type;
+	hdr[2] = (FCGI_REQUEST_ID >> 8) & 0xff;
+	hdr[3] = FCGI_REQUEST_ID & 0xff;
+	hdr[4] = (len >> 8) & 0xff;
+	hdr[5] = len & 0xff;
+	hdr[6] = pad;
+	hdr[7] = 0;
+	b->olen += FCGI_HEADER_LEN;
+
+	if (len)
+		memcpy(&b->obuf[b->olen], data, len);
+	b->olen += len;
+	memset(&b->obuf[b->olen], 0, pad);
+	b->olen += pad;
+}
+
+/* Split data in as many records as needed */
+static void records(struct backend *b, int type, const char *data, size_t len)
+{
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+		record(b, type, data, chunk);
+		data += chunk;
+		len  -= chunk;
+	}
+}
+
+static size_t pair_len(unsigned char *buf, size_t len)
+{
+	if (len < 128) {
+		buf[0] = len;
+		return 1;
+	}
+
+	buf[0] = ((len >> 24) & 0x7f) | 0x80;
+	buf[1] = (len >> 16) & 0xff;
+	buf[2] = (len >> 8) & 0xff;
+	buf[3] = len & 0xff;
+
+	return 4;
+}
+
+static int parse_address(char *address)
+{
+	struct addrinfo hints, *ai;
+	struct sockaddr_un *sun;
+	char *host, *port, *ptr;
+	int rc;
+
+	if (address[0] == '/') {
+		sun = (struct sockaddr_un *)&server;
+		if (strlen(address) >= sizeof(sun->sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		memset(&server, 0, sizeof(server));
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, address);
+		server_len = sizeof(*sun);
+
+		return 0;
+	}
+
+	host = strdup(address);
+	if (!host)
+		return -1;
+
+	port = strrchr(host, ':');
+	if (!port) {
+		free(host);
+		errno = EINVAL;
+		return -1;
+	}
+	*port++ = 0;
+
+	/* [::1]:9000 */
+	ptr = host;
+	if (ptr[0] == '[') {
+		ptr++;
+		ptr[strcspn(ptr, "]")] = 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(ptr, port, &hints, &ai);
+	free(host);
+	if (rc) {
+		syslog(LOG_ERR, "FastCGI backend %s: %s", address, gai_strerror(rc));
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(&server, ai->ai_addr, ai->ai_addrlen);
+	server_len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	return 0;
+}
+
+static int reconnect(struct backend *b)
+{
+	int fd;
+
+	fd = socket(server.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	if (connect(fd, (struct sockaddr *)&server, server_len) < 0 && errno != EINPROGRESS) {
+		syslog(LOG_ERR, "FastCGI backend %s: %s", server_name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	connect_count++;
+	b->fd = fd;
+
+	return 0;
+}
+
+static void disconnect(struct backend *b)
+{
+	if (b->fd >= 0)
+		close(b->fd);
+	b->fd = -1;
+}
+
+/* An idle connection may have been closed by the backend */
+static int alive(struct backend *b)
+{
+	char c;
+	ssize_t n;
+
+	n = recv(b->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 1;
+
+	/* EOF, error, or unexpected data from an idle backend */
+	disconnect(b);
+	return 0;
+}
+
+/* Handle one complete record from the backend */
+static void input(struct backend *b, unsigned char *rec, size_t len)
+{
+	unsigned char *data = rec + FCGI_HEADER_LEN;
+
+	switch (rec[1]) {
+	case FCGI_STDOUT:
+		if (b->outoff) {
+			memmove(b->out, &b->out[b->outoff], b->outlen - b->outoff);
+			b->outlen -= b->outoff;
+			b->outoff  = 0;
+		}
+		grow(&b->out, &b->outsize, b->outlen + len);
+		memcpy(&b->out[b->outlen], data, len);
+		b->outlen += len;
+		break;
+
+	case FCGI_STDERR:
+		while (len > 0 && (data[len - 1] == '\n' || data[len - 1] == '\r'))
+			len--;
+		if (len)
+			syslog(LOG_WARNING, "FastCGI: %.*s", (int)len, data);
+		break;
+
+	case FCGI_END_REQUEST:
+		b->ended = 1;
+		b->keep = len >= 5 && data[4] == FCGI_REQUEST_COMPLETE;
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+int fcgi_init(char *address, int max)
+{
+	int i;
+
+	if (!address || max < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (parse_address(address))
+		return -1;
+
+	pool = calloc(max, sizeof(struct backend));
+	if (!pool)
+		return -1;
+
+	for (i = 0; i < max; i++)
+		pool[i].fd = -1;
+	pool_max = max;
+	server_name = address;
+
+	return 0;
+}
+
+int fcgi_enabled(void)
+{
+	return pool_max > 0;
+}
+
+struct backend *fcgi_get(void)
+{
+	struct backend *b = NULL;
+	int i;
+
+	for (i = 0; i < pool_max; i++) {
+		if (pool[i].busy)
+			continue;
+
+		if (pool[i].fd >= 0 && alive(&pool[i])) {
+			b = &pool[i];
+			break;
+		}
+
+		if (!b)
+			b = &pool[i];
+	}
+
+	if (!b) {
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	if (b->fd < 0 && reconnect(b)) {
+		error_count++;
+		return NULL;
+	}
+
+	b->busy = 1;
+	b->ended = 0;
+	b->keep = 0;
+	b->olen = b->ooff = 0;
+	b->ilen = 0;
+	b->outlen = b->outoff = 0;
+
+	return b;
+}
+
+struct backend *backend_open(int fd)
+{
+	struct backend *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+
+	b->fd   = fd;
+	b->busy = 1;
+	b->raw  = 1;
+
+	return b;
+}
+
+void backend_put(struct backend *b)
+{
+	if (!b)
+		return;
+
+	if (b->raw) {
+		disconnect(b);
+		free(b->obuf);
+		free(b->out);
+		free(b);
+		return;
+	}
+
+	if (!b->ended || !b->keep)
+		disconnect(b);
+	b->busy = 0;
+}
+
+int backend_fd(struct backend *b)
+{
+	return b->fd;
+}
+
+void fcgi_begin(struct backend *b, char **envp, const char *body, size_t len)
+{
+	unsigned char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	unsigned char *p;
+	char *params = NULL;
+	size_t size = 0, plen = 0;
+	size_t nlen, vlen;
+	char *value;
+	int i;
+
+	request_count++;
+	record(b, FCGI_BEGIN_REQUEST, (char *)begin, sizeof(begin));
+
+	for (i = 0; envp[i]; i++) {
+		value = strchr(envp[i], '=');
+		if (!value)
+			continue;
+		nlen = value - envp[i];
+		vlen = strlen(++value);
+
+		grow(&params, &size, plen + 8 + nlen + vlen);
+		p = (unsigned char *)&params[plen];
+		plen += pair_len(p, nlen);
+		plen += pair_len((unsigned char *)&params[plen], vlen);
+		memcpy(&params[plen], envp[i], nlen);
+		plen += nlen;
+		memcpy(&params[plen], value, vlen);
+		plen += vlen;
+	}
+	records(b, FCGI_PARAMS, params, plen);
+	record(b, FCGI_PARAMS, NULL, 0);
+	free(params);
+
+	if (len)
+		backend_stdin(b, body, len);
+}
+
+void backend_stdin(struct backend *b, const char *buf, size_t len)
+{
+	if (b->raw) {
+		if (!len) {
+			b->shut = 1;
+			return;
+		}
+
+		grow(&b->obuf, &b->osize, b->olen + len);
+		memcpy(&b->obuf[b->olen], buf, len);
+		b->olen += len;
+		return;
+	}
+
+	if (!len) {
+		record(b, FCGI_STDIN, NULL, 0);
+		return;
+	}
+
+	records(b, FCGI_STDIN, buf, len);
+}
+
+int backend_send(struct backend *b)
+{
+	ssize_t n;
+
+	while (b->ooff < b->olen) {
+		n = send(b->fd, &b->obuf[b->ooff], b->olen - b->ooff, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			/* CGI programs may not read all of stdin, that's OK */
+			if (b->raw && (errno == EPIPE || errno == ECONNRESET))
+				break;
+
+			if (b->raw) {
+				syslog(LOG_ERR, "CGI input: %s", strerror(errno));
+				return -1;
+			}
+			syslog(LOG_ERR, "FastCGI backend %s: %s", server_name, strerror(errno));
+			error_count++;
+			return -1;
+		}
+		b->ooff += n;
+	}
+	b->olen = b->ooff = 0;
+
+	if (b->shut == 1) {
+		shutdown(b->fd, SHUT_WR);
+		b->shut = 2;
+	}
+
+	return 1;
+}
+
+/* Raw CGI output, as-is, until the program closes its stdout */
+static int recv_raw(struct backend *b)
+{
+	ssize_t n;
+
+	while (!b->ended) {
+		if (b->outlen - b->outoff >= FASTCGI_BUFSIZE)
+			return 0;
+
+		if (b->outoff) {
+			memmove(b->out, &b->out[b->outoff], b->outlen - b->outoff);
+			b->outlen -= b->outoff;
+			b->outoff  = 0;
+		}
+		grow(&b->out, &b->outsize, b->outlen + 16384);
+
+		n = recv(b->fd, &b->out[b->outlen], b->outsize - b->outlen, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			syslog(LOG_ERR, "CGI output: %s", strerror(errno));
+			return -1;
+		}
+		if (n == 0)
+			b->ended = 1;
+		b->outlen += n;
+	}
+
+	return 1;
+}
+
+int backend_recv(struct backend *b)
+{
+	unsigned char *rec;
+	size_t len, total;
+	ssize_t n;
+
+	if (b->raw)
+		return recv_raw(b);
+
+	if (!b->ibuf) {
+		b->ibuf = malloc(FCGI_RECORD_MAX);
+		if (!b->ibuf) {
+			syslog(LOG_CRIT, "Out of memory allocating FastCGI buffer");
+			exit(1);
+		}
+	}
+
+	while (!b->ended) {
+		/* Backpressure, let the caller pass on what we have first */
+		if (b->outlen - b->outoff >= FASTCGI_BUFSIZE)
+			return 0;
+
+		n = recv(b->fd, &b->ibuf[b->ilen], FCGI_RECORD_MAX - b->ilen, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			syslog(LOG_ERR, "FastCGI backend %s: %s", server_name, strerror(errno));
+			error_count++;
+			return -1;
+		}
+		if (n == 0) {
+			syslog(LOG_ERR, "FastCGI backend %s closed connection", server_name);
+			error_count++;
+			return -1;
+		}
+		b->ilen += n;
+
+		/* Handle all complete records */
+		rec = (unsigned char *)b->ibuf;
+		while (!b->ended && b->ilen >= FCGI_HEADER_LEN) {
+			len   = (rec[4] << 8) | rec[5];
+			total = FCGI_HEADER_LEN + len + rec[6];
+			if (b->ilen < total)
+				break;
+
+			input(b, rec, len);
+			rec     += total;
+			b->ilen -= total;
+		}
+		if (b->ilen && rec != (unsigned char *)b->ibuf)
+			memmove(b->ibuf, rec, b->ilen);
+	}
+
+	return 1;
+}
+
+char *backend_output(struct backend *b, size_t *lenP)
+{
+	*lenP = b->outlen - b->outoff;
+	return &b->out[b->outoff];
+}
+
+void backend_consume(struct backend *b, size_t len)
+{
+	b->outoff += len;
+	if (b->outoff >= b->outlen)
+		b->outoff = b->outlen = 0;
+}
+
+void fcgi_exit(void)
+{
+	int i;
+
+	for (i = 0; i < pool_max; i++) {
+		disconnect(&pool[i]);
+		free(pool[i].obuf);
+		free(pool[i].ibuf);
+		free(pool[i].out);
+	}
+	free(pool);
+	pool = NULL;
+	pool_max = 0;
+}
+
+void fcgi_logstats(long secs)
+{
+	int i, connected = 0, busy = 0;
+
+	if (!pool_max)
+		return;
+
+	for (i = 0; i < pool_max; i++) {
+		if (pool[i].fd >= 0)
+			connected++;
+		if (pool[i].busy)
+			busy++;
+	}
+
+	syslog(LOG_INFO, "  FastCGI - %d connected, %d busy, %ld requests (%g/sec), %ld connects, %ld errors",
+	       connected, busy, request_count, secs > 0 ? (float)request_count / secs : 0,
+	       connect_count, error_count);
+	request_count = connect_count = error_count = 0;
+}
@@ -0,0 +1,97 @@
+/* fcgi.h - FastCGI client, and streams to forked CGI programs
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef FCGI_H_
+#define FCGI_H_
+
+#include <sys/types.h>
+
+/* A backend, either a FastCGI connection from the pool, fcgi_get(), or
+** a forked CGI program, backend_open().  The backend_*() functions work
+** on both, at most one request at a time on each.
+*/
+struct backend;
+
+/* Set up a pool of max connections to a FastCGI backend, e.g. php-fpm.
+** The address is either a path to a UNIX socket, or HOST:PORT, which is
+** resolved here, so call this before chroot().  Returns -1 on error.
+*/
+extern int fcgi_init(char *address, int max);
+
+/* Returns non-zero if fcgi_init() has been called successfully. */
+extern int fcgi_enabled(void);
+
+/* Returns an idle connection from the pool, connecting a new one if
+** needed.  Returns (struct backend*) 0 if all connections are busy, or if
+** the backend is unreachable, with errno set.
+*/
+extern struct backend *fcgi_get(void);
+
+/* Done with a backend.  A FastCGI connection is closed if the request
+** did not end cleanly, or if the backend did not agree to keep it open.
+*/
+extern void backend_put(struct backend *b);
+
+/* Wrap a stream socket to a forked CGI program, non-blocking, data is
+** passed on as-is, without FastCGI records, and the end of the request
+** body is a shutdown().  It is not pooled, backend_put() closes it.
+*/
+extern struct backend *backend_open(int fd);
+
+/* The backend socket, for fdwatch. */
+extern int backend_fd(struct backend *b);
+
+/* Queue a new FastCGI request, with the CGI environment as parameters,
+** and the first len bytes of the request body.  Call backend_stdin() for
+** the rest, on either kind of backend, len 0 ends the body.
+*/
+extern void fcgi_begin(struct backend *b, char **envp, const char *body, size_t len);
+extern void backend_stdin(struct backend *b, const char *buf, size_t len);
+
+/* Send queued data to the backend without blocking.  Returns -1 on
+** error, 0 if there is more to send, or 1 if all is sent.
+*/
+extern int backend_send(struct backend *b);
+
+/* Receive from the backend without blocking, the response is collected
+** and returned by backend_output().  Returns -1 on error, 0 if there is
+** more to come, or 1 when the backend has ended the request, or a CGI
+** program has closed its stdout.
+*/
+extern int backend_recv(struct backend *b);
+
+/* The response received so far, and how much of it is passed on. */
+extern char *backend_output(struct backend *b, size_t *lenP);
+extern void  backend_consume(struct backend *b, size_t len);
+
+/* Close all FastCGI connections, usually in preparation for exitting. */
+extern void fcgi_exit(void);
+
+/* Generate debugging statistics syslog message. */
+extern void fcgi_logstats(long secs);
+
+#endif /* FCGI_H_ */
@@ -28,6 +28,7 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -59,6 +60,16 @@
 #include <sys/event.h>
 #endif				/* HAVE_SYS_EVENT_H */
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#ifndef HAVE_EPOLL
+#define HAVE_EPOLL
+#endif				/* !HAVE_EPOLL */
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP 0
+#endif				/* !EPOLLRDHUP */
+#endif				/* HAVE_SYS_EPOLL_H */
+
 #include "fdwatch.h"
 
 #ifdef HAVE_SELECT
@@ -78,6 +89,30 @@ static int *fd_rw;
 static void **fd_data;
 static int nreturned, next_ridx;
 
+#ifdef HAVE_EPOLL
+
+#define WHICH                  "epoll"
+#define INIT(nfiles)           epoll_init(nfiles)
+#define EXIT()                 epoll_exit()
+#define ADD_FD(fd, rw)         epoll_add_fd(fd, rw)
+#define MOD_FD(fd, rw)         epoll_mod_fd(fd, rw)
+#define DEL_FD(fd)             epoll_del_fd(fd)
+#define DRAINED_FD(fd)         epoll_drained_fd(fd)
+#define WATCH(timeout_msecs)   epoll_watch(timeout_msecs)
+#define CHECK_FD(fd)           epoll_check_fd(fd)
+#define GET_FD(ridx)           epoll_get_fd(ridx)
+
+static int epoll_init(int nfiles);
+static void epoll_exit(void);
+static void epoll_add_fd(int fd, int rw);
+static void epoll_mod_fd(int fd, int rw);
+static void epoll_del_fd(int fd);
+static void epoll_drained_fd(int fd);
+static int epoll_watch(long timeout_msecs);
+static int epoll_check_fd(int fd);
+static int epoll_get_fd(int ridx);
+
+#else				/* HAVE_EPOLL */
 #ifdef HAVE_KQUEUE
 
 #define WHICH                  "kevent"
@@ -161,6 +196,18 @@ static int select_get_fd(int ridx);
 #  endif			/* HAVE_POLL */
 # endif				/* HAVE_DEVPOLL */
 #endif				/* HAVE_KQUEUE */
+#endif				/* HAVE_EPOLL */
+
+/* Backends without native support for changing the direction of a
+** descriptor simply delete and re-add it.  Edge-triggered mode is only
+** available with epoll, for the others FDW_EDGE is ignored.
+*/
+#ifndef MOD_FD
+#define MOD_FD(fd, rw)         do { DEL_FD(fd); ADD_FD(fd, rw); } while (0)
+#endif
+#ifndef DRAINED_FD
+#define DRAINED_FD(fd)
+#endif
 
 
 /* Routines. */
@@ -190,7 +237,7 @@ int fdwatch_get_nfiles(void)
 	}
 #endif
 
-#if defined(HAVE_SELECT) && ! ( defined(HAVE_POLL) || defined(HAVE_DEVPOLL) || defined(HAVE_KQUEUE) )
+#if defined(HAVE_SELECT) && ! ( defined(HAVE_POLL) || defined(HAVE_DEVPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_EPOLL) )
 	/* If we use select(), then we must limit ourselves to FD_SETSIZE. */
 	nfiles = MIN(nfiles, FD_SETSIZE);
 #endif
@@ -227,7 +274,9 @@ void fdwatch_put_nfiles(void)
 	EXIT();
 }
 
-/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE.  */
+/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE,
+** optionally OR:ed with FDW_EDGE.
+*/
 void fdwatch_add_fd(int fd, void *arg, int rw)
 {
 	if (fd < 0 || fd >= nfiles || fd_rw[fd] != -1) {
@@ -235,7 +284,27 @@ void fdwatch_add_fd(int fd, void *arg, int rw)
 		return;
 	}
 
+#ifndef HAVE_EPOLL
+	rw &= ~FDW_EDGE;
+#endif
 	ADD_FD(fd, rw);
+	fd_rw[fd] = rw & ~FDW_EDGE;
+	fd_data[fd] = arg;
+}
+
+
+/* Change direction of a descriptor already on the watch list. */
+void fdwatch_mod_fd(int fd, void *arg, int rw)
+{
+	if (fd < 0 || fd >= nfiles || fd_rw[fd] == -1) {
+		syslog(LOG_ERR, "bad fd (%d) passed to fdwatch_mod_fd!", fd);
+		return;
+	}
+
+	/* Edge-triggered mode can only be set by fdwatch_add_fd() */
+	rw &= ~FDW_EDGE;
+	if (fd_rw[fd] != rw)
+		MOD_FD(fd, rw);
 	fd_rw[fd] = rw;
 	fd_data[fd] = arg;
 }
@@ -254,6 +323,18 @@ void fdwatch_del_fd(int fd)
 	fd_data[fd] = NULL;
 }
 
+
+/* I/O on an edge-triggered descriptor returned EAGAIN, disarm it. */
+void fdwatch_drained_fd(int fd)
+{
+	if (fd < 0 || fd >= nfiles || fd_rw[fd] == -1) {
+		syslog(LOG_ERR, "bad fd (%d) passed to fdwatch_drained_fd!", fd);
+		return;
+	}
+
+	DRAINED_FD(fd);
+}
+
 /* Do the watch.  Return value is the number of descriptors that are ready,
 ** or 0 if the timeout expired, or -1 on errors.  A timeout of INFTIM means
 ** wait indefinitely.
@@ -304,6 +385,266 @@ void fdwatch_logstats(long secs)
 }
 
 
+#ifdef HAVE_EPOLL
+
+/* Per-descriptor state.  Edge-triggered descriptors are registered for
+** both directions once, with EPOLLET, and the events the kernel reports
+** are latched in user space until the caller has drained the descriptor.
+** This way a READ <--> WRITE flip costs no system call, and no edge is
+** lost if it arrives while we're watching the other direction.
+*/
+struct epfd {
+	int      ridx;		/* Index in ep_rfds[] of last watch */
+	int      pidx;		/* Index in ep_pending[], or -1 */
+	int      edge;		/* Edge-triggered descriptor */
+	uint32_t latch;		/* Edge-triggered events not yet drained */
+	uint32_t revents;	/* Events reported by last watch */
+};
+
+static int ep;
+static struct epoll_event *epevents;
+static struct epfd *epfds;
+static int *ep_rfds;
+static int *ep_pending;
+static int nep_pending;
+
+
+static uint32_t epoll_mask(int rw)
+{
+	if (rw == FDW_WRITE)
+		return EPOLLOUT | EPOLLERR | EPOLLHUP;
+
+	return EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+}
+
+
+/* Keep ep_pending[] in sync with latched events for the direction rw */
+static void epoll_pend(int fd, int rw)
+{
+	struct epfd *e = &epfds[fd];
+
+	if (e->latch & epoll_mask(rw)) {
+		if (e->pidx == -1) {
+			e->pidx = nep_pending;
+			ep_pending[nep_pending++] = fd;
+		}
+	} else if (e->pidx != -1) {
+		--nep_pending;
+		ep_pending[e->pidx] = ep_pending[nep_pending];
+		epfds[ep_pending[e->pidx]].pidx = e->pidx;
+		e->pidx = -1;
+	}
+}
+
+
+static int epoll_init(int nfiles)
+{
+	int i;
+
+	ep = epoll_create(nfiles);
+	if (ep == -1)
+		return -1;
+
+	fcntl(ep, F_SETFD, FD_CLOEXEC);
+
+	epevents   = (struct epoll_event *)calloc(nfiles, sizeof(struct epoll_event));
+	epfds      = (struct epfd *)calloc(nfiles, sizeof(struct epfd));
+	ep_rfds    = (int *)calloc(nfiles, sizeof(int));
+	ep_pending = (int *)calloc(nfiles, sizeof(int));
+	if (!epevents || !epfds || !ep_rfds || !ep_pending) {
+		epoll_exit();
+		return -1;
+	}
+
+	for (i = 0; i < nfiles; ++i)
+		epfds[i].ridx = epfds[i].pidx = -1;
+	nep_pending = 0;
+
+	return 0;
+}
+
+
+static void epoll_exit(void)
+{
+	close(ep);
+	free(epevents);
+	free(epfds);
+	free(ep_rfds);
+	free(ep_pending);
+}
+
+
+static void epoll_add_fd(int fd, int rw)
+{
+	struct epoll_event ev;
+	struct epfd *e = &epfds[fd];
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+
+	e->edge  = rw & FDW_EDGE;
+	e->latch = 0;
+	if (e->edge) {
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	} else {
+		switch (rw) {
+		case FDW_READ:
+			ev.events = EPOLLIN;
+			break;
+
+		case FDW_WRITE:
+			ev.events = EPOLLOUT;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1)
+		syslog(LOG_ERR, "failed adding fd %d in epoll_add_fd: %m", fd);
+}
+
+
+static void epoll_mod_fd(int fd, int rw)
+{
+	struct epoll_event ev;
+
+	/* Already watching both directions, no need to bother the kernel */
+	if (epfds[fd].edge) {
+		epoll_pend(fd, rw);
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	switch (rw) {
+	case FDW_READ:
+		ev.events = EPOLLIN;
+		break;
+
+	case FDW_WRITE:
+		ev.events = EPOLLOUT;
+		break;
+
+	default:
+		break;
+	}
+
+	if (epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev) == -1)
+		syslog(LOG_ERR, "failed modifying fd %d in epoll_mod_fd: %m", fd);
+}
+
+
+static void epoll_del_fd(int fd)
+{
+	struct epoll_event ev;	/* Pre 2.6.9 kernels require non-NULL */
+	struct epfd *e = &epfds[fd];
+
+	e->latch = 0;
+	epoll_pend(fd, fd_rw[fd]);
+	e->edge = 0;
+
+	memset(&ev, 0, sizeof(ev));
+	if (epoll_ctl(ep, EPOLL_CTL_DEL, fd, &ev) == -1 && errno != EBADF && errno != ENOENT)
+		syslog(LOG_ERR, "failed removing fd %d in epoll_del_fd: %m", fd);
+}
+
+
+static void epoll_drained_fd(int fd)
+{
+	struct epfd *e = &epfds[fd];
+
+	if (!e->edge)
+		return;
+
+	if (fd_rw[fd] == FDW_WRITE)
+		e->latch &= ~EPOLLOUT;
+	else
+		e->latch &= ~(EPOLLIN | EPOLLRDHUP);
+	epoll_pend(fd, fd_rw[fd]);
+}
+
+
+static int epoll_watch(long timeout_msecs)
+{
+	int i, r, fd, nr = 0;
+	struct epfd *e;
+
+	/* Latched edge-triggered events must be served without delay */
+	if (nep_pending > 0)
+		timeout_msecs = 0;
+
+	r = epoll_wait(ep, epevents, nfiles, (int)timeout_msecs);
+	if (r == -1)
+		return -1;
+
+	for (i = 0; i < r; ++i) {
+		fd = epevents[i].data.fd;
+		if (fd < 0 || fd >= nfiles)
+			continue;
+
+		e = &epfds[fd];
+		if (e->edge) {
+			e->latch |= epevents[i].events;
+			epoll_pend(fd, fd_rw[fd]);
+			continue;
+		}
+
+		e->revents = epevents[i].events;
+		e->ridx = nr;
+		ep_rfds[nr++] = fd;
+	}
+
+	/* Edge-triggered descriptors, old and new, with events to serve */
+	for (i = 0; i < nep_pending; ++i) {
+		fd = ep_pending[i];
+		e = &epfds[fd];
+
+		e->revents = e->latch;
+		e->ridx = nr;
+		ep_rfds[nr++] = fd;
+	}
+
+	return nr;
+}
+
+
+static int epoll_check_fd(int fd)
+{
+	struct epfd *e = &epfds[fd];
+	int ridx = e->ridx;
+
+	if (ridx < 0 || ridx >= nreturned || ep_rfds[ridx] != fd)
+		return 0;
+
+	if (e->revents & EPOLLERR)
+		return 0;
+
+	switch (fd_rw[fd]) {
+	case FDW_READ:
+		return (e->revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0;
+
+	case FDW_WRITE:
+		return (e->revents & (EPOLLOUT | EPOLLHUP)) != 0;
+	}
+
+	return 0;
+}
+
+
+static int epoll_get_fd(int ridx)
+{
+	if (ridx < 0 || ridx >= nfiles) {
+		syslog(LOG_ERR, "bad ridx (%d) in epoll_get_fd!", ridx);
+		return -1;
+	}
+
+	return ep_rfds[ridx];
+}
+
+#else /* HAVE_EPOLL */
+
 #ifdef HAVE_KQUEUE
 
 static int maxkqevents;
@@ -957,3 +1298,5 @@ static int select_get_fd(int ridx)
 # endif				/* HAVE_DEVPOLL */
 
 #endif				/* HAVE_KQUEUE */
+
+#endif				/* HAVE_EPOLL */
@@ -49,6 +49,7 @@
 
 #define FDW_READ 0
 #define FDW_WRITE 1
+#define FDW_EDGE 0x10		/* OR:ed with FDW_READ/FDW_WRITE, see below */
 
 #ifndef INFTIM
 #define INFTIM -1
@@ -62,12 +63,28 @@ extern int fdwatch_get_nfiles(void);
 /* Free initialized fdwatch data structues at exit */
 extern void fdwatch_put_nfiles(void);
 
-/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE.  */
+/* Add a descriptor to the watch list.  rw is either FDW_READ or FDW_WRITE,
+** optionally OR:ed with FDW_EDGE to request edge-triggered mode.  Only the
+** epoll backend honors FDW_EDGE, the others silently ignore it.  The caller
+** of an edge-triggered descriptor must call fdwatch_drained_fd() when I/O
+** returns EAGAIN, until then the descriptor is reported as ready.
+*/
 extern void fdwatch_add_fd(int fd, void *arg, int rw);
 
+/* Change direction, FDW_READ or FDW_WRITE, of a descriptor already on the
+** watch list.  Cheaper than fdwatch_del_fd() + fdwatch_add_fd(), and free
+** for edge-triggered descriptors.
+*/
+extern void fdwatch_mod_fd(int fd, void *arg, int rw);
+
 /* Delete a descriptor from the watch list. */
 extern void fdwatch_del_fd(int fd);
 
+/* Tell fdwatch that I/O on an edge-triggered descriptor returned EAGAIN,
+** it will not be reported again until the kernel signals a new edge.
+*/
+extern void fdwatch_drained_fd(int fd);
+
 /* Do the watch.  Return value is the number of descriptors that are ready,
 ** or 0 if the timeout expired, or -1 on errors.  A timeout of INFTIM means
 ** wait indefinitely.
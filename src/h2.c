@@ -0,0 +1,748 @@
+/* h2.c - HTTP/2 connections, using libnghttp2
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Each stream of a connection gets an httpd_conn of its own.  The request
+** headers are turned back into an HTTP/1.1 style request in its read_buf,
+** so parsing, resolving and starting the response is all left to libhttpd
+** as usual.  The response text it sets up becomes a HEADERS frame, and the
+** body, the file, its cached gzip copy, or zlib on the fly, is sent as DATA
+** frames straight from the mapped file, like handle_send() does.
+*/
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#include <nghttp2/nghttp2.h>
+
+#include "fdwatch.h"
+#include "h2.h"
+#include "merecat.h"
+#include "timers.h"
+
+
+/* Defines. */
+#define H2_OUTPUT_SIZE  65536	/* Frames gathered for one write */
+#define H2_MAX_HEADERS  32	/* Response headers, more than send_mime() ever adds */
+#define H2_MAX_REQUEST  5000	/* Request header list, as for HTTP/1.1 in handle_read() */
+
+#define H2_PREFACE      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+struct h2_stream {
+	struct h2_stream *next;	/* Open streams of a connection, or pool */
+	int32_t id;
+	int     started;	/* Handed to h2_ops.request() */
+	int     deferred;	/* Body waiting for h2_throttle() */
+
+	char   *method, *path, *authority;
+	size_t  maxmethod, maxpath, maxauthority;
+	int     headers;	/* Request line added to read_buf */
+	size_t  hdrlen;		/* Header list size so far, RFC 7540, 6.5.2 */
+
+	char   *inl;		/* Body in hc.response, e.g. an error page */
+	size_t  inlen;
+	off_t   off, end;	/* File body left to send */
+#ifdef HAVE_ZLIB_H
+	int     zs_on;		/* Deflating on the fly */
+	int     zs_done;
+	off_t   zs_in;		/* File offset of next input */
+	z_stream zs;
+#endif
+	struct httpd_conn hc;
+};
+
+struct h2 {
+	nghttp2_session *session;
+	struct httpd_conn *hc;	/* The client connection */
+	const struct h2_ops *ops;
+	void   *arg;
+	struct timeval *tv;	/* Of the current call */
+	int     rw;		/* Direction the caller watches */
+
+	struct h2_stream *streams;
+	long    quota;		/* DATA bytes allowed, -1 unlimited */
+
+	const uint8_t *pend;	/* Rest of nghttp2_session_mem_send() data */
+	size_t  pendlen;
+	size_t  outlen, outoff;
+	char    out[H2_OUTPUT_SIZE];
+};
+
+static nghttp2_session_callbacks *callbacks;
+
+/* Closed streams are kept, with their buffers, for the next ones */
+static struct h2_stream *pool;
+static int pooled;
+
+
+static char *keep(char **str, size_t *max, const uint8_t *val, size_t len)
+{
+	httpd_realloc_str(str, max, len);
+	memcpy(*str, val, len);
+	(*str)[len] = 0;
+
+	return *str;
+}
+
+/* Append to the request text in read_buf, for httpd_got_request() */
+static void add_request(struct httpd_conn *hc, const char *str, size_t len)
+{
+	httpd_realloc_str(&hc->read_buf, &hc->read_size, hc->read_idx + len);
+	memcpy(&hc->read_buf[hc->read_idx], str, len);
+	hc->read_idx += len;
+}
+
+static void add_request_line(struct h2_stream *s)
+{
+	struct httpd_conn *hc = &s->hc;
+
+	if (s->headers)
+		return;
+	s->headers = 1;
+
+	add_request(hc, s->method, strlen(s->method));
+	add_request(hc, " ", 1);
+	add_request(hc, s->path, strlen(s->path));
+	add_request(hc, " HTTP/2.0\r\n", 11);
+	if (s->authority[0]) {
+		add_request(hc, "Host: ", 6);
+		add_request(hc, s->authority, strlen(s->authority));
+		add_request(hc, "\r\n", 2);
+	}
+}
+
+static struct h2_stream *stream_new(struct h2 *h2, int32_t id)
+{
+	struct httpd_conn *parent = h2->hc;
+	struct h2_stream *s;
+	struct httpd_conn *hc;
+
+	if (pool) {
+		s = pool;
+		pool = s->next;
+		pooled--;
+	} else {
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			return NULL;
+		keep(&s->method, &s->maxmethod, (const uint8_t *)"", 0);
+		keep(&s->path, &s->maxpath, (const uint8_t *)"", 0);
+		keep(&s->authority, &s->maxauthority, (const uint8_t *)"", 0);
+	}
+
+	s->id = id;
+	s->started = s->deferred = s->headers = 0;
+	s->hdrlen = 0;
+	s->method[0] = s->path[0] = s->authority[0] = 0;
+	s->inl = NULL;
+	s->inlen = 0;
+	s->off = s->end = 0;
+#ifdef HAVE_ZLIB_H
+	s->zs_on = 0;
+#endif
+
+	/* Same client and server as the connection, but no I/O of its own */
+	hc = &s->hc;
+	httpd_init_conn_mem(hc);
+	httpd_init_conn_content(hc);
+	hc->hs = parent->hs;
+	hc->conn_fd = parent->conn_fd;
+	hc->ssl = NULL;
+	hc->stream_id = id;
+	memcpy(&hc->client_addr, &parent->client_addr, sizeof(hc->client_addr));
+	memcpy(hc->real_ip, parent->real_ip, sizeof(hc->real_ip));
+	tmr_prepare_timeval(&hc->t_start);
+
+	s->next = h2->streams;
+	h2->streams = s;
+
+	return s;
+}
+
+static void stream_end(struct h2 *h2, struct h2_stream *s)
+{
+	struct h2_stream **p;
+
+	for (p = &h2->streams; *p; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	}
+
+	if (s->started)
+		h2->ops->done(&s->hc, h2->arg, h2->tv);
+	httpd_release_file(&s->hc, h2->tv);
+#ifdef HAVE_ZLIB_H
+	if (s->zs_on)
+		deflateEnd(&s->zs);
+#endif
+
+	if (pooled >= H2_MAX_STREAMS) {
+		httpd_destroy_conn(&s->hc);
+		free(s->method);
+		free(s->path);
+		free(s->authority);
+		free(s);
+		return;
+	}
+	s->next = pool;
+	pool = s;
+	pooled++;
+}
+
+#ifdef HAVE_ZLIB_H
+/* Deflate the next bytes of the file, from one file window at a time */
+static ssize_t body_deflate(struct h2_stream *s, uint8_t *buf, size_t len)
+{
+	struct httpd_conn *hc = &s->hc;
+	z_stream *zs = &s->zs;
+
+	zs->next_out  = buf;
+	zs->avail_out = len;
+	while (zs->avail_out > 0 && !s->zs_done) {
+		int rc;
+
+		if (zs->avail_in == 0 && s->zs_in < hc->sb.st_size) {
+			size_t n;
+			char *addr;
+
+			addr = httpd_file_window(hc, s->zs_in, &n);
+			if (!addr)
+				return -1;
+			n = MIN(n, FILE_WINDOW_SIZE);
+
+			zs->next_in  = (Bytef *)addr;
+			zs->avail_in = n;
+			s->zs_in += n;
+		}
+
+		rc = deflate(zs, s->zs_in < hc->sb.st_size ? Z_NO_FLUSH : Z_FINISH);
+		if (rc == Z_STREAM_END)
+			s->zs_done = 1;
+		else if (rc != Z_OK)
+			break;
+	}
+
+	return len - zs->avail_out;
+}
+#endif
+
+/* DATA frame payload, the inline body first, then the file */
+static ssize_t body_read(nghttp2_session *session, int32_t id, uint8_t *buf, size_t length,
+			 uint32_t *flags, nghttp2_data_source *source, void *user_data)
+{
+	struct h2_stream *s = source->ptr;
+	struct httpd_conn *hc = &s->hc;
+	struct h2 *h2 = user_data;
+	size_t len = 0;
+	int more;
+
+	(void)session;
+	(void)id;
+
+	if (h2->quota >= 0) {
+		if (h2->quota == 0) {
+			s->deferred = 1;
+			return NGHTTP2_ERR_DEFERRED;
+		}
+		length = MIN(length, (size_t)h2->quota);
+	}
+
+	if (s->inlen > 0) {
+		len = MIN(length, s->inlen);
+		memcpy(buf, s->inl, len);
+		s->inl += len;
+		s->inlen -= len;
+	}
+
+#ifdef HAVE_ZLIB_H
+	if (s->zs_on) {
+		ssize_t n = body_deflate(s, buf + len, length - len);
+
+		if (n < 0)
+			return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+		hc->bytes_sent += n;
+		len += n;
+		more = !s->zs_done;
+	} else
+#endif
+	{
+		while (len < length && s->off < s->end) {
+			struct iovec iov[8];
+			size_t got = 0;
+			int i, n;
+
+			n = httpd_body_iov(hc, s->off, MIN((off_t)(length - len), s->end - s->off), iov, NELEMS(iov));
+			if (n < 0)
+				return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+			for (i = 0; i < n; i++) {
+				memcpy(buf + len + got, iov[i].iov_base, iov[i].iov_len);
+				got += iov[i].iov_len;
+			}
+			if (!got)
+				return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+
+			s->off += got;
+			hc->bytes_sent += got;
+			len += got;
+		}
+		more = s->off < s->end;
+	}
+
+	if (!more && !s->inlen)
+		*flags |= NGHTTP2_DATA_FLAG_EOF;
+	if (h2->quota > 0)
+		h2->quota -= len;
+
+	return len;
+}
+
+/* Convert the response text set up by libhttpd to a HEADERS frame */
+static int respond(struct h2 *h2, struct h2_stream *s)
+{
+	static const char *hop[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+	struct httpd_conn *hc = &s->hc;
+	nghttp2_data_provider data;
+	nghttp2_nv nv[H2_MAX_HEADERS];
+	char *p, *end, *eol;
+	size_t i, n = 0;
+
+	end = memmem(hc->response, hc->responselen, "\r\n\r\n", 4);
+	p = memchr(hc->response, ' ', end ? (size_t)(end - hc->response) : 0);
+	if (!p || end - p < 4)
+		return nghttp2_submit_rst_stream(h2->session, NGHTTP2_FLAG_NONE, s->id, NGHTTP2_INTERNAL_ERROR);
+
+	nv[n].name     = (uint8_t *)":status";
+	nv[n].namelen  = 7;
+	nv[n].value    = (uint8_t *)p + 1;
+	nv[n].valuelen = 3;
+	nv[n++].flags  = NGHTTP2_NV_FLAG_NONE;
+
+	for (p = (char *)memmem(p, end + 2 - p, "\r\n", 2) + 2; p < end && n < NELEMS(nv); p = eol + 2) {
+		char *colon, *val;
+
+		eol = memmem(p, end + 2 - p, "\r\n", 2);
+		colon = memchr(p, ':', eol - p);
+		if (!colon)
+			continue;
+
+		for (i = 0; i < NELEMS(hop); i++) {
+			if (strlen(hop[i]) == (size_t)(colon - p) && !strncasecmp(p, hop[i], colon - p))
+				break;
+		}
+		if (i < NELEMS(hop))
+			continue;
+
+		/* HTTP/2 field names are lowercase */
+		for (val = p; val < colon; val++)
+			*val = tolower(*val);
+		for (val = colon + 1; val < eol && (*val == ' ' || *val == '\t'); val++)
+			;
+
+		nv[n].name     = (uint8_t *)p;
+		nv[n].namelen  = colon - p;
+		nv[n].value    = (uint8_t *)val;
+		nv[n].valuelen = eol - val;
+		nv[n++].flags  = NGHTTP2_NV_FLAG_NONE;
+	}
+
+	/* Error pages and the like come right after the headers */
+	s->inl   = end + 4;
+	s->inlen = hc->responselen - (end + 4 - hc->response);
+	if (hc->method == METHOD_HEAD)
+		s->inlen = 0;
+
+	/* The file, as in start_response(), none for HEAD or 304 */
+	if (hc->file_address || hc->file_fd >= 0) {
+		if (hc->got_range) {
+			s->off = hc->first_byte_index;
+			s->end = hc->last_byte_index + 1;
+		} else {
+			s->off = 0;
+			s->end = hc->bytes_to_send < 0 ? 0 : hc->bytes_to_send;
+		}
+#ifdef HAVE_ZLIB_H
+		/* No cached gzip copy, see mmc_gzip(), deflate on the fly */
+		if (hc->compression_type == COMPRESSION_GZIP) {
+			memset(&s->zs, 0, sizeof(s->zs));
+			if (deflateInit2(&s->zs, hc->hs->compression_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				syslog(LOG_CRIT, "zlib deflateInit2() failed!");
+				exit(1);
+			}
+			s->zs_on = 1;
+			s->zs_done = 0;
+			s->zs_in = 0;
+		}
+#endif
+	}
+
+	if (!s->inlen && s->off >= s->end
+#ifdef HAVE_ZLIB_H
+	    && !s->zs_on
+#endif
+		)
+		return nghttp2_submit_response(h2->session, s->id, nv, n, NULL);
+
+	data.source.ptr = s;
+	data.read_callback = body_read;
+
+	return nghttp2_submit_response(h2->session, s->id, nv, n, &data);
+}
+
+/* All request headers received, hand the request over */
+static int start(struct h2 *h2, struct h2_stream *s)
+{
+	struct httpd_conn *hc = &s->hc;
+
+	add_request_line(s);
+	add_request(hc, "\r\n", 2);
+	if (httpd_got_request(hc) != GR_GOT_REQUEST)
+		return nghttp2_submit_rst_stream(h2->session, NGHTTP2_FLAG_NONE, s->id, NGHTTP2_PROTOCOL_ERROR);
+
+	/* The client retries on an HTTP/1.1 connection, that is logged instead */
+	if (h2->ops->request(hc, h2->arg, h2->tv) == H2_HTTP11) {
+		httpd_release_file(hc, h2->tv);
+		return nghttp2_submit_rst_stream(h2->session, NGHTTP2_FLAG_NONE, s->id, NGHTTP2_HTTP_1_1_REQUIRED);
+	}
+	s->started = 1;
+
+	return respond(h2, s);
+}
+
+static int on_begin_headers(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+	struct h2_stream *s;
+
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+		return 0;
+
+	s = stream_new(user_data, frame->hd.stream_id);
+	if (!s)
+		return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+	nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, s);
+
+	return 0;
+}
+
+static int on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+		     const uint8_t *value, size_t valuelen, uint8_t flags, void *user_data)
+{
+	struct h2_stream *s;
+	struct httpd_conn *hc;
+
+	(void)flags;
+	(void)user_data;
+
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+		return 0;
+	s = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+	if (!s)
+		return 0;
+	hc = &s->hc;
+
+	/* Advertised in h2_open(), but up to us to enforce */
+	s->hdrlen += namelen + valuelen + 32;
+	if (s->hdrlen > H2_MAX_REQUEST)
+		return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+
+	/* Pseudo-headers come first, nghttp2 makes sure of that */
+	if (namelen > 0 && name[0] == ':') {
+		if (namelen == 7 && !memcmp(name, ":method", 7))
+			keep(&s->method, &s->maxmethod, value, valuelen);
+		else if (namelen == 5 && !memcmp(name, ":path", 5))
+			keep(&s->path, &s->maxpath, value, valuelen);
+		else if (namelen == 10 && !memcmp(name, ":authority", 10))
+			keep(&s->authority, &s->maxauthority, value, valuelen);
+		return 0;
+	}
+
+	add_request_line(s);
+	if (namelen == 4 && !memcmp(name, "host", 4) && s->authority[0])
+		return 0;
+	add_request(hc, (const char *)name, namelen);
+	add_request(hc, ": ", 2);
+	add_request(hc, (const char *)value, valuelen);
+	add_request(hc, "\r\n", 2);
+
+	return 0;
+}
+
+static int on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+	struct h2_stream *s;
+
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+		return 0;
+	s = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+	if (s && start(user_data, s))
+		nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, s->id, NGHTTP2_INTERNAL_ERROR);
+
+	return 0;
+}
+
+static int on_frame_send(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+	struct h2 *h2 = user_data;
+	struct h2_stream *s;
+
+	if (frame->hd.type != NGHTTP2_HEADERS || !h2->tv)
+		return 0;
+	s = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+	if (s && !timerisset(&s->hc.t_first))
+		s->hc.t_first = *h2->tv;
+
+	return 0;
+}
+
+static int on_stream_close(nghttp2_session *session, int32_t id, uint32_t error_code, void *user_data)
+{
+	struct h2_stream *s;
+
+	(void)error_code;
+
+	s = nghttp2_session_get_stream_user_data(session, id);
+	if (s)
+		stream_end(user_data, s);
+
+	return 0;
+}
+
+int h2_preface(const char *buf, size_t len)
+{
+	size_t n = sizeof(H2_PREFACE) - 1;
+
+	if (memcmp(buf, H2_PREFACE, MIN(len, n)))
+		return 0;
+
+	return len < n ? -1 : 1;
+}
+
+struct h2 *h2_open(struct httpd_conn *hc, const struct h2_ops *ops, void *arg, struct timeval *tv)
+{
+	nghttp2_settings_entry iv[] = {
+		{ NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS },
+		{ NGHTTP2_SETTINGS_MAX_HEADER_LIST_SIZE,   H2_MAX_REQUEST },
+	};
+	struct h2 *h2;
+
+	if (!callbacks) {
+		if (nghttp2_session_callbacks_new(&callbacks))
+			return NULL;
+		nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, on_begin_headers);
+		nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+		nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv);
+		nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, on_frame_send);
+		nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+	}
+
+	h2 = calloc(1, sizeof(*h2));
+	if (!h2)
+		return NULL;
+	h2->hc    = hc;
+	h2->ops   = ops;
+	h2->arg   = arg;
+	h2->tv    = tv;
+	h2->rw    = H2_READ;
+	h2->quota = -1;
+
+	if (nghttp2_session_server_new(&h2->session, callbacks, h2)) {
+		free(h2);
+		return NULL;
+	}
+	if (nghttp2_submit_settings(h2->session, NGHTTP2_FLAG_NONE, iv, NELEMS(iv)))
+		goto fail;
+
+	/* The preface, and maybe more, may already have been read */
+	if (hc->read_idx > 0) {
+		ssize_t n;
+
+		n = nghttp2_session_mem_recv(h2->session, (uint8_t *)hc->read_buf, hc->read_idx);
+		hc->read_idx = 0;
+		if (n < 0)
+			goto fail;
+	}
+
+	return h2;
+fail:
+	h2_close(h2, tv);
+	return NULL;
+}
+
+/* Read what the client has sent, a few buffers at a time */
+static int h2_recv(struct h2 *h2)
+{
+	struct httpd_conn *hc = h2->hc;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		ssize_t n;
+
+		n = httpd_read(hc, hc->read_buf, hc->read_size);
+		if (n == 0)
+			return -1;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				fdwatch_drained_fd(hc->conn_fd);
+				return 0;
+			}
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (nghttp2_session_mem_recv(h2->session, (uint8_t *)hc->read_buf, n) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Write queued frames, returns 1 if the socket is full, 0 when all is
+** sent, or -1 on error.
+*/
+static int h2_send(struct h2 *h2, size_t *sent)
+{
+	struct httpd_conn *hc = h2->hc;
+
+	while (1) {
+		ssize_t n;
+
+		if (h2->outoff == h2->outlen) {
+			h2->outoff = h2->outlen = 0;
+			while (h2->outlen < sizeof(h2->out)) {
+				size_t len;
+
+				if (!h2->pendlen) {
+					n = nghttp2_session_mem_send(h2->session, &h2->pend);
+					if (n < 0)
+						return -1;
+					if (n == 0)
+						break;
+					h2->pendlen = n;
+				}
+
+				len = MIN(h2->pendlen, sizeof(h2->out) - h2->outlen);
+				memcpy(&h2->out[h2->outlen], h2->pend, len);
+				h2->outlen  += len;
+				h2->pend    += len;
+				h2->pendlen -= len;
+			}
+			if (!h2->outlen)
+				return 0;
+		}
+
+		n = httpd_write(hc, &h2->out[h2->outoff], h2->outlen - h2->outoff);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+			/* Only drained if watched for writing, see fdwatch.h */
+			if (h2->rw == H2_WRITE)
+				fdwatch_drained_fd(hc->conn_fd);
+			return 1;
+		}
+		h2->outoff += n;
+		*sent += n;
+	}
+}
+
+int h2_io(struct h2 *h2, size_t *sent, struct timeval *tv)
+{
+	int rc;
+
+	h2->tv = tv;
+	if (h2->rw == H2_READ && h2_recv(h2))
+		return H2_CLOSE;
+
+	rc = h2_send(h2, sent);
+	if (rc < 0)
+		return H2_CLOSE;
+	if (rc > 0)
+		return h2->rw = H2_WRITE;
+
+	if (!nghttp2_session_want_read(h2->session) && !nghttp2_session_want_write(h2->session))
+		return H2_CLOSE;
+
+	return h2->rw = H2_READ;
+}
+
+int h2_streams(struct h2 *h2)
+{
+	struct h2_stream *s;
+	int n = 0;
+
+	for (s = h2->streams; s; s = s->next)
+		n++;
+
+	return n;
+}
+
+void h2_throttle(struct h2 *h2, long bytes)
+{
+	struct h2_stream *s;
+
+	h2->quota = bytes;
+	if (!bytes)
+		return;
+
+	for (s = h2->streams; s; s = s->next) {
+		if (!s->deferred)
+			continue;
+		s->deferred = 0;
+		nghttp2_session_resume_data(h2->session, s->id);
+	}
+}
+
+void h2_close(struct h2 *h2, struct timeval *tv)
+{
+	size_t sent = 0;
+
+	h2->tv = tv;
+
+	/* Tell the client, if the socket takes it, no waiting around */
+	if (!nghttp2_session_terminate_session(h2->session, NGHTTP2_NO_ERROR))
+		h2_send(h2, &sent);
+
+	while (h2->streams)
+		stream_end(h2, h2->streams);
+	nghttp2_session_del(h2->session);
+	free(h2);
+}
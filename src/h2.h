@@ -0,0 +1,88 @@
+/* h2.h - HTTP/2 connections, using libnghttp2
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef H2_H_
+#define H2_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "libhttpd.h"
+
+/* h2_io() return values, and which way to watch the socket */
+#define H2_CLOSE -1
+#define H2_READ   0
+#define H2_WRITE  1
+
+/* h2_ops.request() return value, refuse the stream with HTTP_1_1_REQUIRED */
+#define H2_HTTP11 1
+
+/* An HTTP/2 connection, one per client connection, with its streams. */
+struct h2;
+
+/* Called for each stream, with its own httpd_conn.  request() gets the
+** headers already read, as for an HTTP/1.1 request, parses and starts it.
+** Returns 0 when a response is set up, or H2_HTTP11.  done() is called
+** when a started stream is closed, for logging and accounting.
+*/
+struct h2_ops {
+	int  (*request)(struct httpd_conn *hc, void *arg, struct timeval *tv);
+	void (*done)   (struct httpd_conn *hc, void *arg, struct timeval *tv);
+};
+
+/* Checks for the client connection preface of HTTP/2 over cleartext,
+** "prior knowledge".  Returns 1 if buf starts with it, 0 if not, or -1
+** if more bytes are needed to tell.
+*/
+extern int h2_preface(const char *buf, size_t len);
+
+/* Start HTTP/2 on the connection hc, after TLS negotiated "h2" with ALPN,
+** or when h2_preface() matched.  Bytes already in hc->read_buf are taken
+** as the start of the HTTP/2 session.  Returns (struct h2*) 0 on error.
+*/
+extern struct h2 *h2_open(struct httpd_conn *hc, const struct h2_ops *ops, void *arg, struct timeval *tv);
+
+/* Reads from the socket, when watched for reading, and writes what is
+** pending, without blocking.  The number of bytes written is added to
+** sent.  Returns H2_READ or H2_WRITE for the direction to watch next, or
+** H2_CLOSE when the session is over, or on error.
+*/
+extern int h2_io(struct h2 *h2, size_t *sent, struct timeval *tv);
+
+/* The number of open streams. */
+extern int h2_streams(struct h2 *h2);
+
+/* Limit the response body bytes sent by the next h2_io(), -1 is unlimited.
+** Used for throttling, streams at the limit wait for this to be raised.
+*/
+extern void h2_throttle(struct h2 *h2, long bytes);
+
+/* Sends GOAWAY, if possible, and frees the session and its streams. */
+extern void h2_close(struct h2 *h2, struct timeval *tv);
+
+#endif /* H2_H_ */
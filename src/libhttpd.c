@@ -31,7 +31,9 @@
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <netinet/tcp.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -51,6 +53,12 @@
 #include <stdint.h>		/* int64_t */
 #include <inttypes.h>		/* PRId64 */
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #ifdef HAVE_OSRELDATE_H
 #include <osreldate.h>
 #endif
@@ -74,14 +82,15 @@
 
 extern char *crypt(const char *key, const char *setting);
 
+#include "alog.h"
 #include "base64.h"
 #include "file.h"
 #include "libhttpd.h"
 #include "match.h"
-#include "md5.h"
 #include "merecat.h"
 #include "mmc.h"
 #include "ssl.h"
+#include "stc.h"
 #include "tdate_parse.h"
 #include "timers.h"
 
@@ -127,7 +136,7 @@ extern char *crypt(const char *key, const char *setting);
 /* Forwards. */
 static void check_options(void);
 static void free_httpd_server(struct httpd_server *hs);
-static int initialize_listen_socket(httpd_sockaddr *hsa);
+static int initialize_listen_socket(struct httpd_server *hs, httpd_sockaddr *hsa);
 static void add_response(struct httpd_conn *hc, const char *str);
 static void send_mime(struct httpd_conn *hc, int status, char *title, char *encodings, const char *extraheads, const char *type, off_t length,
 		      time_t mod);
@@ -162,9 +171,9 @@ static int tilde_map_2(struct httpd_conn *hc);
 #endif
 static int vhost_map(struct httpd_conn *hc);
 static char *expand_symlinks(char *path, char **trailer, int no_symlink_check, int tildemapped);
+static size_t scan_eol(const char *buf, size_t len);
 static char *bufgets(struct httpd_conn *hc);
 static void de_dotdot(char *file);
-static void init_mime(void);
 static void figure_mime(struct httpd_conn *hc);
 
 #ifdef CGI_TIMELIMIT
@@ -172,7 +181,7 @@ static void cgi_kill2(arg_t arg, struct timeval *now);
 static void cgi_kill(arg_t arg, struct timeval *now);
 #endif
 #ifdef GENERATE_INDEXES
-static int ls(struct httpd_conn *hc);
+static int ls(struct httpd_conn *hc, struct timeval *now);
 #endif
 static char *build_env(char *fmt, char *arg);
 
@@ -183,10 +192,12 @@ static char **make_envp(struct httpd_conn *hc);
 static char **make_argp(struct httpd_conn *hc);
 static void cgi_interpose_input(struct httpd_conn *hc, int wfd);
 static void post_post_garbage_hack(struct httpd_conn *hc);
-static void cgi_interpose_output(struct httpd_conn *hc, int rfd);
-static void cgi_child(struct httpd_conn *hc);
+static int cgi_status(char *headers, char *br, char **titleP);
+static void cgi_child(struct httpd_conn *hc, int sock);
 static int cgi(struct httpd_conn *hc);
+static int send_file(struct httpd_conn *hc, char *extra, int is_icon, struct timeval *now);
 static int really_start_request(struct httpd_conn *hc, struct timeval *now);
+static const char *log_host(struct httpd_conn *hc);
 static void make_log_entry(struct httpd_conn *hc);
 static int check_referer(struct httpd_conn *hc);
 static int really_check_referer(struct httpd_conn *hc);
@@ -231,6 +242,16 @@ static void free_httpd_server(struct httpd_server *hs)
 		free(hs->url_pattern);
 	if (hs->local_pattern)
 		free(hs->local_pattern);
+	match_free(hs->cgi_match);
+	match_free(hs->url_match);
+	match_free(hs->local_match);
+	if (hs->stats) {
+		int i;
+
+		for (i = 0; i < hs->stats_count; i++)
+			free(hs->stats[i].host);
+		free(hs->stats);
+	}
 	free(hs);
 }
 
@@ -239,7 +260,8 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 				unsigned short port, void *ssl_ctx, char *cgi_pattern, int cgi_limit,
 				char *charset, int max_age, char *cwd, int no_log,
 				int no_symlink_check, int vhost, int global_passwd, char *url_pattern,
-				char *local_pattern, int no_empty_referers, int list_dotfiles)
+				char *local_pattern, int no_empty_referers, int list_dotfiles,
+				int listen_backlog, int defer_accept, int fastopen)
 {
 	struct httpd_server *hs;
 	static char ghnbuf[256];
@@ -252,6 +274,9 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 		syslog(LOG_CRIT, "out of memory allocating struct httpd_server");
 		return NULL;
 	}
+	hs->accepted = 0;
+	hs->stats = NULL;
+	hs->stats_count = 0;
 
 	if (hostname) {
 		hs->binding_hostname = strdup(hostname);
@@ -302,6 +327,12 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 		while ((cp = strstr(hs->cgi_pattern, "|/")))
 			/* -2 for the offset, +1 for the '\0' */
 			memmove(cp + 1, cp + 2, strlen(cp) - 1);
+
+		hs->cgi_match = match_compile(hs->cgi_pattern);
+		if (!hs->cgi_match) {
+			syslog(LOG_CRIT, "out of memory compiling cgi_pattern");
+			return NULL;
+		}
 	}
 
 	hs->cgi_tracker = calloc(cgi_limit, sizeof(pid_t));
@@ -320,7 +351,8 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 		hs->url_pattern = NULL;
 	} else {
 		hs->url_pattern = strdup(url_pattern);
-		if (!hs->url_pattern) {
+		hs->url_match = match_compile(url_pattern);
+		if (!hs->url_pattern || !hs->url_match) {
 			syslog(LOG_CRIT, "out of memory copying url_pattern");
 			return NULL;
 		}
@@ -330,7 +362,8 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 		hs->local_pattern = NULL;
 	} else {
 		hs->local_pattern = strdup(local_pattern);
-		if (!hs->local_pattern) {
+		hs->local_match = match_compile(local_pattern);
+		if (!hs->local_pattern || !hs->local_match) {
 			syslog(LOG_CRIT, "out of memory copying local_pattern");
 			return NULL;
 		}
@@ -342,6 +375,9 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 	hs->global_passwd = global_passwd;
 	hs->no_empty_referers = no_empty_referers;
 	hs->list_dotfiles = list_dotfiles;
+	hs->listen_backlog = listen_backlog > 0 ? listen_backlog : LISTEN_BACKLOG;
+	hs->defer_accept = defer_accept;
+	hs->fastopen = fastopen;
 
 	/* Initialize listen sockets.  Try v6 first because of a Linux peculiarity;
 	** like some other systems, it has magical v6 sockets that also listen for
@@ -350,11 +386,11 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 	if (!hsav6)
 		hs->listen6_fd = -1;
 	else
-		hs->listen6_fd = initialize_listen_socket(hsav6);
+		hs->listen6_fd = initialize_listen_socket(hs, hsav6);
 	if (!hsav4)
 		hs->listen4_fd = -1;
 	else
-		hs->listen4_fd = initialize_listen_socket(hsav4);
+		hs->listen4_fd = initialize_listen_socket(hs, hsav4);
 
 	/* If we didn't get any valid sockets, fail. */
 	if (hs->listen4_fd == -1 && hs->listen6_fd == -1) {
@@ -362,8 +398,6 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 		return NULL;
 	}
 
-	init_mime();
-
 	/* Done initializing. */
 	if (!hs->binding_hostname)
 		syslog(LOG_NOTICE, "%s starting on port %d, vhost: %d", PACKAGE_STRING, hs->port, vhost);
@@ -375,7 +409,7 @@ struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, httpd_soc
 }
 
 
-static int initialize_listen_socket(httpd_sockaddr *hsa)
+static int initialize_listen_socket(struct httpd_server *hs, httpd_sockaddr *hsa)
 {
 	int listen_fd;
 	int flags;
@@ -419,8 +453,21 @@ static int initialize_listen_socket(httpd_sockaddr *hsa)
 		return -1;
 	}
 
+#ifdef TCP_DEFER_ACCEPT
+	/* Only wake up for connections with a request, or after a timeout */
+	if (hs->defer_accept > 0 &&
+	    setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &hs->defer_accept, sizeof(hs->defer_accept)))
+		syslog(LOG_WARNING, "Failed enabling TCP_DEFER_ACCEPT: %s", strerror(errno));
+#endif
+#ifdef TCP_FASTOPEN
+	/* Request in the SYN, needs server support in net.ipv4.tcp_fastopen */
+	if (hs->fastopen > 0 &&
+	    setsockopt(listen_fd, IPPROTO_TCP, TCP_FASTOPEN, &hs->fastopen, sizeof(hs->fastopen)))
+		syslog(LOG_WARNING, "Failed enabling TCP_FASTOPEN: %s", strerror(errno));
+#endif
+
 	/* Start a listen going. */
-	if (listen(listen_fd, LISTEN_BACKLOG) < 0) {
+	if (listen(listen_fd, hs->listen_backlog) < 0) {
 		syslog(LOG_CRIT, "listen: %s", strerror(errno));
 		close(listen_fd);
 		return -1;
@@ -446,6 +493,40 @@ static int initialize_listen_socket(httpd_sockaddr *hsa)
 }
 
 
+int httpd_listen_again(struct httpd_server *hs, int *listen4_fd, int *listen6_fd)
+{
+#ifdef SO_REUSEPORT
+	int *fds[] = { listen4_fd, listen6_fd };
+	int orig[] = { hs->listen4_fd, hs->listen6_fd };
+	size_t i;
+
+	for (i = 0; i < NELEMS(fds); i++) {
+		httpd_sockaddr sa;
+		socklen_t len = sizeof(sa);
+
+		*fds[i] = -1;
+		if (orig[i] == -1)
+			continue;
+
+		memset(&sa, 0, sizeof(sa));
+		if (getsockname(orig[i], &sa.sa, &len) < 0) {
+			syslog(LOG_CRIT, "getsockname: %s", strerror(errno));
+			return -1;
+		}
+
+		*fds[i] = initialize_listen_socket(hs, &sa);
+		if (*fds[i] == -1)
+			return -1;
+	}
+#else
+	*listen4_fd = hs->listen4_fd;
+	*listen6_fd = hs->listen6_fd;
+#endif
+
+	return 0;
+}
+
+
 void httpd_exit(struct httpd_server *hs)
 {
 	httpd_ssl_exit(hs);
@@ -513,19 +594,55 @@ static char *err500form = "There was an unusual problem serving the requested UR
 static char *err501title = "Not Implemented";
 static char *err501form = "The requested method '%s' is not implemented by this server.\n";
 
+char *httpd_err502title = "Bad Gateway";
+char *httpd_err502form = "The requested URL '%s' could not be handled by the FastCGI backend.\n";
+
 char *httpd_err503title = "Service Temporarily Overloaded";
 char *httpd_err503form = "The requested URL '%s' is temporarily overloaded.  Please try again later.\n";
 
 
+/* Append len bytes to the buffer waiting to be sent as response. */
+static void add_response_len(struct httpd_conn *hc, const char *str, size_t len)
+{
+	httpd_realloc_str(&hc->response, &hc->maxresponse, hc->responselen + len);
+	memmove(&(hc->response[hc->responselen]), str, len);
+	hc->responselen += len;
+	hc->response[hc->responselen] = 0;
+}
+
 /* Append a string to the buffer waiting to be sent as response. */
 static void add_response(struct httpd_conn *hc, const char *str)
 {
-	size_t len;
+	add_response_len(hc, str, strlen(str));
+}
 
-	len = strlen(str);
-	httpd_realloc_str(&hc->response, &hc->maxresponse, hc->responselen + len);
-	memmove(&(hc->response[hc->responselen]), str, len + 1);
-	hc->responselen += len;
+/* Formatting the Date header on every response is a waste, the main
+** loop calls httpd_set_date() on each lap and we only redo it when the
+** second changes.  CGI sub-processes have no main loop, so they keep
+** it fresh themselves in httpd_date().
+*/
+static const char *rfc1123fmt = "%a, %d %b %Y %H:%M:%S GMT";
+static time_t date_now = (time_t)-1;
+static char   date_hdr[100];	/* "Date: ...\r\nServer: ...\r\n" */
+
+void httpd_set_date(time_t now)
+{
+	char buf[50];
+
+	if (now == date_now)
+		return;
+
+	date_now = now;
+	strftime(buf, sizeof(buf), rfc1123fmt, gmtime(&now));
+	snprintf(date_hdr, sizeof(date_hdr), "Date: %s\r\nServer: %s\r\n", buf, EXPOSED_SERVER_SOFTWARE);
+}
+
+static const char *httpd_date(void)
+{
+	if (sub_process || date_now == (time_t)-1)
+		httpd_set_date(time(NULL));
+
+	return date_hdr;
 }
 
 /* Merecat default style */
@@ -567,7 +684,9 @@ void httpd_send_response(struct httpd_conn *hc)
 
 	/* Send the response, if necessary. */
 	if (hc->responselen > 0) {
-		make_log_entry(hc);
+		/* The buffered access log is written when the request is done */
+		if (!alog_enabled() || sub_process)
+			make_log_entry(hc);
 		httpd_write(hc, hc->response, hc->responselen);
 		hc->responselen = 0;
 	}
@@ -619,14 +738,247 @@ static int content_encoding(struct httpd_conn *hc, char *encodings, char *buf, s
 	return ret;
 }
 
+/* The content MD5 digest is cached with the mapping, but hashing a huge
+** file even once delays the first byte, so above etag_limit we fall back
+** to a cheap, Apache style, ETag of inode, size and modification time.
+** Files too large to be mapped whole always get the latter.  The cached
+** gzip copy is another representation, with ranges of its own, so it is
+** told apart with a -gz suffix.
+*/
+static const char *etag(struct httpd_conn *hc)
+{
+	static char buf[64];
+	const char *tag;
+
+	if ((hc->hs->etag_limit >= 0 && hc->sb.st_size > hc->hs->etag_limit) || hc->sb.st_size > MAX_MAPPED_FILE_SIZE) {
+		snprintf(buf, sizeof(buf), "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "\"",
+			 (uint64_t)hc->sb.st_ino, (uint64_t)hc->sb.st_size, (uint64_t)hc->sb.st_mtime);
+		tag = buf;
+	} else {
+		/* Without a mapping we only get the ETag if the file is cached */
+		tag = mmc_etag(hc->file_address, &hc->sb);
+	}
+
+	if (tag && hc->gzip_address) {
+		if (tag != buf)
+			snprintf(buf, sizeof(buf), "%s", tag);
+		snprintf(&buf[strlen(buf) - 1], 5, "-gz\"");
+		tag = buf;
+	}
+
+	return tag;
+}
+
+/* Weak comparison of an If-None-Match list with our ETag, RFC 7232.
+** The gzip variant of the tag, see etag(), matches too.
+*/
+static int etag_match(const char *list, const char *tag)
+{
+	size_t len = strlen(tag);
+	const char *p = list;
+
+	while (*p) {
+		p += strspn(p, " \t,");
+		if (*p == '*')
+			return 1;
+
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+		if (!strncmp(p, tag, len) && (p[len] == '\0' || strchr(" \t,", p[len])))
+			return 1;
+		if (len > 1 && !strncmp(p, tag, len - 1) && !strncmp(&p[len - 1], "-gz\"", 4) &&
+		    (p[len + 3] == '\0' || strchr(" \t,", p[len + 3])))
+			return 1;
+
+		/* Skip to next entity-tag, which may contain a comma */
+		if (*p == '"') {
+			p = strchr(p + 1, '"');
+			if (!p)
+				return 0;
+			p++;
+		}
+		p += strcspn(p, ",");
+	}
+
+	return 0;
+}
+
+/* Check conditional GET/HEAD, If-None-Match takes precedence over
+** If-Modified-Since.  The file is not mapped only to compute its ETag,
+** a HEAD never needs it and a 304 should be cheap.  Without a cached
+** ETag there is nothing to compare, then fall back to If-Modified-Since,
+** if any.
+*/
+static int not_modified(struct httpd_conn *hc)
+{
+	const char *tag;
+
+	if (hc->if_none_match[0]) {
+		tag = etag(hc);
+		if (tag)
+			return etag_match(hc->if_none_match, tag);
+	}
+
+	return hc->if_modified_since != (time_t)-1 && hc->if_modified_since >= hc->sb.st_mtime;
+}
+
+/* Parse a Range: header, a list of first-last, first- and -suffix byte
+** ranges.  Anything we do not understand, or too many ranges, and the
+** whole header is ignored, as RFC 7233 allows.
+*/
+static void parse_range(struct httpd_conn *hc, char *cp)
+{
+	int n = 0;
+
+	if (strncasecmp(cp, "bytes", 5))
+		return;
+	cp += 5;
+	cp += strspn(cp, " \t");
+	if (*cp++ != '=')
+		return;
+
+	while (*cp) {
+		struct httpd_range *r;
+		char *end;
+
+		cp += strspn(cp, " \t,");
+		if (!*cp)
+			break;
+		if (n >= MAX_RANGES)
+			return;
+
+		r = &hc->ranges[n];
+		if (*cp == '-') {
+			if (!isdigit((int)cp[1]))
+				return;
+			r->first = -1;
+			r->last = strtoll(cp + 1, &end, 10);
+		} else {
+			if (!isdigit((int)*cp))
+				return;
+			r->first = strtoll(cp, &end, 10);
+			if (*end++ != '-')
+				return;
+			r->last = -1;
+			if (isdigit((int)*end)) {
+				r->last = strtoll(end, &end, 10);
+				if (r->last < r->first)
+					return;
+			}
+		}
+
+		cp = end + strspn(end, " \t");
+		if (*cp && *cp != ',')
+			return;
+		n++;
+	}
+
+	if (n > 0) {
+		hc->got_range = 1;
+		hc->numranges = n;
+	}
+}
+
+/* Resolve the ranges against the length of the body, drop unsatisfiable
+** ones and merge overlapping, or adjacent, neighbours.  Returns the number
+** of ranges left.
+*/
+static int resolve_ranges(struct httpd_conn *hc, off_t length)
+{
+	int i, n = 0;
+
+	for (i = 0; i < hc->numranges; i++) {
+		off_t first = hc->ranges[i].first;
+		off_t last  = hc->ranges[i].last;
+
+		if (first < 0) {
+			if (last == 0)
+				continue;
+			first = MAX(length - last, 0);
+			last = length - 1;
+		} else if (last < 0 || last >= length) {
+			last = length - 1;
+		}
+		if (first >= length)
+			continue;
+
+		if (n > 0 && first <= hc->ranges[n - 1].last + 1 && last + 1 >= hc->ranges[n - 1].first) {
+			hc->ranges[n - 1].first = MIN(first, hc->ranges[n - 1].first);
+			hc->ranges[n - 1].last  = MAX(last,  hc->ranges[n - 1].last);
+			continue;
+		}
+
+		hc->ranges[n].first = first;
+		hc->ranges[n].last  = last;
+		n++;
+	}
+
+	return hc->numranges = n;
+}
+
+/* If-Range: with a date must match exactly, an ETag strongly */
+static int range_if_match(struct httpd_conn *hc)
+{
+	const char *tag;
+	size_t len;
+
+	if (!hc->range_if_tag[0])
+		return hc->range_if == (time_t)-1 || hc->range_if == hc->sb.st_mtime;
+
+	tag = etag(hc);
+	if (!tag)
+		return 0;
+
+	len = strlen(tag);
+	return !strncmp(hc->range_if_tag, tag, len) && (hc->range_if_tag[len] == '\0' || isspace((int)hc->range_if_tag[len]));
+}
+
+/* Build the part headers and trailer of a multipart/byteranges body for
+** the ranges in hc, the offset of each part header is saved in its range.
+** Returns the length of the whole body.
+*/
+static off_t multipart(struct httpd_conn *hc, const char *boundary, const char *type, off_t length)
+{
+	char buf[1000];
+	off_t total = 0;
+	int i, len;
+
+	hc->partslen = 0;
+	for (i = 0; i <= hc->numranges; i++) {
+		struct httpd_range *r = &hc->ranges[i];
+
+		if (i < hc->numranges)
+			len = snprintf(buf, sizeof(buf), "\r\n--%s\r\nContent-Type: %s\r\n"
+				       "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n",
+				       boundary, type, (int64_t)r->first, (int64_t)r->last, (int64_t)length);
+		else
+			len = snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", boundary);
+		len = MIN((size_t)len, sizeof(buf) - 1);
+
+		httpd_realloc_str(&hc->parts, &hc->maxparts, hc->partslen + len);
+		memcpy(&hc->parts[hc->partslen], buf, len);
+		r->part = hc->partslen;
+		hc->partslen += len;
+
+		total += len;
+		if (i < hc->numranges)
+			total += r->last - r->first + 1;
+	}
+
+	return total;
+}
+
 static void
 send_mime(struct httpd_conn *hc, int status, char *title, char *encodings, const char *extraheads, const char *type, off_t length, time_t mod)
 {
-	time_t now;
-	const char *rfc1123fmt = "%a, %d %b %Y %H:%M:%S GMT";
 	char fixed_type[500];
 	char buf[1000];
+	char boundary[40];
+	const char *hdr = NULL;
+	size_t hdrlen = 0;
 	int partial_content;
+	off_t partial_length = 0;
+	int cacheable;
 	int s100;
 
 	if (status != 200)
@@ -635,46 +987,118 @@ send_mime(struct httpd_conn *hc, int status, char *title, char *encodings, const
 	hc->status = status;
 	hc->bytes_to_send = length;
 	if (hc->mime_flag) {
-		char nowbuf[100];
 		char modbuf[100];
-		char etagbuf[45] = { 0 };
+		char etagbuf[80] = { 0 };
+		size_t start;
+		int len;
 
-		if (status == 200 && hc->got_range &&
-		    (hc->last_byte_index >= hc->first_byte_index) &&
-		    ((hc->last_byte_index != length - 1) ||
-		     (hc->first_byte_index != 0)) && (hc->range_if == (time_t)-1 || hc->range_if == hc->sb.st_mtime)) {
-			partial_content = 1;
+		/* Several ranges go out as multipart/byteranges, not for an
+		** already encoded body though, only zlib on the fly cannot do
+		** ranges at all and is skipped for them.
+		*/
+		partial_content = 0;
+		if (status == 200 && hc->got_range && range_if_match(hc) && resolve_ranges(hc, length) > 0) {
+			if (hc->numranges == 1 && (hc->ranges[0].first != 0 || hc->ranges[0].last != length - 1)) {
+				partial_content = 1;
+				hc->first_byte_index = hc->ranges[0].first;
+				hc->last_byte_index = hc->ranges[0].last;
+				partial_length = hc->last_byte_index - hc->first_byte_index + 1;
+			} else if (hc->numranges > 1 && !encodings[0]) {
+				partial_content = 2;
+				snprintf(boundary, sizeof(boundary), "%08lx%08lx", (unsigned long)random(), (unsigned long)(hc->sb.st_ino ^ date_now));
+				snprintf(fixed_type, sizeof(fixed_type), type, hc->hs->charset);
+				partial_length = multipart(hc, boundary, fixed_type, length);
+				hc->first_byte_index = 0;
+				hc->last_byte_index = partial_length - 1;
+				hc->use_sendfile = 0;
+			}
+		}
+		if (partial_content) {
 			hc->status = status = 206;
 			title = ok206title;
-			hc->compression_type = COMPRESSION_NONE;  /* probably some way to get around this... */
+			hc->compression_type = COMPRESSION_NONE;
 		} else {
-			partial_content = 0;
 			hc->got_range = 0;
+			hc->numranges = 0;
+		}
+
+		/* Match Apache as close as possible, but follow RFC 2616, section 4.2 */
+		len = snprintf(buf, sizeof(buf), "%.20s %d %s\r\n%s", hc->protocol, status, title, httpd_date());
+		add_response_len(hc, buf, MIN((size_t)len, sizeof(buf) - 1));
+
+		/* The headers only depending on the file, and the server or vhost
+		** serving it, are cached with the mapping.  So a steady state 200
+		** of a mapped file is mostly a matter of copying them.
+		*/
+		s100 = status / 100;
+		cacheable = (s100 == 2 || status == 304) && hc->file_address && mod == hc->sb.st_mtime && partial_content != 2;
+		if (cacheable)
+			hdr = mmc_headers(hc->file_address, &hc->sb, hc->hs, type, &hdrlen);
+		if (hdr) {
+			add_response_len(hc, hdr, hdrlen);
+			goto variable;
 		}
 
-		now = time(NULL);
+		start = hc->responselen;
 		if (!mod)
-			mod = now;
-		strftime(nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime(&now));
+			mod = date_now;
 		strftime(modbuf, sizeof(modbuf), rfc1123fmt, gmtime(&mod));
-		snprintf(fixed_type, sizeof(fixed_type), type, hc->hs->charset);
+		snprintf(buf, sizeof(buf), "Last-Modified: %s\r\nAccept-Ranges: bytes\r\n", modbuf);
+		add_response(hc, buf);
 
-		/* Match Apache as close as possible, but follow RFC 2616, section 4.2 */
-		snprintf(buf, sizeof(buf),
-			 "%.20s %d %s\r\n"
-			 "Date: %s\r\n"
-			 "Server: %s\r\n"
-			 "Last-Modified: %s\r\n"
-			 "Accept-Ranges: bytes\r\n",
-			 hc->protocol, status, title, nowbuf, EXPOSED_SERVER_SOFTWARE, modbuf);
+		if (partial_content == 2) {
+			snprintf(buf, sizeof(buf), "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+		} else {
+			snprintf(fixed_type, sizeof(fixed_type), type, hc->hs->charset);
+			snprintf(buf, sizeof(buf), "Content-Type: %s\r\n", fixed_type);
+		}
 		add_response(hc, buf);
 
-		if (partial_content) {
+		if (s100 != 2 && s100 != 3)
+			add_response(hc, "Cache-Control: no-cache,no-store\r\n");
+
+		if (hc->hs->max_age >= 0) {
+			snprintf(buf, sizeof(buf), "Cache-Control: max-age=%d\r\n", hc->hs->max_age);
+			add_response(hc, buf);
+		}
+
+		if (cacheable)
+			mmc_set_headers(hc->file_address, &hc->sb, hc->hs, type, &hc->response[start], hc->responselen - start);
+
+	variable:
+		/* EntityTag -- https://en.wikipedia.org/wiki/HTTP_ETag, not
+		** cached, the gzip copy of a file has an ETag of its own.
+		*/
+		if ((s100 == 2 || status == 304) && (hc->file_address || S_ISREG(hc->sb.st_mode))) {
+			const char *tag = etag(hc);
+
+			if (tag) {
+				snprintf(etagbuf, sizeof(etagbuf), "ETag: %s\r\n", tag);
+				add_response(hc, etagbuf);
+			}
+		}
+
+#ifdef USE_SUPERSEDED_EXPIRES
+		if (hc->hs->max_age >= 0) {
+			char expbuf[100];
+			time_t expires;
+
+			expires = date_now + hc->hs->max_age;
+			strftime(expbuf, sizeof(expbuf), rfc1123fmt, gmtime(&expires));
+			snprintf(buf, sizeof(buf), "Expires: %s\r\n", expbuf);
+			add_response(hc, buf);
+		}
+#endif
+
+		if (partial_content == 2) {
+			snprintf(buf, sizeof(buf), "Content-Length: %" PRId64 "\r\n", (int64_t)partial_length);
+			add_response(hc, buf);
+		} else if (partial_content) {
 			snprintf(buf, sizeof(buf),
 				 "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n"
 				 "Content-Length: %" PRId64 "\r\n",
 				 (int64_t)hc->first_byte_index, (int64_t)hc->last_byte_index,
-				 (int64_t)length, (int64_t)(hc->last_byte_index - hc->first_byte_index + 1));
+				 (int64_t)length, (int64_t)partial_length);
 			add_response(hc, buf);
 		} else if (length >= 0) {
 			/*
@@ -691,52 +1115,19 @@ send_mime(struct httpd_conn *hc, int status, char *title, char *encodings, const
 //			hc->do_keep_alive = 0;
 		}
 
-		snprintf(buf, sizeof(buf), "Content-Type: %s\r\n", fixed_type);
-		add_response(hc, buf);
-
 		if (content_encoding(hc, encodings, buf, sizeof(buf)))
 			add_response(hc, buf);
 
-		s100 = status / 100;
-		if (s100 != 2 && s100 != 3) {
-			snprintf(buf, sizeof(buf), "Cache-Control: no-cache,no-store\r\n");
-			add_response(hc, buf);
-		}
-
-		/* EntityTag -- https://en.wikipedia.org/wiki/HTTP_ETag */
-		if (hc->file_address) {
-			uint8_t dig[MD5_DIGEST_LENGTH];
-			MD5_CTX ctx;
-
-			MD5Init(&ctx);
-			MD5Update(&ctx, (const u_int8_t *)hc->file_address, length);
-			MD5Final(dig, &ctx);
-			snprintf(etagbuf, sizeof(etagbuf),
-				 "ETag: \"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\"\r\n",
-				 dig[0], dig[1], dig[2], dig[3], dig[4], dig[5], dig[6], dig[7],
-				 dig[8], dig[9], dig[10], dig[11], dig[12], dig[13], dig[14], dig[15]);
-		}
-
-		if (hc->hs->max_age >= 0) {
-			snprintf(buf, sizeof(buf), "Cache-Control: max-age=%d\r\n%s", hc->hs->max_age, etagbuf);
-			add_response(hc, buf);
-
-#ifdef USE_SUPERSEDED_EXPIRES
-			char expbuf[100];
-			time_t expires;
-
-			expires = now + hc->hs->max_age;
-			strftime(expbuf, sizeof(expbuf), rfc1123fmt, gmtime(&expires));
-			snprintf(buf, sizeof(buf), "Expires: %s\r\n", expbuf);
-			add_response(hc, buf);
-#endif
-		}
+		/* Only CGI reads a request body, anywhere else what is left
+		** of it would be taken for the next request.
+		*/
+		if (hc->contentlength > 0)
+			hc->do_keep_alive = 0;
 
 		if (hc->do_keep_alive)
-			snprintf(buf, sizeof(buf), "Connection: keep-alive\r\n");
+			add_response(hc, "Connection: keep-alive\r\n");
 		else
-			snprintf(buf, sizeof(buf), "Connection: close\r\n");
-		add_response(hc, buf);
+			add_response(hc, "Connection: close\r\n");
 
 		if (extraheads[0] != '\0')
 			add_response(hc, extraheads);
@@ -797,7 +1188,7 @@ static void send_response(struct httpd_conn *hc, int status, char *title, const
 	snprintf(buf, sizeof(buf), form, defanged_arg);
 	add_response(hc, buf);
 #ifdef MSIE_PADDING
-	if (match("**MSIE**", hc->useragent)) {
+	if (strstr(hc->useragent, "MSIE")) {
 		int n;
 
 		add_response(hc, "<!--\n");
@@ -926,6 +1317,22 @@ void httpd_send_err(struct httpd_conn *hc, int status, char *title, const char *
 }
 
 
+void httpd_send_body(struct httpd_conn *hc, const char *extraheads, const char *type, const char *body, size_t len)
+{
+	/* Not a file, so no ETag, Last-Modified is now, and no ranges */
+	memset(&hc->sb, 0, sizeof(hc->sb));
+	hc->got_range = 0;
+	hc->compression_type = COMPRESSION_NONE;
+
+	send_mime(hc, 200, ok200title, "", extraheads, type, len, (time_t)0);
+	if (hc->method == METHOD_HEAD)
+		return;
+
+	httpd_realloc_str(&hc->response, &hc->maxresponse, hc->responselen + len);
+	memcpy(&hc->response[hc->responselen], body, len);
+	hc->responselen += len;
+	hc->bytes_sent = len;
+}
 #ifdef ERR_DIR
 static int send_err_file(struct httpd_conn *hc, int status, char *title, const char *extraheads, char *filename)
 {
@@ -956,23 +1363,18 @@ static int send_err_file(struct httpd_conn *hc, int status, char *title, const c
 #endif /* ERR_DIR */
 
 #if defined(ACCESS_FILE) || defined(AUTH_FILE)
-static char *find_htfile(char *topdir, char *dir, char *htfile)
+static char *find_htfile(char *topdir, char *dir, char *htfile, char *path, size_t len)
 {
 	int found = 0;
-	char *path;
-	size_t len = strlen(dir) + strlen(htfile) + 2;
 
-	path = malloc(len);
-	if (!path)
+	if ((size_t)snprintf(path, len, "%s/%s", (dir[0] ? dir : "."), htfile) >= len)
 		return NULL;
-
-	snprintf(path, len, "%s/%s", (dir[0] ? dir : "."), htfile);
 	while (1) {
 		int rc;
 		char *ptr, *slash;
 		struct stat st;
 
-		rc = stat(path, &st);
+		rc = stc_stat(path, &st);
 
 		ptr = strstr(path, htfile);
 		if (!ptr)
@@ -996,10 +1398,8 @@ static char *find_htfile(char *topdir, char *dir, char *htfile)
 		memmove(slash + 1, ptr + 1, strlen(htfile) + 1);
 	}
 
-	if (!found) {
-		free(path);
+	if (!found)
 		return NULL;
-	}
 
 	return path;
 }
@@ -1010,7 +1410,7 @@ static char *find_htfile(char *topdir, char *dir, char *htfile)
 static int access_check(struct httpd_conn *hc, char *dir)
 {
 	int rc = 0;
-	char *topdir, *tmp = NULL;
+	char *topdir, tmp[MAXPATHLEN];
 
 	if (!dir) {
 		char *ptr;
@@ -1021,12 +1421,13 @@ static int access_check(struct httpd_conn *hc, char *dir)
 			return -1;
 		}
 
-		tmp = strdup(hc->expnfilename);
-		if (!tmp) {
-			syslog(LOG_ERR, "out of memory in access code; "
-			       "Denying access.");
+		/* Stack copy, keep-alive requests should not touch the heap */
+		if (strlen(hc->expnfilename) >= sizeof(tmp)) {
+			syslog(LOG_ERR, "%.80s URL \"%.80s\" too long for access code; "
+			       "Denying access.", httpd_client(hc), hc->encodedurl);
 			return -1;
 		}
+		strcpy(tmp, hc->expnfilename);
 
 		ptr = strrchr(tmp, '/');
 		if (!ptr)
@@ -1043,16 +1444,10 @@ static int access_check(struct httpd_conn *hc, char *dir)
 		topdir = ".";
 
 	if (!hc->hs->global_passwd) {
-		char *path;
+		char path[MAXPATHLEN];
 	local:
-		path = find_htfile(topdir, dir, ACCESS_FILE);
-		if (path) {
+		if (find_htfile(topdir, dir, ACCESS_FILE, path, sizeof(path)))
 			rc = access_check2(hc, path);
-			free(path);
-		}
-
-		if (tmp)
-			free(tmp);
 
 		return rc;
 	}
@@ -1060,8 +1455,6 @@ static int access_check(struct httpd_conn *hc, char *dir)
 	rc = access_check2(hc, topdir);
 	if (!rc)
 		goto local;
-	if (tmp)
-		free(tmp);
 
 	return rc;
 }
@@ -1081,7 +1474,7 @@ static int access_check2(struct httpd_conn *hc, char *dir)
 	snprintf(hc->accesspath, hc->maxaccesspath, "%s/%s", dir, ACCESS_FILE);
 
 	/* Does this directory have an access file? */
-	if (lstat(hc->accesspath, &sb) < 0) {
+	if (stc_lstat(hc->accesspath, &sb) < 0) {
 		/* Nope, let the request go through. */
 		return 0;
 	}
@@ -1203,7 +1596,7 @@ static void send_authenticate(struct httpd_conn *hc, char *realm)
 static int auth_check(struct httpd_conn *hc, char *dir)
 {
 	int rc = 0;
-	char *topdir, *tmp = NULL;
+	char *topdir, tmp[MAXPATHLEN];
 
 	if (!dir) {
 		char *ptr;
@@ -1214,12 +1607,13 @@ static int auth_check(struct httpd_conn *hc, char *dir)
 			return -1;
 		}
 
-		tmp = strdup(hc->expnfilename);
-		if (!tmp) {
-			syslog(LOG_ERR, "out of memory in authentication code; "
-			       "Denying authorization.");
+		/* Stack copy, keep-alive requests should not touch the heap */
+		if (strlen(hc->expnfilename) >= sizeof(tmp)) {
+			syslog(LOG_ERR, "%.80s URL \"%.80s\" too long for authentication code; "
+			       "Denying authorization.", httpd_client(hc), hc->encodedurl);
 			return -1;
 		}
+		strcpy(tmp, hc->expnfilename);
 
 		ptr = strrchr(tmp, '/');
 		if (!ptr)
@@ -1236,16 +1630,10 @@ static int auth_check(struct httpd_conn *hc, char *dir)
 		topdir = ".";
 
 	if (!hc->hs->global_passwd) {
-		char *path;
+		char path[MAXPATHLEN];
 	local:
-		path = find_htfile(topdir, dir, AUTH_FILE);
-		if (path) {
+		if (find_htfile(topdir, dir, AUTH_FILE, path, sizeof(path)))
 			rc = auth_check2(hc, path);
-			free(path);
-		}
-
-		if (tmp)
-			free(tmp);
 
 		return rc;
 	}
@@ -1253,8 +1641,6 @@ static int auth_check(struct httpd_conn *hc, char *dir)
 	rc = auth_check2(hc, topdir);
 	if (!rc)
 		goto local;
-	if (tmp)
-		free(tmp);
 
 	return rc;
 }
@@ -1279,7 +1665,7 @@ static int auth_check2(struct httpd_conn *hc, char *dir)
 	snprintf(hc->authpath, hc->maxauthpath, "%s/%s", dir, AUTH_FILE);
 
 	/* Does this directory have an auth file? */
-	if (lstat(hc->authpath, &sb) < 0)
+	if (stc_lstat(hc->authpath, &sb) < 0)
 		/* Nope, let the request go through. */
 		return 0;
 
@@ -1614,8 +2000,8 @@ static int vhost_map(struct httpd_conn *hc)
 {
 	httpd_sockaddr sa;
 	socklen_t sz;
-	char *cp1, *temp;
-	size_t len;
+	char *cp1;
+	size_t len, dirlen;
 #ifdef VHOST_DIRLEVELS
 	int i;
 	char *cp2;
@@ -1675,20 +2061,14 @@ static int vhost_map(struct httpd_conn *hc)
 	strcpy(hc->hostdir, hc->hostname);
 #endif /* VHOST_DIRLEVELS */
 
-	/* Prepend hostdir to the filename. */
-	len  = strlen(hc->expnfilename);
-	temp = strdup(hc->expnfilename);
-	httpd_realloc_str(&hc->expnfilename, &hc->maxexpnfilename, strlen(hc->hostdir) + 2 + len);
-	strcpy(hc->expnfilename, hc->hostdir);
-
-	/* Skip any port number */
-	cp1 = strrchr(hc->expnfilename, ':');
-	if (cp1)
-		*cp1 = 0;
-
-	strcat(hc->expnfilename, "/");
-	strcat(hc->expnfilename, temp);
-	free(temp);
+	/* Prepend hostdir, skipping any port number, to the filename. */
+	cp1 = strrchr(hc->hostdir, ':');
+	dirlen = cp1 ? (size_t)(cp1 - hc->hostdir) : strlen(hc->hostdir);
+	len = strlen(hc->expnfilename);
+	httpd_realloc_str(&hc->expnfilename, &hc->maxexpnfilename, dirlen + 1 + len);
+	memmove(&hc->expnfilename[dirlen + 1], hc->expnfilename, len + 1);
+	memcpy(hc->expnfilename, hc->hostdir, dirlen);
+	hc->expnfilename[dirlen] = '/';
 
 	return 1;
 }
@@ -1730,7 +2110,7 @@ static char *expand_symlinks(char *path, char **trailer, int no_symlink_check, i
 		*/
 		struct stat sb;
 
-		if (stat(path, &sb) != -1) {
+		if (stc_stat(path, &sb) != -1) {
 			checkedlen = strlen(path);
 			httpd_realloc_str(&checked, &maxchecked, checkedlen);
 			strcpy(checked, path);
@@ -1834,7 +2214,7 @@ static char *expand_symlinks(char *path, char **trailer, int no_symlink_check, i
 		if (checked[0] == '\0')
 			continue;
 
-		linklen = readlink(checked, link, sizeof(link) - 1);
+		linklen = stc_readlink(checked, link, sizeof(link) - 1);
 		if (linklen == -1) {
 			if (errno == EINVAL)
 				continue;	/* not a symlink */
@@ -1902,39 +2282,180 @@ static char *expand_symlinks(char *path, char **trailer, int no_symlink_check, i
 }
 
 
-void httpd_close_conn(struct httpd_conn *hc, struct timeval *now)
+char *httpd_file_window(struct httpd_conn *hc, off_t off, size_t *len)
 {
+	static off_t pagesz = 0;
+	off_t start;
+
+	*len = 0;
+	if (off >= hc->sb.st_size)
+		return NULL;
+
 	if (hc->file_address) {
-		mmc_unmap(hc->file_address, &(hc->sb), now);
-		hc->file_address = NULL;
+		*len = hc->sb.st_size - off;
+		return hc->file_address + off;
 	}
+	if (hc->file_fd < 0)
+		return NULL;
 
-	if (hc->conn_fd >= 0) {
-		httpd_ssl_close(hc);
-		hc->conn_fd = -1;
+	if (!hc->win_address || off < hc->win_offset || off >= hc->win_offset + (off_t)hc->win_len) {
+		if (!pagesz)
+			pagesz = sysconf(_SC_PAGESIZE);
+
+		if (hc->win_address)
+			munmap(hc->win_address, hc->win_len);
+
+		/* The offset must be page aligned, so the window may start a bit before off */
+		start = off - off % pagesz;
+		hc->win_len = MIN(FILE_WINDOW_SIZE, hc->sb.st_size - start);
+		hc->win_address = mmap(NULL, hc->win_len, PROT_READ, MAP_PRIVATE, hc->file_fd, start);
+		if (hc->win_address == MAP_FAILED) {
+			syslog(LOG_ERR, "mmap %s: %s", hc->expnfilename, strerror(errno));
+			hc->win_address = NULL;
+			return NULL;
+		}
+		hc->win_offset = start;
+#ifdef MADV_SEQUENTIAL
+		madvise(hc->win_address, hc->win_len, MADV_SEQUENTIAL);
+#endif
 	}
+
+	*len = hc->win_offset + hc->win_len - off;
+	return hc->win_address + (off - hc->win_offset);
 }
 
 
-void httpd_destroy_conn(struct httpd_conn *hc)
+/* One slice of the file, or of its cached gzip copy, up to len bytes */
+static ssize_t body_slice(struct httpd_conn *hc, off_t off, size_t len, struct iovec *iov)
 {
-	if (hc->initialized) {
-		free(hc->read_buf);
-		free(hc->decodedurl);
-		free(hc->origfilename);
-		free(hc->indexname);
-		free(hc->expnfilename);
-		free(hc->encodings);
-		free(hc->pathinfo);
-		free(hc->query);
-		free(hc->accept);
-		free(hc->accepte);
-		free(hc->reqhost);
-		free(hc->hostdir);
-		free(hc->remoteuser);
-		free(hc->response);
-#ifdef TILDE_MAP_2
-		free(hc->altdir);
+	size_t avail = len;
+	char *addr;
+
+	if (hc->gzip_address) {
+		addr = &hc->gzip_address[off];
+	} else {
+		addr = httpd_file_window(hc, off, &avail);
+		if (!addr)
+			return -1;
+	}
+
+	iov->iov_base = addr;
+	iov->iov_len  = MIN(len, avail);
+
+	return iov->iov_len;
+}
+
+
+int httpd_body_iov(struct httpd_conn *hc, off_t off, size_t len, struct iovec *iov, int max)
+{
+	off_t pos = 0;
+	int i, n = 0;
+
+	if (max < 1)
+		return -1;
+
+	if (hc->numranges < 2)
+		return body_slice(hc, off, len, iov) < 0 ? -1 : 1;
+
+	/* The body is a part header and a file slice per range, then the trailer */
+	for (i = 0; i <= hc->numranges && len > 0 && n < max; i++) {
+		struct httpd_range *r = &hc->ranges[i];
+		size_t plen = (i < hc->numranges ? hc->ranges[i + 1].part : hc->partslen) - r->part;
+		off_t slen;
+
+		if (off < pos + (off_t)plen) {
+			size_t skip = off - pos;
+			size_t chunk = MIN(plen - skip, len);
+
+			iov[n].iov_base = &hc->parts[r->part + skip];
+			iov[n++].iov_len = chunk;
+			off += chunk;
+			len -= chunk;
+		}
+		pos += plen;
+		if (i == hc->numranges || len == 0 || n >= max)
+			break;
+
+		slen = r->last - r->first + 1;
+		if (off < pos + slen) {
+			size_t want = MIN((off_t)len, pos + slen - off);
+			ssize_t got;
+
+			got = body_slice(hc, r->first + (off - pos), want, &iov[n++]);
+			if (got < 0)
+				return -1;
+
+			/* A window is remapped in place, so only one slice per call */
+			if ((size_t)got < want || !hc->file_address)
+				break;
+			off += got;
+			len -= got;
+		}
+		pos += slen;
+	}
+
+	return n;
+}
+
+
+void httpd_release_file(struct httpd_conn *hc, struct timeval *now)
+{
+	if (hc->file_address) {
+		mmc_unmap(hc->file_address, &(hc->sb), now);
+		hc->file_address = NULL;
+		hc->gzip_address = NULL;
+	}
+	if (hc->win_address) {
+		munmap(hc->win_address, hc->win_len);
+		hc->win_address = NULL;
+	}
+	if (hc->file_fd >= 0) {
+		close(hc->file_fd);
+		hc->file_fd = -1;
+	}
+	if (hc->ls_fd >= 0) {
+		close(hc->ls_fd);
+		hc->ls_fd = -1;
+	}
+	if (hc->ls_buf) {
+		free(hc->ls_buf);
+		hc->ls_buf = NULL;
+		hc->ls_len = hc->ls_size = 0;
+	}
+}
+
+
+void httpd_close_conn(struct httpd_conn *hc, struct timeval *now)
+{
+	httpd_release_file(hc, now);
+
+	if (hc->conn_fd >= 0) {
+		httpd_ssl_close(hc);
+		hc->conn_fd = -1;
+	}
+}
+
+
+void httpd_destroy_conn(struct httpd_conn *hc)
+{
+	if (hc->initialized) {
+		free(hc->read_buf);
+		free(hc->decodedurl);
+		free(hc->origfilename);
+		free(hc->indexname);
+		free(hc->expnfilename);
+		free(hc->encodings);
+		free(hc->pathinfo);
+		free(hc->query);
+		free(hc->acceptbuf);
+		free(hc->acceptebuf);
+		free(hc->reqhost);
+		free(hc->hostdir);
+		free(hc->remoteuser);
+		free(hc->response);
+		free(hc->parts);
+#ifdef TILDE_MAP_2
+		free(hc->altdir);
 #endif
 #ifdef ACCESS_FILE
 		free(hc->accesspath);
@@ -1959,7 +2480,8 @@ void httpd_init_conn_mem(struct httpd_conn *hc)
 	httpd_realloc_str(&hc->read_buf, &hc->read_size, 16384);
 	hc->maxdecodedurl = hc->maxorigfilename =  hc->maxindexname =
 		hc->maxexpnfilename = hc->maxencodings = hc->maxpathinfo = hc->maxquery = hc->maxaccept =
-		hc->maxaccepte = hc->maxreqhost = hc->maxhostdir = hc->maxremoteuser = hc->maxresponse = 0;
+		hc->maxaccepte = hc->maxreqhost = hc->maxhostdir = hc->maxremoteuser = hc->maxresponse =
+		hc->maxparts = 0;
 
 	httpd_realloc_str(&hc->decodedurl, &hc->maxdecodedurl, 1);
 	httpd_realloc_str(&hc->origfilename, &hc->maxorigfilename, 1);
@@ -1968,12 +2490,13 @@ void httpd_init_conn_mem(struct httpd_conn *hc)
 	httpd_realloc_str(&hc->encodings, &hc->maxencodings, 1);
 	httpd_realloc_str(&hc->pathinfo, &hc->maxpathinfo, 0);
 	httpd_realloc_str(&hc->query, &hc->maxquery, 0);
-	httpd_realloc_str(&hc->accept, &hc->maxaccept, 0);
-	httpd_realloc_str(&hc->accepte, &hc->maxaccepte, 0);
+	httpd_realloc_str(&hc->acceptbuf, &hc->maxaccept, 0);
+	httpd_realloc_str(&hc->acceptebuf, &hc->maxaccepte, 0);
 	httpd_realloc_str(&hc->reqhost, &hc->maxreqhost, 0);
 	httpd_realloc_str(&hc->hostdir, &hc->maxhostdir, 0);
 	httpd_realloc_str(&hc->remoteuser, &hc->maxremoteuser, 0);
 	httpd_realloc_str(&hc->response, &hc->maxresponse, 0);
+	httpd_realloc_str(&hc->parts, &hc->maxparts, 0);
 
 #ifdef TILDE_MAP_2
 	hc->maxaltdir = 0;
@@ -2008,6 +2531,9 @@ void httpd_init_conn_content(struct httpd_conn *hc)
 	hc->status = 0;
 	hc->bytes_to_send = 0;
 	hc->bytes_sent = 0;
+	hc->pipelined_idx = 0;
+	hc->fastcgi = 0;
+	hc->cgi_fd = -1;
 	hc->encodedurl = "";
 	hc->decodedurl[0] = '\0';
 	hc->protocol = "UNKNOWN";
@@ -2018,8 +2544,8 @@ void httpd_init_conn_content(struct httpd_conn *hc)
 	hc->query[0] = '\0';
 	hc->referer = "";
 	hc->useragent = "";
-	hc->accept[0] = '\0';
-	hc->accepte[0] = '\0';
+	hc->accept = "";
+	hc->accepte = "";
 	hc->acceptl = "";
 	hc->cookie = "";
 	hc->contenttype = "";
@@ -2035,6 +2561,8 @@ void httpd_init_conn_content(struct httpd_conn *hc)
 	hc->responselen = 0;
 	hc->if_modified_since = (time_t)-1;
 	hc->range_if = (time_t)-1;
+	hc->range_if_tag = "";
+	hc->if_none_match = "";
 	hc->contentlength = 0;
 	hc->type = "";
 	hc->hostname = NULL;
@@ -2044,11 +2572,50 @@ void httpd_init_conn_content(struct httpd_conn *hc)
 	hc->tildemapped = 0;
 	hc->first_byte_index = 0;
 	hc->last_byte_index = -1;
+	hc->numranges = 0;
+	hc->partslen = 0;
 	hc->keep_alive = 0;
 	hc->do_keep_alive = 0;
 	hc->should_linger = 0;
 	hc->file_address = NULL;
+	hc->gzip_address = NULL;
+	hc->file_fd = -1;
+	hc->use_sendfile = 0;
+	hc->win_address = NULL;
+	hc->win_offset = 0;
+	hc->win_len = 0;
+	hc->ls_fd = -1;
+	hc->ls_buf = NULL;
+	hc->ls_len = hc->ls_size = 0;
 	hc->compression_type = COMPRESSION_NONE;
+	hc->stream_id = 0;
+	timerclear(&hc->t_start);
+	timerclear(&hc->t_headers);
+	timerclear(&hc->t_resolved);
+	timerclear(&hc->t_first);
+	timerclear(&hc->t_done);
+}
+
+
+size_t httpd_reset_conn(struct httpd_conn *hc)
+{
+	char *buf = hc->read_buf;
+	size_t len = 0;
+
+	if (hc->pipelined_idx > 0 && hc->pipelined_idx < hc->read_idx) {
+		len = hc->read_idx - hc->pipelined_idx;
+		memmove(buf, &buf[hc->pipelined_idx], len);
+	}
+
+	/* Keep all buffers, and the TLS session, only reset the content */
+	httpd_init_conn_content(hc);
+	hc->read_idx = len;
+
+	/* A pipelined request is already here, its clock starts now */
+	if (len > 0)
+		tmr_prepare_timeval(&hc->t_start);
+
+	return len;
 }
 
 
@@ -2056,13 +2623,17 @@ int httpd_get_conn(struct httpd_server *hs, int listen_fd, struct httpd_conn *hc
 {
 	httpd_sockaddr sa;
 	socklen_t sz;
-	char *real_ip;
+	int one = 1;
 
 	httpd_init_conn_mem(hc);
 
-	/* Accept the new connection. */
+	/* Accept the new connection, non-blocking and close-on-exec */
 	sz = sizeof(sa);
+#ifdef HAVE_ACCEPT4
+	hc->conn_fd = accept4(listen_fd, &sa.sa, &sz, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	hc->conn_fd = accept(listen_fd, &sa.sa, &sz);
+#endif
 	if (hc->conn_fd < 0) {
 		if (errno == EWOULDBLOCK)
 			return GC_NO_MORE;
@@ -2079,24 +2650,32 @@ int httpd_get_conn(struct httpd_server *hs, int listen_fd, struct httpd_conn *hc
 		return GC_FAIL;
 	}
 
+#ifndef HAVE_ACCEPT4
 	fcntl(hc->conn_fd, F_SETFD, 1);
+	httpd_set_ndelay(hc->conn_fd);
+#endif
 	hc->hs = hs;
+
+	/* Responses are written whole, a pipelined one, or the tail of a
+	** file sent after its headers, must not wait for the ACK of the
+	** previous segment, which the client delays.
+	*/
+	setsockopt(hc->conn_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	/* Fixed send buffer size, this disables the kernel's autotuning */
+	if (hs->send_buffer > 0)
+		setsockopt(hc->conn_fd, SOL_SOCKET, SO_SNDBUF, &hs->send_buffer, sizeof(hs->send_buffer));
+
 	memset(&hc->client_addr, 0, sizeof(hc->client_addr));
 	memmove(&hc->client_addr, &sa, sockaddr_len(&sa));
-
-	/*
-	 * Slightly ugly workaround to handle X-Forwarded-For better for IPv6
-	 * Idea from https://blog.steve.fi/IPv6_and_thttpd.html
-	 */
-	real_ip = httpd_ntoa(&hc->client_addr);
-	memset(hc->client_addr.real_ip, 0, sizeof(hc->client_addr.real_ip));
-	strncpy(hc->client_addr.real_ip, real_ip, sizeof(hc->client_addr.real_ip));
+	hc->real_ip[0] = 0;
 
 	if (httpd_ssl_open(hc)) {
 		syslog(LOG_CRIT, "Failed creating new SSL connection");
 		return GC_FAIL;
 	}
 	httpd_init_conn_content(hc);
+	tmr_prepare_timeval(&hc->t_start);
 
 	return GC_OK;
 }
@@ -2110,7 +2689,7 @@ int httpd_get_conn(struct httpd_server *hs, int listen_fd, struct httpd_conn *hc
 ** have checked so far; and hc->checked_state is the current state of the
 ** finite state machine.
 */
-int httpd_got_request(struct httpd_conn *hc)
+static int really_got_request(struct httpd_conn *hc)
 {
 	char c;
 
@@ -2217,6 +2796,12 @@ int httpd_got_request(struct httpd_conn *hc)
 			break;
 
 		case CHST_LINE:
+			/* Skip to the end of the header line in one go */
+			hc->checked_idx += scan_eol(&hc->read_buf[hc->checked_idx], hc->read_idx - hc->checked_idx);
+			if (hc->checked_idx >= hc->read_idx)
+				return GR_NO_REQUEST;
+
+			c = hc->read_buf[hc->checked_idx];
 			switch (c) {
 			case '\n':
 				hc->checked_state = CHST_LF;
@@ -2297,6 +2882,218 @@ int httpd_got_request(struct httpd_conn *hc)
 	return GR_NO_REQUEST;
 }
 
+int httpd_got_request(struct httpd_conn *hc)
+{
+	int rc;
+
+	rc = really_got_request(hc);
+	if (rc == GR_GOT_REQUEST)
+		tmr_prepare_timeval(&hc->t_headers);
+
+	return rc;
+}
+
+
+/* Request headers we care about, see header_id() */
+enum {
+	HDR_UNKNOWN,
+	HDR_ACCEPT,
+	HDR_ACCEPT_ENCODING,
+	HDR_ACCEPT_LANGUAGE,
+	HDR_AUTHORIZATION,
+	HDR_CONNECTION,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_TYPE,
+	HDR_COOKIE,
+	HDR_HOST,
+	HDR_IF_MODIFIED_SINCE,
+	HDR_IF_NONE_MATCH,
+	HDR_IF_RANGE,
+	HDR_RANGE,
+	HDR_REFERER,
+	HDR_TRANSFER_ENCODING,
+	HDR_USER_AGENT,
+	HDR_X_FORWARDED_FOR
+};
+
+#define HDR_IS(name, str) (strncasecmp(name, str, sizeof(str) - 1) == 0)
+
+/* Look up a header name, of the given length, with one compare per
+** candidate of the same length instead of a list of them all.
+*/
+static int header_id(const char *name, size_t len)
+{
+	switch (len) {
+	case 4:
+		if (HDR_IS(name, "Host"))
+			return HDR_HOST;
+		break;
+
+	case 5:
+		if (HDR_IS(name, "Range"))
+			return HDR_RANGE;
+		break;
+
+	case 6:
+		if (HDR_IS(name, "Accept"))
+			return HDR_ACCEPT;
+		if (HDR_IS(name, "Cookie"))
+			return HDR_COOKIE;
+		break;
+
+	case 7:
+		if (HDR_IS(name, "Referer"))
+			return HDR_REFERER;
+		break;
+
+	case 8:
+		if (HDR_IS(name, "If-Range") || HDR_IS(name, "Range-If"))
+			return HDR_IF_RANGE;
+		break;
+
+	case 10:
+		if (HDR_IS(name, "User-Agent"))
+			return HDR_USER_AGENT;
+		if (HDR_IS(name, "Connection"))
+			return HDR_CONNECTION;
+		break;
+
+	case 12:
+		if (HDR_IS(name, "Content-Type"))
+			return HDR_CONTENT_TYPE;
+		break;
+
+	case 13:
+		if (HDR_IS(name, "If-None-Match"))
+			return HDR_IF_NONE_MATCH;
+		if (HDR_IS(name, "Authorization"))
+			return HDR_AUTHORIZATION;
+		break;
+
+	case 14:
+		if (HDR_IS(name, "Content-Length"))
+			return HDR_CONTENT_LENGTH;
+		break;
+
+	case 15:
+		if (HDR_IS(name, "Accept-Encoding"))
+			return HDR_ACCEPT_ENCODING;
+		if (HDR_IS(name, "Accept-Language"))
+			return HDR_ACCEPT_LANGUAGE;
+		if (HDR_IS(name, "X-Forwarded-For"))
+			return HDR_X_FORWARDED_FOR;
+		break;
+
+	case 17:
+		if (HDR_IS(name, "If-Modified-Since"))
+			return HDR_IF_MODIFIED_SINCE;
+		if (HDR_IS(name, "Transfer-Encoding"))
+			return HDR_TRANSFER_ENCODING;
+		break;
+	}
+
+	return HDR_UNKNOWN;
+}
+
+/* A header is used in place, in read_buf.  Only when it is repeated are
+** the values joined, in a buffer of its own, as if sent on one line.
+*/
+static char *join_header(struct httpd_conn *hc, char **buf, size_t *maxbuf, char *prev, char *val, char *name)
+{
+	size_t len;
+
+	if (prev[0] == '\0')
+		return val;
+
+	len = strlen(prev);
+	if (len > 5000) {
+		syslog(LOG_ERR, "%s way too much %s: data", httpd_client(hc), name);
+		return prev;
+	}
+
+	if (prev != *buf) {
+		httpd_realloc_str(buf, maxbuf, len);
+		strcpy(*buf, prev);
+	}
+	httpd_realloc_str(buf, maxbuf, len + 2 + strlen(val));
+	strcat(*buf, ", ");
+	strcat(*buf, val);
+
+	return *buf;
+}
+
+/* A qvalue, "0" to "1.000", as an integer 0-1000 */
+static int qvalue(const char *cp)
+{
+	double q;
+
+	q = strtod(cp, NULL);
+	if (q <= 0.0)
+		return 0;
+	if (q >= 1.0)
+		return 1000;
+
+	return (int)(q * 1000 + 0.5);
+}
+
+/* Parse Accept-Encoding, RFC 7231 section 5.3.4, into hc->accept_q.
+** Codings we do not serve are skipped, "*" stands for those of ours
+** not listed.
+*/
+static void accept_encoding(struct httpd_conn *hc)
+{
+	static const struct {
+		const char *name;
+		size_t      len;
+		int         enc;
+	} codings[] = {
+		{ "br",     2, ENCODING_BR   },
+		{ "zstd",   4, ENCODING_ZSTD },
+		{ "gzip",   4, ENCODING_GZIP },
+		{ "x-gzip", 6, ENCODING_GZIP },
+	};
+	int seen[ENCODING_MAX] = { 0 };
+	const char *cp, *name;
+	int i, q, star = -1;
+	size_t len;
+
+	for (cp = hc->accepte; *cp; ) {
+		cp += strspn(cp, " \t,");
+		name = cp;
+		len = strcspn(cp, " \t,;");
+		cp += len;
+
+		/* Parameters, only q matters */
+		q = 1000;
+		while (*cp && *cp != ',') {
+			cp += strspn(cp, " \t;");
+			if ((cp[0] == 'q' || cp[0] == 'Q') && cp[1] == '=')
+				q = qvalue(&cp[2]);
+			cp += strcspn(cp, ",;");
+		}
+
+		if (len == 1 && name[0] == '*') {
+			star = q;
+			continue;
+		}
+
+		for (i = 0; i < (int)NELEMS(codings); i++) {
+			if (len != codings[i].len || strncasecmp(name, codings[i].name, len))
+				continue;
+
+			hc->accept_q[codings[i].enc] = q;
+			seen[codings[i].enc] = 1;
+		}
+	}
+
+	for (i = 0; star > 0 && i < ENCODING_MAX; i++) {
+		if (!seen[i])
+			hc->accept_q[i] = star;
+	}
+
+	if (hc->accept_q[ENCODING_GZIP] > 0)
+		hc->compression_type = COMPRESSION_GZIP;
+}
 
 int httpd_parse_request(struct httpd_conn *hc)
 {
@@ -2308,6 +3105,8 @@ int httpd_parse_request(struct httpd_conn *hc)
 	char *eol;
 	char *cp;
 	char *pi;
+	int id;
+	int te = 0, cl = 0;
 
 	hc->checked_idx = 0;	/* reset */
 	method_str = bufgets(hc);
@@ -2425,162 +3224,182 @@ int httpd_parse_request(struct httpd_conn *hc)
 			if (buf[0] == '\0')
 				break;
 
-			if (strncasecmp(buf, "Referer:", 8) == 0) {
-				cp = &buf[8];
-				cp += strspn(cp, " \t");
+			cp = strchr(buf, ':');
+			if (!cp)
+				continue;
+
+			id = header_id(buf, cp - buf);
+			cp++;
+			cp += strspn(cp, " \t");
+
+			switch (id) {
+			case HDR_REFERER:
 				hc->referer = cp;
-			} else if (strncasecmp(buf, "User-Agent:", 11) == 0) {
-				cp = &buf[11];
-				cp += strspn(cp, " \t");
+				break;
+
+			case HDR_USER_AGENT:
 				hc->useragent = cp;
-			} else if (strncasecmp(buf, "Host:", 5) == 0) {
-				cp = &buf[5];
-				cp += strspn(cp, " \t");
+				break;
+
+			case HDR_HOST:
 				hc->hdrhost = cp;
 				if (strchr(hc->hdrhost, '/') || hc->hdrhost[0] == '.') {
 					httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "7");
 					return -1;
 				}
-			} else if (strncasecmp(buf, "Accept:", 7) == 0) {
-				cp = &buf[7];
-				cp += strspn(cp, " \t");
-				if (hc->accept[0] != '\0') {
-					if (strlen(hc->accept) > 5000) {
-						syslog(LOG_ERR, "%s way too much Accept: data", httpd_client(hc));
-						continue;
-					}
-					httpd_realloc_str(&hc->accept, &hc->maxaccept, strlen(hc->accept) + 2 + strlen(cp));
-					strcat(hc->accept, ", ");
-				} else
-					httpd_realloc_str(&hc->accept, &hc->maxaccept, strlen(cp));
-				strcat(hc->accept, cp);
-			} else if (strncasecmp(buf, "Accept-Encoding:", 16) == 0) {
-				cp = &buf[16];
-				cp += strspn(cp, " \t");
-				if (hc->accepte[0] != '\0') {
-					if (strlen(hc->accepte) > 5000) {
-						syslog(LOG_ERR, "%s way too much Accept-Encoding: data", httpd_client(hc));
-						continue;
-					}
-					httpd_realloc_str(&hc->accepte, &hc->maxaccepte, strlen(hc->accepte) + 2 + strlen(cp));
-					strcat(hc->accepte, ", ");
-				} else {
-					httpd_realloc_str(&hc->accepte, &hc->maxaccepte, strlen(cp));
-				}
-				strcpy(hc->accepte, cp);
-			} else if (strncasecmp(buf, "Accept-Language:", 16) == 0) {
-				cp = &buf[16];
-				cp += strspn(cp, " \t");
+				break;
+
+			case HDR_ACCEPT:
+				hc->accept = join_header(hc, &hc->acceptbuf, &hc->maxaccept, hc->accept, cp, "Accept");
+				break;
+
+			case HDR_ACCEPT_ENCODING:
+				hc->accepte = join_header(hc, &hc->acceptebuf, &hc->maxaccepte, hc->accepte, cp, "Accept-Encoding");
+				break;
+
+			case HDR_ACCEPT_LANGUAGE:
 				hc->acceptl = cp;
-			} else if (strncasecmp(buf, "If-Modified-Since:", 18) == 0) {
-				cp = &buf[18];
+				break;
+
+			case HDR_IF_MODIFIED_SINCE:
 				hc->if_modified_since = tdate_parse(cp);
 				if (hc->if_modified_since == (time_t)-1)
 					syslog(LOG_DEBUG, "unparsable time: %s", cp);
-			} else if (strncasecmp(buf, "Cookie:", 7) == 0) {
-				cp = &buf[7];
-				cp += strspn(cp, " \t");
+				break;
+
+			case HDR_IF_NONE_MATCH:
+				hc->if_none_match = cp;
+				break;
+
+			case HDR_COOKIE:
 				hc->cookie = cp;
-			} else if (strncasecmp(buf, "Range:", 6) == 0) {
-				/* Only support %d- and %d-%d, not %d-%d,%d-%d or -%d. */
-				if (!strchr(buf, ',')) {
-					char *cp_dash;
-
-					cp = strpbrk(buf, "=");
-					if (cp) {
-						cp_dash = strchr(cp + 1, '-');
-						if (cp_dash && cp_dash != cp + 1) {
-							*cp_dash = '\0';
-							hc->got_range = 1;
-							hc->first_byte_index = atoll(cp + 1);
-							if (hc->first_byte_index < 0)
-								hc->first_byte_index = 0;
-							if (isdigit((int)cp_dash[1])) {
-								hc->last_byte_index = atoll(cp_dash + 1);
-								if (hc->last_byte_index < 0)
-									hc->last_byte_index = -1;
-							}
-						}
-					}
+				break;
+
+			case HDR_RANGE:
+				parse_range(hc, cp);
+				break;
+
+			case HDR_IF_RANGE:
+				if (cp[0] == '"' || !strncmp(cp, "W/", 2)) {
+					hc->range_if_tag = cp;
+					break;
 				}
-			} else if (strncasecmp(buf, "Range-If:", 9) == 0 || strncasecmp(buf, "If-Range:", 9) == 0) {
-				cp = &buf[9];
 				hc->range_if = tdate_parse(cp);
 				if (hc->range_if == (time_t)-1)
 					syslog(LOG_DEBUG, "unparsable time: %s", cp);
-			} else if (strncasecmp(buf, "Content-Type:", 13) == 0) {
-				cp = &buf[13];
-				cp += strspn(cp, " \t");
+				break;
+
+			case HDR_CONTENT_TYPE:
 				hc->contenttype = cp;
-			} else if (strncasecmp(buf, "Content-Length:", 15) == 0) {
-				cp = &buf[15];
-				hc->contentlength = (size_t)atol(cp);
-			} else if (strncasecmp(buf, "Authorization:", 14) == 0) {
-				cp = &buf[14];
-				cp += strspn(cp, " \t");
+				break;
+
+			case HDR_CONTENT_LENGTH: {
+				char *end;
+				long long len;
+
+				/* A repeated header is joined, "10, 20", and
+				** rejected here along with any other junk.
+				*/
+				errno = 0;
+				len = strtoll(cp, &end, 10);
+				if (!isdigit(*cp) || *end || errno || len < 0) {
+					hc->do_keep_alive = 0;
+					httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "9");
+					return -1;
+				}
+				hc->contentlength = (size_t)len;
+				cl = 1;
+				break;
+			}
+
+			case HDR_TRANSFER_ENCODING:
+				te = 1;
+				break;
+
+			case HDR_AUTHORIZATION:
 				hc->authorization = cp;
-			} else if (strncasecmp(buf, "Connection:", 11) == 0) {
-				cp = &buf[11];
-				cp += strspn(cp, " \t");
+				break;
+
+			case HDR_CONNECTION:
 				if (strcasecmp(cp, "keep-alive") == 0) {
 					hc->keep_alive = 1;     /* Client signaling */
 					hc->do_keep_alive = 10; /* Our intention, which might change later */
 				}
-			} else if (strncasecmp(buf, "X-Forwarded-For:", 16) == 0) {
+				break;
+
+			case HDR_X_FORWARDED_FOR: {
 				int i;
 
 				/* Syntax: X-Forwarded-For: client[, proxy1, proxy2, ...] */
-				cp = &buf[16];
-				cp += strspn(cp, " \t");
-				for (i = 0; cp[i]; i++) {
-					hc->client_addr.real_ip[i] = cp[i];
-					if (isblank(cp[i]))
+				for (i = 0; cp[i] && i < (int)sizeof(hc->real_ip) - 1; i++) {
+					hc->real_ip[i] = cp[i];
+					if (isblank(cp[i]) || cp[i] == ',')
 						break;
 				}
-				hc->client_addr.real_ip[i] = 0;
+				hc->real_ip[i] = 0;
+				break;
 			}
 			/*
 			 * Possibly add support for X-Real-IP: here?
 			 * http://distinctplace.com/infrastructure/2014/04/23/story-behind-x-forwarded-for-and-x-real-ip-headers/
 			 */
+
+			default:
 #ifdef LOG_UNKNOWN_HEADERS
-			else if (strncasecmp(buf, "Accept-Charset:", 15)   == 0 ||
-				 strncasecmp(buf, "Accept-Language:", 16)  == 0 ||
-				 strncasecmp(buf, "Agent:", 6)             == 0 ||
-				 strncasecmp(buf, "Cache-Control:", 14)    == 0 ||
-				 strncasecmp(buf, "Cache-Info:", 11)       == 0 ||
-				 strncasecmp(buf, "Charge-To:", 10)        == 0 ||
-				 strncasecmp(buf, "Client-IP:", 10)        == 0 ||
-				 strncasecmp(buf, "Date:", 5)              == 0 ||
-				 strncasecmp(buf, "Extension:", 10)        == 0 ||
-				 strncasecmp(buf, "Forwarded:", 10)        == 0 ||
-				 strncasecmp(buf, "From:", 5)              == 0 ||
-				 strncasecmp(buf, "HTTP-Version:", 13)     == 0 ||
-				 strncasecmp(buf, "Max-Forwards:", 13)     == 0 ||
-				 strncasecmp(buf, "Message-Id:", 11)       == 0 ||
-				 strncasecmp(buf, "MIME-Version:", 13)     == 0 ||
-				 strncasecmp(buf, "Negotiate:", 10)        == 0 ||
-				 strncasecmp(buf, "Pragma:", 7)            == 0 ||
-				 strncasecmp(buf, "Proxy-Agent:", 12)      == 0 ||
-				 strncasecmp(buf, "Proxy-Connection:", 17) == 0 ||
-				 strncasecmp(buf, "Security-Scheme:", 16)  == 0 ||
-				 strncasecmp(buf, "Session-Id:", 11)       == 0 ||
-				 strncasecmp(buf, "UA-Color:", 9)          == 0 ||
-				 strncasecmp(buf, "UA-CPU:", 7)            == 0 ||
-				 strncasecmp(buf, "UA-Disp:", 8)           == 0 ||
-				 strncasecmp(buf, "UA-OS:", 6)             == 0 ||
-				 strncasecmp(buf, "UA-Pixels:", 10)        == 0 ||
-				 strncasecmp(buf, "User:", 5)              == 0 ||
-				 strncasecmp(buf, "Via:", 4)               == 0 ||
-				 strncasecmp(buf, "X-", 2)                 == 0) {
-				; /* ignore */
-			} else {
-				syslog(LOG_DEBUG, "unknown request header: %s", buf);
-			}
+				if (strncasecmp(buf, "Accept-Charset:", 15)   == 0 ||
+				    strncasecmp(buf, "Agent:", 6)             == 0 ||
+				    strncasecmp(buf, "Cache-Control:", 14)    == 0 ||
+				    strncasecmp(buf, "Cache-Info:", 11)       == 0 ||
+				    strncasecmp(buf, "Charge-To:", 10)        == 0 ||
+				    strncasecmp(buf, "Client-IP:", 10)        == 0 ||
+				    strncasecmp(buf, "Date:", 5)              == 0 ||
+				    strncasecmp(buf, "Extension:", 10)        == 0 ||
+				    strncasecmp(buf, "Forwarded:", 10)        == 0 ||
+				    strncasecmp(buf, "From:", 5)              == 0 ||
+				    strncasecmp(buf, "HTTP-Version:", 13)     == 0 ||
+				    strncasecmp(buf, "Max-Forwards:", 13)     == 0 ||
+				    strncasecmp(buf, "Message-Id:", 11)       == 0 ||
+				    strncasecmp(buf, "MIME-Version:", 13)     == 0 ||
+				    strncasecmp(buf, "Negotiate:", 10)        == 0 ||
+				    strncasecmp(buf, "Pragma:", 7)            == 0 ||
+				    strncasecmp(buf, "Proxy-Agent:", 12)      == 0 ||
+				    strncasecmp(buf, "Proxy-Connection:", 17) == 0 ||
+				    strncasecmp(buf, "Security-Scheme:", 16)  == 0 ||
+				    strncasecmp(buf, "Session-Id:", 11)       == 0 ||
+				    strncasecmp(buf, "UA-Color:", 9)          == 0 ||
+				    strncasecmp(buf, "UA-CPU:", 7)            == 0 ||
+				    strncasecmp(buf, "UA-Disp:", 8)           == 0 ||
+				    strncasecmp(buf, "UA-OS:", 6)             == 0 ||
+				    strncasecmp(buf, "UA-Pixels:", 10)        == 0 ||
+				    strncasecmp(buf, "User:", 5)              == 0 ||
+				    strncasecmp(buf, "Via:", 4)               == 0 ||
+				    strncasecmp(buf, "X-", 2)                 == 0)
+					; /* ignore */
+				else
+					syslog(LOG_DEBUG, "unknown request header: %s", buf);
 #endif /* LOG_UNKNOWN_HEADERS */
+				break;
+			}
 		}
 	}
 
+	/* We cannot read a chunked body, nor tell where it ends, so the
+	** rest of the connection cannot be trusted.  With Content-Length
+	** as well the request is ambiguous, RFC 7230, 3.3.3.
+	*/
+	if (te) {
+		hc->do_keep_alive = 0;
+		if (cl)
+			httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "10");
+		else
+			httpd_send_err(hc, 501, err501title, "", "Transfer-Encoding is not implemented by this server.\n", "");
+		return -1;
+	}
+
+	/* Anything after the headers, unless it's a body, is a pipelined request */
+	if (hc->contentlength == 0)
+		hc->pipelined_idx = hc->checked_idx;
+
 	if (hc->one_one) {
 		/* Check that HTTP/1.1 requests specify a host, as required. */
 		if (hc->reqhost[0] == '\0' && hc->hdrhost[0] == '\0') {
@@ -2589,33 +3408,19 @@ int httpd_parse_request(struct httpd_conn *hc)
 		}
 
 		/* If the client wants to do keep-alives, it might also be doing
-		** pipelining.  There's no way for us to tell.  Since we don't
-		** implement keep-alives yet, if we close such a connection there
-		** might be unread pipelined requests waiting.  So, we have to
-		** do a lingering close.
+		** pipelining.  Any pipelined requests we have already read are
+		** kept for the next round, see httpd_reset_conn(), but if we
+		** close such a connection there might be more unread requests
+		** waiting.  So, we have to do a lingering close.
 		*/
 		if (hc->keep_alive)
 			hc->should_linger = 1;
 	}
 
-	/* Look for a gzip accept-encoding */
-	if (hc->accepte[0] != '\0') {
-		char *gz;
-
-		gz = strstr(hc->accepte, "gzip");
-		if (gz) {
-			char *c, *q;
-			float qval = 0.0f;
-
-			c = strstr(gz, ",");
-			q = strstr(gz, "q=");
-			if (q)
-				qval = strtof(q + 2, 0);
-
-			if (!q || c < q || ((!c || q < c) && qval > 0.0f))
-				hc->compression_type = COMPRESSION_GZIP;
-		}
-	}
+	/* Codings the client accepts, gzip enables zlib on the fly */
+	memset(hc->accept_q, 0, sizeof(hc->accept_q));
+	if (hc->accepte[0] != '\0')
+		accept_encoding(hc);
 
 	/*
 	**  Disable keep alive support for bad browsers,
@@ -2721,31 +3526,75 @@ int httpd_parse_request(struct httpd_conn *hc)
 			return -1;
 		}
 	}
+	tmr_prepare_timeval(&hc->t_resolved);
 
 	return 0;
 }
 
 
+/* Offset of the first CR or LF in buf, or len if there is none.  Checks
+** 16 bytes at a time where the CPU can, this is where most of the time
+** reading a request goes.
+*/
+static size_t scan_eol(const char *buf, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&buf[i]);
+		int mask;
+
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__GNUC__)
+	const uint8x16_t cr = vdupq_n_u8('\r');
+	const uint8x16_t lf = vdupq_n_u8('\n');
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)&buf[i]);
+		uint8x16_t eq = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+		uint64_t mask;
+
+		/* Narrow to four bits per byte, there's no movemask on NEON */
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		if (mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (buf[i] == '\n' || buf[i] == '\r')
+			break;
+	}
+
+	return i;
+}
+
 static char *bufgets(struct httpd_conn *hc)
 {
-	int i;
+	size_t i;
 	char c;
 
-	for (i = hc->checked_idx; hc->checked_idx < hc->read_idx; ++hc->checked_idx) {
-		c = hc->read_buf[hc->checked_idx];
-		if (c == '\n' || c == '\r') {
-			hc->read_buf[hc->checked_idx] = '\0';
-			++hc->checked_idx;
-			if (c == '\r' && hc->checked_idx < hc->read_idx && hc->read_buf[hc->checked_idx] == '\n') {
-				hc->read_buf[hc->checked_idx] = '\0';
-				++hc->checked_idx;
-			}
+	i = hc->checked_idx;
+	hc->checked_idx += scan_eol(&hc->read_buf[i], hc->read_idx - i);
+	if (hc->checked_idx >= hc->read_idx)
+		return NULL;
 
-			return &(hc->read_buf[i]);
-		}
+	c = hc->read_buf[hc->checked_idx];
+	hc->read_buf[hc->checked_idx] = '\0';
+	++hc->checked_idx;
+	if (c == '\r' && hc->checked_idx < hc->read_idx && hc->read_buf[hc->checked_idx] == '\n') {
+		hc->read_buf[hc->checked_idx] = '\0';
+		++hc->checked_idx;
 	}
 
-	return NULL;
+	return &(hc->read_buf[i]);
 }
 
 
@@ -2799,51 +3648,43 @@ static void de_dotdot(char *file)
 
 
 struct mime_entry {
-	char *ext;
+	const char *ext;
 	size_t ext_len;
-	char *val;
+	const char *val;
 	size_t val_len;
 };
 
-static struct mime_entry enc_tab[] = {
+/* Perfect hash tables, generated by make_mime.pl */
 #include "mime_encodings.h"
-};
-
-static const int n_enc_tab = sizeof(enc_tab) / sizeof(*enc_tab);
-
-static struct mime_entry typ_tab[] = {
 #include "mime_types.h"
-};
 
-static const int n_typ_tab = sizeof(typ_tab) / sizeof(*typ_tab);
+/* FNV-1a of the lower case extension, the same as fnv() in make_mime.pl */
+static unsigned int mime_hash(unsigned int seed, const char *ext, size_t len)
+{
+	unsigned int h = 2166136261u ^ seed;
 
+	while (len--) {
+		h ^= (unsigned char)tolower((unsigned char)*ext++);
+		h *= 16777619u;
+	}
 
-/* qsort comparison routine - declared old-style on purpose, for portability. */
-static int ext_compare(a, b)
-struct mime_entry *a;
-struct mime_entry *b;
-{
-	return strcmp(a->ext, b->ext);
+	return h;
 }
 
-
-static void init_mime(void)
+/* A single probe, the seed of the extension's bucket picks its slot */
+static const struct mime_entry *mime_find(const struct mime_entry *tab, size_t size,
+					  const unsigned short *seed, size_t seeds,
+					  const char *ext, size_t len)
 {
-	int i;
+	const struct mime_entry *e;
+	unsigned int h;
 
-	/* Sort the tables so we can do binary search. */
-	qsort(enc_tab, n_enc_tab, sizeof(*enc_tab), ext_compare);
-	qsort(typ_tab, n_typ_tab, sizeof(*typ_tab), ext_compare);
+	h = mime_hash(0, ext, len);
+	e = &tab[mime_hash(seed[(h >> 24) & (seeds - 1)], ext, len) & (size - 1)];
+	if (e->ext && e->ext_len == len && !strncasecmp(e->ext, ext, len))
+		return e;
 
-	/* Fill in the lengths. */
-	for (i = 0; i < n_enc_tab; ++i) {
-		enc_tab[i].ext_len = strlen(enc_tab[i].ext);
-		enc_tab[i].val_len = strlen(enc_tab[i].val);
-	}
-	for (i = 0; i < n_typ_tab; ++i) {
-		typ_tab[i].ext_len = strlen(typ_tab[i].ext);
-		typ_tab[i].val_len = strlen(typ_tab[i].val);
-	}
+	return NULL;
 }
 
 
@@ -2853,75 +3694,49 @@ static void init_mime(void)
 */
 static void figure_mime(struct httpd_conn *hc)
 {
+	const struct mime_entry *me[8];
+	const struct mime_entry *e;
 	char *prev_dot;
 	char *dot;
 	char *ext;
-	int me_indexes[100];
-	size_t ext_len, encodings_len, n_me_indexes;
-	int i, top, bot, mid;
-	int r;
+	size_t ext_len, encodings_len, n_me;
+	int i;
 	const char *default_type = "text/plain; charset=%s";
 
 	/* Peel off encoding extensions until there aren't any more. */
-	n_me_indexes = 0;
+	n_me = 0;
 	hc->type = default_type;
 	for (prev_dot = &hc->expnfilename[strlen(hc->expnfilename)];; prev_dot = dot) {
 		for (dot = prev_dot - 1; dot >= hc->expnfilename && *dot != '.'; --dot)
 			;
 		if (dot < hc->expnfilename) {
 			/* No dot found.  No more extensions.  */
-			goto done;
+			break;
 		}
 		ext = dot + 1;
 		ext_len = prev_dot - ext;
-		/* Search the encodings table.  Linear search is fine here, there
-		** are only a few entries.
-		*/
-		for (i = 0; i < n_enc_tab; ++i) {
-			if (ext_len == enc_tab[i].ext_len && strncasecmp(ext, enc_tab[i].ext, ext_len) == 0) {
-				if (n_me_indexes < sizeof(me_indexes) / sizeof(*me_indexes)) {
-					me_indexes[n_me_indexes] = i;
-					++n_me_indexes;
-				}
-				break;
-			}
-		}
-		/* Binary search for a matching type extension. */
-		top = n_typ_tab - 1;
-		bot = 0;
-		while (top >= bot) {
-			mid = (top + bot) / 2;
-			r = strncasecmp(ext, typ_tab[mid].ext, ext_len);
-			if (r < 0)
-				top = mid - 1;
-			else if (r > 0)
-				bot = mid + 1;
-			else if (ext_len < typ_tab[mid].ext_len)
-				top = mid - 1;
-			else if (ext_len > typ_tab[mid].ext_len)
-				bot = mid + 1;
-			else {
-				hc->type = typ_tab[mid].val;
-				goto done;
-			}
+
+		e = mime_find(enc_tab, ENC_TAB_SIZE, enc_tab_seed, ENC_TAB_SEEDS, ext, ext_len);
+		if (e && n_me < NELEMS(me))
+			me[n_me++] = e;
+
+		e = mime_find(typ_tab, TYP_TAB_SIZE, typ_tab_seed, TYP_TAB_SEEDS, ext, ext_len);
+		if (e) {
+			hc->type = e->val;
+			break;
 		}
 	}
 
-done:
-
 	/* The last thing we do is actually generate the mime-encoding header. */
 	hc->encodings[0] = '\0';
 	encodings_len = 0;
-	for (i = n_me_indexes - 1; i >= 0; --i) {
-		httpd_realloc_str(&hc->encodings, &hc->maxencodings, encodings_len + enc_tab[me_indexes[i]].val_len + 1);
-		if (hc->encodings[0] != '\0') {
-			strcpy(&hc->encodings[encodings_len], ",");
-			++encodings_len;
-		}
-		strcpy(&hc->encodings[encodings_len], enc_tab[me_indexes[i]].val);
-		encodings_len += enc_tab[me_indexes[i]].val_len;
+	for (i = n_me - 1; i >= 0; --i) {
+		httpd_realloc_str(&hc->encodings, &hc->maxencodings, encodings_len + me[i]->val_len + 1);
+		if (encodings_len)
+			hc->encodings[encodings_len++] = ',';
+		memcpy(&hc->encodings[encodings_len], me[i]->val, me[i]->val_len + 1);
+		encodings_len += me[i]->val_len;
 	}
-
 }
 
 
@@ -3178,20 +3993,15 @@ static int child_ls_read_names(struct httpd_conn *hc, DIR *dirp, FILE *fp, int o
 	return 0;
 }
 
-/* Forked child process from ls() */
-static int child_ls(struct httpd_conn *hc, DIR *dirp)
+/* Forked child process from ls(), renders the listing on fd */
+static void child_ls(struct httpd_conn *hc, DIR *dirp, int fd)
 {
 	FILE *fp;
-	long len;
-	char *buf;
 
-	fp = tmpfile();
+	fp = fdopen(fd, "w");
 	if (!fp) {
-		syslog(LOG_ERR, "tmpfile: %s", strerror(errno));
-error:
-		httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
-		httpd_send_response(hc);
-		return 1;
+		syslog(LOG_ERR, "fdopen: %s", strerror(errno));
+		_exit(1);
 	}
 
 	fprintf(fp, "<!DOCTYPE html>\n"
@@ -3227,68 +4037,174 @@ error:
 	fprintf(fp, " <address>%s httpd at %s port %d</address>\n", EXPOSED_SERVER_SOFTWARE, get_hostname(hc), (int)hc->hs->port);
 	fprintf(fp, "</div></body>\n</html>\n");
 
-	len = ftell(fp);
-	if (len == -1) {
-		syslog(LOG_ERR, "ftell: %s", strerror(errno));
-		fclose(fp);
-		goto error;
+	/* Parent treats a short listing as an error, so be strict */
+	if (fclose(fp)) {
+		syslog(LOG_ERR, "Failed sending dirlisting to server: %s", strerror(errno));
+		_exit(1);
+	}
+
+	/* Not exit(), leave the parent's stdio buffers and atexit() alone */
+	_exit(0);
+}
+
+/* A listing depends on the directory, and the vhost and URL it is shown for */
+static const char *ls_key(struct httpd_conn *hc)
+{
+	static char *key;
+	static size_t maxkey = 0;
+	char *host = get_hostname(hc);
+
+	httpd_realloc_str(&key, &maxkey, strlen(host) + strlen(hc->encodedurl) + 32);
+	sprintf(key, "%p %s %s", (void *)hc->hs, host, hc->encodedurl);
+
+	return key;
+}
+
+/* Send a listing from the cache, it is just another mapped file */
+static int send_ls(struct httpd_conn *hc, struct timeval *now)
+{
+	char *extra = "";
+
+	hc->type = "text/html; charset=%s";
+	if (!hc->has_deflate || hc->sb.st_size < 256)
+		hc->compression_type = COMPRESSION_NONE;
+	if (hc->has_deflate)
+		extra = "Vary: Accept-Encoding\r\n";
+
+	return send_file(hc, extra, 0, now);
+}
+
+/* Listings are cached, see mmc_body().  On a miss a child renders the
+** listing on a pipe, which the caller reads with httpd_ls_read() while
+** serving other connections.
+*/
+static int ls(struct httpd_conn *hc, struct timeval *now)
+{
+	int r;
+	int fds[2];
+	DIR *dirp;
+
+	if (hc->method != METHOD_GET && hc->method != METHOD_HEAD) {
+		httpd_send_err(hc, 501, err501title, "", err501form, httpd_method_str(hc->method));
+		return -1;
+	}
+
+	hc->file_address = mmc_body(&hc->sb, ls_key(hc), &hc->sb, now);
+	if (hc->file_address)
+		return send_ls(hc, now);
+
+	/* Left to an HTTP/1.x connection to build, then cached for all */
+	if (hc->stream_id)
+		return 1;
+
+	dirp = opendir(hc->expnfilename);
+	if (!dirp) {
+		syslog(LOG_ERR, "opendir %s: %s", hc->expnfilename, strerror(errno));
+		httpd_send_err(hc, 404, err404title, "", err404form, hc->encodedurl);
+		return -1;
+	}
+
+	if (pipe(fds) < 0) {
+		syslog(LOG_ERR, "pipe: %s", strerror(errno));
+		closedir(dirp);
+		httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
+		return -1;
+	}
+
+	r = fork();
+	if (r < 0) {
+		syslog(LOG_ERR, "fork: %s", strerror(errno));
+		closedir(dirp);
+		close(fds[0]);
+		close(fds[1]);
+		httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
+		return -1;
 	}
 
-	buf = malloc((size_t)len);
-	if (!buf) {
-		fclose(fp);
-		goto error;
+	if (r == 0) {
+		/* Child process. */
+		sub_process = 1;
+		httpd_unlisten(hc->hs);
+		close(fds[0]);
+		child_ls(hc, dirp, fds[1]);
 	}
 
-	send_mime(hc, 200, ok200title, "", "", "text/html; charset=%s", (off_t) - 1, hc->sb.st_mtime);
-	httpd_send_response(hc);
-
-	rewind(fp);
-	fread(buf, (size_t)len, 1, fp);
-	if (httpd_write(hc, buf, (size_t)len) <= 0)
-		syslog(LOG_ERR, "Failed sending dirlisting to client: %s", strerror(errno));
+	closedir(dirp);
+	close(fds[1]);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	httpd_set_ndelay(fds[0]);
+	hc->ls_fd = fds[0];
 
-	free(buf);
-	fclose(fp);
+	/* Already in the access log, if set up */
+	if (!alog_enabled())
+		syslog(LOG_INFO, "%s: LST[%d] /%.200s \"%s\" \"%s\"",
+		       httpd_client(hc), r, hc->expnfilename, hc->referer, hc->useragent);
 
 	return 0;
 }
 
-static int ls(struct httpd_conn *hc)
+int httpd_ls_read(struct httpd_conn *hc, struct timeval *now)
 {
-	int r;
-	DIR *dirp;
-	arg_t arg;
+	ssize_t n;
+	void *buf;
 
-	hc->compression_type = COMPRESSION_NONE;
+	for (;;) {
+		if (hc->ls_len == hc->ls_size) {
+			size_t size = hc->ls_size ? hc->ls_size * 2 : 16384;
 
-	dirp = opendir(hc->expnfilename);
-	if (!dirp) {
-		syslog(LOG_ERR, "opendir %s: %s", hc->expnfilename, strerror(errno));
-		httpd_send_err(hc, 404, err404title, "", err404form, hc->encodedurl);
-		return -1;
+			buf = realloc(hc->ls_buf, size);
+			if (!buf) {
+				syslog(LOG_ERR, "out of memory reading dirlisting");
+				goto error;
+			}
+			hc->ls_buf = buf;
+			hc->ls_size = size;
+		}
+
+		n = read(hc->ls_fd, hc->ls_buf + hc->ls_len, hc->ls_size - hc->ls_len);
+		if (n > 0) {
+			hc->ls_len += n;
+			continue;
+		}
+		if (n == 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		syslog(LOG_ERR, "read dirlisting: %s", strerror(errno));
+		goto error;
 	}
 
-	if (hc->method == METHOD_HEAD) {
-		closedir(dirp);
-		send_mime(hc, 200, ok200title, "", "", "text/html; charset=%s", (off_t) - 1, hc->sb.st_mtime);
-	} else if (hc->method == METHOD_GET) {
-		child_ls(hc, dirp);
+	/* The child only ends the page when all went well */
+	if (hc->ls_len < 8 || memcmp(hc->ls_buf + hc->ls_len - 8, "</html>\n", 8)) {
+		syslog(LOG_ERR, "incomplete dirlisting of %s", hc->expnfilename);
+		goto error;
+	}
 
-		closedir(dirp);
-		syslog(LOG_INFO, "%s: LST[%d] /%.200s \"%s\" \"%s\"",
-		       httpd_client(hc), r, hc->expnfilename, hc->referer, hc->useragent);
+	/* The cache owns the buffer from here on */
+	buf = hc->ls_buf;
+	hc->ls_buf = NULL;
+	hc->file_address = mmc_add_body(&hc->sb, ls_key(hc), buf, hc->ls_len, &hc->sb, now);
+	hc->ls_len = hc->ls_size = 0;
+	if (!hc->file_address)
+		goto error;
 
-		hc->status = 200;
-		hc->bytes_sent = CGI_BYTECOUNT;
-		hc->should_linger = 0;
-	} else {
-		closedir(dirp);
-		httpd_send_err(hc, 501, err501title, "", err501form, httpd_method_str(hc->method));
+	if (send_ls(hc, now) < 0)
 		return -1;
-	}
 
-	return 0;
+	return 1;
+error:
+	httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
+	return -1;
+}
+
+#else /* GENERATE_INDEXES */
+
+int httpd_ls_read(struct httpd_conn *hc, struct timeval *now)
+{
+	return -1;
 }
 
 #endif /* GENERATE_INDEXES */
@@ -3356,7 +4272,7 @@ static char **make_envp(struct httpd_conn *hc)
 	cp = get_hostname(hc);
 	if (cp[0])
 		envp[envn++] = build_env("SERVER_NAME=%s", cp);
-	envp[envn++] = "GATEWAY_INTERFACE=CGI/1.1";
+	envp[envn++] = build_env("GATEWAY_INTERFACE=%s", "CGI/1.1");
 	envp[envn++] = build_env("SERVER_PROTOCOL=%s", hc->protocol);
 	snprintf(buf, sizeof(buf), "%d", (int)hc->hs->port);
 	envp[envn++] = build_env("SERVER_PORT=%s", buf);
@@ -3372,6 +4288,7 @@ static char **make_envp(struct httpd_conn *hc)
 		if (cp2) {
 			snprintf(cp2, l, "%s%s", hc->hs->cwd, hc->pathinfo);
 			envp[envn++] = build_env("PATH_TRANSLATED=%s", cp2);
+			free(cp2);
 		}
 	}
 	envp[envn++] = build_env("SCRIPT_NAME=/%s", strcmp(hc->origfilename, ".") == 0 ? "" : hc->origfilename);
@@ -3425,6 +4342,36 @@ static char **make_envp(struct httpd_conn *hc)
 }
 
 
+/* FastCGI requests are handled by the main process, so here we do have to
+** free the environment.  Everything in it comes from build_env().
+*/
+char **httpd_fastcgi_envp(struct httpd_conn *hc)
+{
+	char **envp;
+	int envn;
+
+	envp = make_envp(hc);
+	for (envn = 0; envp[envn]; envn++)
+		;
+
+	envp[envn++] = build_env("REQUEST_URI=%s", hc->encodedurl);
+	envp[envn++] = build_env("DOCUMENT_ROOT=%s", hc->hs->cwd);
+	envp[envn] = NULL;
+
+	return envp;
+}
+
+void httpd_fastcgi_envp_free(char **envp)
+{
+	int envn;
+
+	for (envn = 0; envp[envn]; envn++) {
+		free(envp[envn]);
+		envp[envn] = NULL;
+	}
+}
+
+
 /* Set up argument vector.  Again, we don't have to worry about freeing stuff
 ** since we're a sub-process.  This gets done after make_envp() because we
 ** scribble on hc->query.
@@ -3538,56 +4485,16 @@ static void post_post_garbage_hack(struct httpd_conn *hc)
 }
 
 
-/* This routine is used for parsed-header CGIs.  The idea here is that the
-** CGI can return special headers such as "Status:" and "Location:" which
-** change the return status of the response.  Since the return status has to
-** be the very first line written out, we have to accumulate all the headers
-** and check for the special ones before writing the status.  Then we write
-** out the saved headers and proceed to echo the rest of the response.
+/* Figure out the status.  Look for a Status: or Location: header;
+** else if there's an HTTP header line, get it from there; else
+** default to 200.  The end of the headers is at br.
 */
-static void cgi_interpose_output(struct httpd_conn *hc, int rfd)
+static int cgi_status(char *headers, char *br, char **titleP)
 {
-	ssize_t r;
-	char buf[1024];
-	size_t headers_size, headers_len;
-	char *headers;
-	char *br;
 	int status;
 	char *title;
 	char *cp;
 
-	/* Make sure the connection is in blocking mode.  It should already
-	** be blocking, but we might as well be sure.
-	*/
-	httpd_clear_ndelay(hc->conn_fd);
-
-	/* Slurp in all headers. */
-	headers_size = 0;
-	httpd_realloc_str(&headers, &headers_size, 500);
-	headers_len = 0;
-	for (;;) {
-		r = file_read(rfd, buf, sizeof(buf));
-		if (r <= 0) {
-			br = &(headers[headers_len]);
-			break;
-		}
-
-		httpd_realloc_str(&headers, &headers_size, headers_len + r);
-		memmove(&(headers[headers_len]), buf, r);
-		headers_len += r;
-		headers[headers_len] = '\0';
-		if ((br = strstr(headers, "\r\n\r\n")) || (br = strstr(headers, "\n\n")))
-			break;
-	}
-
-	/* If there were no headers, bail. */
-	if (headers[0] == '\0')
-		return;
-
-	/* Figure out the status.  Look for a Status: or Location: header;
-	** else if there's an HTTP header line, get it from there; else
-	** default to 200.
-	*/
 	status = 200;
 	if (strncmp(headers, "HTTP/", 5) == 0) {
 		cp = headers;
@@ -3636,6 +4543,9 @@ static void cgi_interpose_output(struct httpd_conn *hc, int rfd)
 	case 501:
 		title = err501title;
 		break;
+	case 502:
+		title = httpd_err502title;
+		break;
 	case 503:
 		title = httpd_err503title;
 		break;
@@ -3644,28 +4554,107 @@ static void cgi_interpose_output(struct httpd_conn *hc, int rfd)
 		break;
 	}
 
-	snprintf(buf, sizeof(buf), "HTTP/1.0 %d %s\r\n", status, title);
-	httpd_write(hc, buf, strlen(buf));
+	*titleP = title;
 
-	/* Write the saved headers. */
-	httpd_write(hc, headers, headers_len);
+	return status;
+}
 
-	/* Echo the rest of the output. */
-	for (;;) {
-		r = file_read(rfd, buf, sizeof(buf));
-		if (r <= 0)
-			break;
+/* Header lines are matched case-insensitive, at the start of a line */
+static char *cgi_header(char *headers, char *br, const char *name)
+{
+	size_t len = strlen(name);
+	char *cp = headers;
 
-		if (httpd_write(hc, buf, r) != r)
-			break;
+	while (cp && cp < br) {
+		if (!strncasecmp(cp, name, len))
+			return cp + len;
+
+		cp = strchr(cp, '\n');
+		if (cp)
+			cp++;
+	}
+
+	return NULL;
+}
+
+int httpd_cgi_response(struct httpd_conn *hc, char *headers, size_t len, off_t *lengthP)
+{
+	char buf[256];
+	char *title, *type;
+	char *br, *cp, *end;
+	long long length;
+	int status, gzip;
+
+	/* Make sure to strip the empty line, we add our own headers after */
+	br = &headers[len];
+	while (br > headers && (br[-1] == '\n' || br[-1] == '\r'))
+		br--;
+	if (br == &headers[len])
+		return -1;
+	*br = '\0';
+
+	status = cgi_status(headers, br, &title);
+	hc->status = status;
+
+	/* We send our own status line */
+	if (!strncmp(headers, "HTTP/", 5)) {
+		headers += strcspn(headers, "\n");
+		if (headers < br)
+			headers++;
+	}
+
+	/* Without a length there is no way to tell where the response ends,
+	** the caller holds the program to it, see handle_cgi().
+	*/
+	*lengthP = -1;
+	cp = cgi_header(headers, br, "Content-Length:");
+	if (cp) {
+		cp += strspn(cp, " \t");
+		errno = 0;
+		length = strtoll(cp, &end, 10);
+		end += strspn(end, " \t\r");
+		if (isdigit(*cp) && !errno && (end == br || *end == '\n'))
+			*lengthP = (off_t)length;
+	}
+
+	/* Text without a length may be deflated on the fly, then it is sent
+	** chunked, which HTTP/1.1 clients can keep the connection alive for.
+	** The caller does the rest, for hc->compression_type, see cgi_gzip().
+	*/
+	type = cgi_header(headers, br, "Content-Type:");
+	if (type)
+		type += strspn(type, " \t");
+	gzip = *lengthP < 0 && hc->has_deflate && hc->compression_type == COMPRESSION_GZIP && hc->one_one &&
+		hc->method != METHOD_HEAD && status >= 200 && status != 204 && status != 304 && type &&
+		(!strncasecmp(type, "text/", 5) || !strncasecmp(type, "application/javascript", 22)) &&
+		!cgi_header(headers, br, "Content-Encoding:") && !cgi_header(headers, br, "Transfer-Encoding:");
+	if (!gzip)
+		hc->compression_type = COMPRESSION_NONE;
+	if (*lengthP < 0 && !gzip)
+		hc->do_keep_alive = 0;
+
+	snprintf(buf, sizeof(buf), "%.20s %d %s\r\n", hc->protocol, status, title);
+	add_response(hc, buf);
+	add_response(hc, httpd_date());
+	if (br > headers) {
+		add_response_len(hc, headers, br - headers);
+		add_response(hc, "\r\n");
 	}
+	if (gzip)
+		add_response(hc, "Content-Encoding: gzip\r\nTransfer-Encoding: chunked\r\nVary: Accept-Encoding\r\n");
+	if (hc->do_keep_alive)
+		add_response(hc, "Connection: keep-alive\r\n\r\n");
+	else
+		add_response(hc, "Connection: close\r\n\r\n");
 
-	shutdown(hc->conn_fd, SHUT_WR);
+	return status;
 }
 
 
-/* CGI child process. */
-static void cgi_child(struct httpd_conn *hc)
+/* CGI child process.  With a sock, stdin and stdout are streamed by the
+** main loop, otherwise the CGI program talks to the client directly.
+*/
+static void cgi_child(struct httpd_conn *hc, int sock)
 {
 	int r;
 	char **argp;
@@ -3673,6 +4662,30 @@ static void cgi_child(struct httpd_conn *hc)
 	char *binary;
 	char *directory;
 
+	/* Make the environment vector. */
+	envp = make_envp(hc);
+
+	/* Make the argument vector. */
+	argp = make_argp(hc);
+
+	if (sock >= 0) {
+		int fd;
+
+		/* Out of the way of the stdio descriptors, for dup2() */
+		while (sock <= STDERR_FILENO) {
+			fd = dup(sock);
+			if (fd < 0)
+				exit(1);
+			sock = fd;
+		}
+
+		dup2(sock, STDIN_FILENO);
+		dup2(sock, STDOUT_FILENO);
+		dup2(sock, STDERR_FILENO);
+		close(sock);
+		goto exec;
+	}
+
 	/* Unset close-on-exec flag for this socket.  This actually shouldn't
 	** be necessary, according to POSIX a dup()'d file descriptor does
 	** *not* inherit the close-on-exec flag, its flag is always clear.
@@ -3696,12 +4709,6 @@ static void cgi_child(struct httpd_conn *hc)
 		*/
 	}
 
-	/* Make the environment vector. */
-	envp = make_envp(hc);
-
-	/* Make the argument vector. */
-	argp = make_argp(hc);
-
 	/* Set up stdin.  For POSTs we may have to set up a pipe from an
 	** interposer process, depending on if we've read some of the data
 	** into our buffer.
@@ -3742,47 +4749,13 @@ static void cgi_child(struct httpd_conn *hc)
 			dup2(hc->conn_fd, STDIN_FILENO);
 	}
 
-	/* Set up stdout/stderr.  If we're doing CGI header parsing,
-	** we need an output interposer too.
+	/* Set up stdout/stderr, the request socket.  CGIs with parsed
+	** headers always get a sock, see cgi().
 	*/
-	if (strncmp(argp[0], "nph-", 4) != 0 && hc->mime_flag) {
-		int p[2];
-
-		if (pipe(p) < 0) {
-			syslog(LOG_ERR, "pipe: %s", strerror(errno));
-			httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
-			httpd_send_response(hc);
-			exit(1);
-		}
-		r = fork();
-		if (r < 0) {
-			syslog(LOG_ERR, "fork: %s", strerror(errno));
-			httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
-			httpd_send_response(hc);
-			exit(1);
-		}
-		if (r == 0) {
-			/* Interposer process. */
-			sub_process = 1;
-			close(p[1]);
-			cgi_interpose_output(hc, p[0]);
-			exit(0);
-		}
-		/* Need to schedule a kill for process r; but in the main process! */
-		close(p[0]);
-		if (p[1] != STDOUT_FILENO)
-			dup2(p[1], STDOUT_FILENO);
-		if (p[1] != STDERR_FILENO)
-			dup2(p[1], STDERR_FILENO);
-		if (p[1] != STDOUT_FILENO && p[1] != STDERR_FILENO)
-			close(p[1]);
-	} else {
-		/* Otherwise, the request socket is stdout/stderr. */
-		if (hc->conn_fd != STDOUT_FILENO)
-			dup2(hc->conn_fd, STDOUT_FILENO);
-		if (hc->conn_fd != STDERR_FILENO)
-			dup2(hc->conn_fd, STDERR_FILENO);
-	}
+	if (hc->conn_fd != STDOUT_FILENO)
+		dup2(hc->conn_fd, STDOUT_FILENO);
+	if (hc->conn_fd != STDERR_FILENO)
+		dup2(hc->conn_fd, STDERR_FILENO);
 
 	/* At this point we would like to set close-on-exec again for hc->conn_fd
 	** (see previous comments on Linux's broken behavior re: close-on-exec
@@ -3797,6 +4770,7 @@ static void cgi_child(struct httpd_conn *hc)
 	*/
 	/* fcntl(hc->conn_fd, F_SETFD, 1); */
 
+exec:
 #ifdef CGI_NICE
 	/* Set priority. */
 	nice(CGI_NICE);
@@ -3876,33 +4850,73 @@ int httpd_cgi_untrack(struct httpd_server *hs, pid_t pid)
 
 static int cgi(struct httpd_conn *hc)
 {
+	int sv[2] = { -1, -1 };
+	char *binary;
 	int r;
 	arg_t arg;
 
-	/*
-	** We are not going to leave the socket open after a CGI ... too difficult
-	*/
-	hc->do_keep_alive = 0;
-
 	if (hc->method == METHOD_GET || hc->method == METHOD_POST ||
-	    hc->method == METHOD_PUT || hc->method == METHOD_DELETE) {
+	    hc->method == METHOD_PUT || hc->method == METHOD_DELETE ||
+	    (hc->method == METHOD_HEAD && hc->hs->fastcgi)) {
+		/* A persistent FastCGI backend, driven from the main loop,
+		** can keep the socket open, if it only sends a length.  The
+		** body of a HEAD response is dropped there.
+		*/
+		if (hc->hs->fastcgi) {
+			hc->fastcgi = 1;
+			hc->should_linger = 0;
+			return 0;
+		}
+
 		if (hc->hs->cgi_limit != 0 && hc->hs->cgi_count >= hc->hs->cgi_limit) {
 			httpd_send_err(hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl);
 			return -1;
 		}
 
-		httpd_clear_ndelay(hc->conn_fd);
+		/* CGIs with parsed headers are streamed by the main loop over a
+		** socket pair, stdin and stdout, and may keep the socket open.
+		** Others, nph- and HTTP/0.9, talk to the client directly.
+		*/
+		binary = strrchr(hc->expnfilename, '/');
+		binary = binary ? binary + 1 : hc->expnfilename;
+		if (strncmp(binary, "nph-", 4) != 0 && hc->mime_flag) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+				syslog(LOG_ERR, "socketpair: %s", strerror(errno));
+				httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
+				return -1;
+			}
+			fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		} else {
+			/*
+			** We are not going to leave the socket open after a CGI ... too difficult
+			*/
+			hc->do_keep_alive = 0;
+			httpd_clear_ndelay(hc->conn_fd);
+		}
+
 		r = fork();
 		if (r < 0) {
 			syslog(LOG_ERR, "fork: %s", strerror(errno));
 			httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
+			if (sv[0] >= 0) {
+				close(sv[0]);
+				close(sv[1]);
+			}
 			return -1;
 		}
 		if (r == 0) {
 			/* Child process. */
 			sub_process = 1;
 			httpd_unlisten(hc->hs);
-			cgi_child(hc);
+			if (sv[0] >= 0)
+				close(sv[0]);
+			cgi_child(hc, sv[1]);
+		}
+
+		if (sv[0] >= 0) {
+			close(sv[1]);
+			httpd_set_ndelay(sv[0]);
+			hc->cgi_fd = sv[0];
 		}
 
 		/* Parent process spawned CGI process PID. */
@@ -3921,7 +4935,8 @@ static int cgi(struct httpd_conn *hc)
 #endif
 
 		hc->status = 200;
-		hc->bytes_sent = CGI_BYTECOUNT;
+		if (hc->cgi_fd < 0)
+			hc->bytes_sent = CGI_BYTECOUNT;
 		hc->should_linger = 0;
 	} else {
 		httpd_send_err(hc, 501, err501title, "", err501form, httpd_method_str(hc->method));
@@ -3942,89 +4957,94 @@ static int is_cgi(struct httpd_conn *hc)
 	char *fn = hc->expnfilename;
 
 	if (hc->hs->vhost) {
-		int len;
-		char buf[256];
+		size_t len = strlen(hc->hostdir);
 
-		len = snprintf(buf, sizeof(buf), "%s/**", hc->hostdir) - 2;
-		if (match(buf, fn))
-			fn += len;
+		if (!strncmp(fn, hc->hostdir, len) && fn[len] == '/')
+			fn += len + 1;
 	}
 
 	/* With the vhost prefix out of the way we can match CGI patterns */
-	if (hc->hs->cgi_pattern && match(hc->hs->cgi_pattern, fn))
+	if (hc->hs->cgi_match && match_exec(hc->hs->cgi_match, fn))
 		return 1;
 
 	return 0;
 }
 
 /*
+** Picks the best precompressed sibling of a file, file.br, file.zst or
+** file.gz, that the client accepts at least as much as gzip on the fly.
 ** Adds Vary: Accept-Encoding to relevant files.  For details, see
 ** https://www.maxcdn.com/blog/accept-encoding-its-vary-important/
-** TODO: Refactor, too much focus on finding .gz files
 */
 static char *mod_headers(struct httpd_conn *hc)
 {
-	int serve_dotgz = 0;
-	char *fn = NULL;
-	char *header = "";
+	static const char *suffix[ENCODING_MAX] = { ".br", ".zst", ".gz" };
+	static const char *coding[ENCODING_MAX] = { "br", "zstd", "gzip" };
 	char *match[] = { ".js", ".css", ".xml", ".gz", ".html" };
+	int deflate, vary, best = -1, dynq = 0;
+	struct stat st, best_st;
+	char *fn;
 	size_t i, len;
-	struct stat st;
 
-	if (hc->compression_type != COMPRESSION_GZIP)
-		goto done;
+	/* zlib, on text files, or javascript, but not really small things */
+	deflate = hc->has_deflate && hc->sb.st_size >= 256 &&
+		(!strncmp(hc->type, "text/", 5) || !strcmp(hc->type, "application/javascript"));
+	if (deflate && hc->compression_type == COMPRESSION_GZIP)
+		dynq = hc->accept_q[ENCODING_GZIP];
+	vary = deflate;
+
+	fn = strrchr(hc->expnfilename, '.');
+	for (i = 0; fn && i < NELEMS(match); i++) {
+		if (!strcmp(fn, match[i]))
+			vary = 1;
+	}
+
+	/* Siblings are looked up in the stat cache, in place, no need to
+	** malloc per request.  Not for files with an encoding already.
+	** Any sibling, also one this client does not take, means the
+	** response depends on Accept-Encoding.
+	*/
+	len = strlen(hc->expnfilename);
+	httpd_realloc_str(&hc->expnfilename, &hc->maxexpnfilename, len + 4);
+	for (i = 0; hc->encodings[0] == '\0' && i < ENCODING_MAX; i++) {
+		int q = hc->accept_q[i];
 
-	/* construct .gz filename, remember NUL */
-	len = strlen(hc->expnfilename) + 4;
-	fn = malloc(len);
-	snprintf(fn, len, "%s.gz", hc->expnfilename);
+		strcpy(&hc->expnfilename[len], suffix[i]);
+		if (stc_stat(hc->expnfilename, &st) || !S_ISREG(st.st_mode))
+			continue;
 
-	/* is there a .gz file */
-	if (!stat(fn, &st)) {
 		/* Is it world-readable or world-executable? and newer than original */
-		if (st.st_mode & (S_IROTH | S_IXOTH) && st.st_mtime >= hc->sb.st_mtime)
-			serve_dotgz = 1;
+		if (!(st.st_mode & (S_IROTH | S_IXOTH)) || st.st_mtime < hc->sb.st_mtime)
+			continue;
+		vary = 1;
+
+		if (q <= 0 || q < dynq || (best >= 0 && q <= hc->accept_q[best]))
+			continue;
+
+		best = i;
+		best_st = st;
 	}
+	hc->expnfilename[len] = 0;
 
-	/* can serve .gz file and there is no previous encodings */
-	if (serve_dotgz && hc->encodings[0] == 0) {
-		httpd_realloc_str(&hc->expnfilename, &hc->maxexpnfilename, strlen(fn) + 1);
-		strncpy(hc->expnfilename, fn, hc->maxexpnfilename);
-		hc->sb.st_size = st.st_size;
-		hc->compression_type = COMPRESSION_NONE; /* Compressed already, do not call zlib */
-		httpd_realloc_str(&hc->encodings, &hc->maxencodings, 5);
-		strncpy(hc->encodings, "gzip", hc->maxencodings);
+	if (best >= 0) {
+		strcpy(&hc->expnfilename[len], suffix[best]);
+		hc->sb = best_st;
+		httpd_realloc_str(&hc->encodings, &hc->maxencodings, strlen(coding[best]));
+		strcpy(hc->encodings, coding[best]);
+		vary = 1;
+		deflate = 0; /* Compressed already, do not call zlib */
 	}
 
-	free(fn);
-done:
-	/* no zlib */
-	if (!hc->has_deflate)
-		hc->compression_type = COMPRESSION_NONE;
-	/* don't try to compress non-text files unless it's javascript */
-	else if (strncmp(hc->type, "text/", 5) && strcmp(hc->type, "application/javascript"))
+	if (!deflate)
 		hc->compression_type = COMPRESSION_NONE;
-        /* don't try to compress really small things */
-	else if (hc->sb.st_size < 256)
-		hc->compression_type = COMPRESSION_NONE;
-
-	fn = strrchr(hc->expnfilename, '.');
-	if (fn || strstr(hc->encodings, "gzip")) {
-		for (i = 0; i < NELEMS(match); i++) {
-			if (strcmp(fn, match[i]))
-				continue;
-
-			header = "Vary: Accept-Encoding\r\n";
-			break;
-		}
-	}
 
-	return header;
+	return vary ? "Vary: Accept-Encoding\r\n" : "";
 }
 
 static int really_start_request(struct httpd_conn *hc, struct timeval *now)
 {
 	int is_icon;
+	char *extra;
 	char *cp, *pi;
 	static const char *index_names[] = { INDEX_NAMES };
 	size_t expnlen, indxlen, i;
@@ -4045,7 +5065,7 @@ static int really_start_request(struct httpd_conn *hc, struct timeval *now)
 	}
 
 	/* Stat the file. */
-	if (stat(hc->expnfilename, &hc->sb) < 0) {
+	if (stc_stat(hc->expnfilename, &hc->sb) < 0) {
 		httpd_send_err(hc, 500, err500title, "", err500form, hc->encodedurl);
 		return -1;
 	}
@@ -4092,7 +5112,7 @@ static int really_start_request(struct httpd_conn *hc, struct timeval *now)
 			if (strcmp(hc->indexname, "./") == 0)
 				hc->indexname[0] = '\0';
 			strcat(hc->indexname, index_names[i]);
-			if (stat(hc->indexname, &hc->sb) >= 0)
+			if (stc_stat(hc->indexname, &hc->sb) >= 0)
 				goto got_one;
 		}
 
@@ -4125,7 +5145,7 @@ static int really_start_request(struct httpd_conn *hc, struct timeval *now)
 		if (!check_referer(hc))
 			return -1;
 		/* Ok, generate an index. */
-		return ls(hc);
+		return ls(hc, now);
 #else /* GENERATE_INDEXES */
 		syslog(LOG_INFO, "%s URL \"%s\" tried to index a directory", httpd_client(hc), hc->encodedurl);
 		httpd_send_err(hc, 403, err403title, "",
@@ -4183,25 +5203,17 @@ sneaky:
 		return -1;
 
 	if (hc->method == METHOD_OPTIONS) {
-		time_t now;
 		char buf[1000];
-		char nowbuf[100];
-		const char *rfc1123fmt = "%a, %d %b %Y %H:%M:%S GMT";
-
-		now = time(NULL);
-		strftime(nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime(&now));
 
 		snprintf(buf, sizeof(buf),
 			 "%.20s %d %s\r\n"
-			 "Date: %s\r\n"
-			 "Server: %s\r\n"
+			 "%s"
 			 "Allow: %sOPTIONS,GET,HEAD\r\n"
 			 "Cache-control: max-age=%d\r\n"
 			 "Content-Length: 0\r\n"
 			 "Content-Type: text/html\r\n"
 			 "\r\n",
-			 hc->protocol, 200, "OK", nowbuf,
-			 EXPOSED_SERVER_SOFTWARE,
+			 hc->protocol, 200, "OK", httpd_date(),
 			 is_cgi(hc) ? "POST," : "",
 			 hc->hs->max_age);
 		add_response(hc, buf);
@@ -4210,7 +5222,12 @@ sneaky:
 
 	/* Is it world-executable and in the CGI area? */
 	if (is_cgi(hc)) {
-		if (hc->sb.st_mode & S_IXOTH)
+		/* CGI programs talk HTTP/1.x to the client, see cgi() */
+		if (hc->stream_id)
+			return 1;
+
+		/* FastCGI scripts, e.g. PHP, need not be executable */
+		if ((hc->sb.st_mode & S_IXOTH) || hc->hs->fastcgi)
 			return cgi(hc);
 
 		syslog(LOG_DEBUG, "%s URL \"%s\" is a CGI but not executable, rejecting.", httpd_client(hc), hc->encodedurl);
@@ -4230,22 +5247,55 @@ sneaky:
 		return -1;
 	}
 
-	/* Fill in last_byte_index, if necessary. */
-	if (hc->got_range && (hc->last_byte_index == -1 || hc->last_byte_index >= hc->sb.st_size))
-		hc->last_byte_index = hc->sb.st_size - 1;
-
 	figure_mime(hc);
+	extra = mod_headers(hc);
+
+	return send_file(hc, extra, is_icon, now);
+}
 
-	if (hc->method == METHOD_HEAD) {
-		char *extra = mod_headers(hc);
+/* Send hc->sb, or the mapping already in file_address */
+static int send_file(struct httpd_conn *hc, char *extra, int is_icon, struct timeval *now)
+{
+	off_t length;
 
+	/* Neither 304 nor HEAD needs the file mapped */
+	if (not_modified(hc)) {
+		send_mime(hc, 304, err304title, hc->encodings, extra, hc->type, (off_t) - 1, hc->sb.st_mtime);
+	} else if (hc->method == METHOD_HEAD) {
 		send_mime(hc, 200, ok200title, hc->encodings, extra, hc->type, hc->sb.st_size, hc->sb.st_mtime);
-	} else if (hc->if_modified_since != (time_t)-1 && hc->if_modified_since >= hc->sb.st_mtime) {
-		send_mime(hc, 304, err304title, hc->encodings, "", hc->type, (off_t) - 1, hc->sb.st_mtime);
 	} else {
-		char *extra = mod_headers(hc);
+		int use_sendfile = 0;
+
+#ifdef USE_SENDFILE
+		/* Large plain files, with a metadata ETag, need not be mapped
+		** at all.  Let the kernel copy them straight from the page
+		** cache, this also avoids SIGBUS if the file is truncated.
+		** HTTPS can do the same with kernel TLS offload.
+		*/
+		use_sendfile = (!hc->ssl || httpd_ssl_ktls(hc)) && !is_icon && hc->compression_type == COMPRESSION_NONE &&
+			hc->hs->etag_limit >= 0 && hc->sb.st_size > hc->hs->etag_limit;
+#endif
+		/* Huge files are not mapped whole either, if they cannot be
+		** sent with sendfile() they are read through a sliding window,
+		** see httpd_file_window().
+		*/
+		if (!hc->file_address && (use_sendfile || hc->sb.st_size > MAX_MAPPED_FILE_SIZE)) {
+			hc->file_fd = open(hc->expnfilename, O_RDONLY | O_CLOEXEC);
+			if (hc->file_fd >= 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+				/* Sent front to back, ask for a larger readahead */
+				posix_fadvise(hc->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+				/* Cached stat may be a few seconds old */
+				fstat(hc->file_fd, &hc->sb);
+				hc->use_sendfile = use_sendfile;
+				send_mime(hc, 200, ok200title, hc->encodings, extra, hc->type, hc->sb.st_size, hc->sb.st_mtime);
+				return 0;
+			}
+		}
 
-		hc->file_address = mmc_map(hc->expnfilename, &(hc->sb), now);
+		if (!hc->file_address)
+			hc->file_address = mmc_map(hc->expnfilename, &(hc->sb), now);
 		if (!hc->file_address) {
 			if (is_icon)
 				httpd_send_err(hc, 404, err404title, "", err404form, hc->encodedurl);
@@ -4254,7 +5304,24 @@ sneaky:
 			return -1;
 		}
 
-		send_mime(hc, 200, ok200title, hc->encodings, extra, hc->type, hc->sb.st_size, hc->sb.st_mtime);
+		/* Prefer a cached gzip copy, deflated once, over zlib on the fly.
+		** A single range can be served from it, several are only sent
+		** as multipart/byteranges of the plain file.
+		*/
+		length = hc->sb.st_size;
+		if (hc->compression_type == COMPRESSION_GZIP && hc->encodings[0] == '\0' && hc->numranges < 2) {
+			hc->gzip_address = mmc_gzip(hc->file_address, &hc->sb, hc->hs->compression_level, &length);
+			if (hc->gzip_address) {
+				hc->compression_type = COMPRESSION_NONE;
+				httpd_realloc_str(&hc->encodings, &hc->maxencodings, 5);
+				strcpy(hc->encodings, "gzip");
+			}
+		}
+
+		/* Both gzip and mmc_map(), which refreshes a stale stat, may
+		** change size, so ranges are resolved in send_mime()
+		*/
+		send_mime(hc, 200, ok200title, hc->encodings, extra, hc->type, length, hc->sb.st_mtime);
 	}
 
 	return 0;
@@ -4273,11 +5340,67 @@ int httpd_start_request(struct httpd_conn *hc, struct timeval *now)
 }
 
 
+void httpd_log_request(struct httpd_conn *hc)
+{
+	if (alog_enabled() || hc->stream_id)
+		make_log_entry(hc);
+}
+
+/* Per-vhost access log, only for vhosts that exist */
+static const char *log_host(struct httpd_conn *hc)
+{
+	char dir[MAXPATHLEN];
+	struct stat st;
+
+	if (!hc->hs->vhost || hc->tildemapped || !hc->hostname || !hc->hostdir[0])
+		return NULL;
+
+	/* Any Host: header goes, do not open log files for those */
+	snprintf(dir, sizeof(dir), "%.*s", (int)strcspn(hc->hostdir, ":"), hc->hostdir);
+	if (stc_stat(dir, &st) || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	return hc->hostname;
+}
+
+/* Microseconds spent in each phase of a request, from the timestamps
+** taken along the way; a phase that never started, like resolve for a
+** request rejected while parsing, counts as zero and its time goes to
+** the next phase.  Returns the total, from accept or the first byte of
+** a pipelined request to the last byte of the response.
+*/
+long httpd_phases(struct httpd_conn *hc, long usec[HTTPD_PHASES])
+{
+	struct timeval *t[HTTPD_PHASES + 1] = {
+		&hc->t_start, &hc->t_headers, &hc->t_resolved, &hc->t_first, &hc->t_done
+	};
+	struct timeval *from = t[0];
+	long d, total = 0;
+	int i;
+
+	for (i = 0; i < HTTPD_PHASES; i++) {
+		usec[i] = 0;
+		if (!timerisset(t[i + 1]))
+			continue;
+
+		if (timerisset(from)) {
+			d = (t[i + 1]->tv_sec - from->tv_sec) * 1000000L + t[i + 1]->tv_usec - from->tv_usec;
+			if (d > 0)
+				usec[i] = d;
+		}
+		total += usec[i];
+		from = t[i + 1];
+	}
+
+	return total;
+}
+
 static void make_log_entry(struct httpd_conn *hc)
 {
 	char *ru;
 	char url[305];
 	char bytes[40];
+	char timing[128] = "";
 
 	if (hc->hs->no_log)
 		return;
@@ -4309,6 +5432,27 @@ static void make_log_entry(struct httpd_conn *hc)
 	else
 		strcpy(bytes, "-");
 
+	/* Optional request phase timing, in microseconds, after the CERN
+	** fields.  Only in the buffered access log, which is written when
+	** the request is done, syslog gets the entry before sending.
+	*/
+	if (hc->hs->log_timing && alog_enabled() && !sub_process) {
+		long usec[HTTPD_PHASES], total;
+
+		total = httpd_phases(hc, usec);
+		snprintf(timing, sizeof(timing), " time=%ld read=%ld resolve=%ld respond=%ld send=%ld",
+			 total, usec[HTTPD_PHASE_READ], usec[HTTPD_PHASE_RESOLVE],
+			 usec[HTTPD_PHASE_RESPOND], usec[HTTPD_PHASE_SEND]);
+	}
+
+	/* Buffered access log, true CERN format, sub-processes use syslog */
+	if (alog_enabled() && !sub_process) {
+		alog_printf(log_host(hc), "%s - %s %s \"%s %.200s %s\" %d %s \"%.200s\" \"%.200s\"%s",
+			    httpd_client(hc), ru, alog_date(), httpd_method_str(hc->method), url,
+			    hc->protocol, hc->status, bytes, hc->referer, hc->useragent, timing);
+		return;
+	}
+
 	syslog(LOG_INFO, "%s: %s \"%s %.200s %s\" %d %s \"%.200s\" \"%.200s\"",
 	       httpd_client(hc), ru, httpd_method_str(hc->method), url, hc->protocol,
 	       hc->status, bytes, hc->referer, hc->useragent);
@@ -4353,7 +5497,7 @@ static int really_check_referer(struct httpd_conn *hc)
 	/* Check for an empty referer. */
 	if (!hc->referer || hc->referer[0] == '\0' || (cp1 = strstr(hc->referer, "//")) == NULL) {
 		/* Disallow if we require a referer and the url matches. */
-		if (hs->no_empty_referers && match(hs->url_pattern, hc->origfilename))
+		if (hs->no_empty_referers && match_exec(hs->url_match, hc->origfilename))
 			return 0;
 
 		/* Otherwise ok. */
@@ -4399,7 +5543,10 @@ static int really_check_referer(struct httpd_conn *hc)
 	/* If the referer host doesn't match the local host pattern, and
 	** the filename does match the url pattern, it's an illegal reference.
 	*/
-	if (!match(lp, refhost) && match(hs->url_pattern, hc->origfilename))
+	if (hs->local_match) {
+		if (!match_exec(hs->local_match, refhost) && match_exec(hs->url_match, hc->origfilename))
+			return 0;
+	} else if (!match(lp, refhost) && match_exec(hs->url_match, hc->origfilename))
 		return 0;
 
 	/* Otherwise ok. */
@@ -4436,7 +5583,10 @@ short httpd_port(httpd_sockaddr *hsa)
 
 char *httpd_client(struct httpd_conn *hc)
 {
-	return hc->client_addr.real_ip;
+	if (!hc->real_ip[0])
+		snprintf(hc->real_ip, sizeof(hc->real_ip), "%s", httpd_ntoa(&hc->client_addr));
+
+	return hc->real_ip;
 }
 
 static int sockaddr_check(httpd_sockaddr *hsa)
@@ -41,6 +41,16 @@
 #define USE_IPV6
 #endif
 
+/* Linux style sendfile(2), for plain HTTP uncompressed responses */
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+#define USE_SENDFILE
+#endif
+
+/* Most ranges in one Range: header, more and the header is ignored */
+#ifndef MAX_RANGES
+#define MAX_RANGES 16
+#endif
+
 
 /* A few convenient defines. */
 
@@ -99,9 +109,18 @@ typedef union {
 	struct sockaddr_in6 sa_in6;
 	struct sockaddr_storage sa_stor;
 #endif
-	char real_ip[200];
 } httpd_sockaddr;
 
+/* Request statistics of a server, or one of its virtual hosts */
+#define HTTPD_LATENCY_BUCKETS 10
+struct httpd_stats {
+	char  *host;		/* Virtual host, "" for the server itself */
+	long   status[6];	/* Requests per status class, [0] is unknown */
+	off_t  bytes_sent;
+	double latency_sum;	/* Seconds */
+	long   latency[HTTPD_LATENCY_BUCKETS];
+};
+
 /* A server. */
 struct httpd_server {
 	struct httpd_server *prev, *next;
@@ -112,15 +131,24 @@ struct httpd_server {
 
 	pid_t *cgi_tracker;
 	char  *cgi_pattern;
+	struct pattern *cgi_match;	/* Compiled cgi_pattern */
 	int    cgi_limit;
 	int    cgi_count;
+	int    fastcgi;		/* CGI requests go to a FastCGI backend */
 
 	char *charset;
 	int   max_age;
+	off_t etag_limit;	/* Larger files get a metadata ETag, -1 never */
+	int   compression_level;
+	int   send_buffer;	/* SO_SNDBUF of connections, 0 kernel default */
+	int   log_timing;	/* Request phase timing in the access log */
 	char *cwd;
 
 	int listen4_fd;
 	int listen6_fd;
+	int listen_backlog;
+	int defer_accept;	/* TCP_DEFER_ACCEPT seconds, 0 disabled */
+	int fastopen;		/* TCP_FASTOPEN queue length, 0 disabled */
 
 	int no_log;
 	int no_symlink_check;
@@ -131,17 +159,46 @@ struct httpd_server {
 
 	char *url_pattern;
 	char *local_pattern;
+	struct pattern *url_match;	/* Compiled url_pattern */
+	struct pattern *local_match;	/* Compiled local_pattern */
 
 	void *ctx;		/* Opaque SSL_CTX* */
+
+	long accepted;		/* Connections, for the stats endpoint */
+	struct httpd_stats *stats;
+	int stats_count;
+};
+
+/* One byte range, first is -1 for the last bytes and last -1 if open ended */
+struct httpd_range {
+	off_t first, last;
+	size_t part;		/* Offset of the multipart/byteranges part header */
 };
 
+/* Precompressed siblings, file.br, file.zst and file.gz, in order of
+** preference when the client accepts more than one equally.
+*/
+#define ENCODING_BR   0
+#define ENCODING_ZSTD 1
+#define ENCODING_GZIP 2
+#define ENCODING_MAX  3
+
+/* Request phases, see httpd_phases() */
+#define HTTPD_PHASE_READ    0	/* Accept or first byte, to headers complete */
+#define HTTPD_PHASE_RESOLVE 1	/* Parsing headers and mapping the URL */
+#define HTTPD_PHASE_RESPOND 2	/* Until the first byte of the response */
+#define HTTPD_PHASE_SEND    3	/* Until the last byte */
+#define HTTPD_PHASES        4
+
 /* A connection. */
 struct httpd_conn {
 	int initialized;
 	struct httpd_server *hs;
 	httpd_sockaddr client_addr;
+	char real_ip[200];	/* Formatted by httpd_client(), or X-Forwarded-For */
 	char *read_buf;
 	size_t read_size, read_idx, checked_idx;
+	size_t pipelined_idx;	/* Start of next request in read_buf, or 0 */
 	int checked_state;
 	int method;
 	int status;
@@ -158,9 +215,11 @@ struct httpd_conn {
 	char *query;
 	char *referer;
 	char *useragent;
-	char *accept;
-	char *accepte;
+	char *accept;		/* In read_buf, or acceptbuf if repeated */
+	char *accepte;		/* In read_buf, or acceptebuf if repeated */
 	char *acceptl;
+	char *acceptbuf;
+	char *acceptebuf;
 	char *cookie;
 	char *contenttype;
 	char *reqhost;
@@ -188,6 +247,8 @@ struct httpd_conn {
 #endif
 	size_t responselen;
 	time_t if_modified_since, range_if;
+	char *range_if_tag;	/* If-Range: with an ETag instead of a date */
+	char *if_none_match;
 	size_t contentlength;
 	const char *type;	/* not malloc()ed */
 	char *hostname;		/* not malloc()ed */
@@ -196,14 +257,38 @@ struct httpd_conn {
 	int got_range;
 	int tildemapped;	/* this connection got tilde-mapped */
 	off_t first_byte_index, last_byte_index;
+	struct httpd_range ranges[MAX_RANGES + 1];
+	int numranges;		/* More than one is sent as multipart/byteranges */
+	char *parts;		/* Part headers and trailer, see httpd_body_iov() */
+	size_t maxparts, partslen;
 	int keep_alive;		/* Client signaled */
 	int do_keep_alive;	/* Our intention, which may change */
 	int should_linger;
 	struct stat sb;
 	int conn_fd;
+	int stream_id;		/* HTTP/2 stream, 0 on HTTP/1.x, see h2.c */
 	int has_deflate;	/* Built with zlib:deflate() and enabled */
 	int compression_type;
+	short accept_q[ENCODING_MAX]; /* Accept-Encoding q-values, 0-1000 */
 	char *file_address;
+	char *gzip_address;	/* Cached gzip copy from mmc, not malloc()ed */
+	int file_fd;		/* Unmapped file for sendfile(), or -1 */
+	int use_sendfile;	/* Send file_fd with sendfile(), not a window */
+	char *win_address;	/* Window mapped over file_fd, or NULL */
+	off_t win_offset;
+	size_t win_len;
+	int ls_fd;		/* Caller to read listing with httpd_ls_read(), or -1 */
+	char *ls_buf;
+	size_t ls_len, ls_size;
+	int fastcgi;		/* Caller to pass request on to FastCGI */
+	int cgi_fd;		/* Caller to stream CGI stdin/stdout, or -1 */
+
+	/* Request phase timestamps, see httpd_phases() */
+	struct timeval t_start;		/* Accepted, or pipelined request read */
+	struct timeval t_headers;	/* Request headers complete */
+	struct timeval t_resolved;	/* URL mapped to a file */
+	struct timeval t_first;		/* First byte of the response sent */
+	struct timeval t_done;		/* Last byte sent */
 
 	void *ssl;		/* Opaque SSL* */
 };
@@ -245,7 +330,8 @@ extern struct httpd_server *httpd_init(char *hostname, httpd_sockaddr *hsav4, ht
 				       unsigned short port, void *ssl_ctx, char *cgi_pattern, int cgi_limit,
 				       char *charset, int max_age, char *cwd, int no_log,
 				       int no_symlink_check, int vhost, int global_passwd, char *url_pattern,
-				       char *local_pattern, int no_empty_referers, int list_dotfiles);
+				       char *local_pattern, int no_empty_referers, int list_dotfiles,
+				       int listen_backlog, int defer_accept, int fastopen);
 
 /* Call to shut down. */
 extern void httpd_exit(struct httpd_server *hs);
@@ -253,6 +339,13 @@ extern void httpd_exit(struct httpd_server *hs);
 /* Call to unlisten/close socket(s) listening for new connections. */
 extern void httpd_unlisten(struct httpd_server *hs);
 
+/* Open another set of listen sockets, bound to the same address(es) as
+** hs, for a prefork worker.  With SO_REUSEPORT the kernel balances new
+** connections between them, without it the same sockets are returned.
+** Must be called before giving up root.  Returns -1 on failure.
+*/
+extern int httpd_listen_again(struct httpd_server *hs, int *listen4_fd, int *listen6_fd);
+
 /* Used to reinitialize the connection for pipelined keep-alive requets */
 extern void httpd_init_conn_mem(struct httpd_conn *hc);
 extern void httpd_init_conn_content(struct httpd_conn *hc);
@@ -295,10 +388,13 @@ extern int httpd_parse_request(struct httpd_conn *hc);
 /* Starts sending data back to the client.  In some cases (directories,
 ** CGI programs), finishes sending by itself - in those cases, hc->file_fd
 ** is <0.  If there is more data to be sent, then hc->file_fd is a file
-** descriptor for the file to send.  If you don't have a current timeval
-** handy just pass in 0.
+** descriptor for the file to send.  Uncached directory listings are
+** built in the background, then hc->ls_fd is set, see httpd_ls_read().
+** If you don't have a current timeval handy just pass in 0.
 **
-** Returns -1 on error.
+** Returns -1 on error.  An HTTP/2 stream, with hc->stream_id set, gets 1
+** back for requests that can only be served on an HTTP/1.x connection,
+** CGI and uncached directory listings, nothing is started then.
 */
 extern int httpd_start_request(struct httpd_conn *hc, struct timeval *now);
 
@@ -312,25 +408,98 @@ extern void httpd_send_response(struct httpd_conn *hc);
 */
 extern void httpd_close_conn(struct httpd_conn *hc, struct timeval *now);
 
+/* Returns the file contents at offset off, and in len how many bytes
+** follow it.  For a mapped file that is the rest of it, for huge files
+** only opened on file_fd a window of FILE_WINDOW_SIZE bytes is mapped
+** and slid along as needed.  Returns NULL on error.
+*/
+extern char *httpd_file_window(struct httpd_conn *hc, off_t off, size_t *len);
+
+/* Fills in iov, at most max entries, with up to len bytes of the body
+** at offset off.  For a multipart/byteranges response the offset is in
+** the whole body, part headers included.  Returns the number of entries
+** used, or -1 on error.
+*/
+extern int httpd_body_iov(struct httpd_conn *hc, off_t off, size_t len, struct iovec *iov, int max);
+
+/* Reads the directory listing being built for the request on ls_fd.
+** Returns 0 if there is more to come, call again when ls_fd is readable.
+** Returns 1 when done, the listing is then cached and the response
+** started as for any other file.  Returns -1 on error, a response is
+** started then too.  Either way the caller is left to close ls_fd.
+*/
+extern int httpd_ls_read(struct httpd_conn *hc, struct timeval *now);
+
+/* Unmaps, or closes, the file of the current request. */
+extern void httpd_release_file(struct httpd_conn *hc, struct timeval *now);
+
 /* Call this to de-initialize a connection struct and *really* free the
 ** mallocced strings.
 */
 extern void httpd_destroy_conn(struct httpd_conn *hc);
 
-/* Client IP addresses can be overridden by a proxy using X-Forwarded-For */
+/* Call this when a request is done, with the final status and byte count,
+** to log it to the buffered access log.  Does nothing without one, in
+** that case httpd_send_response() logs to syslog instead, except for
+** HTTP/2 streams, which never pass it.
+*/
+extern void httpd_log_request(struct httpd_conn *hc);
+
+/* Call this when a request is done, after setting hc->t_done, to get the
+** microseconds spent in each HTTPD_PHASE_*.  Returns the total.
+*/
+extern long httpd_phases(struct httpd_conn *hc, long usec[HTTPD_PHASES]);
+
+/* Call this from the main loop, after tmr_prepare_timeval(), to keep the
+** cached Date header current.  Only reformats it when the second changes.
+*/
+extern void httpd_set_date(time_t now);
+
+/* Call this to get a kept-alive connection ready for the next request.
+** Any pipelined request bytes already read are kept in read_buf,
+** returns the number of such bytes, which may be a complete request.
+** All buffers are reused as-is, nothing is freed or allocated.
+*/
+extern size_t httpd_reset_conn(struct httpd_conn *hc);
+
+/* Client IP addresses can be overridden by a proxy using X-Forwarded-For.
+** Otherwise the address is only formatted on first use, e.g. logging.
+*/
 extern char *httpd_client(struct httpd_conn *hc);
 
 /* Send an error message back to the client. */
 extern void httpd_send_err(struct httpd_conn *hc, int status, char *title, const char *extraheads, char *form, char *arg);
 
+/* Send a generated 200 OK response, e.g. the stats endpoint. */
+extern void httpd_send_body(struct httpd_conn *hc, const char *extraheads, const char *type, const char *body, size_t len);
+
 /* Some error messages. */
 extern char *httpd_err400title;
 extern char *httpd_err400form;
 extern char *httpd_err408title;
 extern char *httpd_err408form;
+extern char *httpd_err502title;
+extern char *httpd_err502form;
 extern char *httpd_err503title;
 extern char *httpd_err503form;
 
+/* The CGI environment for a FastCGI request, plus REQUEST_URI and
+** DOCUMENT_ROOT, as a NULL terminated array of "NAME=VALUE" strings.
+** Free with httpd_fastcgi_envp_free() when done.
+*/
+extern char **httpd_fastcgi_envp(struct httpd_conn *hc);
+extern void   httpd_fastcgi_envp_free(char **envp);
+
+/* Convert the headers from a CGI program, or FastCGI backend, of len bytes
+** ending in an empty line, into an HTTP response header in hc->response.
+** Status: and Location: are handled, and keep-alive is only possible if
+** the program sent a valid Content-Length, returned in lengthP, or -1.
+** Text without one is sent gzip'ed and chunked when the client accepts
+** it, then hc->compression_type is left at COMPRESSION_GZIP.
+** Returns the HTTP status code, or -1 if the headers are not terminated.
+*/
+extern int httpd_cgi_response(struct httpd_conn *hc, char *headers, size_t len, off_t *lengthP);
+
 /* Generate a string representation of a method number. */
 extern char *httpd_method_str(int method);
 
@@ -2,36 +2,135 @@
 
 #Run this on developer side, whenever you update
 #your mime encodings, or mime types.
+#
+#Besides the tables, with lengths filled in, a perfect hash is generated
+#for each, so figure_mime() finds an extension with a single probe and
+#nothing needs to be sorted at startup.  It is a hash and displace
+#scheme: the extension hashes to a bucket, and the seed stored for that
+#bucket is chosen so that all extensions in it land in free table slots.
+#mime_hash() in libhttpd.c must compute the same FNV-1a hash as fnv().
 
-open(ENCODINGS, '<', "mime_encodings.txt");
-@encoding=<ENCODINGS>;
-close(ENCODINGS);
+use strict;
+use warnings;
 
-open(ENCHEADER, '>', "mime_encodings.h");
-foreach (@encoding)
+sub fnv
 {
-	chomp($_);
-	@element = split(/\t+/,$_);
-	next if $element[0] =~ /#/ ;
-	next if $element[1] =~ /#/ ;
-	next if length($element[0]) == 0 || length($element[1]) == 0 ;
-	print ENCHEADER '{ "', $element[0], '", 0, "', $element[1], '", 0 },', "\n";
+	my ($seed, $str) = @_;
+	my $h = (2166136261 ^ $seed) & 0xffffffff;
+
+	foreach my $c (unpack("C*", lc($str))) {
+		$h ^= $c;
+		$h = ($h * 16777619) & 0xffffffff;
+	}
+
+	return $h;
+}
+
+sub pow2
+{
+	my ($n) = @_;
+	my $p = 1;
+
+	$p <<= 1 while $p < $n;
+	return $p;
 }
-close(ENCHEADER);
 
+sub readtab
+{
+	my ($file) = @_;
+	my (@tab, %seen);
+
+	open(my $fh, '<', $file) or die "$file: $!";
+	foreach (<$fh>)
+	{
+		chomp($_);
+		my @element = split(/\t+/,$_);
+		next if !defined $element[0] || !defined $element[1];
+		next if $element[0] =~ /#/ ;
+		next if $element[1] =~ /#/ ;
+		next if length($element[0]) == 0 || length($element[1]) == 0 ;
+		next if $seen{lc($element[0])}++;
+		push(@tab, [ $element[0], $element[1] ]);
+	}
+	close($fh);
+
+	return @tab;
+}
+
+# Try to place all buckets, largest first, returns the slot table and seeds
+sub place
+{
+	my ($tab, $size, $nseeds) = @_;
+	my (@buckets, @slots, @seeds);
+
+	foreach my $i (0 .. $#$tab) {
+		push(@{$buckets[(fnv(0, $tab->[$i][0]) >> 24) & ($nseeds - 1)]}, $i);
+	}
+	@seeds = (0) x $nseeds;
+
+	foreach my $b (sort { scalar(@{$buckets[$b] || []}) <=> scalar(@{$buckets[$a] || []}) } 0 .. $nseeds - 1) {
+		my $keys = $buckets[$b] or next;
+		my $seed;
+
+	SEED:	for ($seed = 1; $seed < 65536; $seed++) {
+			my %taken;
 
-open(TYPES, '<', "mime_types.txt");
-@type=<TYPES>;
-close(TYPES);
+			foreach my $i (@$keys) {
+				my $slot = fnv($seed, $tab->[$i][0]) & ($size - 1);
+				next SEED if defined $slots[$slot] || $taken{$slot}++;
+			}
+			last;
+		}
+		return () if $seed == 65536;
+
+		$seeds[$b] = $seed;
+		foreach my $i (@$keys) {
+			$slots[fnv($seed, $tab->[$i][0]) & ($size - 1)] = $i;
+		}
+	}
+
+	return (\@slots, \@seeds);
+}
 
-open(TYPEHEADER, '>', "mime_types.h");
-foreach (@type)
+sub generate
 {
-	chomp($_);
-	@element = split(/\t+/,$_);
-	next if $element[0] =~ /#/ ;
-	next if $element[1] =~ /#/ ;
-	next if length($element[0]) == 0 || length($element[1]) == 0 ;
-	print TYPEHEADER '{ "', $element[0], '", 0, "', $element[1], '", 0 },', "\n";
+	my ($txt, $header, $name) = @_;
+	my @tab = readtab($txt);
+	my $size = pow2(scalar(@tab));
+	my $nseeds = pow2(int((scalar(@tab) + 3) / 4));
+	my ($slots, $seeds);
+
+	while (1) {
+		($slots, $seeds) = place(\@tab, $size, $nseeds);
+		last if $slots;
+		$size *= 2;
+	}
+
+	my $NAME = uc($name);
+	open(my $fh, '>', $header) or die "$header: $!";
+	print $fh "/* Generated by make_mime.pl from $txt, do not edit */\n";
+	print $fh "#define ${NAME}_SIZE $size\n";
+	print $fh "#define ${NAME}_SEEDS $nseeds\n\n";
+
+	print $fh "static const unsigned short ${name}_seed[${NAME}_SEEDS] = {";
+	foreach my $i (0 .. $nseeds - 1) {
+		print $fh ($i % 12 ? " " : "\n\t"), $seeds->[$i], ",";
+	}
+	print $fh "\n};\n\n";
+
+	print $fh "static const struct mime_entry ${name}[${NAME}_SIZE] = {\n";
+	foreach my $i (0 .. $size - 1) {
+		my $e = defined $slots->[$i] ? $tab[$slots->[$i]] : undef;
+
+		if ($e) {
+			print $fh '	{ "', $e->[0], '", ', length($e->[0]), ', "', $e->[1], '", ', length($e->[1]), " },\n";
+		} else {
+			print $fh "	{ NULL, 0, NULL, 0 },\n";
+		}
+	}
+	print $fh "};\n";
+	close($fh);
 }
-close(TYPEHEADER);
+
+generate("mime_encodings.txt", "mime_encodings.h", "enc_tab");
+generate("mime_types.txt", "mime_types.h", "typ_tab");
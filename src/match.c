@@ -28,9 +28,31 @@
 */
 
 #include <config.h>
+#include <stdlib.h>
 #include <string.h>
 #include "match.h"
 
+/* Kinds of alternatives in a compiled pattern */
+#define MATCH_ANY    0		/* **          */
+#define MATCH_EXACT  1		/* str         */
+#define MATCH_PREFIX 2		/* str**       */
+#define MATCH_DIR    3		/* str*        */
+#define MATCH_SUFFIX 4		/* **str       */
+#define MATCH_SUBSTR 5		/* **str**     */
+#define MATCH_GLOB   6		/* Anything else, see match_one() */
+
+struct alt {
+	int         kind;
+	const char *str;
+	size_t      len;
+};
+
+struct pattern {
+	int         count;
+	struct alt *alt;
+	char       *buf;		/* Copy of pattern, split at | */
+};
+
 static int match_one(const char *pattern, int patternlen, const char *string);
 
 int match(const char *pattern, const char *string)
@@ -89,3 +111,164 @@ static int match_one(const char *pattern, int patternlen, const char *string)
 
 	return 0;
 }
+
+
+static int wild(const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (str[i] == '*' || str[i] == '?')
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Classify one alternative, which is NUL terminated in buf */
+static void compile_one(struct alt *a, char *str)
+{
+	size_t len = strlen(str);
+
+	a->kind = MATCH_GLOB;
+	a->str  = str;
+	a->len  = len;
+
+	if (!wild(str, len)) {
+		a->kind = MATCH_EXACT;
+		return;
+	}
+
+	if (len == 2 && !strcmp(str, "**")) {
+		a->kind = MATCH_ANY;
+		return;
+	}
+
+	if (len >= 4 && !strncmp(str, "**", 2) && !strcmp(&str[len - 2], "**") && !wild(&str[2], len - 4)) {
+		str[len - 2] = 0;
+		a->kind = MATCH_SUBSTR;
+		a->str  = &str[2];
+		a->len  = len - 4;
+		return;
+	}
+
+	if (len >= 2 && !strncmp(str, "**", 2) && !wild(&str[2], len - 2)) {
+		a->kind = MATCH_SUFFIX;
+		a->str  = &str[2];
+		a->len  = len - 2;
+		return;
+	}
+
+	if (len >= 2 && !strcmp(&str[len - 2], "**") && !wild(str, len - 2)) {
+		a->kind = MATCH_PREFIX;
+		a->len  = len - 2;
+		return;
+	}
+
+	if (len >= 1 && str[len - 1] == '*' && !wild(str, len - 1)) {
+		a->kind = MATCH_DIR;
+		a->len  = len - 1;
+		return;
+	}
+}
+
+struct pattern *match_compile(const char *pattern)
+{
+	struct pattern *p;
+	char *ptr, *or;
+	int i;
+
+	if (!pattern)
+		return NULL;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	p->buf = strdup(pattern);
+	if (!p->buf)
+		goto fail;
+
+	p->count = 1;
+	for (ptr = p->buf; (ptr = strchr(ptr, '|')); ptr++)
+		p->count++;
+
+	p->alt = calloc(p->count, sizeof(struct alt));
+	if (!p->alt)
+		goto fail;
+
+	ptr = p->buf;
+	for (i = 0; i < p->count; i++) {
+		or = strchr(ptr, '|');
+		if (or)
+			*or = 0;
+
+		compile_one(&p->alt[i], ptr);
+		if (or)
+			ptr = or + 1;
+	}
+
+	return p;
+fail:
+	match_free(p);
+	return NULL;
+}
+
+int match_exec(const struct pattern *p, const char *string)
+{
+	size_t len = strlen(string);
+	const struct alt *a;
+	int i;
+
+	for (i = 0; i < p->count; i++) {
+		a = &p->alt[i];
+
+		switch (a->kind) {
+		case MATCH_ANY:
+			return 1;
+
+		case MATCH_EXACT:
+			if (len == a->len && !memcmp(string, a->str, len))
+				return 1;
+			break;
+
+		case MATCH_PREFIX:
+			if (len >= a->len && !memcmp(string, a->str, a->len))
+				return 1;
+			break;
+
+		case MATCH_DIR:
+			if (len >= a->len && !memcmp(string, a->str, a->len) &&
+			    !strchr(&string[a->len], '/'))
+				return 1;
+			break;
+
+		case MATCH_SUFFIX:
+			if (len >= a->len && !memcmp(&string[len - a->len], a->str, a->len))
+				return 1;
+			break;
+
+		case MATCH_SUBSTR:
+			if (strstr(string, a->str))
+				return 1;
+			break;
+
+		default:
+			if (match_one(a->str, a->len, string))
+				return 1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+void match_free(struct pattern *p)
+{
+	if (!p)
+		return;
+
+	free(p->alt);
+	free(p->buf);
+	free(p);
+}
@@ -33,4 +33,15 @@
 */
 extern int match(const char *pattern, const char *string);
 
+/* The same pattern compiled once, at startup, instead of parsed on every
+** call.  Common forms like **.ext, **word** and directory prefixes are
+** then matched with a single compare, other forms fall back to the above.
+** Returns NULL on error, match_exec() returns 1 or 0.
+*/
+struct pattern;
+
+extern struct pattern *match_compile(const char *pattern);
+extern int  match_exec(const struct pattern *p, const char *string);
+extern void match_free(struct pattern *p);
+
 #endif /* MATCH_H_ */
@@ -36,6 +36,7 @@
 #ifdef HAVE_GRP_H
 #include <grp.h>
 #endif
+#include <stdarg.h>
 #include <stdio.h>
 #include <signal.h>
 
@@ -48,24 +49,53 @@
 #include <sys/wait.h>
 #include <sys/uio.h>
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #ifdef HAVE_ZLIB_H
 #include <zlib.h>
 #endif
 
 #include "conf.h"
+#include "alog.h"
+#include "fcgi.h"
 #include "fdwatch.h"
+#ifdef ENABLE_HTTP2
+#include "h2.h"
+#endif
 #include "libhttpd.h"
 #include "match.h"
 #include "mmc.h"
 #include "merecat.h"
 #include "srv.h"
 #include "ssl.h"
+#include "stc.h"
 #include "timers.h"
 
 #ifndef SHUT_WR
 #define SHUT_WR 1
 #endif
 
+/* Number of httpd_conn per slab, see conn_alloc() */
+#ifndef CONN_SLAB_SIZE
+#define CONN_SLAB_SIZE 64
+#endif
+
+#ifndef CGI_MAX_HEADERS
+#define CGI_MAX_HEADERS 16384	/* Response headers from the backend */
+#endif
+
+#ifdef CGI_TIMELIMIT
+#define CGI_IDLE_TIMELIMIT CGI_TIMELIMIT
+#else
+#define CGI_IDLE_TIMELIMIT IDLE_SEND_TIMELIMIT
+#endif
+
+/* Most iovecs in one writev(), headers and a few multipart/byteranges parts */
+#ifndef MAX_SEND_IOV
+#define MAX_SEND_IOV 16
+#endif
+
 /* For content-encoding: gzip */
 #ifdef HAVE_ZLIB_H
 #define ZLIB_OUTPUT_BUF_SIZE 262136
@@ -74,12 +104,20 @@
 #define DEFAULT_COMPRESSION  0
 #endif
 
+/* HTTP/2, over TLS with ALPN and cleartext with prior knowledge */
+#ifdef ENABLE_HTTP2
+#define DEFAULT_HTTP2 1
+#else
+#define DEFAULT_HTTP2 0
+#endif
+
 char        *prognm;		/* Instead of non-portable __progname */
 char        *ident;		/* Used for logging */
 
 /* Global config settings */
 uint16_t     port              = 0;
 int          max_age           = DEFAULT_MAX_AGE;
+off_t        etag_limit        = DEFAULT_ETAG_LIMIT;
 int          compression_level = DEFAULT_COMPRESSION; /* For content-encoding: gzip */
 int          do_chroot         = 0;
 int          do_ssl            = 0;
@@ -89,6 +127,16 @@ int          do_list_dotfiles  = 0;
 int          no_symlink_check  = 1;
 int          no_empty_referers = 0;
 int          cgi_limit         = CGI_LIMIT;
+int          fastcgi_pool      = FASTCGI_POOL;
+int          send_buffer       = 0;     /* SO_SNDBUF, 0: kernel autotuning */
+int          log_timing        = 0;     /* Request phase timing in access log */
+int          slow_request      = 0;     /* Trace requests slower than msec, 0: off */
+int          listen_backlog    = LISTEN_BACKLOG;
+int          defer_accept      = 0;     /* TCP_DEFER_ACCEPT seconds, 0: disabled */
+int          tcp_fastopen      = 0;     /* TCP_FASTOPEN queue length, 0: disabled */
+off_t        cache_size        = DESIRED_MAX_MAPPED_BYTES;
+char        *cache_manifest    = NULL;  /* Hot files, preloaded at startup */
+int          workers           = 1;     /* Prefork worker processes */
 char        *cgi_pattern       = CGI_PATTERN;
 char        *local_pattern     = NULL;
 char        *url_pattern       = NULL;
@@ -97,9 +145,17 @@ char        *data_dir          = NULL;
 char        *certfile          = NULL;
 char        *keyfile           = NULL;
 char        *dhfile            = NULL;
+int          ssl_session_cache   = SSL_SESSION_CACHE;
+int          ssl_session_timeout = SSL_SESSION_TIMEOUT;
+int          ssl_tickets         = 1;
+int          do_http2          = DEFAULT_HTTP2;
 char        *hostname          = NULL;
 char        *user              = DEFAULT_USER;    /* Usually www-data or nobody */
 char        *charset           = DEFAULT_CHARSET;
+char        *stats_path        = NULL;  /* Stats endpoint, e.g. "/.stats" */
+char        *stats_allow       = STATS_ALLOW; /* Clients allowed to see it */
+char        *access_log        = NULL;  /* Buffered access log, or syslog */
+char        *fastcgi           = NULL;  /* FastCGI backend, or fork CGI */
 
 /* Global options */
 static int   background        = 1;
@@ -109,6 +165,8 @@ static char *throttlefile      = NULL;
 
 typedef struct {
 	char *pattern;
+	struct pattern *match;		/* Compiled pattern */
+	int type;			/* THROTTLE_URL, _CLIENT or _VHOST */
 	long max_limit, min_limit;
 	long rate;
 	off_t bytes_since_avg;
@@ -120,26 +178,64 @@ static int numthrottles, maxthrottles;
 
 #define THROTTLE_NOLIMIT -1
 
+#define THROTTLE_URL    0		/* Pattern matches the file name */
+#define THROTTLE_CLIENT 1		/* Limit per client address */
+#define THROTTLE_VHOST  2		/* Limit per virtual host */
+
+/* Share of a client: or vhost: throttle, one per address or host */
+struct tkey {
+	struct tkey *next;
+	int tnum;
+	int num_sending;
+	char key[1];
+};
+
+#define TKEY_HASH 256
+static struct tkey *tkeys[TKEY_HASH];
+
 
 typedef struct {
 	int conn_state;
 	int next_free_connect;
 	struct httpd_conn *hc;
 	int tnums[MAXTHROTTLENUMS];	/* throttle indexes */
+	struct tkey *tkeys[MAXTHROTTLENUMS]; /* and their keys, if any */
 	int numtnums;
 	long max_limit, min_limit;
-	time_t started_at, active_at;
+	double tokens;			/* Bytes we may send right now */
+	struct timeval tokens_at;	/* Last token bucket refill */
+	time_t active_at;
 	Timer *wakeup_timer;
 	Timer *linger_timer;
+#ifdef USE_WOULDBLOCK_DELAY
 	long wouldblock_delay;
+#endif
 	off_t bytes;
 	off_t end_byte_index;
 	off_t next_byte_index;
+	struct timeval req_at;		/* Request start, for the stats endpoint */
+	int pipelined;			/* Queued, with a pipelined request read */
+	void *pipeline_next;
+	struct backend *backend;	/* FastCGI or CGI, NULL if queued */
+	int cgi_watch;			/* Client fd watched for, or -1 */
+	int cgi_bwatch;			/* Backend fd watched for, or -1 */
+	int cgi_flags;
+	size_t cgi_body;		/* Request body bytes sent to backend */
+	size_t cgi_sent;		/* Response header bytes sent to client */
+	off_t cgi_length;		/* Response Content-Length, or -1 */
+	unsigned long cgi_round;	/* Main loop round it was done in */
+	void *cgi_next;
 
 #ifdef HAVE_ZLIB_H
 	z_stream zs;
 	int      zs_state;
 	void    *zs_output_head;
+	off_t    zs_in;		/* File offset of next input, see httpd_file_window() */
+	uLong    zs_crc;
+#endif
+#ifdef ENABLE_HTTP2
+	struct h2 *h2;			/* HTTP/2 session, see start_h2() */
+	int      h2_rw;			/* H2_READ or H2_WRITE */
 #endif
 } connecttab;
 static connecttab *connects;
@@ -152,6 +248,33 @@ static int httpd_conn_count;
 #define CNST_SENDING 2
 #define CNST_PAUSING 3
 #define CNST_LINGERING 4
+#define CNST_HANDSHAKE 5
+#define CNST_CGI 6
+#define CNST_LISTING 7
+#define CNST_H2 8
+#define CNST_MAX CNST_H2	/* Highest state, for tables of them */
+
+/* Kept-alive connections with pipelined requests waiting in read_buf */
+static connecttab *pipeline_head;
+
+/* CGI and FastCGI requests, and those waiting for a backend connection */
+static connecttab *cgi_active, *fcgi_wait_head, *fcgi_wait_tail;
+#define CGI_STDIN_DONE 0x01		/* Request body sent */
+#define CGI_HEADERS    0x02		/* Response headers parsed */
+#define CGI_BLOCKED    0x04		/* Backend socket full */
+#define CGI_WAITING    0x08		/* Client socket full */
+#define CGI_GZIP       0x10		/* Body deflated and chunked, see cgi_gzip() */
+
+/* Main loop rounds, to tell stale fdwatch events */
+static unsigned long rounds;
+
+/* httpd_conn are carved from slabs, never freed until shut_down() */
+struct conn_slab {
+	struct conn_slab *next;
+	int               used;
+	struct httpd_conn conn[CONN_SLAB_SIZE];
+};
+static struct conn_slab *conn_slabs;
 
 static struct httpd_server *server_list = NULL;
 int terminate = 0;
@@ -159,9 +282,23 @@ time_t start_time, stats_time;
 long stats_connections;
 off_t stats_bytes;
 int stats_simultaneous;
+static char  *stats_buf;		/* Stats endpoint response */
+static struct pattern *stats_match;	/* Compiled stats_allow */
+static size_t stats_max, stats_len;
 
 static volatile int got_hup, got_bus, got_usr1, watchdog_flag;
 
+/* Prefork mode, only used by the master process */
+static volatile int got_term, got_usr2, got_chld;
+static pid_t *worker_pid;
+static int   *worker_fd;	/* listen4_fd, listen6_fd pair per worker */
+static int    worker_id;	/* 0 also when not in prefork mode */
+
+/* Cache manifest, see open_manifest() */
+static int    manifest_fd = -1;
+static int    manifest_dir = -1;
+static char  *manifest_name;
+
 /* External functions */
 extern int pidfile(const char *basename);
 
@@ -174,6 +311,7 @@ static void read_throttlefile(char *throttlefile)
 	int len;
 	char pattern[5000];
 	long max_limit, min_limit;
+	int type;
 	struct timeval tv;
 
 	fp = fopen(throttlefile, "r");
@@ -211,11 +349,22 @@ static void read_throttlefile(char *throttlefile)
 			continue;
 		}
 
-		/* Nuke any leading slashes in pattern. */
-		if (pattern[0] == '/')
-			memmove(pattern, &pattern[1], strlen(pattern));
-		while ((cp = strstr(pattern, "|/")))
-			memmove(cp + 1, cp + 2, strlen(cp) - 1);
+		/* Per client address, or per virtual host, limit? */
+		if (!strncmp(pattern, "client:", 7)) {
+			type = THROTTLE_CLIENT;
+			memmove(pattern, &pattern[7], strlen(pattern) - 6);
+		} else if (!strncmp(pattern, "vhost:", 6)) {
+			type = THROTTLE_VHOST;
+			memmove(pattern, &pattern[6], strlen(pattern) - 5);
+		} else {
+			type = THROTTLE_URL;
+
+			/* Nuke any leading slashes in pattern. */
+			if (pattern[0] == '/')
+				memmove(pattern, &pattern[1], strlen(pattern));
+			while ((cp = strstr(pattern, "|/")))
+				memmove(cp + 1, cp + 2, strlen(cp) - 1);
+		}
 
 		/* Check for room in throttles. */
 		if (numthrottles >= maxthrottles) {
@@ -235,11 +384,13 @@ static void read_throttlefile(char *throttlefile)
 
 		/* Add to table. */
 		throttles[numthrottles].pattern = strdup(pattern);
-		if (!throttles[numthrottles].pattern) {
+		throttles[numthrottles].match = match_compile(pattern);
+		if (!throttles[numthrottles].pattern || !throttles[numthrottles].match) {
 			syslog(LOG_CRIT, "Failed storing throttle pattern: %s", strerror(errno));
 			exit(1);
 		}
 
+		throttles[numthrottles].type = type;
 		throttles[numthrottles].max_limit = max_limit;
 		throttles[numthrottles].min_limit = min_limit;
 		throttles[numthrottles].rate = 0;
@@ -252,13 +403,125 @@ static void read_throttlefile(char *throttlefile)
 }
 
 
+/* The manifest, and its directory, are opened before chroot() and
+** dropping privileges.  It is read once to queue the files to warm up,
+** and then replaced, see write_manifest().
+*/
+static void open_manifest(char *fn)
+{
+	char dir[MAXPATHLEN];
+	char *slash;
+	FILE *fp;
+	int n;
+
+	manifest_fd = open(fn, O_RDWR | O_CREAT, 0644);
+	if (manifest_fd < 0) {
+		syslog(LOG_CRIT, "%s: %s", fn, strerror(errno));
+		exit(1);
+	}
+	fcntl(manifest_fd, F_SETFD, FD_CLOEXEC);
+
+	slash = strrchr(fn, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == fn)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, MIN(sizeof(dir), (size_t)(slash - fn) + 1), "%s", fn);
+	manifest_name = strdup(slash ? slash + 1 : fn);
+	manifest_dir = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (!manifest_name || manifest_dir < 0) {
+		syslog(LOG_CRIT, "%s: %s", dir, strerror(errno));
+		exit(1);
+	}
+
+	fp = fdopen(dup(manifest_fd), "r");
+	if (!fp) {
+		syslog(LOG_CRIT, "%s: %s", fn, strerror(errno));
+		exit(1);
+	}
+	n = mmc_warm(fp, CACHE_MANIFEST_MAX);
+	fclose(fp);
+
+	if (n > 0)
+		syslog(LOG_NOTICE, "Warming up %d files from %s", n, fn);
+}
+
+/* Only one of the prefork workers keeps the manifest up to date.  A
+** new one is written next to it and renamed over it, so it is never
+** left half written.  If the directory is not writable, e.g. after
+** dropping privileges, it is overwritten in place and then cut to
+** size, which at least never leaves it empty.
+*/
+static void write_manifest(void)
+{
+	char tmp[MAXPATHLEN];
+	int fd, inplace = 0;
+	FILE *fp;
+
+	if (manifest_fd < 0 || worker_id)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", manifest_name);
+	fd = openat(manifest_dir, tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		inplace = 1;
+		fd = dup(manifest_fd);
+		if (fd >= 0 && lseek(fd, 0, SEEK_SET)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0) {
+		syslog(LOG_ERR, "Failed rewriting cache manifest: %s", strerror(errno));
+		return;
+	}
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto fail;
+	}
+	if (mmc_manifest(fp, CACHE_MANIFEST_MAX) < 0 || (inplace && ftruncate(fd, ftello(fp)))) {
+		syslog(LOG_ERR, "Failed writing cache manifest: %s", strerror(errno));
+		fclose(fp);
+		goto fail;
+	}
+
+	if (!inplace) {
+		if (renameat(manifest_dir, tmp, manifest_dir, manifest_name)) {
+			syslog(LOG_ERR, "Failed replacing cache manifest: %s", strerror(errno));
+			fclose(fp);
+			goto fail;
+		}
+
+		/* The new one is the manifest now, in case we go in place later */
+		close(manifest_fd);
+		manifest_fd = dup(fd);
+	}
+	fclose(fp);
+	return;
+fail:
+	if (!inplace)
+		unlinkat(manifest_dir, tmp, 0);
+}
+
+
 /* Generate debugging statistics syslog message. */
 static void merecat_logstats(long secs)
 {
+	struct alog_stats as;
+
 	if (secs > 0)
 		syslog(LOG_INFO, "  %s - %ld connections (%g/sec), %d max simultaneous, %ld bytes (%g/sec), %d httpd_conns allocated",
 		       PACKAGE_NAME, stats_connections, (float)stats_connections / secs,
 		       stats_simultaneous, (long int)stats_bytes, (float)stats_bytes / secs, httpd_conn_count);
+	if (alog_enabled()) {
+		alog_getstats(&as);
+		if (secs > 0)
+			syslog(LOG_INFO, "  access log - %ld lines (%g/sec), %ld bytes, %ld overflows, %ld dropped",
+			       as.lines, (float)as.lines / secs, as.bytes, as.overflows, as.drops);
+	}
 	stats_connections = 0;
 	stats_bytes = 0;
 	stats_simultaneous = 0;
@@ -289,11 +552,35 @@ static void logstats(struct timeval *now)
 	merecat_logstats(stats_secs);
 	httpd_logstats(stats_secs);
 	mmc_logstats(stats_secs);
+	fcgi_logstats(stats_secs);
+	stc_logstats(stats_secs);
 	fdwatch_logstats(stats_secs);
 	tmr_logstats(stats_secs);
 }
 
 
+/*
+** Each connects[] slot keeps its httpd_conn, and all its buffers, for
+** the lifetime of the server.  So instead of one malloc per slot, hand
+** them out from larger slabs to keep them close together in memory.
+*/
+static struct httpd_conn *conn_alloc(void)
+{
+	struct conn_slab *slab = conn_slabs;
+
+	if (!slab || slab->used >= CONN_SLAB_SIZE) {
+		slab = NEW(struct conn_slab, 1);
+		if (!slab)
+			return NULL;
+
+		slab->used = 0;
+		slab->next = conn_slabs;
+		conn_slabs = slab;
+	}
+
+	return &slab->conn[slab->used++];
+}
+
 static void shut_down(void)
 {
 	struct httpd_server *server;
@@ -308,52 +595,203 @@ static void shut_down(void)
 
 		if (connects[i].hc) {
 			httpd_destroy_conn(connects[i].hc);
-			free(connects[i].hc);
 			connects[i].hc = NULL;
 			--httpd_conn_count;
 		}
 	}
 
+	while (conn_slabs) {
+		struct conn_slab *slab = conn_slabs;
+
+		conn_slabs = slab->next;
+		free(slab);
+	}
+
 	LIST_FOREACH(server, server_list) {
 		LIST_REMOVE(server, server_list);
 		srv_exit(server);
 	}
 
+	alog_exit();
+	fcgi_exit();
 	conf_exit();
 	fdwatch_put_nfiles();
+	write_manifest();
 	mmc_destroy();
+	stc_destroy();
 	tmr_destroy();
 	free(connects);
+	free(stats_buf);
+	if (stats_match)
+		match_free(stats_match);
+	for (i = 0; i < numthrottles; i++) {
+		free(throttles[i].pattern);
+		match_free(throttles[i].match);
+	}
 	if (throttles)
 		free(throttles);
+	for (i = 0; i < TKEY_HASH; i++) {
+		while (tkeys[i]) {
+			struct tkey *k = tkeys[i];
+
+			tkeys[i] = k->next;
+			free(k);
+		}
+	}
+}
+
+
+static unsigned int tkey_hash(int tnum, const char *key)
+{
+	unsigned int h = tnum;
+
+	while (*key)
+		h = h * 33 + (unsigned char)*key++;
+
+	return h % TKEY_HASH;
+}
+
+static struct tkey *tkey_find(int tnum, const char *key)
+{
+	struct tkey *k;
+
+	for (k = tkeys[tkey_hash(tnum, key)]; k; k = k->next) {
+		if (k->tnum == tnum && !strcmp(k->key, key))
+			return k;
+	}
+
+	return NULL;
+}
+
+static struct tkey *tkey_get(int tnum, const char *key)
+{
+	struct tkey *k;
+	unsigned int h;
+
+	k = tkey_find(tnum, key);
+	if (!k) {
+		k = malloc(sizeof(*k) + strlen(key));
+		if (!k) {
+			syslog(LOG_CRIT, "Out of memory allocating a throttle key");
+			exit(1);
+		}
+
+		h = tkey_hash(tnum, key);
+		k->tnum = tnum;
+		k->num_sending = 0;
+		strcpy(k->key, key);
+		k->next = tkeys[h];
+		tkeys[h] = k;
+	}
+	++k->num_sending;
+
+	return k;
+}
+
+static void tkey_put(struct tkey *k)
+{
+	struct tkey **pp;
+
+	if (--k->num_sending > 0)
+		return;
+
+	for (pp = &tkeys[tkey_hash(k->tnum, k->key)]; *pp; pp = &(*pp)->next) {
+		if (*pp == k) {
+			*pp = k->next;
+			break;
+		}
+	}
+	free(k);
 }
 
+/* What each connection sending under a throttle, or its key, may use */
+static long throttle_share(int tnum, struct tkey *k)
+{
+	int n = k ? k->num_sending : throttles[tnum].num_sending;
+	long l;
+
+	l = throttles[tnum].max_limit / (n > 0 ? n : 1);
+	if (l < 1)
+		l = 1;
+
+	return l;
+}
+
+/* Lowest share of all the throttles a connection is sending under */
+static void throttle_rate(connecttab *c)
+{
+	int tind;
+	long l;
+
+	c->max_limit = THROTTLE_NOLIMIT;
+	for (tind = 0; tind < c->numtnums; ++tind) {
+		l = throttle_share(c->tnums[tind], c->tkeys[tind]);
+		if (c->max_limit == THROTTLE_NOLIMIT)
+			c->max_limit = l;
+		else
+			c->max_limit = MIN(c->max_limit, l);
+	}
+}
+
+static char *throttle_subject(struct httpd_conn *hc, int type)
+{
+	switch (type) {
+	case THROTTLE_CLIENT:
+		/* Not httpd_client(), X-Forwarded-For is set by the
+		** client and would give it a fresh bucket per request. */
+		return httpd_ntoa(&hc->client_addr);
+
+	case THROTTLE_VHOST:
+		if (hc->hostname)
+			return hc->hostname;
+		return hc->reqhost[0] ? hc->reqhost : hc->hdrhost;
+	}
+
+	return hc->expnfilename;
+}
 
-static int check_throttles(connecttab *c)
+/* The request in hc, the connection's own or an HTTP/2 stream's */
+static int check_throttles(connecttab *c, struct httpd_conn *hc)
 {
+	struct tkey *k;
+	char *subject;
 	int tnum;
 	long l;
 
 	c->numtnums = 0;
 	c->max_limit = c->min_limit = THROTTLE_NOLIMIT;
 	for (tnum = 0; tnum < numthrottles && c->numtnums < MAXTHROTTLENUMS; ++tnum) {
-		if (match(throttles[tnum].pattern, c->hc->expnfilename)) {
-			/* If we're way over the limit, don't even start. */
-			if (throttles[tnum].rate > throttles[tnum].max_limit * 2)
-				return 0;
+		subject = throttle_subject(hc, throttles[tnum].type);
+		if (match_exec(throttles[tnum].match, subject)) {
+			k = NULL;
+			if (throttles[tnum].type != THROTTLE_URL) {
+				/* Each client, or vhost, has its own limit, and
+				** the minimum caps the number of connections.
+				*/
+				k = tkey_find(tnum, subject);
+				if (k && throttles[tnum].max_limit / (k->num_sending + 1) < throttles[tnum].min_limit)
+					return 0;
+			} else {
+				/* If we're way over the limit, don't even start. */
+				if (throttles[tnum].rate > throttles[tnum].max_limit * 2)
+					return 0;
 
-			/* Also don't start if we're under the minimum. */
-			if (throttles[tnum].rate < throttles[tnum].min_limit)
-				return 0;
+				/* Also don't start if we're under the minimum. */
+				if (throttles[tnum].rate < throttles[tnum].min_limit)
+					return 0;
+			}
 
 			if (throttles[tnum].num_sending < 0) {
 				syslog(LOG_ERR, "throttle sending count was negative - shouldn't happen!");
 				throttles[tnum].num_sending = 0;
 			}
+			if (throttles[tnum].type != THROTTLE_URL)
+				k = tkey_get(tnum, subject);
+			c->tkeys[c->numtnums] = k;
 			c->tnums[c->numtnums++] = tnum;
 			++throttles[tnum].num_sending;
 
-			l = throttles[tnum].max_limit / throttles[tnum].num_sending;
+			l = throttle_share(tnum, k);
 			if (c->max_limit == THROTTLE_NOLIMIT)
 				c->max_limit = l;
 			else
@@ -375,17 +813,64 @@ static void clear_throttles(connecttab *c, struct timeval *tv)
 {
 	int tind;
 
-	for (tind = 0; tind < c->numtnums; ++tind)
+	for (tind = 0; tind < c->numtnums; ++tind) {
 		--throttles[c->tnums[tind]].num_sending;
+		if (c->tkeys[tind])
+			tkey_put(c->tkeys[tind]);
+	}
+	c->numtnums = 0;
+}
+
+
+/* Bytes in one slice of the connection's rate, at least one */
+static double throttle_slice(connecttab *c)
+{
+	double slice;
+
+	slice = (double)c->max_limit * THROTTLE_SLICE / 1000;
+	if (slice < 1)
+		slice = 1;
+
+	return slice;
+}
+
+/* Token bucket refill, in milliseconds.  It holds two slices, so a late
+** wakeup does not lose what was earned in the meantime.  The share is
+** recalculated first, connections sharing a throttle come and go.
+*/
+static void throttle_refill(connecttab *c, struct timeval *tv)
+{
+	double ms, cap;
+
+	throttle_rate(c);
+	ms = (tv->tv_sec - c->tokens_at.tv_sec) * 1000.0 + (tv->tv_usec - c->tokens_at.tv_usec) / 1000.0;
+	if (ms > 0)
+		c->tokens += c->max_limit * ms / 1000;
+	c->tokens_at = *tv;
+
+	cap = 2 * throttle_slice(c);
+	if (c->tokens > cap)
+		c->tokens = cap;
+}
+
+/* Milliseconds until the token bucket holds a full slice again */
+static long throttle_delay(connecttab *c)
+{
+	double ms;
+
+	ms = (throttle_slice(c) - c->tokens) * 1000 / c->max_limit;
+	if (ms < 1)
+		ms = 1;
+
+	return (long)ms;
 }
 
 
 static void update_throttles(arg_t arg, struct timeval *now)
 {
-	int tnum, tind;
+	int tnum;
 	int cnum;
 	connecttab *c;
-	long l;
 
 	/* Update the average sending rate for each throttle.
 	** This is only used when new connections start up.
@@ -394,6 +879,10 @@ static void update_throttles(arg_t arg, struct timeval *now)
 		throttles[tnum].rate = (2 * throttles[tnum].rate + throttles[tnum].bytes_since_avg / THROTTLE_TIME) / 3;
 		throttles[tnum].bytes_since_avg = 0;
 
+		/* The limit of client: and vhost: throttles is per key */
+		if (throttles[tnum].type != THROTTLE_URL)
+			continue;
+
 		/* Log a warning message if necessary. */
 		if (throttles[tnum].rate > throttles[tnum].max_limit && throttles[tnum].num_sending != 0) {
 			if (throttles[tnum].rate > throttles[tnum].max_limit * 2)
@@ -418,142 +907,542 @@ static void update_throttles(arg_t arg, struct timeval *now)
 	*/
 	for (cnum = 0; cnum < max_connects; ++cnum) {
 		c = &connects[cnum];
-		if (c->conn_state == CNST_SENDING || c->conn_state == CNST_PAUSING) {
-			c->max_limit = THROTTLE_NOLIMIT;
-
-			for (tind = 0; tind < c->numtnums; ++tind) {
-				tnum = c->tnums[tind];
-				l = throttles[tnum].max_limit / throttles[tnum].num_sending;
-
-				if (c->max_limit == THROTTLE_NOLIMIT)
-					c->max_limit = l;
-				else
-					c->max_limit = MIN(c->max_limit, l);
-			}
-		}
+		if (c->conn_state == CNST_SENDING || c->conn_state == CNST_PAUSING)
+			throttle_rate(c);
 	}
 }
 
 
-static void really_clear_connection(connecttab *c, struct timeval *tv)
+/* Upper bounds of the request latency histogram buckets, in seconds */
+static const double latency_le[HTTPD_LATENCY_BUCKETS] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0
+};
+
+/* Upper bounds of the request phase histogram buckets, most phases of
+** a static file request take well under a millisecond.
+*/
+static const double phase_le[] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.1, 1.0
+};
+static const char *phase_names[HTTPD_PHASES] = { "read", "resolve", "respond", "send" };
+
+/* Request phases and slow requests of this process, for the stats endpoint */
+static long   phase_count;
+static double phase_sum[HTTPD_PHASES];
+static long   phase_hist[HTTPD_PHASES][NELEMS(phase_le)];
+static long   slow_count;
+
+static void account_phases(long usec[HTTPD_PHASES])
 {
-	stats_bytes += c->hc->bytes_sent;
-	if (c->conn_state != CNST_PAUSING)
-		fdwatch_del_fd(c->hc->conn_fd);
+	size_t j;
+	int i;
 
-	httpd_close_conn(c->hc, tv);
-	clear_throttles(c, tv);
-	if (c->linger_timer) {
-		tmr_cancel(c->linger_timer);
-		c->linger_timer = 0;
-	}
+	phase_count++;
+	for (i = 0; i < HTTPD_PHASES; i++) {
+		double secs = usec[i] / 1000000.0;
 
-#ifdef HAVE_ZLIB_H
-	if (c->zs_output_head) {
-		free(c->zs_output_head);
-		c->zs_output_head = NULL;
-		deflateEnd(&c->zs);
+		phase_sum[i] += secs;
+		for (j = 0; j < NELEMS(phase_le); j++) {
+			if (secs <= phase_le[j]) {
+				phase_hist[i][j]++;
+				break;
+			}
+		}
 	}
-#endif
-	c->conn_state = CNST_FREE;
-	c->next_free_connect = first_free_connect;
-	first_free_connect = c - connects;	/* division by sizeof is implied */
-	--num_connects;
 }
 
-
-static void wakeup_connection(arg_t arg, struct timeval *now)
+/* Trace a request slower than slow-request to syslog, sampled by only
+** tracing the first SLOW_TRACE_MAX each second.
+*/
+static void trace_slow(struct httpd_conn *hc, long total, long usec[HTTPD_PHASES], struct timeval *tv)
 {
-	connecttab *c;
-
-	c = (connecttab *)arg.p;
-	c->wakeup_timer = NULL;
-	if (c->conn_state == CNST_PAUSING) {
-		c->conn_state = CNST_SENDING;
-		fdwatch_add_fd(c->hc->conn_fd, c, FDW_WRITE);
+	static time_t second;
+	static long traced, skipped;
+	char more[40] = "";
+
+	slow_count++;
+	if (tv->tv_sec != second) {
+		second = tv->tv_sec;
+		traced = 0;
+	}
+	if (traced++ >= SLOW_TRACE_MAX) {
+		skipped++;
+		return;
 	}
-}
 
-static void linger_clear_connection(arg_t arg, struct timeval *now)
-{
-	connecttab *c;
+	if (skipped)
+		snprintf(more, sizeof(more), ", %ld more not traced", skipped);
+	skipped = 0;
 
-	c = (connecttab *)arg.p;
-	c->hc->do_keep_alive = 0;
-	c->linger_timer = NULL;
-	really_clear_connection(c, now);
+	syslog(LOG_NOTICE, "%s slow request \"%s %.200s\" %d, %lld bytes in %ld ms: "
+	       "read %ld resolve %ld respond %ld send %ld usec%s",
+	       httpd_client(hc), httpd_method_str(hc->method), hc->encodedurl, hc->status,
+	       (long long)hc->bytes_sent, total / 1000, usec[HTTPD_PHASE_READ],
+	       usec[HTTPD_PHASE_RESOLVE], usec[HTTPD_PHASE_RESPOND], usec[HTTPD_PHASE_SEND], more);
 }
 
-
-static void clear_connection(connecttab *c, struct timeval *tv)
+static struct httpd_stats *get_stats(struct httpd_server *hs, char *host)
 {
-	arg_t arg;
+	struct httpd_stats *st;
+	int i;
 
-	if (c->wakeup_timer) {
-		tmr_cancel(c->wakeup_timer);
-		c->wakeup_timer = 0;
-	}
+	if (!hs->vhost || !host)
+		host = "";
 
-	/* This is our version of Apache's lingering_close() routine, which is
-	** their version of the often-broken SO_LINGER socket option.  For why
-	** this is necessary, see [1].  What we do is delay the actual closing
-	** for a few seconds, while reading any bytes that come over the
-	** connection.  However, we don't want to do this unless it's
-	** necessary, because it ties up a connection slot and file descriptor
-	** which means our maximum connection-handling rate is lower.  So,
-	** elsewhere we set a flag when we detect the few circumstances that
-	** make a lingering close necessary.  If the flag isn't set we do the
-	** real close now.
-	**
-	** [1]: http://www.apache.org/docs/misc/fin_wait_2.html
-	*/
-	if (c->conn_state == CNST_LINGERING && !c->hc->do_keep_alive) {
-		/* If we were already lingering, shut down for real. */
-		tmr_cancel(c->linger_timer);
-		c->linger_timer = NULL;
-		c->hc->should_linger = 0;
+	for (i = 0; i < hs->stats_count; i++) {
+		if (!strcasecmp(hs->stats[i].host, host))
+			return &hs->stats[i];
 	}
 
-	if (c->hc->do_keep_alive) {
-		if (c->conn_state != CNST_PAUSING)
-			fdwatch_del_fd(c->hc->conn_fd);
-		fdwatch_add_fd(c->hc->conn_fd, c, FDW_READ);
+	/* Bounded, any excess virtual hosts are accounted to the server */
+	if (host[0] && hs->stats_count > STATS_MAX_VHOSTS)
+		return get_stats(hs, "");
 
-		c->conn_state = CNST_READING;
-		c->next_byte_index = 0;
+	st = RENEW(hs->stats, struct httpd_stats, hs->stats_count + 1);
+	if (!st)
+		return NULL;
+	hs->stats = st;
 
-		arg.p = c;
-		if (c->linger_timer)
-			tmr_cancel(c->linger_timer);
+	st = &hs->stats[hs->stats_count];
+	memset(st, 0, sizeof(*st));
+	st->host = strdup(host);
+	if (!st->host)
+		return NULL;
+	hs->stats_count++;
 
-		/* release file memory */
-		if (c->hc->file_address) {
-			mmc_unmap(c->hc->file_address, &c->hc->sb, tv);
-			c->hc->file_address = NULL;
-		}
+	return st;
+}
 
-		/* release httpd_conn auxiliary memory */
-		httpd_destroy_conn(c->hc);
+/* Called when a request is done, successful or not, req_at is when it
+** was read.
+*/
+static void account(struct httpd_conn *hc, struct timeval *req_at, struct timeval *tv)
+{
+	struct httpd_stats *st;
+	struct timeval diff;
+	long usec[HTTPD_PHASES], total;
+	double secs;
+	int i;
 
-		/* reinitialize httpd_conn */
-		httpd_init_conn_mem(c->hc);
-		httpd_init_conn_content(c->hc);
+	timersub(tv, req_at, &diff);
 
-		/* Reset the connection file descriptor to no-delay mode. */
-		httpd_set_ndelay(c->hc->conn_fd);
+	/* Error responses are sent in one go, without passing handle_send() */
+	tmr_prepare_timeval(&hc->t_done);
+	if (!timerisset(&hc->t_first))
+		hc->t_first = hc->t_done;
+	total = httpd_phases(hc, usec);
+	account_phases(usec);
+	if (slow_request > 0 && total >= slow_request * 1000L)
+		trace_slow(hc, total, usec, tv);
 
-		c->linger_timer = tmr_create(tv, linger_clear_connection, arg, KEEPALIVE_TIMELIMIT, 0);
-		if (!c->linger_timer) {
-			syslog(LOG_CRIT, "tmr_create(linger_clear_connection)2 failed");
-			exit(1);
-		}
-	} else if (c->hc->should_linger) {
-		if (c->conn_state != CNST_PAUSING)
-			fdwatch_del_fd(c->hc->conn_fd);
+	httpd_log_request(hc);
 
-		c->conn_state = CNST_LINGERING;
-		shutdown(c->hc->conn_fd, SHUT_WR);
-		fdwatch_add_fd(c->hc->conn_fd, c, FDW_READ);
+	st = get_stats(hc->hs, hc->hostname);
+	if (!st)
+		return;
+
+	i = hc->status / 100;
+	if (i < 1 || i > 5)
+		i = 0;
+	st->status[i]++;
+	st->bytes_sent += hc->bytes_sent;
+
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+	st->latency_sum += secs;
+	for (i = 0; i < HTTPD_LATENCY_BUCKETS; i++) {
+		if (secs <= latency_le[i]) {
+			st->latency[i]++;
+			break;
+		}
+	}
+}
+
+static void account_request(connecttab *c, struct timeval *tv)
+{
+	if (!timerisset(&c->req_at))
+		return;
+
+	account(c->hc, &c->req_at, tv);
+	timerclear(&c->req_at);
+}
+
+static void stats_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len <= 0)
+		return;
+
+	httpd_realloc_str(&stats_buf, &stats_max, stats_len + len);
+	va_start(ap, fmt);
+	vsnprintf(&stats_buf[stats_len], stats_max - stats_len + 1, fmt, ap);
+	va_end(ap);
+	stats_len += len;
+}
+
+/* Escape a Prometheus label value */
+static char *stats_label(const char *str, char *buf, size_t len)
+{
+	size_t i = 0;
+
+	while (*str && i + 2 < len) {
+		if (*str == '"' || *str == '\\')
+			buf[i++] = '\\';
+		if (*str == '\n') {
+			buf[i++] = '\\';
+			buf[i++] = 'n';
+			str++;
+			continue;
+		}
+		buf[i++] = *str++;
+	}
+	buf[i] = 0;
+
+	return buf;
+}
+
+/* The stats endpoint only exists for clients matching stats_allow, by
+** their socket address, anyone else gets whatever file is at the path.
+*/
+static int is_stats(struct httpd_conn *hc)
+{
+	if (!stats_path || strcmp(hc->decodedurl, stats_path))
+		return 0;
+
+	return match_exec(stats_match, httpd_ntoa(&hc->client_addr));
+}
+
+/* Serve the stats endpoint in Prometheus text exposition format */
+static void send_stats(struct httpd_conn *hc, struct timeval *tv)
+{
+	static const char *states[] = { "free", "reading", "sending", "pausing", "lingering", "handshake", "cgi", "listing", "h2" };
+	_Static_assert(NELEMS(states) == CNST_MAX + 1, "states[] must name every CNST_* state");
+	static const char *classes[] = { "unknown", "1xx", "2xx", "3xx", "4xx", "5xx" };
+	struct httpd_server *hs;
+	struct mmc_stats ms;
+	struct tmr_stats ts;
+	int count[CNST_MAX + 1] = { 0 };
+	char srv[300], host[300];
+	int i, j;
+
+	stats_len = 0;
+	stats_printf("# TYPE merecat_info gauge\n"
+		     "merecat_info{version=\"%s\",pid=\"%d\"} 1\n"
+		     "# TYPE merecat_uptime_seconds gauge\n"
+		     "merecat_uptime_seconds %ld\n",
+		     VERSION, (int)getpid(), (long)(tv->tv_sec - start_time));
+
+	for (i = 0; i < max_connects; i++) {
+		if (connects[i].conn_state >= 0 && connects[i].conn_state <= CNST_MAX)
+			count[connects[i].conn_state]++;
+	}
+	stats_printf("# TYPE merecat_connections gauge\n");
+	for (i = 0; i <= CNST_MAX; i++)
+		stats_printf("merecat_connections{state=\"%s\"} %d\n", states[i], count[i]);
+
+	stats_printf("# TYPE merecat_accepted_total counter\n");
+	LIST_FOREACH(hs, server_list) {
+		snprintf(host, sizeof(host), "%s:%d", hs->server_hostname ? hs->server_hostname : "", hs->port);
+		stats_printf("merecat_accepted_total{server=\"%s\"} %ld\n", stats_label(host, srv, sizeof(srv)), hs->accepted);
+	}
+
+	stats_printf("# TYPE merecat_requests_total counter\n");
+	LIST_FOREACH(hs, server_list) {
+		snprintf(host, sizeof(host), "%s:%d", hs->server_hostname ? hs->server_hostname : "", hs->port);
+		stats_label(host, srv, sizeof(srv));
+		for (i = 0; i < hs->stats_count; i++) {
+			struct httpd_stats *st = &hs->stats[i];
+
+			stats_label(st->host, host, sizeof(host));
+			for (j = 0; j < (int)NELEMS(classes); j++) {
+				if (!st->status[j])
+					continue;
+				stats_printf("merecat_requests_total{server=\"%s\",vhost=\"%s\",code=\"%s\"} %ld\n",
+					     srv, host, classes[j], st->status[j]);
+			}
+		}
+	}
+
+	stats_printf("# TYPE merecat_sent_bytes_total counter\n");
+	LIST_FOREACH(hs, server_list) {
+		snprintf(host, sizeof(host), "%s:%d", hs->server_hostname ? hs->server_hostname : "", hs->port);
+		stats_label(host, srv, sizeof(srv));
+		for (i = 0; i < hs->stats_count; i++) {
+			stats_printf("merecat_sent_bytes_total{server=\"%s\",vhost=\"%s\"} %lld\n", srv,
+				     stats_label(hs->stats[i].host, host, sizeof(host)), (long long)hs->stats[i].bytes_sent);
+		}
+	}
+
+	stats_printf("# TYPE merecat_request_duration_seconds histogram\n");
+	LIST_FOREACH(hs, server_list) {
+		snprintf(host, sizeof(host), "%s:%d", hs->server_hostname ? hs->server_hostname : "", hs->port);
+		stats_label(host, srv, sizeof(srv));
+		for (i = 0; i < hs->stats_count; i++) {
+			struct httpd_stats *st = &hs->stats[i];
+			long total = 0, sum = 0;
+
+			stats_label(st->host, host, sizeof(host));
+			for (j = 0; j < (int)NELEMS(classes); j++)
+				total += st->status[j];
+			for (j = 0; j < HTTPD_LATENCY_BUCKETS; j++) {
+				sum += st->latency[j];
+				stats_printf("merecat_request_duration_seconds_bucket{server=\"%s\",vhost=\"%s\",le=\"%g\"} %ld\n",
+					     srv, host, latency_le[j], sum);
+			}
+			stats_printf("merecat_request_duration_seconds_bucket{server=\"%s\",vhost=\"%s\",le=\"+Inf\"} %ld\n"
+				     "merecat_request_duration_seconds_sum{server=\"%s\",vhost=\"%s\"} %f\n"
+				     "merecat_request_duration_seconds_count{server=\"%s\",vhost=\"%s\"} %ld\n",
+				     srv, host, total, srv, host, st->latency_sum, srv, host, total);
+		}
+	}
+
+	stats_printf("# TYPE merecat_request_phase_seconds histogram\n");
+	for (i = 0; i < HTTPD_PHASES; i++) {
+		long sum = 0;
+
+		for (j = 0; j < (int)NELEMS(phase_le); j++) {
+			sum += phase_hist[i][j];
+			stats_printf("merecat_request_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %ld\n",
+				     phase_names[i], phase_le[j], sum);
+		}
+		stats_printf("merecat_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %ld\n"
+			     "merecat_request_phase_seconds_sum{phase=\"%s\"} %f\n"
+			     "merecat_request_phase_seconds_count{phase=\"%s\"} %ld\n",
+			     phase_names[i], phase_count, phase_names[i], phase_sum[i], phase_names[i], phase_count);
+	}
+	stats_printf("# TYPE merecat_slow_requests_total counter\n"
+		     "merecat_slow_requests_total %ld\n", slow_count);
+
+	mmc_getstats(&ms);
+	stats_printf("# TYPE merecat_mmc_maps gauge\n"
+		     "merecat_mmc_maps %d\n"
+		     "# TYPE merecat_mmc_mapped_bytes gauge\n"
+		     "merecat_mmc_mapped_bytes %lld\n"
+		     "# TYPE merecat_mmc_gzip_maps gauge\n"
+		     "merecat_mmc_gzip_maps %d\n"
+		     "# TYPE merecat_mmc_gzip_bytes gauge\n"
+		     "merecat_mmc_gzip_bytes %lld\n"
+		     "# TYPE merecat_mmc_hits_total counter\n"
+		     "merecat_mmc_hits_total %ld\n"
+		     "# TYPE merecat_mmc_misses_total counter\n"
+		     "merecat_mmc_misses_total %ld\n"
+		     "# TYPE merecat_mmc_evictions_total counter\n"
+		     "merecat_mmc_evictions_total %ld\n",
+		     ms.maps, (long long)ms.mapped_bytes, ms.gzip_count, (long long)ms.gzip_bytes, ms.hits, ms.misses,
+		     ms.evictions);
+
+	if (do_ssl) {
+		struct httpd_ssl_stats ss, sum = { 0 };
+
+		LIST_FOREACH(hs, server_list) {
+			httpd_ssl_getstats(hs->ctx, &ss);
+			sum.full         += ss.full;
+			sum.resumed      += ss.resumed;
+			sum.cache_hits   += ss.cache_hits;
+			sum.cache_misses += ss.cache_misses;
+		}
+		stats_printf("# TYPE merecat_tls_handshakes_total counter\n"
+			     "merecat_tls_handshakes_total{resumed=\"no\"} %ld\n"
+			     "merecat_tls_handshakes_total{resumed=\"yes\"} %ld\n"
+			     "# TYPE merecat_tls_session_cache_total counter\n"
+			     "merecat_tls_session_cache_total{result=\"hit\"} %ld\n"
+			     "merecat_tls_session_cache_total{result=\"miss\"} %ld\n",
+			     sum.full, sum.resumed, sum.cache_hits, sum.cache_misses);
+	}
+
+	tmr_getstats(&ts);
+	stats_printf("# TYPE merecat_timers gauge\n"
+		     "merecat_timers{state=\"active\"} %d\n"
+		     "merecat_timers{state=\"free\"} %d\n",
+		     ts.active, ts.free);
+
+	if (numthrottles > 0) {
+		stats_printf("# TYPE merecat_throttle_rate_bytes gauge\n");
+		for (i = 0; i < numthrottles; i++)
+			stats_printf("merecat_throttle_rate_bytes{pattern=\"%s\"} %ld\n",
+				     stats_label(throttles[i].pattern, host, sizeof(host)), throttles[i].rate);
+		stats_printf("# TYPE merecat_throttle_limit_bytes gauge\n");
+		for (i = 0; i < numthrottles; i++)
+			stats_printf("merecat_throttle_limit_bytes{pattern=\"%s\"} %ld\n",
+				     stats_label(throttles[i].pattern, host, sizeof(host)), throttles[i].max_limit);
+		stats_printf("# TYPE merecat_throttle_sending gauge\n");
+		for (i = 0; i < numthrottles; i++)
+			stats_printf("merecat_throttle_sending{pattern=\"%s\"} %d\n",
+				     stats_label(throttles[i].pattern, host, sizeof(host)), throttles[i].num_sending);
+	}
+
+	httpd_send_body(hc, "Cache-Control: no-store\r\n", "text/plain; version=0.0.4; charset=%s", stats_buf, stats_len);
+}
+
+
+/* Done reading a directory listing, see start_listing() */
+static void stop_listing(connecttab *c)
+{
+	struct httpd_conn *hc = c->hc;
+
+	fdwatch_del_fd(hc->ls_fd);
+	close(hc->ls_fd);
+	hc->ls_fd = -1;
+	fdwatch_add_fd(hc->conn_fd, c, FDW_READ | FDW_EDGE);
+}
+
+
+static void really_clear_connection(connecttab *c, struct timeval *tv)
+{
+	stats_bytes += c->hc->bytes_sent;
+	if (c->conn_state != CNST_PAUSING)
+		fdwatch_del_fd(c->hc->conn_fd);
+
+#ifdef ENABLE_HTTP2
+	/* GOAWAY, and account any streams still open */
+	if (c->h2) {
+		h2_close(c->h2, tv);
+		c->h2 = NULL;
+	}
+#endif
+	httpd_close_conn(c->hc, tv);
+	clear_throttles(c, tv);
+	if (c->linger_timer) {
+		tmr_cancel(c->linger_timer);
+		c->linger_timer = 0;
+	}
+
+#ifdef HAVE_ZLIB_H
+	if (c->zs_output_head) {
+		free(c->zs_output_head);
+		c->zs_output_head = NULL;
+		deflateEnd(&c->zs);
+	}
+#endif
+	c->conn_state = CNST_FREE;
+	c->next_free_connect = first_free_connect;
+	first_free_connect = c - connects;	/* division by sizeof is implied */
+	--num_connects;
+}
+
+
+static void wakeup_connection(arg_t arg, struct timeval *now)
+{
+	connecttab *c;
+
+	c = (connecttab *)arg.p;
+	c->wakeup_timer = NULL;
+	if (c->conn_state == CNST_PAUSING) {
+		c->conn_state = CNST_SENDING;
+		fdwatch_add_fd(c->hc->conn_fd, c, FDW_WRITE | FDW_EDGE);
+	}
+}
+
+static void pause_connection(connecttab *c, struct timeval *tv, long msecs)
+{
+	arg_t arg;
+
+	c->conn_state = CNST_PAUSING;
+	fdwatch_del_fd(c->hc->conn_fd);
+
+	arg.p = c;
+	if (c->wakeup_timer)
+		syslog(LOG_ERR, "replacing non-null wakeup_timer!");
+
+	c->wakeup_timer = tmr_create(tv, wakeup_connection, arg, msecs, 0);
+	if (!c->wakeup_timer) {
+		syslog(LOG_CRIT, "tmr_create(wakeup_connection) failed");
+		exit(1);
+	}
+}
+
+static void linger_clear_connection(arg_t arg, struct timeval *now)
+{
+	connecttab *c;
+
+	c = (connecttab *)arg.p;
+	c->hc->do_keep_alive = 0;
+	c->linger_timer = NULL;
+	really_clear_connection(c, now);
+}
+
+
+static void clear_connection(connecttab *c, struct timeval *tv)
+{
+	arg_t arg;
+
+	if (c->conn_state == CNST_LISTING) {
+		stop_listing(c);
+		c->conn_state = CNST_READING;
+	}
+
+	account_request(c, tv);
+	clear_throttles(c, tv);
+	if (c->wakeup_timer) {
+		tmr_cancel(c->wakeup_timer);
+		c->wakeup_timer = 0;
+	}
+
+	/* This is our version of Apache's lingering_close() routine, which is
+	** their version of the often-broken SO_LINGER socket option.  For why
+	** this is necessary, see [1].  What we do is delay the actual closing
+	** for a few seconds, while reading any bytes that come over the
+	** connection.  However, we don't want to do this unless it's
+	** necessary, because it ties up a connection slot and file descriptor
+	** which means our maximum connection-handling rate is lower.  So,
+	** elsewhere we set a flag when we detect the few circumstances that
+	** make a lingering close necessary.  If the flag isn't set we do the
+	** real close now.
+	**
+	** [1]: http://www.apache.org/docs/misc/fin_wait_2.html
+	*/
+	if (c->conn_state == CNST_LINGERING && !c->hc->do_keep_alive) {
+		/* If we were already lingering, shut down for real. */
+		tmr_cancel(c->linger_timer);
+		c->linger_timer = NULL;
+		c->hc->should_linger = 0;
+	}
+
+	if (c->hc->do_keep_alive) {
+		if (c->conn_state != CNST_PAUSING)
+			fdwatch_mod_fd(c->hc->conn_fd, c, FDW_READ);
+		else
+			fdwatch_add_fd(c->hc->conn_fd, c, FDW_READ | FDW_EDGE);
+
+		c->conn_state = CNST_READING;
+		c->next_byte_index = 0;
+
+		arg.p = c;
+		if (c->linger_timer)
+			tmr_cancel(c->linger_timer);
+
+		/* release file memory */
+		httpd_release_file(c->hc, tv);
+
+		/* reinitialize httpd_conn, keeping any pipelined requests, they
+		** are handled in handle_pipelined() without waiting on fdwatch.
+		*/
+		if (httpd_reset_conn(c->hc) > 0 && !c->pipelined) {
+			c->pipelined = 1;
+			c->pipeline_next = pipeline_head;
+			pipeline_head = c;
+		}
+
+		/* Reset the connection file descriptor to no-delay mode. */
+		httpd_set_ndelay(c->hc->conn_fd);
+
+		c->linger_timer = tmr_create(tv, linger_clear_connection, arg, KEEPALIVE_TIMELIMIT, 0);
+		if (!c->linger_timer) {
+			syslog(LOG_CRIT, "tmr_create(linger_clear_connection)2 failed");
+			exit(1);
+		}
+	} else if (c->hc->should_linger) {
+		if (c->conn_state != CNST_PAUSING)
+			fdwatch_mod_fd(c->hc->conn_fd, c, FDW_READ);
+		else
+			fdwatch_add_fd(c->hc->conn_fd, c, FDW_READ | FDW_EDGE);
+
+		c->conn_state = CNST_LINGERING;
+		shutdown(c->hc->conn_fd, SHUT_WR);
 
 		arg.p = c;
 		if (c->linger_timer) {
@@ -584,12 +1473,17 @@ static void finish_connection(connecttab *c, struct timeval *tv)
 int handle_newconnect(struct httpd_server *hs, struct timeval *tv, int fd)
 {
 	connecttab *c;
+	int n;
 
 	/* This loops until the accept() fails, trying to start new
 	** connections as fast as possible so we don't overrun the
-	** listen queue.
+	** listen queue.  At most MAX_ACCEPT_BATCH at a time though,
+	** then the existing connections get their turn.
 	*/
-	for (;;) {
+	for (n = 0; ; n++) {
+		if (n >= MAX_ACCEPT_BATCH)
+			return 0;
+
 		/* Is there room in the connection table? */
 		if (num_connects >= max_connects) {
 			/* Out of connection slots.  Run the timers, then the
@@ -610,7 +1504,7 @@ int handle_newconnect(struct httpd_server *hs, struct timeval *tv, int fd)
 		/* Make the httpd_conn if necessary. */
 		c = &connects[first_free_connect];
 		if (!c->hc) {
-			c->hc = NEW(struct httpd_conn, 1);
+			c->hc = conn_alloc();
 			if (!c->hc) {
 				syslog(LOG_CRIT, "Out of memory allocating an httpd_conn");
 				exit(1);
@@ -634,7 +1528,8 @@ int handle_newconnect(struct httpd_server *hs, struct timeval *tv, int fd)
 			return 1;
 		}
 
-		c->conn_state = CNST_READING;
+		/* HTTPS connections start with a non-blocking TLS handshake */
+		c->conn_state = c->hc->ssl ? CNST_HANDSHAKE : CNST_READING;
 		/* Pop it off the free list. */
 		first_free_connect = c->next_free_connect;
 		c->next_free_connect = -1;
@@ -644,11 +1539,13 @@ int handle_newconnect(struct httpd_server *hs, struct timeval *tv, int fd)
 		c->linger_timer = NULL;
 		c->next_byte_index = 0;
 		c->numtnums = 0;
+		timerclear(&c->req_at);
+		++hs->accepted;
 
-		/* Set the connection file descriptor to no-delay mode. */
-		httpd_set_ndelay(c->hc->conn_fd);
-
-		fdwatch_add_fd(c->hc->conn_fd, c, FDW_READ);
+		/* Edge-triggered, if supported, to save syscalls on each
+		** READ <--> WRITE flip.  Remember fdwatch_drained_fd()!
+		*/
+		fdwatch_add_fd(c->hc->conn_fd, c, FDW_READ | FDW_EDGE);
 
 		++stats_connections;
 		if (num_connects > stats_simultaneous)
@@ -657,68 +1554,635 @@ int handle_newconnect(struct httpd_server *hs, struct timeval *tv, int fd)
 }
 
 
-static void handle_read(connecttab *c, struct timeval *tv)
+/*
+** CGI and FastCGI requests are driven from the main loop without
+** blocking.  The client socket is edge-triggered, so only watched again
+** after a read or write would block, the backend socket, or the socket
+** pair to a CGI program, is level-triggered.  Both have
+** the connecttab as argument, so events on either end up in
+** handle_cgi().
+*/
+static void cgi_watch_client(connecttab *c, int rw)
 {
-	int sz;
-	struct httpd_conn *hc = c->hc;
+	int fd = c->hc->conn_fd;
 
-	/* Is there room in our buffer to read more bytes? */
-	if (hc->read_idx >= hc->read_size) {
-		if (hc->read_size > 5000) {
-			httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "");
-			finish_connection(c, tv);
-			return;
-		}
-		httpd_realloc_str(&hc->read_buf, &hc->read_size, hc->read_size + 1000);
-	}
+	if (c->cgi_watch == rw)
+		return;
 
-	/* Read some more bytes. */
-	sz = httpd_read(hc, &(hc->read_buf[hc->read_idx]), hc->read_size - hc->read_idx);
-	if (sz == 0) {
-//		if (!hc->do_keep_alive)
-//			httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "");
-		if (hc->do_keep_alive)
-			hc->do_keep_alive--;
+	if (rw < 0)
+		fdwatch_del_fd(fd);
+	else if (c->cgi_watch < 0)
+		fdwatch_add_fd(fd, c, rw | FDW_EDGE);
+	else
+		fdwatch_mod_fd(fd, c, rw);
+	c->cgi_watch = rw;
+}
 
-		c->active_at = tv->tv_sec;
-		finish_connection(c, tv);
+static void cgi_watch_backend(connecttab *c, int rw)
+{
+	int fd = backend_fd(c->backend);
+
+	if (c->cgi_bwatch == rw)
 		return;
-	}
 
-	if (sz < 0) {
-		/* Ignore EINTR and EAGAIN.  Also ignore EWOULDBLOCK.  At first glance
-		** you would think that connections returned by fdwatch as readable
-		** should never give an EWOULDBLOCK; however, this apparently can
-		** happen if a packet gets garbled.
-		*/
-		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-			return;
+	if (rw < 0)
+		fdwatch_del_fd(fd);
+	else if (c->cgi_bwatch < 0)
+		fdwatch_add_fd(fd, c, rw);
+	else
+		fdwatch_mod_fd(fd, c, rw);
+	c->cgi_bwatch = rw;
+}
 
-//		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "");
-		finish_connection(c, tv);
-		return;
+static void cgi_unlink(connecttab **head, connecttab *c)
+{
+	connecttab **pp;
+
+	for (pp = head; *pp; pp = (connecttab **)&(*pp)->cgi_next) {
+		if (*pp == c) {
+			*pp = c->cgi_next;
+			break;
+		}
 	}
+	c->cgi_next = NULL;
+}
 
-	hc->read_idx += sz;
-	c->active_at = tv->tv_sec;
+static void fastcgi_dequeue(connecttab *c)
+{
+	connecttab *p;
 
-	/* Do we have a complete request yet? */
-	switch (httpd_got_request(hc)) {
-	case GR_NO_REQUEST:
-		return;
+	cgi_unlink(&fcgi_wait_head, c);
+	fcgi_wait_tail = NULL;
+	for (p = fcgi_wait_head; p; p = p->cgi_next)
+		fcgi_wait_tail = p;
+}
 
-	case GR_BAD_REQUEST:
-//		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "");
-		finish_connection(c, tv);
-		return;
-	}
+static void fastcgi_next(struct timeval *tv);
 
-	/* Must tell libhttpd if we can deflate files */
 #ifdef HAVE_ZLIB_H
-	hc->has_deflate = compression_level != 0;
-#else
-	hc->has_deflate = 0;
-#endif
+/* Deflated CGI output is sent in chunks, each one holding all that can
+** be deflated of what the backend has sent so far.  Chunks are framed
+** in place in zs_output_head, with room for a fixed width size before,
+** and the CRLF, and the last chunk, after.
+*/
+#define CHUNK_HEAD 8		/* "%06x\r\n" */
+#define CHUNK_TAIL 7		/* "\r\n" "0\r\n\r\n" */
+
+static int cgi_gzip_init(connecttab *c)
+{
+	/* Initialized zlib state goes with the buffer, see clear_connection() */
+	c->zs_output_head = malloc(ZLIB_OUTPUT_BUF_SIZE + 8);
+	if (!c->zs_output_head)
+		return -1;
+
+	c->zs.zalloc = Z_NULL;
+	c->zs.zfree  = Z_NULL;
+	c->zs.opaque = Z_NULL;
+	c->zs_state = deflateInit2(&c->zs, compression_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	if (c->zs_state != Z_OK) {
+		free(c->zs_output_head);
+		c->zs_output_head = NULL;
+		return -1;
+	}
+	c->zs.next_out = c->zs_output_head;
+	c->cgi_flags |= CGI_GZIP;
+
+	return 0;
+}
+
+static void cgi_gzip_end(connecttab *c)
+{
+	if (!(c->cgi_flags & CGI_GZIP))
+		return;
+
+	deflateEnd(&c->zs);
+	free(c->zs_output_head);
+	c->zs_output_head = NULL;
+	c->cgi_flags &= ~CGI_GZIP;
+}
+
+/* Deflate the backend output into the next chunk, the last one at eof */
+static int cgi_gzip(connecttab *c, int eof)
+{
+	char *head = c->zs_output_head;
+	char size[16];
+	size_t len;
+	char *in;
+
+	in = backend_output(c->backend, &len);
+	c->zs.next_in   = (Bytef *)in;
+	c->zs.avail_in  = len;
+	c->zs.next_out  = (Bytef *)head + CHUNK_HEAD;
+	c->zs.avail_out = ZLIB_OUTPUT_BUF_SIZE - CHUNK_HEAD - CHUNK_TAIL;
+
+	/* Sync, not to hold back output of a slow program */
+	c->zs_state = deflate(&c->zs, eof ? Z_FINISH : Z_SYNC_FLUSH);
+	if (c->zs_state != Z_OK && c->zs_state != Z_STREAM_END && c->zs_state != Z_BUF_ERROR)
+		return -1;
+	backend_consume(c->backend, len - c->zs.avail_in);
+
+	len = (char *)c->zs.next_out - head - CHUNK_HEAD;
+	if (!len) {
+		c->zs.next_out = (Bytef *)head;
+		return 0;
+	}
+
+	snprintf(size, sizeof(size), "%06x\r\n", (unsigned int)len);
+	memcpy(head, size, CHUNK_HEAD);
+	memcpy(c->zs.next_out, "\r\n", 2);
+	c->zs.next_out += 2;
+	if (c->zs_state == Z_STREAM_END) {
+		memcpy(c->zs.next_out, "0\r\n\r\n", 5);
+		c->zs.next_out += 5;
+	}
+
+	return 0;
+}
+#endif /* HAVE_ZLIB_H */
+
+static void cgi_done(connecttab *c, struct timeval *tv, int err)
+{
+	struct httpd_conn *hc = c->hc;
+	int released = 0;
+
+#ifdef HAVE_ZLIB_H
+	cgi_gzip_end(c);
+#endif
+
+	if (c->backend) {
+		cgi_watch_backend(c, -1);
+		backend_put(c->backend);
+		c->backend = NULL;
+		cgi_unlink(&cgi_active, c);
+		released = 1;
+	} else {
+		fastcgi_dequeue(c);
+	}
+
+	/* Request body not read, cannot keep-alive, linger instead */
+	if (!(c->cgi_flags & CGI_STDIN_DONE)) {
+		hc->do_keep_alive = 0;
+		hc->should_linger = 1;
+	}
+
+	if (c->cgi_flags & CGI_HEADERS) {
+		/* Sent, or partially sent, no way to take it back */
+		hc->responselen = 0;
+		if (err)
+			hc->do_keep_alive = 0;
+
+		/* Body shorter than its Content-Length, only closing tells */
+		if (c->cgi_length >= 0 && hc->bytes_sent < c->cgi_length && hc->method != METHOD_HEAD)
+			hc->do_keep_alive = 0;
+	} else if (err) {
+		hc->do_keep_alive = 0;
+		httpd_send_err(hc, 502, httpd_err502title, "", httpd_err502form, hc->encodedurl);
+	}
+
+	/* Events already returned by fdwatch for this round are stale now */
+	c->cgi_round = rounds;
+
+	/* clear_connection() expects the client socket to be watched */
+	cgi_watch_client(c, FDW_READ);
+	finish_connection(c, tv);
+
+	if (released)
+		fastcgi_next(tv);
+}
+
+static void handle_cgi(connecttab *c, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+	struct backend *b = c->backend;
+	struct iovec iov[2];
+	char buf[8192];
+	size_t len, hdr;
+	ssize_t n;
+	char *out;
+	int err = 1;
+	int cnt, rc;
+
+	/* Still waiting for a backend connection */
+	if (!b)
+		return;
+
+	c->active_at = tv->tv_sec;
+	c->cgi_flags &= ~(CGI_BLOCKED | CGI_WAITING);
+
+	/* Request body, from the client to the backend */
+	rc = backend_send(b);
+	while (rc > 0 && !(c->cgi_flags & CGI_STDIN_DONE)) {
+		n = httpd_read(hc, buf, MIN(sizeof(buf), hc->contentlength - c->cgi_body));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (c->cgi_watch == FDW_READ)
+				fdwatch_drained_fd(hc->conn_fd);
+			break;
+		}
+		if (n <= 0)
+			goto client;
+
+		backend_stdin(b, buf, n);
+		c->cgi_body += n;
+		if (c->cgi_body >= hc->contentlength) {
+			backend_stdin(b, NULL, 0);
+			c->cgi_flags |= CGI_STDIN_DONE;
+		}
+		rc = backend_send(b);
+	}
+	if (rc < 0)
+		goto fail;
+	if (rc == 0)
+		c->cgi_flags |= CGI_BLOCKED;
+
+	/* Response headers, from the backend */
+	rc = backend_recv(b);
+	if (rc < 0)
+		goto fail;
+
+	if (!(c->cgi_flags & CGI_HEADERS)) {
+		out = backend_output(b, &len);
+		for (hdr = 0; hdr < len; hdr++) {
+			if (out[hdr] != '\n')
+				continue;
+			if (hdr + 1 < len && out[hdr + 1] == '\n')
+				break;
+			if (hdr + 2 < len && out[hdr + 1] == '\r' && out[hdr + 2] == '\n') {
+				hdr++;
+				break;
+			}
+		}
+
+		if (hdr >= len) {
+			if (rc > 0 || len >= CGI_MAX_HEADERS)
+				goto fail;
+			goto watch;
+		}
+
+		hdr += 2;
+		if (httpd_cgi_response(hc, out, hdr, &c->cgi_length) < 0)
+			goto fail;
+#ifdef HAVE_ZLIB_H
+		if (hc->compression_type == COMPRESSION_GZIP && cgi_gzip_init(c)) {
+			hc->responselen = 0;
+			goto fail;
+		}
+#endif
+
+		backend_consume(b, hdr);
+		c->cgi_flags |= CGI_HEADERS;
+		c->cgi_sent = 0;
+	}
+
+	/* Pass on response headers and body to the client */
+	for (;;) {
+#ifdef HAVE_ZLIB_H
+		if (c->cgi_flags & CGI_GZIP) {
+			/* The chunk being sent, or else the next one */
+			out = c->zs_output_head;
+			len = (char *)c->zs.next_out - out;
+			if (!len && c->zs_state != Z_STREAM_END) {
+				if (cgi_gzip(c, rc > 0))
+					goto fail;
+				len = (char *)c->zs.next_out - out;
+			}
+		} else
+#endif
+		{
+			out = backend_output(b, &len);
+			if (hc->method == METHOD_HEAD) {
+				backend_consume(b, len);
+				len = 0;
+			}
+
+			/* Never more than the Content-Length, the rest is dropped */
+			if (c->cgi_length >= 0 && (off_t)len > c->cgi_length - hc->bytes_sent) {
+				size_t left = c->cgi_length - hc->bytes_sent;
+
+				if (!left)
+					backend_consume(b, len);
+				len = left;
+			}
+		}
+
+		cnt = 0;
+		if (c->cgi_sent < hc->responselen) {
+			iov[cnt].iov_base = &hc->response[c->cgi_sent];
+			iov[cnt].iov_len  = hc->responselen - c->cgi_sent;
+			cnt++;
+		}
+		if (len > 0) {
+			iov[cnt].iov_base = out;
+			iov[cnt].iov_len  = len;
+			cnt++;
+		}
+
+		if (!cnt) {
+			if (rc > 0)
+				break;
+
+			/* All sent, anything more from the backend? */
+			rc = backend_recv(b);
+			if (rc < 0)
+				goto fail;
+
+			/* Deflated, the end of output is a chunk of its own */
+			out = backend_output(b, &len);
+			if (!len && !(rc > 0 && (c->cgi_flags & CGI_GZIP)))
+				break;
+			continue;
+		}
+
+		n = httpd_writev(hc, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (c->cgi_watch == FDW_WRITE)
+					fdwatch_drained_fd(hc->conn_fd);
+				c->cgi_flags |= CGI_WAITING;
+				break;
+			}
+			goto client;
+		}
+
+		if (!timerisset(&hc->t_first))
+			tmr_prepare_timeval(&hc->t_first);
+		hdr = MIN((size_t)n, hc->responselen - c->cgi_sent);
+		c->cgi_sent += hdr;
+#ifdef HAVE_ZLIB_H
+		if (c->cgi_flags & CGI_GZIP) {
+			memmove(out, out + n - hdr, len - (n - hdr));
+			c->zs.next_out -= n - hdr;
+		} else
+#endif
+			backend_consume(b, n - hdr);
+		hc->bytes_sent += n - hdr;
+	}
+
+	if (rc > 0 && !(c->cgi_flags & CGI_WAITING)) {
+		cgi_done(c, tv, 0);
+		return;
+	}
+
+watch:
+	if (c->cgi_flags & CGI_WAITING)
+		cgi_watch_client(c, FDW_WRITE);
+	else if (!(c->cgi_flags & (CGI_STDIN_DONE | CGI_BLOCKED)))
+		cgi_watch_client(c, FDW_READ);
+	else
+		cgi_watch_client(c, -1);
+
+	if (c->cgi_flags & CGI_BLOCKED)
+		cgi_watch_backend(c, FDW_WRITE);
+	else if (rc == 0 && !(c->cgi_flags & CGI_WAITING))
+		cgi_watch_backend(c, FDW_READ);
+	else
+		cgi_watch_backend(c, -1);
+	return;
+
+client:
+	/* Client went away, or some other error on its socket */
+	hc->should_linger = 0;
+	err = 0;
+	c->cgi_flags |= CGI_HEADERS;
+fail:
+	hc->do_keep_alive = 0;
+	cgi_done(c, tv, err);
+}
+
+/* Any part of the request body already read, pipelined requests may
+** follow it, see httpd_reset_conn().  Returns its length.
+*/
+static size_t cgi_buffered(connecttab *c)
+{
+	struct httpd_conn *hc = c->hc;
+	size_t len = 0;
+
+	if (hc->read_idx > hc->checked_idx)
+		len = MIN(hc->read_idx - hc->checked_idx, hc->contentlength);
+	if (hc->contentlength > 0 && hc->checked_idx + len < hc->read_idx)
+		hc->pipelined_idx = hc->checked_idx + len;
+	c->cgi_body = len;
+
+	return len;
+}
+
+/* Start request with b, the buffered part of the body is already queued */
+static void cgi_begin(connecttab *c, struct backend *b, struct timeval *tv)
+{
+	if (c->cgi_body >= c->hc->contentlength) {
+		backend_stdin(b, NULL, 0);
+		c->cgi_flags |= CGI_STDIN_DONE;
+	}
+
+	handle_cgi(c, tv);
+}
+
+static void cgi_init(connecttab *c, struct timeval *tv)
+{
+	c->conn_state = CNST_CGI;
+	c->active_at = tv->tv_sec;
+	c->backend = NULL;
+	c->cgi_watch = FDW_READ;
+	c->cgi_bwatch = -1;
+	c->cgi_flags = 0;
+	c->cgi_body = 0;
+	c->cgi_sent = 0;
+	c->cgi_length = -1;
+	c->cgi_next = NULL;
+}
+
+static void cgi_attach(connecttab *c, struct backend *b)
+{
+	c->backend = b;
+	c->cgi_next = cgi_active;
+	cgi_active = c;
+}
+
+static void fastcgi_begin(connecttab *c, struct backend *b, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+	char **envp;
+	size_t len;
+
+	cgi_attach(c, b);
+	envp = httpd_fastcgi_envp(hc);
+	if (!envp) {
+		cgi_done(c, tv, 1);
+		return;
+	}
+
+	len = cgi_buffered(c);
+	fcgi_begin(b, envp, &hc->read_buf[hc->checked_idx], len);
+	httpd_fastcgi_envp_free(envp);
+
+	cgi_begin(c, b, tv);
+}
+
+/* Start queued requests, on as many idle backend connections there are */
+static void fastcgi_next(struct timeval *tv)
+{
+	struct backend *b;
+	connecttab *c;
+
+	while (fcgi_wait_head) {
+		b = fcgi_get();
+		if (!b && errno == EAGAIN)
+			break;
+
+		c = fcgi_wait_head;
+		fastcgi_dequeue(c);
+		if (!b)
+			cgi_done(c, tv, 1);
+		else
+			fastcgi_begin(c, b, tv);
+	}
+}
+
+static void start_fastcgi(connecttab *c, struct timeval *tv)
+{
+	struct backend *b = NULL;
+
+	cgi_init(c, tv);
+
+	/* First come, first served */
+	if (!fcgi_wait_head)
+		b = fcgi_get();
+	if (!b && (fcgi_wait_head || errno == EAGAIN)) {
+		if (fcgi_wait_tail)
+			fcgi_wait_tail->cgi_next = c;
+		else
+			fcgi_wait_head = c;
+		fcgi_wait_tail = c;
+		cgi_watch_client(c, -1);
+		return;
+	}
+	if (!b) {
+		cgi_done(c, tv, 1);
+		return;
+	}
+
+	fastcgi_begin(c, b, tv);
+}
+
+/* Stream stdin and stdout of a forked CGI program, see cgi() */
+static void start_cgi(connecttab *c, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+	struct backend *b;
+	size_t len;
+
+	cgi_init(c, tv);
+	b = backend_open(hc->cgi_fd);
+	if (!b) {
+		close(hc->cgi_fd);
+		hc->cgi_fd = -1;
+		cgi_done(c, tv, 1);
+		return;
+	}
+	hc->cgi_fd = -1;
+
+	cgi_attach(c, b);
+	len = cgi_buffered(c);
+	if (len)
+		backend_stdin(b, &hc->read_buf[hc->checked_idx], len);
+
+	cgi_begin(c, b, tv);
+}
+
+
+static void start_buffered(connecttab *c, struct timeval *tv);
+static void start_response(connecttab *c, struct timeval *tv);
+#ifdef ENABLE_HTTP2
+static void start_h2(connecttab *c, struct timeval *tv);
+#endif
+
+/* Wait for the listing to be built by the child, in the meantime the
+** client connection is not watched, like a paused one.
+*/
+static void start_listing(connecttab *c, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+
+	c->conn_state = CNST_LISTING;
+	c->active_at = tv->tv_sec;
+	fdwatch_del_fd(hc->conn_fd);
+	fdwatch_add_fd(hc->ls_fd, c, FDW_READ);
+}
+
+
+static void handle_listing(connecttab *c, struct timeval *tv)
+{
+	int rc;
+
+	rc = httpd_ls_read(c->hc, tv);
+	if (rc == 0)
+		return;
+
+	stop_listing(c);
+	c->conn_state = CNST_READING;
+	c->active_at = tv->tv_sec;
+	if (rc < 0)
+		finish_connection(c, tv);
+	else
+		start_response(c, tv);
+}
+
+
+/* A request we could not make sense of, or too large to read.  It is
+** logged and accounted as any other, in the oldest protocol we speak.
+*/
+static void bad_request(connecttab *c, struct timeval *tv)
+{
+	c->req_at = *tv;
+	c->hc->protocol = "HTTP/1.0";
+	httpd_send_err(c->hc, 400, httpd_err400title, "", httpd_err400form, "");
+	finish_connection(c, tv);
+}
+
+static void handle_request(connecttab *c, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+
+#ifdef ENABLE_HTTP2
+	/* HTTP/2 over cleartext, with prior knowledge, no Upgrade: h2c */
+	if (do_http2 && !hc->ssl) {
+		switch (h2_preface(hc->read_buf, hc->read_idx)) {
+		case 1:
+			start_h2(c, tv);
+			return;
+
+		case -1:
+			return;		/* Need more to tell */
+		}
+	}
+#endif
+
+	/* Do we have a complete request yet? */
+	switch (httpd_got_request(hc)) {
+	case GR_NO_REQUEST:
+		return;
+
+	case GR_BAD_REQUEST:
+		bad_request(c, tv);
+		return;
+	}
+
+	/* Got a request, start the clock and stop the keep-alive timer */
+	c->req_at = *tv;
+	if (c->linger_timer) {
+		tmr_cancel(c->linger_timer);
+		c->linger_timer = NULL;
+	}
+
+	/* Must tell libhttpd if we can deflate files */
+#ifdef HAVE_ZLIB_H
+	hc->has_deflate = compression_level != 0;
+#else
+	hc->has_deflate = 0;
+#endif
 
 	/* Yes.  Try parsing and resolving it. */
 	if (httpd_parse_request(hc) < 0) {
@@ -726,8 +2190,15 @@ static void handle_read(connecttab *c, struct timeval *tv)
 		return;
 	}
 
+	/* Built-in stats endpoint, not subject to throttling */
+	if (is_stats(hc)) {
+		send_stats(hc, tv);
+		start_buffered(c, tv);
+		return;
+	}
+
 	/* Check the throttle table */
-	if (!check_throttles(c)) {
+	if (!check_throttles(c, hc)) {
 		httpd_send_err(hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl);
 		finish_connection(c, tv);
 		return;
@@ -740,6 +2211,56 @@ static void handle_read(connecttab *c, struct timeval *tv)
 		return;
 	}
 
+	/* Handed over to the FastCGI backend, or a CGI program */
+	if (hc->fastcgi) {
+		start_fastcgi(c, tv);
+		return;
+	}
+	if (hc->cgi_fd >= 0) {
+		start_cgi(c, tv);
+		return;
+	}
+
+	/* Directory listing to be built first */
+	if (hc->ls_fd >= 0) {
+		start_listing(c, tv);
+		return;
+	}
+
+	start_response(c, tv);
+}
+
+
+/* The whole response, body too, is in hc->response, too large to be sure
+** to go out in a single write.  So handle_send() writes it, resuming any
+** partial write like it does for the headers of a file.
+*/
+static void start_buffered(connecttab *c, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+
+	c->next_byte_index = c->end_byte_index = 0;
+	if (!hc->responselen) {
+		finish_connection(c, tv);
+		return;
+	}
+
+	c->conn_state = CNST_SENDING;
+	c->tokens = 0;
+	c->tokens_at = *tv;
+	if (c->max_limit != THROTTLE_NOLIMIT)
+		c->tokens = throttle_slice(c);
+#ifdef USE_WOULDBLOCK_DELAY
+	c->wouldblock_delay = 0;
+#endif
+	fdwatch_mod_fd(hc->conn_fd, c, FDW_WRITE);
+}
+
+/* The response is started, set up sending the body, if any */
+static void start_response(connecttab *c, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+
 	/* Fill in end_byte_index. */
 	if (hc->got_range) {
 		c->next_byte_index = hc->first_byte_index;
@@ -751,7 +2272,7 @@ static void handle_read(connecttab *c, struct timeval *tv)
 	}
 
 	/* Check if it's already handled. */
-	if (!hc->file_address) {
+	if (!hc->file_address && hc->file_fd < 0) {
 		/* No file address means someone else is handling it. */
 		int tind;
 
@@ -771,8 +2292,13 @@ static void handle_read(connecttab *c, struct timeval *tv)
 
 	/* Cool, we have a valid connection and a file to send to it. */
 	c->conn_state = CNST_SENDING;
-	c->started_at = tv->tv_sec;
+	c->tokens = 0;
+	c->tokens_at = *tv;
+	if (c->max_limit != THROTTLE_NOLIMIT)
+		c->tokens = throttle_slice(c);
+#ifdef USE_WOULDBLOCK_DELAY
 	c->wouldblock_delay = 0;
+#endif
 
 #ifdef HAVE_ZLIB_H
 	if (hc->compression_type != COMPRESSION_NONE) {
@@ -783,53 +2309,299 @@ static void handle_read(connecttab *c, struct timeval *tv)
 		c->zs.zfree  = Z_NULL;
 		c->zs.opaque = Z_NULL;
 
-		/* setup zlib input file to mmap'ed location */
-		c->zs.next_in  = (Bytef *)c->hc->file_address;
-		c->zs.avail_in = c->hc->sb.st_size;
+		/* zlib input is fed one file window at a time from handle_send() */
+		c->zs.next_in  = Z_NULL;
+		c->zs.avail_in = 0;
+		c->zs_in  = 0;
+		c->zs_crc = crc32(0L, Z_NULL, 0);
+
+		/* allocate memory for output buffer, if it's not already allocated */
+		if (!c->zs_output_head) {
+			c->zs_output_head = malloc(ZLIB_OUTPUT_BUF_SIZE + 8);
+			if (!c->zs_output_head) {
+				syslog(LOG_CRIT, "out of memory allocating deflate buffer");
+				exit(1);
+			}
+		}
+
+		if (hc->compression_type == COMPRESSION_GZIP) {
+			/* add gzip header to output file */
+			sprintf(c->zs_output_head, "%c%c%c%c%c%c%c%c%c%c",
+				0x1f, 0x8b,
+				Z_DEFLATED,
+				0 /*flags*/,
+#if 0 /* Seems to be optional according to https://tools.ietf.org/html/rfc1952 */
+				&c->hc->sb.st_mtime, /* XXX: use a more transportable implementation! */
+				&c->hc->sb.st_mtime + 1,
+				&c->hc->sb.st_mtime + 2,
+				&c->hc->sb.st_mtime + 3,
+#else
+				0, 0, 0, 0,
+#endif
+				0 /*xflags*/,
+				0x03);
+
+			c->zs.next_out  = c->zs_output_head + 10 ;
+			c->zs.avail_out = ZLIB_OUTPUT_BUF_SIZE - 10;
+		}
+
+		/* call the initialization for zlib with negative window
+		** size to omit the "deflate" prefix
+		*/
+		c->zs_state = deflateInit2(&c->zs, compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+		if (c->zs_state != Z_OK) {
+			syslog(LOG_CRIT, "zlib deflateInit2() failed!");
+			exit(1);
+		}
+	}
+#endif /* HAVE_ZLIB_H */
+
+	fdwatch_mod_fd(hc->conn_fd, c, FDW_WRITE);
+}
+
+
+static void handle_read(connecttab *c, struct timeval *tv)
+{
+	int sz;
+	struct httpd_conn *hc = c->hc;
+
+	/* Is there room in our buffer to read more bytes? */
+	if (hc->read_idx >= hc->read_size) {
+		if (hc->read_size > 5000) {
+			bad_request(c, tv);
+			return;
+		}
+		httpd_realloc_str(&hc->read_buf, &hc->read_size, hc->read_size + 1000);
+	}
+
+	/* Read some more bytes. */
+	sz = httpd_read(hc, &(hc->read_buf[hc->read_idx]), hc->read_size - hc->read_idx);
+	if (sz == 0) {
+//		if (!hc->do_keep_alive)
+//			httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "");
+		if (hc->do_keep_alive)
+			hc->do_keep_alive--;
+
+		c->active_at = tv->tv_sec;
+		finish_connection(c, tv);
+		return;
+	}
+
+	if (sz < 0) {
+		/* Ignore EINTR and EAGAIN.  Also ignore EWOULDBLOCK.  At first glance
+		** you would think that connections returned by fdwatch as readable
+		** should never give an EWOULDBLOCK; however, this apparently can
+		** happen if a packet gets garbled.
+		*/
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			fdwatch_drained_fd(hc->conn_fd);
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+
+//		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "");
+		finish_connection(c, tv);
+		return;
+	}
+
+	hc->read_idx += sz;
+	c->active_at = tv->tv_sec;
+	if (!timerisset(&hc->t_start))
+		hc->t_start = *tv;
+
+	handle_request(c, tv);
+}
+
+
+/* Answer pipelined requests, already read, back to back.  A slot may have
+** been cleared, even reused, after it was queued, then there's nothing in
+** read_buf and handle_request() returns right away.
+*/
+static void handle_pipelined(struct timeval *tv)
+{
+	while (pipeline_head) {
+		connecttab *c = pipeline_head;
+
+		pipeline_head = c->pipeline_next;
+		c->pipelined = 0;
+		if (c->conn_state == CNST_READING) {
+			c->active_at = tv->tv_sec;
+			handle_request(c, tv);
+		}
+	}
+}
+
+
+#ifdef ENABLE_HTTP2
+/*
+** HTTP/2 connections, see h2.c.  Each stream is a request of its own,
+** parsed and started by libhttpd, then logged and accounted when the
+** stream is closed.  Throttling is per connection, set up by the first
+** stream that matches a throttle, all streams share its token bucket.
+*/
+static void handle_h2(connecttab *c, struct timeval *tv);
+
+static int h2_request(struct httpd_conn *hc, void *arg, struct timeval *tv)
+{
+	connecttab *c = arg;
+
+	/* Must tell libhttpd if we can deflate files */
+#ifdef HAVE_ZLIB_H
+	hc->has_deflate = compression_level != 0;
+#else
+	hc->has_deflate = 0;
+#endif
+
+	/* An error response is already set up */
+	if (httpd_parse_request(hc) < 0)
+		return 0;
+
+	/* Built-in stats endpoint, not subject to throttling */
+	if (is_stats(hc)) {
+		send_stats(hc, tv);
+		return 0;
+	}
+
+	if (!c->numtnums) {
+		if (!check_throttles(c, hc)) {
+			clear_throttles(c, tv);
+			httpd_send_err(hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl);
+			return 0;
+		}
+		if (c->numtnums) {
+			c->tokens = throttle_slice(c);
+			c->tokens_at = *tv;
+			if (c->h2)
+				h2_throttle(c->h2, (long)c->tokens);
+		}
+	}
+
+	/* CGI and uncached directory listings, the client retries those */
+	if (httpd_start_request(hc, tv) > 0)
+		return H2_HTTP11;
+
+	return 0;
+}
+
+static void h2_done(struct httpd_conn *hc, void *arg, struct timeval *tv)
+{
+	stats_bytes += hc->bytes_sent;
+	if (timerisset(&hc->t_headers))
+		account(hc, &hc->t_headers, tv);
+}
+
+static void wakeup_h2(arg_t arg, struct timeval *now)
+{
+	connecttab *c;
+
+	c = (connecttab *)arg.p;
+	c->wakeup_timer = NULL;
+	handle_h2(c, now);
+}
+
+static void start_h2(connecttab *c, struct timeval *tv)
+{
+	static const struct h2_ops ops = { h2_request, h2_done };
+
+	c->conn_state = CNST_H2;
+	c->max_limit = c->min_limit = THROTTLE_NOLIMIT;
+	c->tokens = 0;
+	c->tokens_at = *tv;
+	if (c->linger_timer) {
+		tmr_cancel(c->linger_timer);
+		c->linger_timer = NULL;
+	}
+
+	c->h2 = h2_open(c->hc, &ops, c, tv);
+	if (!c->h2) {
+		syslog(LOG_ERR, "%s failed starting HTTP/2", httpd_client(c->hc));
+		clear_connection(c, tv);
+		return;
+	}
+
+	c->h2_rw = H2_READ;
+	fdwatch_mod_fd(c->hc->conn_fd, c, FDW_READ);
+	handle_h2(c, tv);
+}
+
+static void handle_h2(connecttab *c, struct timeval *tv)
+{
+	size_t sent = 0;
+	int tind, rw;
+
+	if (c->numtnums > 0) {
+		throttle_refill(c, tv);
+		h2_throttle(c->h2, c->tokens >= 1 ? (long)c->tokens : 0);
+	}
+
+	rw = h2_io(c->h2, &sent, tv);
+	if (rw == H2_CLOSE) {
+		clear_connection(c, tv);
+		return;
+	}
+	c->active_at = tv->tv_sec;
+
+	if (c->numtnums > 0) {
+		c->tokens -= sent;
+		for (tind = 0; tind < c->numtnums; ++tind)
+			throttles[c->tnums[tind]].bytes_since_avg += sent;
 
-		/* allocate memory for output buffer, if it's not already allocated */
-		if (!c->zs_output_head) {
-			c->zs_output_head = malloc(ZLIB_OUTPUT_BUF_SIZE + 8);
-			if (!c->zs_output_head) {
-				syslog(LOG_CRIT, "out of memory allocating deflate buffer");
+		/* Streams wait until the bucket holds a slice again */
+		if (c->tokens < 1 && !c->wakeup_timer) {
+			arg_t arg;
+
+			arg.p = c;
+			c->wakeup_timer = tmr_create(tv, wakeup_h2, arg, throttle_delay(c), 0);
+			if (!c->wakeup_timer) {
+				syslog(LOG_CRIT, "tmr_create(wakeup_h2) failed");
 				exit(1);
 			}
 		}
+	}
 
-		if (hc->compression_type == COMPRESSION_GZIP) {
-			/* add gzip header to output file */
-			sprintf(c->zs_output_head, "%c%c%c%c%c%c%c%c%c%c",
-				0x1f, 0x8b,
-				Z_DEFLATED,
-				0 /*flags*/,
-#if 0 /* Seems to be optional according to https://tools.ietf.org/html/rfc1952 */
-				&c->hc->sb.st_mtime, /* XXX: use a more transportable implementation! */
-				&c->hc->sb.st_mtime + 1,
-				&c->hc->sb.st_mtime + 2,
-				&c->hc->sb.st_mtime + 3,
-#else
-				0, 0, 0, 0,
-#endif
-				0 /*xflags*/,
-				0x03);
+	if (rw != c->h2_rw) {
+		fdwatch_mod_fd(c->hc->conn_fd, c, rw == H2_WRITE ? FDW_WRITE : FDW_READ);
+		c->h2_rw = rw;
+	}
+}
+#endif /* ENABLE_HTTP2 */
 
-			c->zs.next_out  = c->zs_output_head + 10 ;
-			c->zs.avail_out = ZLIB_OUTPUT_BUF_SIZE - 10;
-		}
 
-		/* call the initialization for zlib with negative window
-		** size to omit the "deflate" prefix
-		*/
-		c->zs_state = deflateInit2(&c->zs, compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-		if (c->zs_state != Z_OK) {
-			syslog(LOG_CRIT, "zlib deflateInit2() failed!");
-			exit(1);
+static void handle_handshake(connecttab *c, struct timeval *tv)
+{
+	struct httpd_conn *hc = c->hc;
+
+	switch (httpd_ssl_handshake(hc)) {
+	case HS_DONE:
+#ifdef ENABLE_HTTP2
+		if (httpd_ssl_h2(hc)) {
+			c->active_at = tv->tv_sec;
+			start_h2(c, tv);
+			break;
 		}
-	}
-#endif /* HAVE_ZLIB_H */
+#endif
+		c->conn_state = CNST_READING;
+		c->active_at = tv->tv_sec;
+		fdwatch_mod_fd(hc->conn_fd, c, FDW_READ);
 
-	fdwatch_del_fd(hc->conn_fd);
-	fdwatch_add_fd(hc->conn_fd, c, FDW_WRITE);
+		/* The request may already be buffered, try reading it now */
+		handle_read(c, tv);
+		break;
+
+	case HS_WANT_READ:
+		fdwatch_mod_fd(hc->conn_fd, c, FDW_READ);
+		fdwatch_drained_fd(hc->conn_fd);
+		break;
+
+	case HS_WANT_WRITE:
+		fdwatch_mod_fd(hc->conn_fd, c, FDW_WRITE);
+		fdwatch_drained_fd(hc->conn_fd);
+		break;
+
+	default:
+		hc->do_keep_alive = 0;
+		clear_connection(c, tv);
+		break;
+	}
 }
 
 
@@ -837,50 +2609,125 @@ static void handle_send(connecttab *c, struct timeval *tv)
 {
 	size_t max_bytes;
 	ssize_t sz = -1;
-	int coast;
-	arg_t arg;
-	time_t elapsed;
 	struct httpd_conn *hc = c->hc;
+	struct timeval first;
 	int tind;
 
 	if (c->max_limit == THROTTLE_NOLIMIT)
 		max_bytes = 1000000000L;
-	else
-		max_bytes = c->max_limit / 4;	/* send at most 1/4 seconds worth */
+	else {
+		/* Send what the token bucket holds, refilled since last time */
+		throttle_refill(c, tv);
+		if (c->tokens < 1) {
+			pause_connection(c, tv, throttle_delay(c));
+			return;
+		}
+		max_bytes = c->tokens;
+	}
 
-	if (hc->compression_type == COMPRESSION_NONE) {
-		/* Do we need to write the headers first? */
-		if (hc->responselen == 0) {
-			/* No, just write the file. */
-			sz = httpd_write(hc, &(hc->file_address[c->next_byte_index]),
-					 MIN(c->end_byte_index - c->next_byte_index, (off_t)max_bytes));
+	/* The first write may be the whole file, the response starts before it */
+	timerclear(&first);
+	if (!timerisset(&hc->t_first))
+		tmr_prepare_timeval(&first);
+
+#ifdef USE_SENDFILE
+	if (hc->use_sendfile) {
+		off_t off = c->next_byte_index;
+		size_t len = MIN(c->end_byte_index - c->next_byte_index, (off_t)max_bytes);
+
+		/* Headers first, MSG_MORE holds them back to coalesce with the file */
+		if (hc->responselen > 0) {
+			if (hc->ssl)
+				sz = httpd_write(hc, hc->response, hc->responselen);
+			else
+				sz = send(hc->conn_fd, hc->response, hc->responselen, MSG_MORE);
+			if (sz == (ssize_t)hc->responselen) {
+				ssize_t n;
+
+				if (hc->ssl)
+					n = httpd_ssl_sendfile(hc, hc->file_fd, off, len);
+				else
+					n = sendfile(hc->conn_fd, hc->file_fd, &off, len);
+				if (n == 0 && len > 0) {
+					syslog(LOG_ERR, "file %s truncated while sending", hc->expnfilename);
+					clear_connection(c, tv);
+					return;
+				}
+				if (n > 0)
+					sz += n;
+			}
 		} else {
-			/* Yes.  We'll combine headers and file into a single writev(),
-			** hoping that this generates a single packet.
-			*/
-			struct iovec iv[2];
+			if (hc->ssl)
+				sz = httpd_ssl_sendfile(hc, hc->file_fd, off, len);
+			else
+				sz = sendfile(hc->conn_fd, hc->file_fd, &off, len);
+			if (sz == 0 && len > 0) {
+				/* EOF before end_byte_index, file was truncated */
+				syslog(LOG_ERR, "file %s truncated while sending", hc->expnfilename);
+				clear_connection(c, tv);
+				return;
+			}
+		}
+	} else
+#endif
+	if (hc->compression_type == COMPRESSION_NONE) {
+		size_t len = MIN(c->end_byte_index - c->next_byte_index, (off_t)max_bytes);
+		struct iovec iv[MAX_SEND_IOV];
+		int n = 0, num;
 
-			iv[0].iov_base = hc->response;
-			iv[0].iov_len = hc->responselen;
-			iv[1].iov_base = &(hc->file_address[c->next_byte_index]);
-			iv[1].iov_len = MIN(c->end_byte_index - c->next_byte_index, (off_t)max_bytes);
-			sz = httpd_writev(hc, iv, 2);
+		/* Do we need to write the headers first?  If so we combine
+		** headers and file into a single writev(), hoping that this
+		** generates a single packet.
+		*/
+		if (hc->responselen > 0) {
+			iv[n].iov_base = hc->response;
+			iv[n++].iov_len = hc->responselen;
+		}
+
+		/* The file, its cached gzip copy (see mmc_gzip()), or the slices
+		** and part headers of a multipart/byteranges response.  Nothing
+		** but the response, see start_buffered().
+		*/
+		num = 0;
+		if (hc->file_address || hc->file_fd >= 0)
+			num = httpd_body_iov(hc, c->next_byte_index, len, &iv[n], NELEMS(iv) - n);
+		if (num < 0) {
+			clear_connection(c, tv);
+			return;
 		}
+		sz = httpd_writev(hc, iv, n + num);
 #ifdef HAVE_ZLIB_H
 	} else {
 		int iv_count;
 		struct iovec iv[2];
 
 		/* call deflate only if necessary */
-		if ((c->zs_state == Z_OK) && (c->zs.avail_out > 0)) {
-			c->zs_state = deflate(&c->zs, Z_FINISH);
+		while ((c->zs_state == Z_OK) && (c->zs.avail_out > 0)) {
+			/* refill input from the next window of the file, if needed */
+			if (c->zs.avail_in == 0 && c->zs_in < hc->sb.st_size) {
+				size_t len;
+				char *addr;
+
+				addr = httpd_file_window(hc, c->zs_in, &len);
+				if (!addr) {
+					clear_connection(c, tv);
+					return;
+				}
+				len = MIN(len, FILE_WINDOW_SIZE);
+
+				c->zs.next_in  = (Bytef *)addr;
+				c->zs.avail_in = len;
+				c->zs_crc = crc32(c->zs_crc, (Bytef *)addr, len);
+				c->zs_in += len;
+			}
+
+			c->zs_state = deflate(&c->zs, c->zs_in < hc->sb.st_size ? Z_NO_FLUSH : Z_FINISH);
 
 			/* when zlib claims to be done, add the suffix info */
 			if (c->zs_state == Z_STREAM_END) {
-				uLong crc = crc32(0L, Z_NULL, 0);
+				uLong crc = c->zs_crc;
 
 				/* crc32 must not be converted into network byte order */
-				crc = crc32(crc, (Bytef *)c->hc->file_address, c->hc->sb.st_size);
 				memcpy(c->zs.next_out, &crc, sizeof(uLong));
 				memcpy(c->zs.next_out + 4, &(hc->sb.st_size), 4);
 				c->zs.next_out += 8;
@@ -890,17 +2737,17 @@ static void handle_send(connecttab *c, struct timeval *tv)
 		/* Do we need to write the headers first? */
 		iv_count = 1;
 		iv[0].iov_base = c->zs_output_head;
-		iv[0].iov_len = c->zs.next_out - (Bytef *)c->zs_output_head;
+		iv[0].iov_len = MIN(c->zs.next_out - (Bytef *)c->zs_output_head, (off_t)max_bytes);
 
 		if (hc->responselen != 0) {
 			/* Yes.  We'll combine headers and file into a single writev(),
 			** hoping that this generates a single packet.
 			*/
 			iv_count = 2;
+			iv[1].iov_base = iv[0].iov_base;
+			iv[1].iov_len  = iv[0].iov_len;
 			iv[0].iov_base = hc->response;
 			iv[0].iov_len  = hc->responselen;
-			iv[1].iov_base = c->zs_output_head;
-			iv[1].iov_len  = c->zs.next_out - (Bytef *)c->zs_output_head;
 		}
 		sz = httpd_writev(hc, iv, iv_count);
 #endif /* HAVE_ZLIB_H */
@@ -911,7 +2758,13 @@ static void handle_send(connecttab *c, struct timeval *tv)
 		return;
 	}
 
-	if (sz == 0 || (sz < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))) {
+	if (sz < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+#ifndef USE_WOULDBLOCK_DELAY
+		/* Socket buffer is full, wait for the client to catch up.  We
+		** are still watched for FDW_WRITE, edge-triggered if possible.
+		*/
+		fdwatch_drained_fd(hc->conn_fd);
+#else
 		/* This shouldn't happen, but some kernels, e.g.
 		 ** SunOS 4.1.x, are broken and select() says that
 		 ** O_NDELAY sockets are always writable even when
@@ -923,18 +2776,14 @@ static void handle_send(connecttab *c, struct timeval *tv)
 		 ** blocking code, for use with throttling.
 		 */
 		c->wouldblock_delay += MIN_WOULDBLOCK_DELAY;
-		c->conn_state = CNST_PAUSING;
-		fdwatch_del_fd(hc->conn_fd);
-		arg.p = c;
-
-		if (c->wakeup_timer)
-			syslog(LOG_ERR, "replacing non-null wakeup_timer!");
+		pause_connection(c, tv, c->wouldblock_delay);
+#endif
+		return;
+	}
 
-		c->wakeup_timer = tmr_create(tv, wakeup_connection, arg, c->wouldblock_delay, 0);
-		if (!c->wakeup_timer) {
-			syslog(LOG_CRIT, "tmr_create(wakeup_connection) failed");
-			exit(1);
-		}
+	/* Nothing sent, and no EAGAIN to wait for the socket to drain */
+	if (sz == 0) {
+		clear_connection(c, tv);
 		return;
 	}
 
@@ -958,6 +2807,10 @@ static void handle_send(connecttab *c, struct timeval *tv)
 
 	/* Ok, we wrote something. */
 	c->active_at = tv->tv_sec;
+	if (!timerisset(&hc->t_first))
+		hc->t_first = first;
+	if (c->max_limit != THROTTLE_NOLIMIT)
+		c->tokens -= sz;
 	/* Was this a headers + file writev()? */
 	if (hc->responselen > 0) {
 		/* Yes; did we write only part of the headers? */
@@ -982,7 +2835,7 @@ static void handle_send(connecttab *c, struct timeval *tv)
 
 	/* Are we done? */
 	if (c->hc->compression_type == COMPRESSION_NONE) {
-		if (c->next_byte_index >= c->end_byte_index) {
+		if (c->next_byte_index >= c->end_byte_index && !hc->responselen) {
 			/* This connection is finished! */
 			finish_connection(c, tv);
 			return;
@@ -1005,34 +2858,15 @@ static void handle_send(connecttab *c, struct timeval *tv)
 #endif /* HAVE_ZLIB_H */
 	}
 
+#ifdef USE_WOULDBLOCK_DELAY
 	/* Tune the (blockheaded) wouldblock delay. */
 	if (c->wouldblock_delay > MIN_WOULDBLOCK_DELAY)
 		c->wouldblock_delay -= MIN_WOULDBLOCK_DELAY;
+#endif
 
-	/* If we're throttling, check if we're sending too fast. */
-	if (c->max_limit != THROTTLE_NOLIMIT) {
-		elapsed = tv->tv_sec - c->started_at;
-		if (elapsed == 0)
-			elapsed = 1;	/* count at least one second */
-
-		if (c->hc->bytes_sent / elapsed > c->max_limit) {
-			c->conn_state = CNST_PAUSING;
-			fdwatch_del_fd(hc->conn_fd);
-			/* How long should we wait to get back on schedule?  If less
-			 ** than a second (integer math rounding), use 1/2 second.
-			 */
-			coast = c->hc->bytes_sent / c->max_limit - elapsed;
-			arg.p = c;
-			if (c->wakeup_timer)
-				syslog(LOG_ERR, "replacing non-null wakeup_timer!");
-			c->wakeup_timer = tmr_create(tv, wakeup_connection, arg,
-						     coast > 0 ? (coast * 1000L) : 500L, 0);
-			if (!c->wakeup_timer) {
-				syslog(LOG_CRIT, "tmr_create(wakeup_connection) failed");
-				exit(1);
-			}
-		}
-	}
+	/* If we're throttling, wait for the bucket to fill up a slice again. */
+	if (c->max_limit != THROTTLE_NOLIMIT && c->tokens < 1)
+		pause_connection(c, tv, throttle_delay(c));
 	/* (No check on min_limit here, that only controls connection startups.) */
 }
 
@@ -1047,6 +2881,8 @@ static void handle_linger(connecttab *c, struct timeval *tv)
 	*/
 	do {
 		r = httpd_read(c->hc, buf, sizeof(buf));
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			fdwatch_drained_fd(c->hc->conn_fd);
 		if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
 			return;
 	} while (r > 0);
@@ -1064,9 +2900,17 @@ static void idle(arg_t arg, struct timeval *now)
 	for (cnum = 0; cnum < max_connects; ++cnum) {
 		c = &connects[cnum];
 		switch (c->conn_state) {
+		case CNST_HANDSHAKE:
+			if (now->tv_sec - c->active_at >= IDLE_READ_TIMELIMIT) {
+				syslog(LOG_INFO, "%s connection timed out in TLS handshake", httpd_client(c->hc));
+				c->hc->do_keep_alive = 0;
+				clear_connection(c, now);
+			}
+			break;
+
 		case CNST_READING:
 			if (now->tv_sec - c->active_at >= IDLE_READ_TIMELIMIT) {
-				syslog(LOG_INFO, "%s connection timed out reading", c->hc->client_addr.real_ip);
+				syslog(LOG_INFO, "%s connection timed out reading", httpd_client(c->hc));
 //				httpd_send_err(c->hc, 408, httpd_err408title, "", httpd_err408form, "");
 				finish_connection(c, now);
 			}
@@ -1075,22 +2919,76 @@ static void idle(arg_t arg, struct timeval *now)
 		case CNST_SENDING:
 		case CNST_PAUSING:
 			if (now->tv_sec - c->active_at >= IDLE_SEND_TIMELIMIT) {
-				syslog(LOG_INFO, "%s connection timed out sending", c->hc->client_addr.real_ip);
+				syslog(LOG_INFO, "%s connection timed out sending", httpd_client(c->hc));
+				clear_connection(c, now);
+			}
+			break;
+
+		case CNST_CGI:
+			if (now->tv_sec - c->active_at >= CGI_IDLE_TIMELIMIT) {
+				syslog(LOG_INFO, "%s connection timed out waiting for CGI", httpd_client(c->hc));
+				cgi_done(c, now, 1);
+			}
+			break;
+
+		case CNST_LISTING:
+			if (now->tv_sec - c->active_at >= CGI_IDLE_TIMELIMIT) {
+				syslog(LOG_INFO, "%s connection timed out waiting for dirlisting", httpd_client(c->hc));
+				c->hc->do_keep_alive = 0;
+				clear_connection(c, now);
+			}
+			break;
+#ifdef ENABLE_HTTP2
+
+		case CNST_H2:
+			/* Streams sending, or an idle connection */
+			if (now->tv_sec - c->active_at >= (h2_streams(c->h2) ? IDLE_SEND_TIMELIMIT : IDLE_READ_TIMELIMIT)) {
+				syslog(LOG_INFO, "%s HTTP/2 connection timed out", httpd_client(c->hc));
 				clear_connection(c, now);
 			}
 			break;
+#endif
 		}
 	}
 }
 
 
+static void flush_log(arg_t arg, struct timeval *now)
+{
+	alog_flush();
+}
+
 static void occasional(arg_t arg, struct timeval *now)
 {
 	mmc_cleanup(now);
+	write_manifest();
+	stc_cleanup(now);
 	tmr_cleanup();
 	watchdog_flag = 1;	/* let the watchdog know that we are alive */
 }
 
+/* Files from the cache manifest are read in a batch at a time, without
+** holding up connections accepted meanwhile.  The next batch is due a
+** millisecond later, so tmr_run() leaves it for the next round.
+*/
+static void warm_up(arg_t arg, struct timeval *now)
+{
+	if (mmc_warm_up(compression_level, CACHE_WARM_BYTES, now) > 0 &&
+	    !tmr_create(now, warm_up, noarg, 1, 0)) {
+		syslog(LOG_CRIT, "tmr_create(warm_up) failed");
+		exit(1);
+	}
+}
+
+/* Derive the next session ticket key when its period starts */
+static void rotate_tickets(arg_t arg, struct timeval *now)
+{
+	struct httpd_server *hs;
+
+	LIST_FOREACH(hs, server_list)
+		httpd_ssl_rotate(hs->ctx, now->tv_sec);
+}
+
 
 #ifdef STATS_TIME
 static void show_stats(arg_t arg, struct timeval *now)
@@ -1269,6 +3167,202 @@ static void init_signals(void)
 	alarm(OCCASIONAL_TIME * 3);
 }
 
+/* Master process, in prefork mode, forwards signals to its workers. */
+static void handle_master(int signo)
+{
+	switch (signo) {
+	case SIGHUP:
+		got_hup = 1;
+		break;
+
+	case SIGUSR1:
+		got_usr1 = 1;
+		break;
+
+	case SIGUSR2:
+		got_usr2 = 1;
+		break;
+
+	case SIGCHLD:
+		got_chld = 1;
+		break;
+
+	default:
+		got_term = 1;
+		break;
+	}
+}
+
+static void signal_workers(int signo)
+{
+	int i;
+
+	for (i = 0; i < workers; i++) {
+		if (worker_pid[i] > 0)
+			kill(worker_pid[i], signo);
+	}
+}
+
+/* Open one set of listen sockets per worker, before giving up root. */
+static void worker_listen(struct httpd_server *hs)
+{
+	int i;
+
+	worker_pid = calloc(workers, sizeof(pid_t));
+	worker_fd  = calloc(workers, 2 * sizeof(int));
+	if (!worker_pid || !worker_fd) {
+		syslog(LOG_CRIT, "Out of memory allocating worker table");
+		exit(1);
+	}
+
+	worker_fd[0] = hs->listen4_fd;
+	worker_fd[1] = hs->listen6_fd;
+	for (i = 1; i < workers; i++) {
+		if (httpd_listen_again(hs, &worker_fd[2 * i], &worker_fd[2 * i + 1])) {
+			syslog(LOG_CRIT, "Failed opening listen sockets for worker %d", i);
+			exit(1);
+		}
+	}
+}
+
+static pid_t spawn_worker(struct httpd_server *hs, int id)
+{
+	int fd4 = worker_fd[2 * id];
+	int fd6 = worker_fd[2 * id + 1];
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid) {
+		if (pid < 0)
+			syslog(LOG_ERR, "Failed forking worker %d: %s", id, strerror(errno));
+		return pid;
+	}
+
+	/* In the worker, keep only our own listen sockets */
+	for (i = 0; i < 2 * workers; i++) {
+		if (worker_fd[i] != -1 && worker_fd[i] != fd4 && worker_fd[i] != fd6)
+			close(worker_fd[i]);
+	}
+	hs->listen4_fd = fd4;
+	hs->listen6_fd = fd6;
+	worker_id = id;
+
+	return 0;
+}
+
+/* Fork off the workers and supervise them, restarting any that die.
+** Returns only in the workers, the master exits when all are done.
+*/
+static void master(struct httpd_server *hs)
+{
+	int signals[] = { SIGTERM, SIGINT, SIGHUP, SIGUSR1, SIGUSR2, SIGCHLD };
+	struct sigaction sa;
+	sigset_t mask, omask;
+	time_t *started;
+	size_t j;
+	int i, stopping = 0;
+
+	started = calloc(workers, sizeof(time_t));
+	if (!started) {
+		syslog(LOG_CRIT, "Out of memory allocating worker table");
+		exit(1);
+	}
+
+	/* No watchdog for the master, it does not serve anything */
+	alarm(0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_master;
+	sigemptyset(&mask);
+	for (j = 0; j < NELEMS(signals); j++) {
+		sigaction(signals[j], &sa, NULL);
+		sigaddset(&mask, signals[j]);
+	}
+	sigprocmask(SIG_BLOCK, &mask, &omask);
+
+	for (i = 0; i < workers; i++) {
+		worker_pid[i] = spawn_worker(hs, i);
+		if (!worker_pid[i])
+			goto worker;
+		if (worker_pid[i] < 0) {
+			signal_workers(SIGTERM);
+			exit(1);
+		}
+		started[i] = time(NULL);
+	}
+	syslog(LOG_NOTICE, "Started %d worker processes", workers);
+
+	while (1) {
+		pid_t pid;
+		int status;
+
+		sigsuspend(&omask);
+
+		if (got_term || got_usr1) {
+			signal_workers(got_term ? SIGTERM : SIGUSR1);
+			got_term = got_usr1 = 0;
+			stopping = 1;
+		}
+		if (got_hup) {
+			got_hup = 0;
+			signal_workers(SIGHUP);
+		}
+		if (got_usr2) {
+			got_usr2 = 0;
+			signal_workers(SIGUSR2);
+		}
+
+		if (got_chld) {
+			got_chld = 0;
+			while ((pid = waitpid((pid_t)-1, &status, WNOHANG)) > 0) {
+				for (i = 0; i < workers; i++) {
+					if (worker_pid[i] == pid)
+						break;
+				}
+				if (i == workers)
+					continue;
+
+				worker_pid[i] = 0;
+				if (stopping)
+					continue;
+
+				if (WIFSIGNALED(status))
+					syslog(LOG_WARNING, "Worker %d (PID %d) killed by signal %d, restarting.",
+					       i, pid, WTERMSIG(status));
+				else
+					syslog(LOG_WARNING, "Worker %d (PID %d) exited with status %d, restarting.",
+					       i, pid, WEXITSTATUS(status));
+				if (time(NULL) - started[i] < 1)
+					sleep(1);	/* Don't spin on a worker that dies at once */
+
+				pid = spawn_worker(hs, i);
+				if (!pid)
+					goto worker;
+				worker_pid[i] = pid > 0 ? pid : 0;
+				started[i] = time(NULL);
+			}
+		}
+
+		if (stopping) {
+			for (i = 0; i < workers; i++) {
+				if (worker_pid[i] > 0)
+					break;
+			}
+			if (i == workers) {
+				syslog(LOG_NOTICE, "All workers done, exiting.");
+				closelog();
+				exit(0);
+			}
+		}
+	}
+
+worker:
+	free(started);
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	init_signals();
+}
+
 static int loglvl(char *level)
 {
 	for (int i = 0; prioritynames[i].c_name; i++) {
@@ -1293,9 +3387,12 @@ static int usage(int code)
 	       "  -d DIR     Optional DIR to change into after chrooting to WEBROOT\n"
 	       "  -g         Use global password, .htpasswd, and .htaccess files\n"
 #endif
+	       "  -F ADDR    FastCGI backend for CGI requests, UNIX socket or HOST:PORT\n"
 	       "  -h         This help text\n"
 	       "  -I IDENT   Identity for syslog, .conf, and PID file, default: %s\n"
 	       "  -l LEVEL   Set log level: none, err, info, notice*, debug\n"
+	       "  -L FILE    Access log, instead of syslog, use %%s in FILE for per-vhost logs\n"
+	       "  -m PATH    Serve stats, in Prometheus text format, at PATH, e.g. /.stats\n"
 	       "  -n         Run in foreground, do not detach from controlling terminal\n"
 	       "  -p PORT    Port to listen to, default 80, or 443 if HTTPS is enabled\n"
 	       "  -P PIDFN   Path to PID file, default: " RUNDIR "/%s.pid\n"
@@ -1310,6 +3407,7 @@ static int usage(int code)
 	       "  -v         Enable virtual hosting with WEBROOT as base\n"
 #endif
 	       "  -V         Show Merecat httpd version\n"
+	       "  -w NUM     Number of worker processes, default: 1\n"
 	       "\n", prognm,
 #ifdef HAVE_LIBCONFUSE
 	       ident,
@@ -1366,7 +3464,7 @@ int main(int argc, char **argv)
 	struct timeval tv;
 
 	ident = prognm = progname(argv[0]);
-	while ((c = getopt(argc, argv, "c:d:f:ghI:l:np:P:rsSu:vV")) != EOF) {
+	while ((c = getopt(argc, argv, "c:d:f:F:ghI:l:L:m:np:P:rsSt:u:vVw:")) != EOF) {
 		switch (c) {
 #ifndef HAVE_LIBCONFUSE
 		case 'c':
@@ -1391,6 +3489,10 @@ int main(int argc, char **argv)
 #endif
 			break;
 
+		case 'F':
+			fastcgi = optarg;
+			break;
+
 		case 'h':
 			return usage(0);
 
@@ -1404,6 +3506,14 @@ int main(int argc, char **argv)
 				return usage(1);
 			break;
 
+		case 'L':
+			access_log = optarg;
+			break;
+
+		case 'm':
+			stats_path = optarg;
+			break;
+
 		case 'n':
 			background = 0;
 			do_syslog--;
@@ -1449,6 +3559,12 @@ int main(int argc, char **argv)
 		case 'V':
 			return version();
 
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 1)
+				return usage(1);
+			break;
+
 		default:
 			return usage(1);
 		}
@@ -1480,6 +3596,14 @@ int main(int argc, char **argv)
 	if (throttlefile)
 		read_throttlefile(throttlefile);
 
+	if (stats_path) {
+		stats_match = match_compile(stats_allow);
+		if (!stats_match) {
+			syslog(LOG_CRIT, "Failed compiling stats-allow pattern: %s", strerror(errno));
+			exit(1);
+		}
+	}
+
 	/* If we're root and we're going to drop privileges to become another
 	** user, get their uid/gid now.
 	*/
@@ -1570,12 +3694,29 @@ int main(int argc, char **argv)
 	}
 	max_connects -= SPARE_FDS;
 
+	/* Open the access log, per-vhost logs are opened later, in the chroot */
+	if (access_log && alog_init(access_log)) {
+		syslog(LOG_CRIT, "Failed setting up access log %s", access_log);
+		exit(1);
+	}
+
+	mmc_init(cache_size);
+	if (cache_manifest)
+		open_manifest(cache_manifest);
+
+	/* Resolve the FastCGI backend, it is connected to on demand */
+	if (fastcgi && fcgi_init(fastcgi, fastcgi_pool)) {
+		syslog(LOG_CRIT, "Failed setting up FastCGI backend %s: %s", fastcgi, strerror(errno));
+		exit(1);
+	}
+
 	/* Chroot if requested. */
 	if (do_chroot) {
 		if (chroot(path) < 0) {
 			syslog(LOG_CRIT, "chroot: %s", strerror(errno));
 			exit(1);
 		}
+		alog_chroot(path);
 
 		strcpy(path, "/");
 		/* Always chdir to / after a chroot. */
@@ -1602,6 +3743,10 @@ int main(int argc, char **argv)
 	/* Create the server */
 	server = srv_init(hostname, path, port, do_ssl);
 
+	/* Prefork workers need their own listen sockets, open while still root */
+	if (workers > 1)
+		worker_listen(server);
+
 	/* Add to list of servers */
 	LIST_INSERT(server, server_list);
 
@@ -1617,6 +3762,18 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	/* Set up the access log flush timer. */
+	if (alog_enabled() && !tmr_create(NULL, flush_log, noarg, ACCESS_LOG_FLUSH * 1000L, 1)) {
+		syslog(LOG_CRIT, "tmr_create(flush_log) failed");
+		exit(1);
+	}
+
+	/* Set up the session ticket key rotation timer. */
+	if (do_ssl && !tmr_create(NULL, rotate_tickets, noarg, SSL_ROTATE_TIME * 1000L, 1)) {
+		syslog(LOG_CRIT, "tmr_create(rotate_tickets) failed");
+		exit(1);
+	}
+
 	if (numthrottles > 0) {
 		/* Set up the throttles timer. */
 		if (!tmr_create(NULL, update_throttles, noarg, THROTTLE_TIME * 1000L, 1)) {
@@ -1672,6 +3829,25 @@ int main(int argc, char **argv)
 			syslog(LOG_WARNING, "Started as root without requesting chroot(), warning only");
 	}
 
+	/* Fork off workers, each with its own fdwatch, connection table, and
+	** mmc cache.  Only the workers return here.
+	*/
+	if (workers > 1) {
+		master(server);
+
+		fdwatch_put_nfiles();
+		max_connects = fdwatch_get_nfiles();
+		if (max_connects < 0) {
+			syslog(LOG_CRIT, "fdwatch initialization failure");
+			exit(1);
+		}
+		max_connects -= SPARE_FDS;
+	}
+
+	/* Each worker has its own pool of FastCGI backend connections */
+	if (fcgi_enabled())
+		max_connects -= fastcgi_pool;
+
 	/* Initialize our connections table. */
 	connects = NEW(connecttab, max_connects);
 	if (!connects) {
@@ -1683,8 +3859,14 @@ int main(int argc, char **argv)
 		connects[cnum].conn_state = CNST_FREE;
 		connects[cnum].next_free_connect = cnum + 1;
 		connects[cnum].hc = NULL;
+		connects[cnum].backend = NULL;
+		connects[cnum].cgi_round = 0;
+		connects[cnum].pipelined = 0;
 #ifdef HAVE_ZLIB_H
 		connects[cnum].zs_output_head = NULL;
+#endif
+#ifdef ENABLE_HTTP2
+		connects[cnum].h2 = NULL;
 #endif
 	}
 	connects[max_connects - 1].next_free_connect = -1;	/* end of link list */
@@ -1696,17 +3878,27 @@ int main(int argc, char **argv)
 	LIST_FOREACH(server, server_list)
 		srv_start(server);
 
+	/* Warm up the cache, in the background, now that we are serving */
+	if (manifest_fd >= 0 && !tmr_create(NULL, warm_up, noarg, 0, 0)) {
+		syslog(LOG_CRIT, "tmr_create(warm_up) failed");
+		exit(1);
+	}
+
 	/* Main loop. */
 	tmr_prepare_timeval(&tv);
+	httpd_set_date(tv.tv_sec);
 	while ((!terminate) || num_connects > 0) {
 		int got = 0;
 
 		/* Do we need to re-open the log file? */
-		if (got_hup)
+		if (got_hup) {
 			got_hup = 0;
+			alog_reopen();
+		}
 
-		/* Do the fd watch. */
-		num_ready = fdwatch(tmr_mstimeout(&tv));
+		/* Do the fd watch, don't sleep on queued pipelined requests. */
+		num_ready = fdwatch(pipeline_head ? 0 : tmr_mstimeout(&tv));
+		rounds++;
 		if (num_ready < 0) {
 			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
 				continue;	/* try again */
@@ -1715,10 +3907,12 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 		tmr_prepare_timeval(&tv);
+		httpd_set_date(tv.tv_sec);
 
 		if (num_ready == 0) {
 			/* No fd's are ready - run the timers. */
 			tmr_run(&tv);
+			handle_pipelined(&tv);
 			continue;
 		}
 
@@ -1740,6 +3934,21 @@ int main(int argc, char **argv)
 			if (!ct)
 				continue;
 
+			/* Either socket of a CGI request, errors show up
+			** in handle_cgi(), or a stale event after it's done.
+			*/
+			if (ct->conn_state == CNST_CGI) {
+				handle_cgi(ct, &tv);
+				continue;
+			}
+			/* Only the listing pipe is watched, see start_listing() */
+			if (ct->conn_state == CNST_LISTING) {
+				handle_listing(ct, &tv);
+				continue;
+			}
+			if (ct->cgi_round == rounds)
+				continue;
+
 			hc = ct->hc;
 			if (!fdwatch_check_fd(hc->conn_fd)) {
 				/* Something went wrong. */
@@ -1747,6 +3956,10 @@ int main(int argc, char **argv)
 				clear_connection(ct, &tv);
 			} else {
 				switch (ct->conn_state) {
+				case CNST_HANDSHAKE:
+					handle_handshake(ct, &tv);
+					break;
+
 				case CNST_READING:
 					handle_read(ct, &tv);
 					break;
@@ -1758,9 +3971,16 @@ int main(int argc, char **argv)
 				case CNST_LINGERING:
 					handle_linger(ct, &tv);
 					break;
+#ifdef ENABLE_HTTP2
+
+				case CNST_H2:
+					handle_h2(ct, &tv);
+					break;
+#endif
 				}
 			}
 		}
+		handle_pipelined(&tv);
 		tmr_run(&tv);
 
 		if (got_usr1 && !terminate) {
@@ -104,6 +104,12 @@
 #define CGI_LIMIT 1
 #endif
 
+/* CONFIGURE: Number of persistent connections to a FastCGI backend, in
+** each worker process.  When all are busy, new requests wait for the
+** next to become idle.  This can also be set in the runtime config file.
+*/
+#define FASTCGI_POOL 8
+
 
 /* CONFIGURE: How many seconds to allow for reading the initial request
 ** on a new connection.
@@ -186,6 +192,28 @@
 */
 #define DEFAULT_MAX_AGE 604800
 
+/* CONFIGURE: Files larger than this, in bytes, get a cheap ETag made from
+** the inode, size and modification time instead of an MD5 digest of the
+** contents.  The digest is only computed once per file version, but for
+** a huge file even that delays the first byte considerably.  Set to -1
+** to always use the MD5 digest, or 0 to never use it.  This can also be
+** set in the runtime config file.
+*/
+#define DEFAULT_ETAG_LIMIT 16777216
+
+/* CONFIGURE: Max number of virtual hosts per server to keep request
+** statistics for, when the stats endpoint is enabled.  Requests to any
+** other virtual host are accounted to the server itself.
+*/
+#define STATS_MAX_VHOSTS 32
+
+/* CONFIGURE: Clients allowed to read the stats endpoint, a pattern, see
+** match(), matched against the address of the connecting socket.  For
+** anyone else the endpoint does not exist.  This can also be set in the
+** runtime config file.
+*/
+#define STATS_ALLOW "127.*|::1"
+
 /* Most people won't want to change anything below here. */
 
 /* CONFIGURE: This controls the SERVER_NAME environment variable that gets
@@ -302,6 +330,35 @@
 */
 #define OCCASIONAL_TIME 120
 
+/* CONFIGURE: HTTPS session resumption.  The number of sessions in the
+** cache shared by all worker processes, and how many seconds a session
+** lasts.  With session tickets the ticket keys are rotated as often, the
+** worker timers check every SSL_ROTATE_TIME seconds.
+*/
+#define SSL_SESSION_CACHE   4096
+#define SSL_SESSION_TIMEOUT 3600
+#define SSL_ROTATE_TIME     10
+
+/* CONFIGURE: Most slow requests traced to syslog per second and worker,
+** see slow-request in merecat.conf.  The rest are only counted, so a
+** stalled disk or backend cannot flood the log.
+*/
+#define SLOW_TRACE_MAX 10
+
+/* CONFIGURE: Most concurrent streams of an HTTP/2 connection, announced to
+** the client in SETTINGS.  Each stream has an httpd_conn of its own, at
+** most this many closed ones are kept, with their buffers, for reuse.
+*/
+#define H2_MAX_STREAMS 100
+
+/* CONFIGURE: Most files listed in the cache manifest, see cache-manifest
+** in merecat.conf, and about how many bytes of them are read in, or
+** hashed and compressed, at a time when warming up the cache at startup,
+** between serving connections.
+*/
+#define CACHE_MANIFEST_MAX 1000
+#define CACHE_WARM_BYTES   1048576
+
 /* CONFIGURE: Seconds between stats syslogs.  If this is undefined then
 ** no stats are accumulated and no stats syslogs are done.
 ** Original default: 3600
@@ -317,13 +374,23 @@
 */
 #define DESIRED_MAX_MAPPED_FILES 1000
 
-/* CONFIGURE: The mmap cache also tries to keep the total mapped bytes
-** below this number, so you don't run out of address space.  Again
-** it's not a hard limit, merecat will go over it if you really are
-** accessing a bunch of large files.
+/* CONFIGURE: The mmap cache also keeps the total mapped bytes below this
+** number, so you don't run out of address space, by evicting the least
+** recently used maps.  It's not a hard limit, merecat will go over it if
+** you really are accessing a bunch of large files at the same time.  The
+** default for the cache-size setting.
 */
 #define DESIRED_MAX_MAPPED_BYTES 1000000000
 
+/* CONFIGURE: Files larger than this are never mapped whole, nor cached.
+** They are sent with sendfile() when possible, otherwise through a window
+** of FILE_WINDOW_SIZE bytes mapped around the current send position, so
+** huge files and range requests in them only cost bounded memory.  Such
+** files always get a metadata ETag, see DEFAULT_ETAG_LIMIT.
+*/
+#define MAX_MAPPED_FILE_SIZE (64 * 1024 * 1024)
+#define FILE_WINDOW_SIZE     (4 * 1024 * 1024)
+
 /* CONFIGURE: Minimum and maximum intervals between child-process reaping,
 ** in seconds.
 */
@@ -363,6 +430,13 @@
 #define GENERATE_INDEXES
 #endif
 
+/* CONFIGURE: Generated index pages are cached, and compressed, like any
+** other file.  A listing is rebuilt as soon as its directory changes,
+** but changes to the files in it, e.g. their size, only show up once
+** the cached listing is this many seconds old.
+*/
+#define BODY_CACHE_AGE 60
+
 /* CONFIGURE: Whether to log unknown request headers.  Most sites will not
 ** want to log them, which will save them a bit of CPU time.
 */
@@ -370,9 +444,19 @@
 #define LOG_UNKNOWN_HEADERS
 #endif
 
+/* CONFIGURE: Seconds between writes of the buffered access log, if set up.
+** A full buffer is written out immediately.
+*/
+#define ACCESS_LOG_FLUSH 1
+
 /* CONFIGURE: Time between updates of the throttle table's rolling averages. */
 #define THROTTLE_TIME 2
 
+/* CONFIGURE: Milliseconds worth of its rate that a throttled connection
+** may send in one go.  Smaller gives a smoother flow, larger fewer wakeups.
+*/
+#define THROTTLE_SLICE 50
+
 /* CONFIGURE: The listen() backlog queue length.  The 1024 doesn't actually
 ** get used, the kernel uses its maximum allowed value.  This is a config
 ** parameter only in case there's some OS where asking for too high a queue
@@ -381,6 +465,12 @@
 */
 #define LISTEN_BACKLOG 1024
 
+/* CONFIGURE: Maximum number of connections to accept in one go before
+** serving those already open.  The listen queue holds the rest until the
+** next round, so a burst of new connections cannot starve existing ones.
+*/
+#define MAX_ACCEPT_BATCH 64
+
 /* CONFIGURE: Maximum number of throttle patterns that any single URL can
 ** be included in.  This has nothing to do with the number of throttle
 ** patterns that you can define, which is unlimited.
@@ -411,6 +501,15 @@
 */
 #define MAX_LINKS 32
 
+/* CONFIGURE: When a write to the client would block, the connection waits
+** for the socket to become writable again.  Some old kernels, e.g. SunOS
+** 4.1.x, report O_NDELAY sockets as always writable.  Define this to pause
+** the connection on a timer instead, see MIN_WOULDBLOCK_DELAY.
+*/
+#ifdef notdef
+#define USE_WOULDBLOCK_DELAY
+#endif
+
 /*
 ** CONFIGURE: You don't even want to know.
 */
@@ -427,6 +526,7 @@ extern char *ident;
 */
 extern uint16_t  port;
 extern int       max_age;
+extern off_t     etag_limit;
 extern int       compression_level;
 extern int       do_chroot;
 extern int       do_ssl;
@@ -436,6 +536,16 @@ extern int       do_list_dotfiles;
 extern int       no_symlink_check;
 extern int       no_empty_referers;
 extern int       cgi_limit;
+extern int       fastcgi_pool;
+extern int       send_buffer;
+extern int       log_timing;
+extern int       slow_request;
+extern int       listen_backlog;
+extern int       defer_accept;
+extern int       tcp_fastopen;
+extern off_t     cache_size;
+extern char     *cache_manifest;
+extern int       workers;
 extern char     *cgi_pattern;
 extern char     *local_pattern;
 extern char     *url_pattern;
@@ -444,8 +554,16 @@ extern char     *data_dir;
 extern char     *certfile;
 extern char     *keyfile;
 extern char     *dhfile;
+extern int       ssl_session_cache;
+extern int       ssl_session_timeout;
+extern int       ssl_tickets;
+extern int       do_http2;
 extern char     *hostname;
 extern char     *user;
 extern char     *charset;
+extern char     *stats_path;
+extern char     *stats_allow;
+extern char     *access_log;
+extern char     *fastcgi;
 
 #endif /* MERECAT_H_ */
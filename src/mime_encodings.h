@@ -1,4 +1,18 @@
-{ "Z", 0, "compress", 0 },
-{ "gz", 0, "gzip", 0 },
-{ "svgz", 0, "gzip", 0 },
-{ "uu", 0, "x-uuencode", 0 },
+/* Generated by make_mime.pl from mime_encodings.txt, do not edit */
+#define ENC_TAB_SIZE 8
+#define ENC_TAB_SEEDS 2
+
+static const unsigned short enc_tab_seed[ENC_TAB_SEEDS] = {
+	5, 1,
+};
+
+static const struct mime_entry enc_tab[ENC_TAB_SIZE] = {
+	{ "br", 2, "br", 2 },
+	{ "gz", 2, "gzip", 4 },
+	{ "Z", 1, "compress", 8 },
+	{ NULL, 0, NULL, 0 },
+	{ "svgz", 4, "gzip", 4 },
+	{ "zst", 3, "zstd", 4 },
+	{ "uu", 2, "x-uuencode", 10 },
+	{ NULL, 0, NULL, 0 },
+};
@@ -1,214 +1,271 @@
-{ "7z", 0, "application/x-7z-compressed", 0 },
-{ "a", 0, "application/octet-stream", 0 },
-{ "aab", 0, "application/x-authorware-bin", 0 },
-{ "aam", 0, "application/x-authorware-map", 0 },
-{ "aas", 0, "application/x-authorware-seg", 0 },
-{ "ai", 0, "application/postscript", 0 },
-{ "aif", 0, "audio/x-aiff", 0 },
-{ "aifc", 0, "audio/x-aiff", 0 },
-{ "aiff", 0, "audio/x-aiff", 0 },
-{ "arc", 0, "application/octet-stream", 0 },
-{ "arj", 0, "application/octet-stream", 0 },
-{ "asc", 0, "text/plain; charset=%s", 0 },
-{ "asf", 0, "video/x-ms-asf", 0 },
-{ "asx", 0, "video/x-ms-asf", 0 },
-{ "au", 0, "audio/basic", 0 },
-{ "avi", 0, "video/x-msvideo", 0 },
-{ "bcpio", 0, "application/x-bcpio", 0 },
-{ "bin", 0, "application/octet-stream", 0 },
-{ "bmp", 0, "image/bmp", 0 },
-{ "bz2", 0, "application/octet-stream", 0 },
-{ "cdf", 0, "application/x-netcdf", 0 },
-{ "class", 0, "application/x-java-vm", 0 },
-{ "cpio", 0, "application/x-cpio", 0 },
-{ "cpt", 0, "application/mac-compactpro", 0 },
-{ "crl", 0, "application/x-pkcs7-crl", 0 },
-{ "cer", 0, "application/x-x509-ca-cert", 0 },
-{ "crt", 0, "application/x-x509-ca-cert", 0 },
-{ "csh", 0, "application/x-csh", 0 },
-{ "css", 0, "text/css; charset=%s", 0 },
-{ "dcr", 0, "application/x-director", 0 },
-{ "der", 0, "application/x-x509-ca-cert", 0 },
-{ "dir", 0, "application/x-director", 0 },
-{ "disco", 0, "text/xml", 0 },
-{ "djv", 0, "image/vnd.djvu", 0 },
-{ "djvu", 0, "image/vnd.djvu", 0 },
-{ "dll", 0, "application/octet-stream", 0 },
-{ "dms", 0, "application/octet-stream", 0 },
-{ "doc", 0, "application/msword", 0 },
-{ "dtd", 0, "text/xml; charset=%s", 0 },
-{ "dump", 0, "application/octet-stream", 0 },
-{ "dvi", 0, "application/x-dvi", 0 },
-{ "dxr", 0, "application/x-director", 0 },
-{ "eps", 0, "application/postscript", 0 },
-{ "etx", 0, "text/x-setext", 0 },
-{ "exe", 0, "application/octet-stream", 0 },
-{ "ez", 0, "application/andrew-inset", 0 },
-{ "fgd", 0, "application/x-director", 0 },
-{ "fh", 0, "image/x-freehand", 0 },
-{ "fh4", 0, "image/x-freehand", 0 },
-{ "fh5", 0, "image/x-freehand", 0 },
-{ "fh7", 0, "image/x-freehand", 0 },
-{ "fhc", 0, "image/x-freehand", 0 },
-{ "gif", 0, "image/gif", 0 },
-{ "gtar", 0, "application/x-gtar", 0 },
-{ "hdf", 0, "application/x-hdf", 0 },
-{ "hqx", 0, "application/mac-binhex40", 0 },
-{ "htm", 0, "text/html; charset=%s", 0 },
-{ "html", 0, "text/html; charset=%s", 0 },
-{ "ice", 0, "x-conference/x-cooltalk", 0 },
-{ "ico", 0, "image/x-icon", 0 },
-{ "ief", 0, "image/ief", 0 },
-{ "iges", 0, "model/iges", 0 },
-{ "igs", 0, "model/iges", 0 },
-{ "iv", 0, "application/x-inventor", 0 },
-{ "jar", 0, "application/x-java-archive", 0 },
-{ "jfif", 0, "image/jpeg", 0 },
-{ "jpe", 0, "image/jpeg", 0 },
-{ "jpeg", 0, "image/jpeg", 0 },
-{ "jpg", 0, "image/jpeg", 0 },
-{ "js", 0, "application/javascript", 0 },
-{ "kar", 0, "audio/midi", 0 },
-{ "kml", 0, "application/vnd.google-earth.kml+xml", 0 },
-{ "kmz", 0, "application/vnd.google-earth.kmz", 0 },
-{ "latex", 0, "application/x-latex", 0 },
-{ "lha", 0, "application/octet-stream", 0 },
-{ "loc", 0, "application/xml-loc", 0 },
-{ "lzh", 0, "application/octet-stream", 0 },
-{ "m3u", 0, "audio/x-mpegurl", 0 },
-{ "man", 0, "application/x-troff-man", 0 },
-{ "mathml", 0, "application/mathml+xml", 0 },
-{ "me", 0, "application/x-troff-me", 0 },
-{ "mesh", 0, "model/mesh", 0 },
-{ "mid", 0, "audio/midi", 0 },
-{ "midi", 0, "audio/midi", 0 },
-{ "mif", 0, "application/vnd.mif", 0 },
-{ "mime", 0, "message/rfc822", 0 },
-{ "mml", 0, "application/mathml+xml", 0 },
-{ "mov", 0, "video/quicktime", 0 },
-{ "movie", 0, "video/x-sgi-movie", 0 },
-{ "mp2", 0, "audio/mpeg", 0 },
-{ "mp3", 0, "audio/mpeg", 0 },
-{ "mp4", 0, "video/mp4", 0 },
-{ "mpe", 0, "video/mpeg", 0 },
-{ "mpeg", 0, "video/mpeg", 0 },
-{ "mpg", 0, "video/mpeg", 0 },
-{ "mpga", 0, "audio/mpeg", 0 },
-{ "ms", 0, "application/x-troff-ms", 0 },
-{ "msh", 0, "model/mesh", 0 },
-{ "mv", 0, "video/x-sgi-movie", 0 },
-{ "mxu", 0, "video/vnd.mpegurl", 0 },
-{ "nc", 0, "application/x-netcdf", 0 },
-{ "o", 0, "application/octet-stream", 0 },
-{ "oda", 0, "application/oda", 0 },
-{ "ogg", 0, "application/ogg", 0 },
-{ "ogv", 0, "video/ogg", 0 },
-{ "ogx", 0, "application/ogg", 0 },
-{ "pac", 0, "application/x-ns-proxy-autoconfig", 0 },
-{ "pbm", 0, "image/x-portable-bitmap", 0 },
-{ "pdb", 0, "chemical/x-pdb", 0 },
-{ "pdf", 0, "application/pdf", 0 },
-{ "pgm", 0, "image/x-portable-graymap", 0 },
-{ "pgn", 0, "application/x-chess-pgn", 0 },
-{ "png", 0, "image/png", 0 },
-{ "pnm", 0, "image/x-portable-anymap", 0 },
-{ "ppm", 0, "image/x-portable-pixmap", 0 },
-{ "ppt", 0, "application/vnd.ms-powerpoint", 0 },
-{ "ps", 0, "application/postscript", 0 },
-{ "qt", 0, "video/quicktime", 0 },
-{ "ra", 0, "audio/x-realaudio", 0 },
-{ "ram", 0, "audio/x-pn-realaudio", 0 },
-{ "ras", 0, "image/x-cmu-raster", 0 },
-{ "rdf", 0, "application/rdf+xml", 0 },
-{ "rgb", 0, "image/x-rgb", 0 },
-{ "rm", 0, "audio/x-pn-realaudio", 0 },
-{ "roff", 0, "application/x-troff", 0 },
-{ "rpm", 0, "audio/x-pn-realaudio-plugin", 0 },
-{ "rss", 0, "application/rss+xml", 0 },
-{ "rtf", 0, "text/rtf; charset=%s", 0 },
-{ "rtx", 0, "text/richtext; charset=%s", 0 },
-{ "sfx", 0, "application/octet-stream", 0 },
-{ "sgm", 0, "text/sgml; charset=%s", 0 },
-{ "sgml", 0, "text/sgml; charset=%s", 0 },
-{ "sh", 0, "application/x-sh", 0 },
-{ "shar", 0, "application/x-shar", 0 },
-{ "silo", 0, "model/mesh", 0 },
-{ "sit", 0, "application/x-stuffit", 0 },
-{ "skd", 0, "application/x-koan", 0 },
-{ "skm", 0, "application/x-koan", 0 },
-{ "skp", 0, "application/x-koan", 0 },
-{ "skt", 0, "application/x-koan", 0 },
-{ "smi", 0, "application/smil", 0 },
-{ "smil", 0, "application/smil", 0 },
-{ "snd", 0, "audio/basic", 0 },
-{ "so", 0, "application/octet-stream", 0 },
-{ "spl", 0, "application/x-futuresplash", 0 },
-{ "src", 0, "application/x-wais-source", 0 },
-{ "stc", 0, "application/vnd.sun.xml.calc.template", 0 },
-{ "std", 0, "application/vnd.sun.xml.draw.template", 0 },
-{ "sti", 0, "application/vnd.sun.xml.impress.template", 0 },
-{ "stw", 0, "application/vnd.sun.xml.writer.template", 0 },
-{ "sv4cpio", 0, "application/x-sv4cpio", 0 },
-{ "sv4crc", 0, "application/x-sv4crc", 0 },
-{ "svg", 0, "image/svg+xml", 0 },
-{ "svgx", 0, "image/svg+xml", 0 },
-{ "svgz", 0, "image/svg+xml", 0 },
-{ "swf", 0, "application/x-shockwave-flash", 0 },
-{ "sxc", 0, "application/vnd.sun.xml.calc", 0 },
-{ "sxd", 0, "application/vnd.sun.xml.draw", 0 },
-{ "sxg", 0, "application/vnd.sun.xml.writer.global", 0 },
-{ "sxi", 0, "application/vnd.sun.xml.impress", 0 },
-{ "sxm", 0, "application/vnd.sun.xml.math", 0 },
-{ "sxw", 0, "application/vnd.sun.xml.writer", 0 },
-{ "t", 0, "application/x-troff", 0 },
-{ "tar", 0, "application/x-tar", 0 },
-{ "taz", 0, "application/octet-stream", 0 },
-{ "tgz", 0, "application/octet-stream", 0 },
-{ "tbz2", 0, "application/octet-stream", 0 },
-{ "tcl", 0, "application/x-tcl", 0 },
-{ "tex", 0, "application/x-tex", 0 },
-{ "texi", 0, "application/x-texinfo", 0 },
-{ "texinfo", 0, "application/x-texinfo", 0 },
-{ "tif", 0, "image/tiff", 0 },
-{ "tiff", 0, "image/tiff", 0 },
-{ "torrent", 0, "application/x-bittorrent", 0 },
-{ "tr", 0, "application/x-troff", 0 },
-{ "tsp", 0, "application/dsptype", 0 },
-{ "tsv", 0, "text/tab-separated-values; charset=%s", 0 },
-{ "txt", 0, "text/plain; charset=%s", 0 },
-{ "ustar", 0, "application/x-ustar", 0 },
-{ "vcd", 0, "application/x-cdlink", 0 },
-{ "vrml", 0, "model/vrml", 0 },
-{ "vx", 0, "video/x-rad-screenplay", 0 },
-{ "wav", 0, "audio/x-wav", 0 },
-{ "wax", 0, "audio/x-ms-wax", 0 },
-{ "wbmp", 0, "image/vnd.wap.wbmp", 0 },
-{ "wbxml", 0, "application/vnd.wap.wbxml", 0 },
-{ "wm", 0, "video/x-ms-wm", 0 },
-{ "wma", 0, "audio/x-ms-wma", 0 },
-{ "wmd", 0, "application/x-ms-wmd", 0 },
-{ "wml", 0, "text/vnd.wap.wml", 0 },
-{ "wmlc", 0, "application/vnd.wap.wmlc", 0 },
-{ "wmls", 0, "text/vnd.wap.wmlscript", 0 },
-{ "wmlsc", 0, "application/vnd.wap.wmlscriptc", 0 },
-{ "wmv", 0, "video/x-ms-wmv", 0 },
-{ "wmx", 0, "video/x-ms-wmx", 0 },
-{ "wmz", 0, "application/x-ms-wmz", 0 },
-{ "wrl", 0, "model/vrml", 0 },
-{ "wsrc", 0, "application/x-wais-source", 0 },
-{ "wvx", 0, "video/x-ms-wvx", 0 },
-{ "xbm", 0, "image/x-xbitmap", 0 },
-{ "xht", 0, "application/xhtml+xml; charset=%s", 0 },
-{ "xhtml", 0, "application/xhtml+xml; charset=%s", 0 },
-{ "xls", 0, "application/vnd.ms-excel", 0 },
-{ "xml", 0, "text/xml; charset=%s", 0 },
-{ "xpi", 0, "application/x-xpinstall", 0 },
-{ "xpm", 0, "image/x-xpixmap", 0 },
-{ "xsd", 0, "text/xml; charset=%s", 0 },
-{ "xsl", 0, "text/xml; charset=%s", 0 },
-{ "xslt", 0, "text/xml; charset=%s", 0 },
-{ "xul", 0, "application/vnd.mozilla.xul+xml", 0 },
-{ "xwd", 0, "image/x-xwindowdump", 0 },
-{ "xyz", 0, "chemical/x-xyz", 0 },
-{ "zip", 0, "application/zip", 0 },
-{ "zoo", 0, "application/octet-stream", 0 },
+/* Generated by make_mime.pl from mime_types.txt, do not edit */
+#define TYP_TAB_SIZE 256
+#define TYP_TAB_SEEDS 64
+
+static const unsigned short typ_tab_seed[TYP_TAB_SEEDS] = {
+	0, 2, 4, 12, 5, 1, 3, 1, 9, 7, 25, 19,
+	4, 2, 2, 16, 14, 13, 2, 1, 2, 1, 3, 1,
+	77, 16, 1, 1, 17, 1, 9, 4, 19, 3, 17, 33,
+	3, 12, 29, 44, 10, 82, 3, 61, 10, 0, 11, 6,
+	7, 12, 3, 7, 45, 0, 6, 0, 2, 8, 12, 0,
+	54, 1, 28, 9,
+};
+
+static const struct mime_entry typ_tab[TYP_TAB_SIZE] = {
+	{ "wax", 3, "audio/x-ms-wax", 14 },
+	{ "qt", 2, "video/quicktime", 15 },
+	{ "kmz", 3, "application/vnd.google-earth.kmz", 32 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "xht", 3, "application/xhtml+xml; charset=%s", 33 },
+	{ "iges", 4, "model/iges", 10 },
+	{ "cer", 3, "application/x-x509-ca-cert", 26 },
+	{ NULL, 0, NULL, 0 },
+	{ "css", 3, "text/css; charset=%s", 20 },
+	{ "wav", 3, "audio/x-wav", 11 },
+	{ "o", 1, "application/octet-stream", 24 },
+	{ NULL, 0, NULL, 0 },
+	{ "vrml", 4, "model/vrml", 10 },
+	{ "tbz2", 4, "application/octet-stream", 24 },
+	{ "djvu", 4, "image/vnd.djvu", 14 },
+	{ "gtar", 4, "application/x-gtar", 18 },
+	{ "midi", 4, "audio/midi", 10 },
+	{ "aifc", 4, "audio/x-aiff", 12 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "xml", 3, "text/xml; charset=%s", 20 },
+	{ "wmlc", 4, "application/vnd.wap.wmlc", 24 },
+	{ "crt", 3, "application/x-x509-ca-cert", 26 },
+	{ "mml", 3, "application/mathml+xml", 22 },
+	{ "taz", 3, "application/octet-stream", 24 },
+	{ "au", 2, "audio/basic", 11 },
+	{ "so", 2, "application/octet-stream", 24 },
+	{ "cpio", 4, "application/x-cpio", 18 },
+	{ "bin", 3, "application/octet-stream", 24 },
+	{ "ras", 3, "image/x-cmu-raster", 18 },
+	{ "sh", 2, "application/x-sh", 16 },
+	{ "msh", 3, "model/mesh", 10 },
+	{ "mid", 3, "audio/midi", 10 },
+	{ NULL, 0, NULL, 0 },
+	{ "mpeg", 4, "video/mpeg", 10 },
+	{ "wsrc", 4, "application/x-wais-source", 25 },
+	{ "mxu", 3, "video/vnd.mpegurl", 17 },
+	{ NULL, 0, NULL, 0 },
+	{ "jpeg", 4, "image/jpeg", 10 },
+	{ "fh7", 3, "image/x-freehand", 16 },
+	{ "mpga", 4, "audio/mpeg", 10 },
+	{ "fh", 2, "image/x-freehand", 16 },
+	{ "jpg", 3, "image/jpeg", 10 },
+	{ "wbmp", 4, "image/vnd.wap.wbmp", 18 },
+	{ "dvi", 3, "application/x-dvi", 17 },
+	{ "sti", 3, "application/vnd.sun.xml.impress.template", 40 },
+	{ "sgm", 3, "text/sgml; charset=%s", 21 },
+	{ "mpg", 3, "video/mpeg", 10 },
+	{ "html", 4, "text/html; charset=%s", 21 },
+	{ "src", 3, "application/x-wais-source", 25 },
+	{ "disco", 5, "text/xml", 8 },
+	{ "ez", 2, "application/andrew-inset", 24 },
+	{ NULL, 0, NULL, 0 },
+	{ "avi", 3, "video/x-msvideo", 15 },
+	{ "aiff", 4, "audio/x-aiff", 12 },
+	{ "ogx", 3, "application/ogg", 15 },
+	{ "rgb", 3, "image/x-rgb", 11 },
+	{ NULL, 0, NULL, 0 },
+	{ "cdf", 3, "application/x-netcdf", 20 },
+	{ "wmx", 3, "video/x-ms-wmx", 14 },
+	{ "pdb", 3, "chemical/x-pdb", 14 },
+	{ "movie", 5, "video/x-sgi-movie", 17 },
+	{ NULL, 0, NULL, 0 },
+	{ "igs", 3, "model/iges", 10 },
+	{ "asx", 3, "video/x-ms-asf", 14 },
+	{ NULL, 0, NULL, 0 },
+	{ "mathml", 6, "application/mathml+xml", 22 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "tr", 2, "application/x-troff", 19 },
+	{ NULL, 0, NULL, 0 },
+	{ "dtd", 3, "text/xml; charset=%s", 20 },
+	{ "ra", 2, "audio/x-realaudio", 17 },
+	{ "wm", 2, "video/x-ms-wm", 13 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "dxr", 3, "application/x-director", 22 },
+	{ "wvx", 3, "video/x-ms-wvx", 14 },
+	{ "jar", 3, "application/x-java-archive", 26 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "rm", 2, "audio/x-pn-realaudio", 20 },
+	{ "oda", 3, "application/oda", 15 },
+	{ "rtx", 3, "text/richtext; charset=%s", 25 },
+	{ "wma", 3, "audio/x-ms-wma", 14 },
+	{ "zip", 3, "application/zip", 15 },
+	{ "swf", 3, "application/x-shockwave-flash", 29 },
+	{ NULL, 0, NULL, 0 },
+	{ "ustar", 5, "application/x-ustar", 19 },
+	{ "txt", 3, "text/plain; charset=%s", 22 },
+	{ "dms", 3, "application/octet-stream", 24 },
+	{ "xbm", 3, "image/x-xbitmap", 15 },
+	{ "gif", 3, "image/gif", 9 },
+	{ "roff", 4, "application/x-troff", 19 },
+	{ "rpm", 3, "audio/x-pn-realaudio-plugin", 27 },
+	{ "jpe", 3, "image/jpeg", 10 },
+	{ "wmz", 3, "application/x-ms-wmz", 20 },
+	{ "wmlsc", 5, "application/vnd.wap.wmlscriptc", 30 },
+	{ NULL, 0, NULL, 0 },
+	{ "xsl", 3, "text/xml; charset=%s", 20 },
+	{ NULL, 0, NULL, 0 },
+	{ "vcd", 3, "application/x-cdlink", 20 },
+	{ "skm", 3, "application/x-koan", 18 },
+	{ "mp2", 3, "audio/mpeg", 10 },
+	{ "skt", 3, "application/x-koan", 18 },
+	{ "bcpio", 5, "application/x-bcpio", 19 },
+	{ "texi", 4, "application/x-texinfo", 21 },
+	{ "pac", 3, "application/x-ns-proxy-autoconfig", 33 },
+	{ "sv4cpio", 7, "application/x-sv4cpio", 21 },
+	{ "mesh", 4, "model/mesh", 10 },
+	{ "ief", 3, "image/ief", 9 },
+	{ "shar", 4, "application/x-shar", 18 },
+	{ "mov", 3, "video/quicktime", 15 },
+	{ "xpm", 3, "image/x-xpixmap", 15 },
+	{ NULL, 0, NULL, 0 },
+	{ "fgd", 3, "application/x-director", 22 },
+	{ "tar", 3, "application/x-tar", 17 },
+	{ "wrl", 3, "model/vrml", 10 },
+	{ "xslt", 4, "text/xml; charset=%s", 20 },
+	{ "sgml", 4, "text/sgml; charset=%s", 21 },
+	{ "mv", 2, "video/x-sgi-movie", 17 },
+	{ "xyz", 3, "chemical/x-xyz", 14 },
+	{ "ogv", 3, "video/ogg", 9 },
+	{ "svg", 3, "image/svg+xml", 13 },
+	{ "xwd", 3, "image/x-xwindowdump", 19 },
+	{ "csh", 3, "application/x-csh", 17 },
+	{ "rtf", 3, "text/rtf; charset=%s", 20 },
+	{ "nc", 2, "application/x-netcdf", 20 },
+	{ "dump", 4, "application/octet-stream", 24 },
+	{ "djv", 3, "image/vnd.djvu", 14 },
+	{ "hdf", 3, "application/x-hdf", 17 },
+	{ "ps", 2, "application/postscript", 22 },
+	{ "mp3", 3, "audio/mpeg", 10 },
+	{ "t", 1, "application/x-troff", 19 },
+	{ NULL, 0, NULL, 0 },
+	{ "7z", 2, "application/x-7z-compressed", 27 },
+	{ "ram", 3, "audio/x-pn-realaudio", 20 },
+	{ "sv4crc", 6, "application/x-sv4crc", 20 },
+	{ "stw", 3, "application/vnd.sun.xml.writer.template", 39 },
+	{ "ice", 3, "x-conference/x-cooltalk", 23 },
+	{ NULL, 0, NULL, 0 },
+	{ "mp4", 3, "video/mp4", 9 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "kar", 3, "audio/midi", 10 },
+	{ "der", 3, "application/x-x509-ca-cert", 26 },
+	{ "std", 3, "application/vnd.sun.xml.draw.template", 37 },
+	{ NULL, 0, NULL, 0 },
+	{ "dir", 3, "application/x-director", 22 },
+	{ "lzh", 3, "application/octet-stream", 24 },
+	{ NULL, 0, NULL, 0 },
+	{ "wmd", 3, "application/x-ms-wmd", 20 },
+	{ "bmp", 3, "image/bmp", 9 },
+	{ "snd", 3, "audio/basic", 11 },
+	{ "m3u", 3, "audio/x-mpegurl", 15 },
+	{ "asf", 3, "video/x-ms-asf", 14 },
+	{ "pgm", 3, "image/x-portable-graymap", 24 },
+	{ "ppt", 3, "application/vnd.ms-powerpoint", 29 },
+	{ "sxw", 3, "application/vnd.sun.xml.writer", 30 },
+	{ NULL, 0, NULL, 0 },
+	{ "stc", 3, "application/vnd.sun.xml.calc.template", 37 },
+	{ "spl", 3, "application/x-futuresplash", 26 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "svgz", 4, "image/svg+xml", 13 },
+	{ "tif", 3, "image/tiff", 10 },
+	{ "hqx", 3, "application/mac-binhex40", 24 },
+	{ "man", 3, "application/x-troff-man", 23 },
+	{ "crl", 3, "application/x-pkcs7-crl", 23 },
+	{ "tiff", 4, "image/tiff", 10 },
+	{ "aam", 3, "application/x-authorware-map", 28 },
+	{ "wmls", 4, "text/vnd.wap.wmlscript", 22 },
+	{ "wmv", 3, "video/x-ms-wmv", 14 },
+	{ "jfif", 4, "image/jpeg", 10 },
+	{ "ogg", 3, "application/ogg", 15 },
+	{ "sxd", 3, "application/vnd.sun.xml.draw", 28 },
+	{ "skd", 3, "application/x-koan", 18 },
+	{ NULL, 0, NULL, 0 },
+	{ "aif", 3, "audio/x-aiff", 12 },
+	{ "dcr", 3, "application/x-director", 22 },
+	{ "sfx", 3, "application/octet-stream", 24 },
+	{ "pbm", 3, "image/x-portable-bitmap", 23 },
+	{ NULL, 0, NULL, 0 },
+	{ "rss", 3, "application/rss+xml", 19 },
+	{ "png", 3, "image/png", 9 },
+	{ "fh5", 3, "image/x-freehand", 16 },
+	{ "arj", 3, "application/octet-stream", 24 },
+	{ "etx", 3, "text/x-setext", 13 },
+	{ "aab", 3, "application/x-authorware-bin", 28 },
+	{ "xpi", 3, "application/x-xpinstall", 23 },
+	{ "texinfo", 7, "application/x-texinfo", 21 },
+	{ "vx", 2, "video/x-rad-screenplay", 22 },
+	{ NULL, 0, NULL, 0 },
+	{ "torrent", 7, "application/x-bittorrent", 24 },
+	{ "latex", 5, "application/x-latex", 19 },
+	{ "iv", 2, "application/x-inventor", 22 },
+	{ "mime", 4, "message/rfc822", 14 },
+	{ "htm", 3, "text/html; charset=%s", 21 },
+	{ "ico", 3, "image/x-icon", 12 },
+	{ "mif", 3, "application/vnd.mif", 19 },
+	{ "rdf", 3, "application/rdf+xml", 19 },
+	{ "pnm", 3, "image/x-portable-anymap", 23 },
+	{ "pgn", 3, "application/x-chess-pgn", 23 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+	{ "sxg", 3, "application/vnd.sun.xml.writer.global", 37 },
+	{ "wbxml", 5, "application/vnd.wap.wbxml", 25 },
+	{ "sxc", 3, "application/vnd.sun.xml.calc", 28 },
+	{ "sxm", 3, "application/vnd.sun.xml.math", 28 },
+	{ "kml", 3, "application/vnd.google-earth.kml+xml", 36 },
+	{ "asc", 3, "text/plain; charset=%s", 22 },
+	{ "ppm", 3, "image/x-portable-pixmap", 23 },
+	{ "bz2", 3, "application/octet-stream", 24 },
+	{ "lha", 3, "application/octet-stream", 24 },
+	{ "me", 2, "application/x-troff-me", 22 },
+	{ "sxi", 3, "application/vnd.sun.xml.impress", 31 },
+	{ "xsd", 3, "text/xml; charset=%s", 20 },
+	{ "svgx", 4, "image/svg+xml", 13 },
+	{ "smi", 3, "application/smil", 16 },
+	{ "tsv", 3, "text/tab-separated-values; charset=%s", 37 },
+	{ "tgz", 3, "application/octet-stream", 24 },
+	{ "cpt", 3, "application/mac-compactpro", 26 },
+	{ "xls", 3, "application/vnd.ms-excel", 24 },
+	{ "silo", 4, "model/mesh", 10 },
+	{ "exe", 3, "application/octet-stream", 24 },
+	{ NULL, 0, NULL, 0 },
+	{ "a", 1, "application/octet-stream", 24 },
+	{ "ms", 2, "application/x-troff-ms", 22 },
+	{ "arc", 3, "application/octet-stream", 24 },
+	{ "xhtml", 5, "application/xhtml+xml; charset=%s", 33 },
+	{ "loc", 3, "application/xml-loc", 19 },
+	{ "mpe", 3, "video/mpeg", 10 },
+	{ "fhc", 3, "image/x-freehand", 16 },
+	{ "tsp", 3, "application/dsptype", 19 },
+	{ "xul", 3, "application/vnd.mozilla.xul+xml", 31 },
+	{ "ai", 2, "application/postscript", 22 },
+	{ "pdf", 3, "application/pdf", 15 },
+	{ "class", 5, "application/x-java-vm", 21 },
+	{ "tex", 3, "application/x-tex", 17 },
+	{ "sit", 3, "application/x-stuffit", 21 },
+	{ "js", 2, "application/javascript", 22 },
+	{ "skp", 3, "application/x-koan", 18 },
+	{ "zoo", 3, "application/octet-stream", 24 },
+	{ "fh4", 3, "image/x-freehand", 16 },
+	{ NULL, 0, NULL, 0 },
+	{ "doc", 3, "application/msword", 18 },
+	{ "dll", 3, "application/octet-stream", 24 },
+	{ NULL, 0, NULL, 0 },
+	{ "aas", 3, "application/x-authorware-seg", 28 },
+	{ "smil", 4, "application/smil", 16 },
+	{ "eps", 3, "application/postscript", 22 },
+	{ "wml", 3, "text/vnd.wap.wml", 16 },
+	{ "tcl", 3, "application/x-tcl", 17 },
+};
@@ -47,9 +47,13 @@
 # endif
 #endif
 #include <sys/mman.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 #include "file.h"
 #include "libhttpd.h"
+#include "md5.h"
 #include "mmc.h"
 
 
@@ -66,9 +70,21 @@
 #ifndef DESIRED_MAX_MAPPED_BYTES
 #define DESIRED_MAX_MAPPED_BYTES 1000000000
 #endif
+#ifndef DESIRED_MAX_GZIP_BYTES
+#define DESIRED_MAX_GZIP_BYTES (64 * 1024 * 1024)
+#endif
+#ifndef MAX_GZIP_FILE_SIZE
+#define MAX_GZIP_FILE_SIZE (4 * 1024 * 1024)
+#endif
 #ifndef INITIAL_HASH_SIZE
 #define INITIAL_HASH_SIZE (1 << 10)
 #endif
+#ifndef BODY_CACHE_AGE
+#define BODY_CACHE_AGE 60
+#endif
+#ifndef MAX_WILLNEED_SIZE
+#define MAX_WILLNEED_SIZE (1024 * 1024)
+#endif
 
 #ifndef MAX
 #define MAX(a,b) ((a)>(b)?(a):(b))
@@ -86,27 +102,63 @@ typedef struct MapStruct {
 	int refcount;
 	time_t reftime;
 	void *addr;
+	char etag[MD5_DIGEST_STRING_LENGTH + 2];	/* Lazily computed */
+	void *gzaddr;		/* Lazily compressed copy, or NULL */
+	off_t gzsize;
+	char *hdr;		/* Cached response headers, or NULL */
+	size_t hdrlen;
+	const void *hdrkey;
+	const char *hdrtype;
+	int malloced;		/* Built-in icon copy or body, not mmap()ed */
+	char *key;		/* Generated body, see mmc_body(), or NULL */
+	char *name;		/* File name, for mmc_manifest(), or NULL */
+	long hits;
+	time_t born;
 	unsigned int hash;
-	int hash_idx;
+	struct MapStruct *hnext;	/* Hash chain */
+	struct MapStruct *lru_prev;	/* Unreferenced maps, oldest first */
+	struct MapStruct *lru_next;
+	struct MapStruct *prev;
 	struct MapStruct *next;
 } Map;
 
+/* A file queued by mmc_warm(), sb is from when it was read in */
+typedef struct {
+	char *name;
+	int etag;
+	int gzip;
+	struct stat sb;
+} Warm;
+
 /* Globals. */
 static Map *maps = NULL;
 static Map *free_maps = NULL;
+static Map *lru_head = NULL, *lru_tail = NULL;
 static int alloc_count = 0, map_count = 0, free_count = 0;
 static Map **hash_table = NULL;
 static int hash_size;
 static unsigned int hash_mask;
 static time_t expire_age = DEFAULT_EXPIRE_AGE;
+static off_t max_mapped_bytes = DESIRED_MAX_MAPPED_BYTES;
 static off_t mapped_bytes = 0;
+static int gzip_count = 0;
+static off_t gzip_bytes = 0;
+static long gzip_hits = 0;
+static long hit_count = 0, miss_count = 0;	/* Never reset, see mmc_getstats() */
+static long evict_count = 0;
+static Warm *warm_list = NULL;
+static int warm_count = 0, warm_next = 0, warm_done = 0;
 
 /* Forwards. */
-static void panic(void);
-static void really_unmap(Map **mm);
+static void lru_add(Map *m);
+static void lru_del(Map *m);
+static off_t evict(off_t bytes);
+static void really_unmap(Map *m);
 static int check_hash_size(void);
-static int add_hash(Map *m);
+static void add_hash(Map *m);
+static Map *find_addr(void *addr, struct stat *sbP);
 static Map *find_hash(ino_t ino, dev_t dev, off_t size, time_t ctime);
+static Map *find_body(const struct stat *sbP, const char *key, time_t now);
 static unsigned int hash(ino_t ino, dev_t dev, off_t size, time_t ctime);
 
 #ifdef BUILTIN_ICONS
@@ -209,6 +261,25 @@ static off_t mmc_icon_open(char *filename, char **buf, struct stat *st)
 }
 #endif /* BUILTIN_ICONS */
 
+void mmc_init(off_t max_bytes)
+{
+	if (max_bytes > 0)
+		max_mapped_bytes = max_bytes;
+}
+
+/* Existing map, no longer up for eviction while referenced */
+static void *hit(Map *m, time_t now)
+{
+	if (m->refcount == 0)
+		lru_del(m);
+	++m->refcount;
+	m->reftime = now;
+	++m->hits;
+	++hit_count;
+
+	return m->addr;
+}
+
 void *mmc_map(char *filename, struct stat *sbP, struct timeval *nowP)
 {
 	time_t now;
@@ -242,10 +313,7 @@ void *mmc_map(char *filename, struct stat *sbP, struct timeval *nowP)
 	m = find_hash(sb.st_ino, sb.st_dev, sb.st_size, sb.st_ctime);
 	if (m) {
 		/* Yep.  Just return the existing map */
-		++m->refcount;
-		m->reftime = now;
-
-		return m->addr;
+		return hit(m, now);
 	}
 
 	/* Open the file. */
@@ -255,6 +323,31 @@ void *mmc_map(char *filename, struct stat *sbP, struct timeval *nowP)
 			syslog(LOG_ERR, "open: %s", strerror(errno));
 			return NULL;
 		}
+	} else {
+		struct stat fsb;
+
+		/* The stat buffer may be from the stat cache and a few
+		** seconds old, make sure we map what we actually opened.
+		*/
+		if (!fstat(fd, &fsb) && (fsb.st_ino != sb.st_ino || fsb.st_dev != sb.st_dev ||
+					 fsb.st_size != sb.st_size || fsb.st_ctime != sb.st_ctime)) {
+			sb = fsb;
+			if (sbP)
+				*sbP = sb;
+
+			m = find_hash(sb.st_ino, sb.st_dev, sb.st_size, sb.st_ctime);
+			if (m) {
+				close(fd);
+				return hit(m, now);
+			}
+		}
+	}
+	++miss_count;
+
+	/* Make room within the budget, least recently used maps go first */
+	while (lru_head && (mapped_bytes + sb.st_size > max_mapped_bytes || map_count >= DESIRED_MAX_MAPPED_FILES)) {
+		really_unmap(lru_head);
+		++evict_count;
 	}
 
 	/* Find a free Map entry or make a new one. */
@@ -281,6 +374,16 @@ void *mmc_map(char *filename, struct stat *sbP, struct timeval *nowP)
 	m->ctime = sb.st_ctime;
 	m->refcount = 1;
 	m->reftime = now;
+	m->etag[0] = 0;
+	m->gzaddr = NULL;
+	m->gzsize = 0;
+	m->hdr = NULL;
+	m->hdrlen = 0;
+	m->malloced = 0;
+	m->key = NULL;
+	m->name = buf ? NULL : strdup(filename);
+	m->hits = 0;
+	m->born = now;
 
 	/* Avoid doing anything for zero-length files; some systems don't like
 	** to mmap them, other systems dislike mallocing zero bytes.
@@ -300,16 +403,16 @@ void *mmc_map(char *filename, struct stat *sbP, struct timeval *nowP)
 				return NULL;
 			}
 			memcpy(m->addr, buf, size_size);
+			m->malloced = 1;
 			goto cont;
 		}
 
 		/* Map the file into memory. */
 		m->addr = mmap(0, size_size, PROT_READ, MAP_PRIVATE, fd, 0);
-		if (m->addr == (void *)-1 && errno == ENOMEM) {
-			/* Ooo, out of address space.  Free all unreferenced maps
-			 ** and try again.
+		while (m->addr == (void *)-1 && errno == ENOMEM && evict(m->size)) {
+			/* Ooo, out of address space.  Free the least recently
+			 ** used unreferenced maps and try again.
 			 */
-			panic();
 			m->addr = mmap(0, size_size, PROT_READ, MAP_PRIVATE, fd, 0);
 		}
 
@@ -321,20 +424,26 @@ void *mmc_map(char *filename, struct stat *sbP, struct timeval *nowP)
 
 			return NULL;
 		}
+
+#ifdef MADV_WILLNEED
+		/* Small files are likely sent in full right away, so start
+		** reading them in now.  Larger ones are mostly read front to
+		** back, let the kernel read ahead more aggressively.
+		*/
+		if (madvise(m->addr, size_size, size_size <= MAX_WILLNEED_SIZE ? MADV_WILLNEED : MADV_SEQUENTIAL))
+			syslog(LOG_DEBUG, "madvise: %s", strerror(errno));
+#endif
 	}
 	close(fd);
 cont:
 	/* Put the Map into the hash table. */
-	if (add_hash(m) < 0) {
-		syslog(LOG_ERR, "add_hash() failure");
-		free(m);
-		--alloc_count;
-
-		return NULL;
-	}
+	add_hash(m);
 
 	/* Put the Map on the active list. */
+	m->prev = NULL;
 	m->next = maps;
+	if (maps)
+		maps->prev = m;
 	maps = m;
 	++map_count;
 
@@ -348,23 +457,9 @@ cont:
 
 void mmc_unmap(void *addr, struct stat *sbP, struct timeval *nowP)
 {
-	Map *m = NULL;
-
-	/* Find the Map entry for this address.  First try a hash. */
-	if (sbP) {
-		m = find_hash(sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime);
-		if (m && m->addr != addr)
-			m = NULL;
-	}
-
-	/* If that didn't work, try a full search. */
-	if (!m) {
-		for (m = maps; m; m = m->next) {
-			if (m->addr == addr)
-				break;
-		}
-	}
+	Map *m;
 
+	m = find_addr(addr, sbP);
 	if (!m) {
 		syslog(LOG_ERR, "mmc_unmap failed to find entry!");
 		return;
@@ -379,39 +474,472 @@ void mmc_unmap(void *addr, struct stat *sbP, struct timeval *nowP)
 		m->reftime = nowP->tv_sec;
 	else
 		m->reftime = time(NULL);
+
+	/* Unreferenced, newest at the tail of the LRU list */
+	if (m->refcount == 0)
+		lru_add(m);
 }
 
 
-void mmc_cleanup(struct timeval *nowP)
+/* Fake a stat buffer for a body, it inherits the identity of its source */
+static void body_stat(Map *m, const struct stat *src, struct stat *sbP)
+{
+	*sbP = *src;
+	sbP->st_mode = S_IFREG | 0444;
+	sbP->st_size = m->size;
+}
+
+void *mmc_body(const struct stat *src, const char *key, struct stat *sbP, struct timeval *nowP)
 {
 	time_t now;
-	Map **mm;
 	Map *m;
 
-	/* Get the current time, if necessary. */
 	if (nowP)
 		now = nowP->tv_sec;
 	else
 		now = time(NULL);
 
-	/* Really unmap any unreferenced entries older than the age limit. */
-	for (mm = &maps; *mm;) {
-		m = *mm;
-		if (m->refcount == 0 && now - m->reftime >= expire_age)
-			really_unmap(mm);
+	if (check_hash_size() < 0) {
+		syslog(LOG_ERR, "check_hash_size() failure");
+		return NULL;
+	}
+
+	m = find_body(src, key, now);
+	if (!m) {
+		++miss_count;
+		return NULL;
+	}
+
+	body_stat(m, src, sbP);
+	return hit(m, now);
+}
+
+void *mmc_add_body(const struct stat *src, const char *key, void *buf, size_t len, struct stat *sbP, struct timeval *nowP)
+{
+	time_t now;
+	Map *m;
+
+	if (nowP)
+		now = nowP->tv_sec;
+	else
+		now = time(NULL);
+
+	if (check_hash_size() < 0) {
+		syslog(LOG_ERR, "check_hash_size() failure");
+		free(buf);
+		return NULL;
+	}
+
+	/* Another connection may have built the same body meanwhile */
+	m = find_body(src, key, now);
+	if (m) {
+		free(buf);
+		body_stat(m, src, sbP);
+		return hit(m, now);
+	}
+
+	while (lru_head && (mapped_bytes + (off_t)len > max_mapped_bytes || map_count >= DESIRED_MAX_MAPPED_FILES)) {
+		really_unmap(lru_head);
+		++evict_count;
+	}
+
+	if (free_maps) {
+		m = free_maps;
+		free_maps = m->next;
+		--free_count;
+	} else {
+		m = (Map *)malloc(sizeof(Map));
+		if (!m) {
+			syslog(LOG_ERR, "out of memory allocating a Map");
+			free(buf);
+			return NULL;
+		}
+		++alloc_count;
+	}
+
+	m->key = strdup(key);
+	if (!m->key) {
+		syslog(LOG_ERR, "out of memory allocating a Map");
+		m->next = free_maps;
+		free_maps = m;
+		++free_count;
+		free(buf);
+		return NULL;
+	}
+
+	m->ino = src->st_ino;
+	m->dev = src->st_dev;
+	m->size = len;
+	m->ctime = src->st_ctime;
+	m->refcount = 1;
+	m->reftime = now;
+	m->born = now;
+	m->etag[0] = 0;
+	m->gzaddr = NULL;
+	m->gzsize = 0;
+	m->hdr = NULL;
+	m->hdrlen = 0;
+	m->name = NULL;
+	m->hits = 0;
+	m->malloced = 1;
+	if (len > 0) {
+		m->addr = buf;
+	} else {
+		free(buf);
+		m->addr = (void *)1;
+		m->malloced = 0;
+	}
+
+	add_hash(m);
+	m->prev = NULL;
+	m->next = maps;
+	if (maps)
+		maps->prev = m;
+	maps = m;
+	++map_count;
+	mapped_bytes += m->size;
+
+	body_stat(m, src, sbP);
+	return m->addr;
+}
+
+
+const char *mmc_etag(void *addr, struct stat *sbP)
+{
+	u_int8_t dig[MD5_DIGEST_LENGTH];
+	MD5_CTX ctx;
+	Map *m;
+
+	/* Without an address we can only look for an already mapped file */
+	if (!addr) {
+		if (!sbP || !hash_table)
+			return NULL;
+
+		m = find_hash(sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime);
+		if (!m)
+			return NULL;
+	} else {
+		m = find_addr(addr, sbP);
+		if (!m) {
+			syslog(LOG_ERR, "mmc_etag failed to find entry!");
+			return NULL;
+		}
+	}
+
+	/* Only hash each version of a file once, the Map is keyed on ctime */
+	if (!m->etag[0]) {
+		MD5Init(&ctx);
+		if (m->size > 0)
+			MD5Update(&ctx, (const u_int8_t *)m->addr, m->size);
+		MD5Final(dig, &ctx);
+		snprintf(m->etag, sizeof(m->etag),
+			 "\"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\"",
+			 dig[0], dig[1], dig[2], dig[3], dig[4], dig[5], dig[6], dig[7],
+			 dig[8], dig[9], dig[10], dig[11], dig[12], dig[13], dig[14], dig[15]);
+	}
+
+	return m->etag;
+}
+
+
+const char *mmc_headers(void *addr, struct stat *sbP, const void *key, const char *type, size_t *lenP)
+{
+	Map *m;
+
+	m = find_addr(addr, sbP);
+	if (!m || !m->hdr || m->hdrkey != key || m->hdrtype != type)
+		return NULL;
+
+	*lenP = m->hdrlen;
+
+	return m->hdr;
+}
+
+
+void mmc_set_headers(void *addr, struct stat *sbP, const void *key, const char *type, const char *hdr, size_t len)
+{
+	Map *m;
+	char *ptr;
+
+	m = find_addr(addr, sbP);
+	if (!m)
+		return;
+
+	/* Same file served by another vhost, or with another MIME type */
+	ptr = realloc(m->hdr, len);
+	if (!ptr)
+		return;
+
+	memcpy(ptr, hdr, len);
+	m->hdr = ptr;
+	m->hdrlen = len;
+	m->hdrkey = key;
+	m->hdrtype = type;
+}
+
+
+#ifdef HAVE_ZLIB_H
+void *mmc_gzip(void *addr, struct stat *sbP, int level, off_t *sizeP)
+{
+	z_stream zs;
+	uLong bound;
+	void *buf, *ptr;
+	Map *m;
+	int rc;
+
+	m = find_addr(addr, sbP);
+	if (!m) {
+		syslog(LOG_ERR, "mmc_gzip failed to find entry!");
+		return NULL;
+	}
+
+	if (m->gzaddr) {
+		++gzip_hits;
+		*sizeP = m->gzsize;
+		return m->gzaddr;
+	}
+
+	/* Leave huge files, and overflow, to on-the-fly deflate */
+	if (m->size == 0 || m->size > MAX_GZIP_FILE_SIZE || gzip_bytes + m->size > DESIRED_MAX_GZIP_BYTES)
+		return NULL;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		syslog(LOG_ERR, "zlib deflateInit2() failed!");
+		return NULL;
+	}
+
+	/* With windowBits 15 + 16 zlib adds the gzip header and trailer */
+	bound = deflateBound(&zs, m->size);
+	buf = malloc(bound);
+	if (!buf) {
+		syslog(LOG_ERR, "out of memory allocating gzip cache entry");
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in   = (Bytef *)m->addr;
+	zs.avail_in  = m->size;
+	zs.next_out  = (Bytef *)buf;
+	zs.avail_out = bound;
+	rc = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (rc != Z_STREAM_END) {
+		syslog(LOG_ERR, "zlib deflate() failed!");
+		free(buf);
+		return NULL;
+	}
+
+	ptr = realloc(buf, zs.total_out);
+	m->gzaddr = ptr ? ptr : buf;
+	m->gzsize = zs.total_out;
+
+	++gzip_count;
+	gzip_bytes += m->gzsize;
+
+	*sizeP = m->gzsize;
+	return m->gzaddr;
+}
+#else
+void *mmc_gzip(void *addr, struct stat *sbP, int level, off_t *sizeP)
+{
+	return NULL;
+}
+#endif /* HAVE_ZLIB_H */
+
+
+/* Hottest first */
+static int hits_cmp(const void *a, const void *b)
+{
+	const Map *x = *(const Map **)a, *y = *(const Map **)b;
+
+	return x->hits < y->hits ? 1 : x->hits > y->hits ? -1 : 0;
+}
+
+int mmc_manifest(FILE *fp, int max)
+{
+	Map **list, *m;
+	int i, n = 0;
+
+	list = malloc((map_count + 1) * sizeof(Map *));
+	if (!list) {
+		syslog(LOG_ERR, "out of memory writing cache manifest");
+		return -1;
+	}
+
+	/* One file per line, leave out any name that would break that */
+	for (m = maps; m; m = m->next) {
+		if (m->name && !strchr(m->name, '\n'))
+			list[n++] = m;
+	}
+	qsort(list, n, sizeof(Map *), hits_cmp);
+
+	if (n > max)
+		n = max;
+	fprintf(fp, "# size etag/gzip name, most requested first\n");
+	for (i = 0; i < n; i++) {
+		m = list[i];
+		fprintf(fp, "%lld %c%c %s\n", (long long)m->size, m->etag[0] ? 'e' : '-',
+			m->gzaddr ? 'z' : '-', m->name);
+	}
+	free(list);
+
+	if (fflush(fp) || ferror(fp))
+		return -1;
+
+	return n;
+}
+
+
+static void warm_free(void)
+{
+	while (warm_next < warm_count)
+		free(warm_list[warm_next++].name);
+	free(warm_list);
+	warm_list = NULL;
+	warm_count = warm_next = warm_done = 0;
+}
+
+int mmc_warm(FILE *fp, int max)
+{
+	char buf[MAXPATHLEN + 64];
+	off_t total = 0;
+
+	warm_free();
+	warm_list = calloc(max, sizeof(Warm));
+	if (!warm_list)
+		return 0;
+
+	while (warm_count < max && fgets(buf, sizeof(buf), fp)) {
+		char flags[3], *name;
+		long long size;
+		int len;
+
+		/* Skip comments, and anything mangled or cut short */
+		buf[strcspn(buf, "\n")] = 0;
+		if (sscanf(buf, "%lld %2s %n", &size, flags, &len) != 2 || size < 0 || strlen(flags) != 2)
+			continue;
+		name = &buf[len];
+		if (!name[0])
+			continue;
+
+		/* No point in reading in more than the cache holds */
+		if (total + size > max_mapped_bytes)
+			continue;
+		total += size;
+
+		warm_list[warm_count].name = strdup(name);
+		if (!warm_list[warm_count].name)
+			break;
+		warm_list[warm_count].etag = flags[0] == 'e';
+		warm_list[warm_count].gzip = flags[1] == 'z';
+		warm_count++;
+	}
+
+	if (!warm_count)
+		warm_free();
+
+	return warm_count;
+}
+
+/* Read in the next files, about bytes worth, at least one */
+static void warm_read(off_t bytes, struct timeval *nowP)
+{
+	off_t sum = 0;
+
+	while (sum < bytes && warm_next < warm_count) {
+		Warm *w = &warm_list[warm_next++];
+		void *addr;
+
+		/* Gone, or replaced by something we would not serve from here */
+		if (stat(w->name, &w->sb) || !S_ISREG(w->sb.st_mode) ||
+		    mapped_bytes + w->sb.st_size > max_mapped_bytes)
+			addr = NULL;
 		else
-			mm = &(*mm)->next;
+			addr = mmc_map(w->name, &w->sb, nowP);
+		free(w->name);
+		if (!addr) {
+			w->etag = w->gzip = 0;
+			continue;
+		}
+		sum += w->sb.st_size;
+
+#ifdef MADV_WILLNEED
+		/* The file is likely wanted soon, have all of it read in */
+		if (w->sb.st_size > 0 && madvise(addr, w->sb.st_size, MADV_WILLNEED))
+			syslog(LOG_DEBUG, "madvise: %s", strerror(errno));
+#endif
+		mmc_unmap(addr, &w->sb, nowP);
 	}
+}
+
+/* ETag and gzip copy of the files read in, about bytes worth at a time.
+** Files larger than that are left for their first request.
+*/
+static void warm_derive(int level, off_t bytes, struct timeval *nowP)
+{
+	off_t sum = 0, len;
 
-	/* Adjust the age limit if there are too many bytes mapped, or
-	 ** too many or too few files mapped.
-	 */
-	if (mapped_bytes > DESIRED_MAX_MAPPED_BYTES)
-		expire_age = MAX((expire_age * 2) / 3, DEFAULT_EXPIRE_AGE / 10);
-	else if (map_count > DESIRED_MAX_MAPPED_FILES)
-		expire_age = MAX((expire_age * 2) / 3, DEFAULT_EXPIRE_AGE / 10);
-	else if (map_count < DESIRED_MAX_MAPPED_FILES / 2)
-		expire_age = MIN((expire_age * 5) / 4, DEFAULT_EXPIRE_AGE * 3);
+	while (sum < bytes && warm_done < warm_count) {
+		Warm *w = &warm_list[warm_done++];
+		Map *m;
+
+		if (!w->etag && !(w->gzip && level))
+			continue;
+		if (w->sb.st_size > bytes)
+			continue;
+
+		/* Evicted already, or changed since */
+		m = find_hash(w->sb.st_ino, w->sb.st_dev, w->sb.st_size, w->sb.st_ctime);
+		if (!m)
+			continue;
+		sum += w->sb.st_size;
+
+		/* Held while we work on it, but not counted as a hit */
+		if (m->refcount++ == 0)
+			lru_del(m);
+		if (w->etag)
+			mmc_etag(m->addr, &w->sb);
+		if (w->gzip && level)
+			mmc_gzip(m->addr, &w->sb, level, &len);
+		mmc_unmap(m->addr, &w->sb, nowP);
+	}
+}
+
+int mmc_warm_up(int level, off_t bytes, struct timeval *nowP)
+{
+	/* All files are read in before any hashing or compressing, by then
+	** the kernel has had a few rounds to get them off the disk.
+	*/
+	if (warm_next < warm_count)
+		warm_read(bytes, nowP);
+	else
+		warm_derive(level, bytes, nowP);
+
+	if (warm_done == warm_count) {
+		warm_free();
+		return 0;
+	}
+
+	return warm_count - warm_done;
+}
+
+void mmc_cleanup(struct timeval *nowP)
+{
+	time_t now;
+	Map *m;
+
+	/* Get the current time, if necessary. */
+	if (nowP)
+		now = nowP->tv_sec;
+	else
+		now = time(NULL);
+
+	/* Really unmap any unreferenced entries older than the age limit.
+	** The LRU list is in reftime order, so stop at the first younger.
+	*/
+	while (lru_head && now - lru_head->reftime >= expire_age)
+		really_unmap(lru_head);
 
 	/* Really free excess blocks on the free list. */
 	while (free_count > DESIRED_FREE_COUNT) {
@@ -424,30 +952,56 @@ void mmc_cleanup(struct timeval *nowP)
 }
 
 
-static void panic(void)
+static void lru_add(Map *m)
 {
-	Map **mm;
-	Map *m;
+	m->lru_next = NULL;
+	m->lru_prev = lru_tail;
+	if (lru_tail)
+		lru_tail->lru_next = m;
+	else
+		lru_head = m;
+	lru_tail = m;
+}
 
-	syslog(LOG_ERR, "mmc panic - freeing all unreferenced maps");
 
-	/* Really unmap all unreferenced entries. */
-	for (mm = &maps; *mm;) {
-		m = *mm;
-		if (m->refcount == 0)
-			really_unmap(mm);
-		else
-			mm = &(*mm)->next;
+static void lru_del(Map *m)
+{
+	if (m->lru_prev)
+		m->lru_prev->lru_next = m->lru_next;
+	else
+		lru_head = m->lru_next;
+	if (m->lru_next)
+		m->lru_next->lru_prev = m->lru_prev;
+	else
+		lru_tail = m->lru_prev;
+	m->lru_prev = m->lru_next = NULL;
+}
+
+
+/* Unmap least recently used maps until at least bytes have been freed.
+** Returns the number of bytes actually freed, 0 if nothing was left.
+*/
+static off_t evict(off_t bytes)
+{
+	off_t freed = 0;
+
+	while (lru_head && freed < bytes) {
+		freed += lru_head->size;
+		really_unmap(lru_head);
+		++evict_count;
 	}
+
+	return freed;
 }
 
 
-static void really_unmap(Map **mm)
+static void really_unmap(Map *m)
 {
-	Map *m;
+	Map **mm;
 
-	m = *mm;
-	if (m->size) {
+	if (m->malloced) {
+		free(m->addr);
+	} else if (m->size) {
 		if (munmap(m->addr, m->size) < 0)
 			syslog(LOG_ERR, "munmap: %s", strerror(errno));
 	}
@@ -455,17 +1009,50 @@ static void really_unmap(Map **mm)
 	/* Update the total byte count. */
 	mapped_bytes -= m->size;
 
+	if (m->gzaddr) {
+		free(m->gzaddr);
+		m->gzaddr = NULL;
+		--gzip_count;
+		gzip_bytes -= m->gzsize;
+	}
+
+	if (m->hdr) {
+		free(m->hdr);
+		m->hdr = NULL;
+	}
+
+	if (m->key) {
+		free(m->key);
+		m->key = NULL;
+	}
+
+	if (m->name) {
+		free(m->name);
+		m->name = NULL;
+	}
+
+	if (m->refcount == 0)
+		lru_del(m);
+
+	/* Drop it from its hash chain. */
+	for (mm = &hash_table[m->hash]; *mm; mm = &(*mm)->hnext) {
+		if (*mm == m) {
+			*mm = m->hnext;
+			break;
+		}
+	}
+
 	/* And move the Map to the free list. */
-	*mm = m->next;
+	if (m->prev)
+		m->prev->next = m->next;
+	else
+		maps = m->next;
+	if (m->next)
+		m->next->prev = m->prev;
 	--map_count;
 	m->next = free_maps;
 	free_maps = m;
 	++free_count;
-
-	/* This will sometimes break hash chains, but that's harmless; the
-	 ** unmapping code that searches the hash table knows to keep searching.
-	 */
-	hash_table[m->hash_idx] = NULL;
 }
 
 
@@ -473,8 +1060,10 @@ void mmc_destroy(void)
 {
 	Map *m;
 
+	warm_free();
+
 	while (maps)
-		really_unmap(&maps);
+		really_unmap(maps);
 
 	while (free_maps) {
 		m         = free_maps;
@@ -497,7 +1086,7 @@ static int check_hash_size(void)
 	int i;
 	Map *m;
 
-	/* At least three times bigger than the number of entries? */
+	/* At least three times more chains than the number of entries? */
 	if (hash_table && hash_size >= map_count * 3)
 		return 0;
 
@@ -526,54 +1115,76 @@ static int check_hash_size(void)
 		hash_table[i] = NULL;
 
 	/* And rehash all entries. */
-	for (m = maps; m; m = m->next) {
-		if (add_hash(m) < 0)
-			return -1;
-	}
+	for (m = maps; m; m = m->next)
+		add_hash(m);
 
 	return 0;
 }
 
 
-static int add_hash(Map *m)
+/* Bodies are looked up before their size is known, so leave it out */
+static void add_hash(Map *m)
 {
-	unsigned int h, he, i;
+	m->hash = hash(m->ino, m->dev, m->key ? 0 : m->size, m->ctime);
+	m->hnext = hash_table[m->hash];
+	hash_table[m->hash] = m;
+}
+
 
-	h = hash(m->ino, m->dev, m->size, m->ctime);
-	he = (h + hash_size - 1) & hash_mask;
-	for (i = h;; i = (i + 1) & hash_mask) {
-		if (!hash_table[i]) {
-			hash_table[i] = m;
-			m->hash = h;
-			m->hash_idx = i;
-			return 0;
+/* Find the Map entry for an address.  First try a hash, then a full search. */
+static Map *find_addr(void *addr, struct stat *sbP)
+{
+	Map *m = NULL;
+
+	if (sbP) {
+		for (m = hash_table[hash(sbP->st_ino, sbP->st_dev, sbP->st_size, sbP->st_ctime)]; m; m = m->hnext) {
+			if (m->addr == addr)
+				break;
 		}
+		if (!m) {
+			for (m = hash_table[hash(sbP->st_ino, sbP->st_dev, 0, sbP->st_ctime)]; m; m = m->hnext) {
+				if (m->addr == addr)
+					break;
+			}
+		}
+	}
 
-		if (i == he)
-			break;
+	if (!m) {
+		for (m = maps; m; m = m->next) {
+			if (m->addr == addr)
+				break;
+		}
 	}
 
-	return -1;
+	return m;
 }
 
 
 static Map *find_hash(ino_t ino, dev_t dev, off_t size, time_t ctime)
 {
-	unsigned int h, he, i;
 	Map *m;
 
-	h = hash(ino, dev, size, ctime);
-	he = (h + hash_size - 1) & hash_mask;
-	for (i = h;; i = (i + 1) & hash_mask) {
-		m = hash_table[i];
-		if (!m)
-			break;
-
-		if (m->hash == h && m->ino == ino && m->dev == dev && m->size == size && m->ctime == ctime)
+	for (m = hash_table[hash(ino, dev, size, ctime)]; m; m = m->hnext) {
+		if (!m->key && m->ino == ino && m->dev == dev && m->size == size && m->ctime == ctime)
 			return m;
+	}
 
-		if (i == he)
-			break;
+	return NULL;
+}
+
+
+/* Bodies older than BODY_CACHE_AGE are no longer handed out, they
+** linger until unreferenced and then age out like any other map.
+*/
+static Map *find_body(const struct stat *sbP, const char *key, time_t now)
+{
+	Map *m;
+
+	for (m = hash_table[hash(sbP->st_ino, sbP->st_dev, 0, sbP->st_ctime)]; m; m = m->hnext) {
+		if (m->key && m->ino == sbP->st_ino && m->dev == sbP->st_dev &&
+		    m->ctime == sbP->st_ctime && now - m->born < BODY_CACHE_AGE &&
+		    !strcmp(m->key, key))
+			return m;
 	}
 
 	return NULL;
@@ -596,11 +1207,28 @@ static unsigned int hash(ino_t ino, dev_t dev, off_t size, time_t ctime)
 }
 
 
+void mmc_getstats(struct mmc_stats *st)
+{
+	st->maps = map_count;
+	st->mapped_bytes = mapped_bytes;
+	st->gzip_count = gzip_count;
+	st->gzip_bytes = gzip_bytes;
+	st->hits = hit_count;
+	st->misses = miss_count;
+	st->evictions = evict_count;
+}
+
+
 /* Generate debugging statistics syslog message. */
 void mmc_logstats(long secs)
 {
-	syslog(LOG_INFO, "map cache - %d allocated, %d active (%lld bytes), %d free; hash size: %d; expire age: %lld",
-	       alloc_count, map_count, (long long)mapped_bytes, free_count, hash_size, (long long)expire_age);
+	syslog(LOG_INFO, "map cache - %d allocated, %d active (%lld of %lld bytes), %d free; hash size: %d; expire age: %lld",
+	       alloc_count, map_count, (long long)mapped_bytes, (long long)max_mapped_bytes, free_count, hash_size,
+	       (long long)expire_age);
+	syslog(LOG_INFO, "  map cache - %ld hits, %ld misses, %ld evictions", hit_count, miss_count, evict_count);
+	syslog(LOG_INFO, "  gzip cache - %d compressed (%lld bytes), %ld hits (%g/sec)",
+	       gzip_count, (long long)gzip_bytes, gzip_hits, secs > 0 ? (float)gzip_hits / secs : 0);
+	gzip_hits = 0;
 
 	if (map_count + free_count != alloc_count)
 		syslog(LOG_ERR, "map counts don't add up!");
@@ -31,6 +31,12 @@
 /* Checks if filename is a built-in icon */
 extern int mmc_icon_check(char *filename, struct stat *st);
 
+/* Set the byte budget for mapped files, 0 keeps the built-in default.
+** Unreferenced maps are evicted, least recently used first, by mmc_map()
+** to stay within it.
+*/
+extern void mmc_init(off_t max_bytes);
+
 /* Returns an mmap()ed area for the given file, or (void*) 0 on errors.
 ** If you have a stat buffer on the file, pass it in, otherwise pass 0.
 ** Same for the current time.
@@ -43,6 +49,61 @@ extern void *mmc_map(char *filename, struct stat *sbP, struct timeval *nowP);
 */
 extern void mmc_unmap(void *addr, struct stat *sbP, struct timeval *nowP);
 
+/* Generated bodies, e.g. directory listings, cached like mapped files.
+** They are identified by the stat buffer of their source, and a key for
+** whatever else the contents depend on.  mmc_body() returns a cached
+** body, or (void*) 0 if there is none or it has aged out.  mmc_add_body()
+** takes over the malloc()ed buffer, if a body for the same source and
+** key has been added in the meantime that one is returned instead.  Both
+** fill in sbP to describe the body as a regular file, use it with the
+** other calls and release the body with mmc_unmap().
+*/
+extern void *mmc_body(const struct stat *src, const char *key, struct stat *sbP, struct timeval *nowP);
+extern void *mmc_add_body(const struct stat *src, const char *key, void *buf, size_t len, struct stat *sbP, struct timeval *nowP);
+
+/* Returns the quoted ETag, an MD5 digest of the contents, for an area
+** returned by mmc_map().  The digest is computed on first use and then
+** cached with the mapping.  If you have a stat buffer on the file, pass
+** it in, otherwise pass 0.  With a 0 address the stat buffer is used to
+** look for an existing mapping only, returns (char*) 0 if there is none.
+*/
+extern const char *mmc_etag(void *addr, struct stat *sbP);
+
+/* Returns the block of response headers cached with an area returned
+** by mmc_map(), and its length in lenP, or (char*) 0 if there is none.
+** The headers only depend on the file, and the key and MIME type they
+** were stored with using mmc_set_headers(), e.g. the server and vhost.
+** Only one block is kept per mapping, setting a new one replaces it.
+*/
+extern const char *mmc_headers(void *addr, struct stat *sbP, const void *key, const char *type, size_t *lenP);
+extern void mmc_set_headers(void *addr, struct stat *sbP, const void *key, const char *type, const char *hdr, size_t len);
+
+/* Returns a gzip compressed copy of an area returned by mmc_map(), and
+** its size in sizeP.  The copy is made on first use and then cached with
+** the mapping, within a total byte budget.  Returns (void*) 0 if the file
+** is too large, the cache is full, or when built without zlib.  In that
+** case the caller may want to fall back to deflating on the fly.
+*/
+extern void *mmc_gzip(void *addr, struct stat *sbP, int level, off_t *sizeP);
+
+/* Writes a manifest of the most requested mapped files, at most max of
+** them, hottest first, to fp.  Each line is the size, whether the ETag
+** and gzip copy were in use, and the file name, as given to mmc_map().
+** Returns the number of files written, or -1 on write errors.
+*/
+extern int mmc_manifest(FILE *fp, int max);
+
+/* Reads a manifest written by mmc_manifest(), queueing at most max files
+** that fit within the byte budget.  Each call to mmc_warm_up() then works
+** on about bytes worth of them.  First all files are mapped and the
+** kernel is asked to read them in, then their ETag and gzip copy are
+** precomputed, as before, except for files larger than bytes, those are
+** left for their first request.  The files are left unreferenced, to be
+** evicted like any other.  Returns the number of files still queued.
+*/
+extern int mmc_warm(FILE *fp, int max);
+extern int mmc_warm_up(int level, off_t bytes, struct timeval *nowP);
+
 /* Clean up the mmc package, freeing any unused storage.
 ** This should be called periodically, say every five minutes.
 ** If you have the current time, pass it in, otherwise pass 0.
@@ -52,6 +113,20 @@ extern void mmc_cleanup(struct timeval *nowP);
 /* Free all storage, usually in preparation for exitting. */
 extern void mmc_destroy(void);
 
+/* Counters for the stats endpoint, hits, misses and evictions are never
+** reset.
+*/
+struct mmc_stats {
+	int   maps;
+	off_t mapped_bytes;
+	int   gzip_count;
+	off_t gzip_bytes;
+	long  hits;
+	long  misses;
+	long  evictions;
+};
+extern void mmc_getstats(struct mmc_stats *st);
+
 /* Generate debugging statistics syslog message. */
 extern void mmc_logstats(long secs);
 
@@ -32,6 +32,7 @@
 #include <syslog.h>
 #include <sys/stat.h>
 
+#include "fcgi.h"
 #include "fdwatch.h"
 #include "libhttpd.h"
 #include "merecat.h"
@@ -172,11 +173,12 @@ struct httpd_server *srv_init(char *hostname, char *path, uint16_t port, int ssl
 
 	/* Initialize SSL library and load cert files before we chroot */
 	if (ssl) {
-		ctx = httpd_ssl_init(certfile, keyfile, dhfile);
+		ctx = httpd_ssl_init(certfile, keyfile, dhfile, ssl_session_cache, ssl_session_timeout, ssl_tickets);
 		if (!ctx) {
 			syslog(LOG_ERR, "Failed initializing SSL");
 			exit(1);
 		}
+		httpd_ssl_alpn(ctx, do_http2);
 	}
 
 	/* Initialize the HTTP layer.  Got to do this before giving up root,
@@ -185,10 +187,18 @@ struct httpd_server *srv_init(char *hostname, char *path, uint16_t port, int ssl
 	srv = httpd_init(hostname, gotv4 ? &sa4 : NULL, gotv6 ? &sa6 : NULL, port, ctx,
 			 cgi_pattern, cgi_limit, charset, max_age, path, 0,
 			 no_symlink_check, do_vhost, do_global_passwd, url_pattern, local_pattern,
-			 no_empty_referers, do_list_dotfiles);
+			 no_empty_referers, do_list_dotfiles,
+			 listen_backlog, defer_accept, tcp_fastopen);
 	if (!srv)
 		exit(1);
 
+	/* Tunables not passed to httpd_init() */
+	srv->etag_limit = etag_limit;
+	srv->compression_level = compression_level;
+	srv->send_buffer = send_buffer;
+	srv->log_timing = log_timing;
+	srv->fastcgi = fcgi_enabled();
+
 	return srv;
 }
 
@@ -26,8 +26,12 @@
 */
 
 #include <config.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -42,12 +46,375 @@
 #include <openssl/engine.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+/* Kernel TLS, OpenSSL 3.0 and later, if built with it */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS
+#endif
 
 #include "libhttpd.h"
 #include "file.h"
 #include "ssl.h"
 
-void *httpd_ssl_init(char *cert, char *key, char *dhparm)
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Sessions larger than this, e.g. with a client certificate, are not
+** stored in the shared cache.  Server side sessions are usually a few
+** hundred bytes.
+*/
+#ifndef SESSION_DER_MAX
+#define SESSION_DER_MAX 1024
+#endif
+
+/* One session in the shared cache.  A writer makes seq odd while it
+** updates the slot, other processes treat that as a miss, as they do a
+** slot that changed while it was read.  The cache is best effort, two
+** workers storing sessions in the same slot at the same time lose one.
+*/
+struct sess_slot {
+	volatile unsigned int seq;
+	unsigned int  idlen;
+	unsigned int  derlen;
+	time_t        expires;
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned char der[SESSION_DER_MAX];
+};
+
+struct ticket_key {
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+};
+
+/* Per SSL_CTX, set up before prefork workers are started, so all of
+** them share the session cache mapping and the ticket key secret.
+*/
+struct ssl_cache {
+	struct sess_slot *slots;	/* MAP_SHARED, or NULL */
+	size_t nslots;
+	long   timeout;
+
+	unsigned char secret[32];
+	time_t epoch;
+	struct ticket_key keys[2];	/* Current and previous */
+
+	struct httpd_ssl_stats stats;	/* This process only */
+};
+
+/* One TLS record worth of plaintext, see httpd_ssl_writev().  We are
+** single threaded and SSL_write() is done with the data on return, so
+** a single buffer is enough for all connections.
+*/
+static char staging[16384];
+
+static struct ssl_cache *ssl_cache(SSL *ssl)
+{
+	return SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+}
+
+static struct sess_slot *sess_slot(struct ssl_cache *c, const unsigned char *id, unsigned int len)
+{
+	unsigned int h = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ id[i]) * 16777619u;
+
+	return &c->slots[h % c->nslots];
+}
+
+/* Lock a slot for writing, fails if another process is at it */
+static int sess_lock(struct sess_slot *s)
+{
+	unsigned int seq = s->seq;
+
+	if (seq & 1)
+		return 0;
+
+	return __sync_bool_compare_and_swap(&s->seq, seq, seq + 1);
+}
+
+static void sess_unlock(struct sess_slot *s)
+{
+	__sync_fetch_and_add(&s->seq, 1);
+}
+
+static int sess_new(SSL *ssl, SSL_SESSION *sess)
+{
+	struct ssl_cache *c = ssl_cache(ssl);
+	const unsigned char *id;
+	unsigned char *p;
+	struct sess_slot *s;
+	unsigned int idlen;
+	int len;
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (!c || !idlen || idlen > sizeof(s->id) || len <= 0 || len > SESSION_DER_MAX)
+		return 0;
+
+	s = sess_slot(c, id, idlen);
+	if (!sess_lock(s))
+		return 0;
+
+	p = s->der;
+	s->derlen = i2d_SSL_SESSION(sess, &p);
+	s->idlen = idlen;
+	memcpy(s->id, id, idlen);
+	s->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+	sess_unlock(s);
+
+	/* We keep a copy, not a reference */
+	return 0;
+}
+
+static SSL_SESSION *sess_get(SSL *ssl, const unsigned char *id, int idlen, int *copy)
+{
+	struct ssl_cache *c = ssl_cache(ssl);
+	unsigned char der[SESSION_DER_MAX];
+	const unsigned char *p = der;
+	SSL_SESSION *sess = NULL;
+	struct sess_slot *s;
+	unsigned int seq, len;
+
+	*copy = 0;
+	if (!c || idlen <= 0 || idlen > (int)sizeof(s->id))
+		return NULL;
+
+	s = sess_slot(c, id, idlen);
+	seq = s->seq;
+	__sync_synchronize();
+	len = s->derlen;
+	if ((seq & 1) || s->idlen != (unsigned int)idlen || memcmp(s->id, id, idlen) ||
+	    s->expires <= time(NULL) || len > sizeof(der))
+		goto miss;
+
+	memcpy(der, s->der, len);
+	__sync_synchronize();
+	if (s->seq != seq)
+		goto miss;
+
+	sess = d2i_SSL_SESSION(NULL, &p, len);
+	if (!sess)
+		goto miss;
+
+	c->stats.cache_hits++;
+	return sess;
+miss:
+	c->stats.cache_misses++;
+	return NULL;
+}
+
+static void sess_remove(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	struct ssl_cache *c = SSL_CTX_get_app_data(ctx);
+	const unsigned char *id;
+	struct sess_slot *s;
+	unsigned int idlen;
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if (!c || !idlen || idlen > sizeof(s->id))
+		return;
+
+	s = sess_slot(c, id, idlen);
+	if (s->idlen != idlen || memcmp(s->id, id, idlen) || !sess_lock(s))
+		return;
+
+	s->idlen = 0;
+	sess_unlock(s);
+}
+
+/* Ticket keys are derived from the secret and the rotation period they
+** are for, so all workers arrive at the same keys without talking to
+** each other.
+*/
+static void ticket_key(struct ssl_cache *c, time_t epoch, struct ticket_key *k)
+{
+	unsigned char buf[sizeof(c->secret) + sizeof(uint64_t) + 1];
+	unsigned char md[EVP_MAX_MD_SIZE];
+	uint64_t e = (uint64_t)epoch;
+	unsigned int len;
+	size_t i;
+
+	memcpy(buf, c->secret, sizeof(c->secret));
+	memcpy(&buf[sizeof(c->secret)], &e, sizeof(e));
+	for (i = 0; i < 3; i++) {
+		buf[sizeof(buf) - 1] = i;
+		EVP_Digest(buf, sizeof(buf), md, &len, EVP_sha256(), NULL);
+		switch (i) {
+		case 0:
+			memcpy(k->name, md, sizeof(k->name));
+			break;
+		case 1:
+			memcpy(k->aes, md, sizeof(k->aes));
+			break;
+		case 2:
+			memcpy(k->hmac, md, sizeof(k->hmac));
+			break;
+		}
+	}
+	OPENSSL_cleanse(buf, sizeof(buf));
+	OPENSSL_cleanse(md, sizeof(md));
+}
+
+/* Find the key for a ticket, and set up the cipher, returns the key
+** index or -1 on error or if the key has been rotated out.
+*/
+static int ticket_cipher(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, int enc)
+{
+	struct ssl_cache *c = ssl_cache(ssl);
+	int i;
+
+	if (!c)
+		return -1;
+
+	if (enc) {
+		i = 0;
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return -1;
+		memcpy(name, c->keys[0].name, sizeof(c->keys[0].name));
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, c->keys[0].aes, iv) != 1)
+			return -1;
+	} else {
+		for (i = 0; i < 2; i++) {
+			if (!memcmp(name, c->keys[i].name, sizeof(c->keys[i].name)))
+				break;
+		}
+		if (i == 2)
+			return -1;
+		if (EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, c->keys[i].aes, iv) != 1)
+			return -1;
+	}
+
+	return i;
+}
+
+/* Returns 1 for a good ticket, 2 if it should be renewed with the
+** current key, and 0 for a full handshake.
+*/
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+{
+	OSSL_PARAM params[3];
+	int i;
+
+	i = ticket_cipher(ssl, name, iv, ectx, enc);
+	if (i < 0)
+		return enc ? -1 : 0;
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, ssl_cache(ssl)->keys[i].hmac, 32);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+		return -1;
+
+	return i == 0 ? 1 : 2;
+}
+#else
+static int ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	int i;
+
+	i = ticket_cipher(ssl, name, iv, ectx, enc);
+	if (i < 0)
+		return enc ? -1 : 0;
+
+	if (HMAC_Init_ex(hctx, ssl_cache(ssl)->keys[i].hmac, 32, EVP_sha256(), NULL) != 1)
+		return -1;
+
+	return i == 0 ? 1 : 2;
+}
+#endif
+
+static int ssl_cache_init(SSL_CTX *ctx, int entries, int timeout, int tickets)
+{
+	struct ssl_cache *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return 1;
+
+	if (timeout <= 0)
+		timeout = SSL_CTX_get_timeout(ctx);
+	c->timeout = timeout;
+	SSL_CTX_set_timeout(ctx, timeout);
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)PACKAGE, strlen(PACKAGE));
+	SSL_CTX_set_app_data(ctx, c);
+
+	/* Without a shared cache each process keeps its own */
+	if (entries > 0) {
+		c->slots = mmap(NULL, entries * sizeof(struct sess_slot), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (c->slots == MAP_FAILED) {
+			syslog(LOG_ERR, "Failed mapping TLS session cache: %s", strerror(errno));
+			c->slots = NULL;
+		} else {
+			c->nslots = entries;
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+			SSL_CTX_sess_set_new_cb(ctx, sess_new);
+			SSL_CTX_sess_set_get_cb(ctx, sess_get);
+			SSL_CTX_sess_set_remove_cb(ctx, sess_remove);
+		}
+	}
+
+	if (!tickets) {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		return 0;
+	}
+
+	if (RAND_bytes(c->secret, sizeof(c->secret)) != 1)
+		return 1;
+	httpd_ssl_rotate(ctx, time(NULL));
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_cb);
+#endif
+
+	return 0;
+}
+
+void httpd_ssl_rotate(void *ctx, time_t now)
+{
+	struct ssl_cache *c;
+	time_t epoch;
+
+	if (!ctx)
+		return;
+
+	c = SSL_CTX_get_app_data((SSL_CTX *)ctx);
+	if (!c)
+		return;
+
+	epoch = now / c->timeout;
+	if (epoch == c->epoch)
+		return;
+
+	c->epoch = epoch;
+	ticket_key(c, epoch, &c->keys[0]);
+	ticket_key(c, epoch - 1, &c->keys[1]);
+}
+
+void httpd_ssl_getstats(void *ctx, struct httpd_ssl_stats *st)
+{
+	struct ssl_cache *c = NULL;
+
+	if (ctx)
+		c = SSL_CTX_get_app_data((SSL_CTX *)ctx);
+	if (!c) {
+		memset(st, 0, sizeof(*st));
+		return;
+	}
+
+	*st = c->stats;
+}
+
+void *httpd_ssl_init(char *cert, char *key, char *dhparm, int cache, int timeout, int tickets)
 {
 	SSL_CTX *ctx;
 
@@ -74,6 +441,14 @@ void *httpd_ssl_init(char *cert, char *key, char *dhparm)
 
 	SSL_CTX_set_cipher_list(ctx, "HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4");
 
+	/* Non-blocking I/O, retried writes may come from another buffer */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef HAVE_KTLS
+	/* Let the kernel do record encryption when possible, for sendfile() */
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
  	SSL_CTX_set_default_verify_paths(ctx);
  	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
 
@@ -98,17 +473,70 @@ void *httpd_ssl_init(char *cert, char *key, char *dhparm)
 			httpd_ssl_log_errors();
 	}
 
+	if (ssl_cache_init(ctx, cache, timeout, tickets))
+		goto error;
+
 	return ctx;
 error:
 	httpd_ssl_log_errors();
 	return NULL;
 }
 
+/* RFC 7540, section 9.2, h2 needs TLS 1.2 or later */
+static int alpn_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		   const unsigned char *in, unsigned int inlen, void *arg)
+{
+	static const unsigned char protos[] = "\x02h2\x08http/1.1";
+	const unsigned char *p = protos;
+	unsigned int len = sizeof(protos) - 1;
+
+	if (!arg || SSL_version(ssl) < TLS1_2_VERSION) {
+		p   += 3;
+		len -= 3;
+	}
+
+	if (SSL_select_next_proto((unsigned char **)out, outlen, p, len, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
+void httpd_ssl_alpn(void *ctx, int h2)
+{
+	if (!ctx)
+		return;
+
+	SSL_CTX_set_alpn_select_cb((SSL_CTX *)ctx, alpn_cb, h2 ? ctx : NULL);
+}
+
+int httpd_ssl_h2(struct httpd_conn *hc)
+{
+	const unsigned char *proto = NULL;
+	unsigned int len = 0;
+
+	if (!hc->ssl)
+		return 0;
+
+	SSL_get0_alpn_selected(hc->ssl, &proto, &len);
+
+	return len == 2 && !memcmp(proto, "h2", 2);
+}
+
 void httpd_ssl_exit(struct httpd_server *hs)
 {
+	struct ssl_cache *c;
+
 	if (!hs || !hs->ctx)
 		return;
 
+	c = SSL_CTX_get_app_data((SSL_CTX *)hs->ctx);
+	if (c) {
+		if (c->slots)
+			munmap(c->slots, c->nslots * sizeof(struct sess_slot));
+		OPENSSL_cleanse(c, sizeof(*c));
+		free(c);
+	}
+
 #if HAVE_DECL_SSL_COMP_FREE_COMPRESSION_METHODS
 	SSL_COMP_free_compression_methods();
 #endif
@@ -145,10 +573,7 @@ int httpd_ssl_open(struct httpd_conn *hc)
 			goto error;
 
 		SSL_set_fd(hc->ssl, hc->conn_fd);
-		if (SSL_accept(hc->ssl) <= 0) {
-			SSL_free(hc->ssl);
-			goto error;
-		}
+		SSL_set_accept_state(hc->ssl);
 	}
 
 	return 0;
@@ -157,9 +582,50 @@ error:
 	return 1;
 }
 
+int httpd_ssl_handshake(struct httpd_conn *hc)
+{
+	int rc;
+
+	if (!hc->ssl)
+		return HS_DONE;
+
+	ERR_clear_error();
+	rc = SSL_accept(hc->ssl);
+	if (rc == 1) {
+		struct ssl_cache *c = ssl_cache(hc->ssl);
+
+		if (c) {
+			if (SSL_session_reused(hc->ssl))
+				c->stats.resumed++;
+			else
+				c->stats.full++;
+		}
+
+		return HS_DONE;
+	}
+
+	switch (SSL_get_error(hc->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+		return HS_WANT_READ;
+
+	case SSL_ERROR_WANT_WRITE:
+		return HS_WANT_WRITE;
+
+	default:
+		break;
+	}
+
+	httpd_ssl_log_errors();
+	return HS_FAIL;
+}
+
 void httpd_ssl_close(struct httpd_conn *hc)
 {
 	if (hc->ssl) {
+		/* Most clients just close, OpenSSL would then drop the
+		** session from the cache.  Fatal alerts already do that. */
+		if (SSL_is_init_finished(hc->ssl))
+			SSL_set_shutdown(hc->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
 		SSL_free(hc->ssl);
 		hc->ssl = NULL;
 	}
@@ -191,10 +657,46 @@ void httpd_ssl_log_errors(void)
 	ERR_print_errors_cb(ssl_error_cb, NULL);
 }
 
+/* Translate SSL_read()/SSL_write() return value to read()/write() style */
+static ssize_t ssl_error(struct httpd_conn *hc, int rc)
+{
+	switch (SSL_get_error(hc->ssl, rc)) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;	/* close_notify from client */
+
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		break;
+
+	case SSL_ERROR_SYSCALL:
+		/* errno set already, unless EOF without close_notify */
+		if (rc == 0 || !errno)
+			errno = ECONNRESET;
+		break;
+
+	default:
+		ERR_clear_error();
+		errno = EINVAL;
+		break;
+	}
+
+	/* Signal error to callee, like read()/write() */
+	return -1;
+}
+
 ssize_t httpd_ssl_read(struct httpd_conn *hc, void *buf, size_t len)
 {
-	if (hc->ssl)
-		return SSL_read(hc->ssl, buf, len);
+	if (hc->ssl) {
+		int rc;
+
+		ERR_clear_error();
+		rc = SSL_read(hc->ssl, buf, len);
+		if (rc <= 0)
+			return ssl_error(hc, rc);
+
+		return rc;
+	}
 
 	/* Yes, it's a regular read() here, not file_read() */
 	return read(hc->conn_fd, buf, len);
@@ -202,57 +704,101 @@ ssize_t httpd_ssl_read(struct httpd_conn *hc, void *buf, size_t len)
 
 ssize_t httpd_ssl_write(struct httpd_conn *hc, void *buf, size_t len)
 {
-	if (hc->ssl)
-		return SSL_write(hc->ssl, buf, len);
+	if (hc->ssl) {
+		int rc;
+
+		ERR_clear_error();
+		rc = SSL_write(hc->ssl, buf, len);
+		if (rc <= 0)
+			return ssl_error(hc, rc);
+
+		return rc;
+	}
 
 	return file_write(hc->conn_fd, buf, len);
 }
 
+/* Coalesce the response headers with the start of the body into one
+** TLS record, the rest is written straight from the caller's buffers.
+** Retries after EAGAIN start with the same bytes, as OpenSSL requires,
+** because only what was actually written is reported back.
+*/
 ssize_t httpd_ssl_writev(struct httpd_conn *hc, struct iovec *iov, size_t num)
 {
 	if (hc->ssl) {
-		char *buf;
-		size_t i, pos = 0, len = 0;
-		ssize_t rc;
+		size_t i, len = 0, skip = 0;
+		ssize_t rc, total;
 
-		for (i = 0; i < num; i++)
-			len += iov[i].iov_len;
+		if (num == 1 || iov[0].iov_len >= sizeof(staging))
+			return httpd_ssl_write(hc, iov[0].iov_base, iov[0].iov_len);
 
-		buf = malloc(len);
-		for (i = 0; i < num; i++) {
-			memcpy(&buf[pos], iov[i].iov_base, iov[i].iov_len);
-			pos += iov[i].iov_len;
+		for (i = 0; i < num && len < sizeof(staging); i++) {
+			skip = MIN(iov[i].iov_len, sizeof(staging) - len);
+			memcpy(&staging[len], iov[i].iov_base, skip);
+			len += skip;
 		}
 
-		rc = SSL_write(hc->ssl, buf, len);
-		if (rc < 0 && BIO_should_retry(SSL_get_wbio(hc->ssl))) {
-			usleep(100000);
-			rc = SSL_write(hc->ssl, buf, len);
-		}
+		total = httpd_ssl_write(hc, staging, len);
+		if (total < (ssize_t)len)
+			return total;
 
-		free(buf);
-		if (rc <= 0) {
-			rc = SSL_get_error(hc->ssl, rc);
-			switch (rc) {
-			case SSL_ERROR_WANT_WRITE:
-				errno = EAGAIN;
-				break;
+		/* Continue from the first byte not staged */
+		if (i > 0 && skip < iov[i - 1].iov_len)
+			i--;
+		else
+			skip = 0;
 
-			case SSL_ERROR_SYSCALL:
-				/* errno set already */
-				break;
+		for (; i < num; i++, skip = 0) {
+			char *ptr = (char *)iov[i].iov_base + skip;
 
-			default:
-				errno = EINVAL;
+			len = iov[i].iov_len - skip;
+			rc = httpd_ssl_write(hc, ptr, len);
+			if (rc <= 0)
 				break;
-			}
 
-			/* Signal error to callee, like writev() */
-			rc = -1;
+			total += rc;
+			if (rc < (ssize_t)len)
+				break;
 		}
 
-		return rc;
+		return total;
 	}
 
 	return writev(hc->conn_fd, iov, num);
 }
+
+#ifdef HAVE_KTLS
+/* Kernel TLS offload is only active if both OpenSSL and the kernel support
+** it, and only for the ciphers the kernel knows.  Check after handshake.
+*/
+int httpd_ssl_ktls(struct httpd_conn *hc)
+{
+	if (!hc->ssl)
+		return 0;
+
+	return BIO_get_ktls_send(SSL_get_wbio(hc->ssl));
+}
+
+ssize_t httpd_ssl_sendfile(struct httpd_conn *hc, int fd, off_t off, size_t len)
+{
+	ossl_ssize_t rc;
+
+	ERR_clear_error();
+	rc = SSL_sendfile(hc->ssl, fd, off, len, 0);
+	if (rc <= 0)
+		return ssl_error(hc, rc);
+
+	return rc;
+}
+#else
+int httpd_ssl_ktls(struct httpd_conn *hc)
+{
+	return 0;
+}
+
+ssize_t httpd_ssl_sendfile(struct httpd_conn *hc, int fd, off_t off, size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif /* HAVE_KTLS */
@@ -32,17 +32,54 @@
 #include <sys/uio.h>
 #include "libhttpd.h"
 
+/* httpd_ssl_handshake() return values */
+#define HS_FAIL       -1
+#define HS_DONE        0
+#define HS_WANT_READ   1
+#define HS_WANT_WRITE  2
+
+/* TLS counters of this process, for the stats endpoint */
+struct httpd_ssl_stats {
+	long full;		/* Handshakes without resumption */
+	long resumed;		/* Session ID or ticket handshakes */
+	long cache_hits;	/* Session ID lookups in the shared cache */
+	long cache_misses;
+};
+
 #ifdef ENABLE_SSL
 
-/* Initialize SSL and load certificate and key file */
-void *httpd_ssl_init(char *cert, char *key, char *dhparm);
+/* Initialize SSL and load certificate and key file.  Resumed sessions
+** are looked up in a cache of that many entries, shared with any worker
+** processes forked later, 0 uses a per-process cache.  Sessions expire
+** after timeout seconds, and with tickets enabled that is also how often
+** the ticket keys are rotated, see httpd_ssl_rotate().
+*/
+void *httpd_ssl_init(char *cert, char *key, char *dhparm, int cache, int timeout, int tickets);
+
+/* Call periodically to rotate session ticket keys, the previous key is
+** still accepted for one more period, those tickets are renewed.
+*/
+void httpd_ssl_rotate(void *ctx, time_t now);
+
+/* Negotiate the protocol with ALPN, h2 is preferred if enabled and the
+** client talks TLS 1.2 or later, otherwise http/1.1.
+*/
+void httpd_ssl_alpn(void *ctx, int h2);
+
+/* Get counters, all zero without HTTPS */
+void httpd_ssl_getstats(void *ctx, struct httpd_ssl_stats *st);
 
 /* Unload SSL, called automatically at httpd_exit() */
 void httpd_ssl_exit(struct httpd_server *hs);
 
-/* Open a new HTTPS connection */
+/* Open a new HTTPS connection, the handshake is done later */
 int httpd_ssl_open(struct httpd_conn *hc);
 
+/* Non-blocking TLS handshake, call again when the socket is ready in
+** the direction given by HS_WANT_READ or HS_WANT_WRITE.
+*/
+int httpd_ssl_handshake(struct httpd_conn *hc);
+
 /* Close a HTTP/HTTPS connection */
 void httpd_ssl_close(struct httpd_conn *hc);
 
@@ -52,16 +89,29 @@ void httpd_ssl_shutdown(struct httpd_conn *hc);
 /* Reads SSL error log and sends to syslog */
 void httpd_ssl_log_errors(void);
 
-/* Wrappers for read()/write() and writev() */
+/* Wrappers for read()/write() and writev(), a TLS connection that wants
+** to read or write returns -1 with errno EAGAIN, just like a socket.
+*/
 ssize_t httpd_ssl_read   (struct httpd_conn *hc, void *buf, size_t len);
 ssize_t httpd_ssl_write  (struct httpd_conn *hc, void *buf, size_t len);
 ssize_t httpd_ssl_writev (struct httpd_conn *hc, struct iovec *iov, size_t num);
 
+/* Client and server agreed on h2, after handshake */
+int     httpd_ssl_h2       (struct httpd_conn *hc);
+
+/* Kernel TLS send offload active, after handshake, then sendfile() works */
+int     httpd_ssl_ktls     (struct httpd_conn *hc);
+ssize_t httpd_ssl_sendfile (struct httpd_conn *hc, int fd, off_t off, size_t len);
+
 #else
-#define httpd_ssl_init(cert, key, dhparm) NULL
+#define httpd_ssl_init(cert, key, dhparm, cache, timeout, tickets) NULL
+#define httpd_ssl_rotate(ctx, now)
+#define httpd_ssl_alpn(ctx, h2)
+#define httpd_ssl_getstats(ctx, st)    memset(st, 0, sizeof(*(st)))
 #define httpd_ssl_exit(hs)
 
 #define httpd_ssl_open(hc)             (hc->ssl = NULL)
+#define httpd_ssl_handshake(hc)        HS_DONE
 #define httpd_ssl_close(hc)            close(hc->conn_fd)
 #define httpd_ssl_shutdown(hc)
 
@@ -70,6 +120,10 @@ ssize_t httpd_ssl_writev (struct httpd_conn *hc, struct iovec *iov, size_t num);
 #define httpd_ssl_read(hc, buf, len)   read       (hc->conn_fd, buf, len)
 #define httpd_ssl_write(hc, buf, len)  file_write (hc->conn_fd, buf, len)
 #define httpd_ssl_writev(hc, iov, num) writev     (hc->conn_fd, iov, num)
+
+#define httpd_ssl_h2(hc)               0
+#define httpd_ssl_ktls(hc)             0
+#define httpd_ssl_sendfile(hc, fd, off, len) (errno = ENOSYS, -1)
 #endif
 
 #endif /* MERECAT_SSL_H_ */
@@ -0,0 +1,625 @@
+/* stc.c - stat cache
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#ifdef TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# ifdef HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "stc.h"
+
+
+/* Defines. */
+#ifndef STAT_CACHE_AGE
+#define STAT_CACHE_AGE 2
+#endif
+#ifndef STAT_CACHE_AGE_INOTIFY
+#define STAT_CACHE_AGE_INOTIFY 60
+#endif
+#ifndef STAT_CACHE_SIZE
+#define STAT_CACHE_SIZE 4096
+#endif
+#define HASH_SIZE (STAT_CACHE_SIZE * 2)	/* Power of two */
+
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
+#define STC_STAT     0
+#define STC_LSTAT    1
+#define STC_READLINK 2
+#define STC_KINDS    3
+
+#define WATCH_HASH   1024	/* Power of two */
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+		      IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* The Entry struct. */
+typedef struct EntryStruct {
+	struct EntryStruct *next;
+	struct EntryStruct *dnext;	/* Entries in the same watched directory */
+	struct EntryStruct **dprev;
+	struct WatchStruct *watch;	/* Watch on the directory, or NULL */
+	unsigned int hash;
+	int kind;
+	int err;		/* errno of failed lookup, or 0 */
+	time_t expires;
+	struct stat sb;
+	char *link;		/* readlink() result, not NUL terminated */
+	ssize_t linklen;
+	char path[];
+} Entry;
+
+/* An inotify watch on a directory, removed again when the last entry
+** cached from the directory is dropped.
+*/
+typedef struct WatchStruct {
+	struct WatchStruct *next;	/* Path hash chain */
+	struct WatchStruct *wdnext;	/* Watch descriptor hash chain */
+	unsigned int hash;
+	int wd;			/* -1 when already removed by the kernel */
+	Entry *entries;
+	char path[];
+} Watch;
+
+/* Globals. */
+static Entry *hash_table[HASH_SIZE];
+static int entry_count = 0;
+static long lookup_count = 0, hit_count = 0, negative_count = 0, inval_count = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+static Watch *watch_table[WATCH_HASH];	/* By directory */
+static Watch *wd_table[WATCH_HASH];	/* By watch descriptor */
+static int ifd = -2;		/* -2 not yet initialized, -1 not available */
+static time_t checked_at = 0;
+#endif
+
+/* Forwards. */
+static void notify(void);
+static void unwatch(Watch *w);
+
+
+static unsigned int hash(int kind, const char *path)
+{
+	unsigned int h = 2166136261u ^ kind;	/* FNV-1a */
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static Entry *find(int kind, const char *path, unsigned int h)
+{
+	Entry *e;
+
+	for (e = hash_table[h & (HASH_SIZE - 1)]; e; e = e->next) {
+		if (e->hash == h && e->kind == kind && !strcmp(e->path, path))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void attach(Entry *e, Watch *w)
+{
+	e->watch = w;
+	e->dnext = w->entries;
+	if (e->dnext)
+		e->dnext->dprev = &e->dnext;
+	e->dprev = &w->entries;
+	w->entries = e;
+}
+
+/* The last entry of a directory takes its watch with it */
+static void detach(Entry *e)
+{
+	Watch *w = e->watch;
+
+	if (!w)
+		return;
+
+	*e->dprev = e->dnext;
+	if (e->dnext)
+		e->dnext->dprev = e->dprev;
+	e->watch = NULL;
+
+	if (!w->entries)
+		unwatch(w);
+}
+
+static void drop(Entry **ep)
+{
+	Entry *e = *ep;
+
+	*ep = e->next;
+	detach(e);
+	if (e->link)
+		free(e->link);
+	free(e);
+	--entry_count;
+}
+
+/* Drop an entry, found via its hash chain */
+static void drop_entry(Entry *e)
+{
+	Entry **ep = &hash_table[e->hash & (HASH_SIZE - 1)];
+
+	while (*ep != e)
+		ep = &(*ep)->next;
+	drop(ep);
+}
+
+/* Drop the stat, lstat and readlink entries of path */
+static void drop_path(const char *path)
+{
+	int kind;
+
+	for (kind = 0; kind < STC_KINDS; kind++) {
+		unsigned int h = hash(kind, path);
+		Entry **ep = &hash_table[h & (HASH_SIZE - 1)];
+
+		while (*ep) {
+			Entry *e = *ep;
+
+			if (e->hash == h && e->kind == kind && !strcmp(e->path, path))
+				drop(ep);
+			else
+				ep = &e->next;
+		}
+	}
+}
+
+/* Drop all entries, and with them all watches */
+static void invalidate(void)
+{
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		while (hash_table[i])
+			drop(&hash_table[i]);
+	}
+
+	++inval_count;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static Watch *find_watch(int wd)
+{
+	Watch *w;
+
+	for (w = wd_table[wd & (WATCH_HASH - 1)]; w; w = w->wdnext) {
+		if (w->wd == wd)
+			return w;
+	}
+
+	return NULL;
+}
+
+/* Watch the directory of path, returns the watch or NULL. */
+static Watch *watch(const char *path)
+{
+	char dir[MAXPATHLEN];
+	char *slash;
+	unsigned int h;
+	Watch *w;
+	int wd;
+
+	if (ifd == -2) {
+		ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (ifd < 0)
+			syslog(LOG_INFO, "stat cache: inotify not available: %s", strerror(errno));
+	}
+	if (ifd < 0)
+		return NULL;
+
+	slash = strrchr(path, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == path)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, MIN(sizeof(dir), (size_t)(slash - path) + 1), "%s", path);
+
+	h = hash(0, dir);
+	for (w = watch_table[h & (WATCH_HASH - 1)]; w; w = w->next) {
+		if (w->hash == h && !strcmp(w->path, dir))
+			return w;
+	}
+
+	/* The same directory by another name gets the same descriptor */
+	wd = inotify_add_watch(ifd, dir, WATCH_EVENTS);
+	if (wd < 0)
+		return NULL;
+	w = find_watch(wd);
+	if (w)
+		return w;
+
+	w = malloc(sizeof(Watch) + strlen(dir) + 1);
+	if (!w) {
+		inotify_rm_watch(ifd, wd);
+		return NULL;
+	}
+
+	strcpy(w->path, dir);
+	w->hash = h;
+	w->wd = wd;
+	w->entries = NULL;
+	w->next = watch_table[h & (WATCH_HASH - 1)];
+	watch_table[h & (WATCH_HASH - 1)] = w;
+	w->wdnext = wd_table[wd & (WATCH_HASH - 1)];
+	wd_table[wd & (WATCH_HASH - 1)] = w;
+
+	return w;
+}
+
+static void unwatch(Watch *w)
+{
+	Watch **wp;
+
+	for (wp = &watch_table[w->hash & (WATCH_HASH - 1)]; *wp; wp = &(*wp)->next) {
+		if (*wp == w) {
+			*wp = w->next;
+			break;
+		}
+	}
+	for (wp = &wd_table[w->wd & (WATCH_HASH - 1)]; w->wd >= 0 && *wp; wp = &(*wp)->wdnext) {
+		if (*wp == w) {
+			*wp = w->wdnext;
+			break;
+		}
+	}
+
+	if (w->wd >= 0)
+		inotify_rm_watch(ifd, w->wd);
+	free(w);
+}
+
+/* Drop the entries of a directory named in an event.  Entries in the
+** directory may be cached by any name, so compare with the last part.
+*/
+static void drop_name(Watch *w, const char *name)
+{
+	Entry *e, *next;
+
+	for (e = w->entries; e; e = next) {
+		char *base = strrchr(e->path, '/');
+
+		next = e->dnext;
+		if (!strcmp(base ? base + 1 : e->path, name))
+			drop_entry(e);
+	}
+}
+
+/* Drop all entries of a directory, the last one frees the watch */
+static void drop_dir(Watch *w)
+{
+	Entry *e, *next;
+
+	for (e = w->entries; e; e = next) {
+		next = e->dnext;
+		drop_entry(e);
+	}
+}
+
+/* Drain inotify events, at most once per second.  Only the file named
+** in an event is dropped, and the directory itself when its contents
+** change, all of it only when the directory itself goes away.
+*/
+static void notify(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	time_t now = time(NULL);
+	ssize_t len;
+
+	if (ifd < 0 || now == checked_at)
+		return;
+	checked_at = now;
+
+	while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+		char *ptr;
+
+		for (ptr = buf; ptr < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+			char dir[MAXPATHLEN];
+			Watch *w;
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				invalidate();
+				continue;
+			}
+
+			w = find_watch(ev->wd);
+			if (!w)
+				continue;
+			++inval_count;
+
+			if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+				/* Already removed, take it out of the lookup by wd */
+				if (ev->mask & IN_IGNORED) {
+					Watch **wp = &wd_table[w->wd & (WATCH_HASH - 1)];
+
+					while (*wp != w)
+						wp = &(*wp)->wdnext;
+					*wp = w->wdnext;
+					w->wd = -1;
+				}
+
+				drop_dir(w);
+				continue;
+			}
+
+			/* Either may free the watch, with the last entry */
+			snprintf(dir, sizeof(dir), "%s", w->path);
+			if (ev->len && ev->name[0])
+				drop_name(w, ev->name);
+			if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+				drop_path(dir);
+		}
+	}
+}
+#else
+static Watch *watch(const char *path)
+{
+	return NULL;
+}
+
+static void unwatch(Watch *w)
+{
+}
+
+static void notify(void)
+{
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* Is path resolved in its directory alone, i.e. with no ancestor? */
+static int direct(const char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	return !slash || slash == path;
+}
+
+/* Look up, or create, the cache entry.  Returns NULL if it must be done
+** uncached, e.g. cache disabled or out of memory.
+*/
+static Entry *lookup(int kind, const char *path)
+{
+	time_t now;
+	unsigned int h;
+	int link = 0;
+	Entry *e;
+	int rc;
+
+	if (STAT_CACHE_AGE <= 0)
+		return NULL;
+
+	notify();
+
+	++lookup_count;
+	now = time(NULL);
+	h = hash(kind, path);
+	e = find(kind, path, h);
+	if (e && e->expires > now) {
+		++hit_count;
+		if (e->err)
+			++negative_count;
+		return e;
+	}
+
+	if (!e) {
+		if (entry_count >= STAT_CACHE_SIZE) {
+			stc_cleanup(NULL);
+			if (entry_count >= STAT_CACHE_SIZE)
+				invalidate();
+		}
+
+		e = malloc(sizeof(Entry) + strlen(path) + 1);
+		if (!e)
+			return NULL;
+
+		memset(e, 0, sizeof(*e));
+		strcpy(e->path, path);
+		e->hash = h;
+		e->kind = kind;
+		e->next = hash_table[h & (HASH_SIZE - 1)];
+		hash_table[h & (HASH_SIZE - 1)] = e;
+		++entry_count;
+	} else if (e->link) {
+		free(e->link);
+		e->link = NULL;
+	}
+
+	if (kind == STC_READLINK) {
+		char link[MAXPATHLEN];
+
+		e->linklen = readlink(path, link, sizeof(link));
+		rc = e->linklen < 0 ? -1 : 0;
+		if (!rc) {
+			e->link = malloc(e->linklen + 1);
+			if (!e->link)
+				e->linklen = 0;
+			else
+				memcpy(e->link, link, e->linklen);
+		}
+	} else {
+		/* Same result as stat(), unless it's a symlink */
+		rc = lstat(path, &e->sb);
+		if (kind == STC_STAT && !rc && S_ISLNK(e->sb.st_mode)) {
+			rc = stat(path, &e->sb);
+			link = 1;
+		}
+	}
+	e->err = rc ? errno : 0;
+
+	/* Make sure we don't give out a half-baked entry */
+	if (e->err && e->err != ENOENT && e->err != ENOTDIR && e->err != EINVAL && e->err != EACCES) {
+		e->expires = 0;
+	} else {
+		if (!e->watch) {
+			Watch *w = watch(path);
+
+			if (w)
+				attach(e, w);
+		}
+
+		/* Only the directory the entry is in is watched, so a
+		** renamed ancestor, or a symlink target changing, goes
+		** unseen.  Only entries that depend on nothing else may
+		** live longer. */
+		if (e->watch && !link && direct(path))
+			e->expires = now + STAT_CACHE_AGE_INOTIFY;
+		else
+			e->expires = now + STAT_CACHE_AGE;
+	}
+
+	return e;
+}
+
+
+int stc_stat(const char *path, struct stat *sbP)
+{
+	Entry *e;
+
+	e = lookup(STC_STAT, path);
+	if (!e)
+		return stat(path, sbP);
+
+	if (e->err) {
+		errno = e->err;
+		return -1;
+	}
+
+	*sbP = e->sb;
+	return 0;
+}
+
+
+int stc_lstat(const char *path, struct stat *sbP)
+{
+	Entry *e;
+
+	e = lookup(STC_LSTAT, path);
+	if (!e)
+		return lstat(path, sbP);
+
+	if (e->err) {
+		errno = e->err;
+		return -1;
+	}
+
+	*sbP = e->sb;
+	return 0;
+}
+
+
+ssize_t stc_readlink(const char *path, char *buf, size_t len)
+{
+	Entry *e;
+
+	e = lookup(STC_READLINK, path);
+	if (!e || (!e->err && !e->link))
+		return readlink(path, buf, len);
+
+	if (e->err) {
+		errno = e->err;
+		return -1;
+	}
+
+	len = MIN(len, (size_t)e->linklen);
+	memcpy(buf, e->link, len);
+
+	return len;
+}
+
+
+void stc_cleanup(struct timeval *nowP)
+{
+	time_t now;
+	int i;
+
+	if (nowP)
+		now = nowP->tv_sec;
+	else
+		now = time(NULL);
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		Entry **ep = &hash_table[i];
+
+		while (*ep) {
+			if ((*ep)->expires <= now)
+				drop(ep);
+			else
+				ep = &(*ep)->next;
+		}
+	}
+}
+
+
+void stc_destroy(void)
+{
+	invalidate();
+#ifdef HAVE_SYS_INOTIFY_H
+	if (ifd >= 0)
+		close(ifd);
+	ifd = -2;
+#endif
+}
+
+
+/* Generate debugging statistics syslog message. */
+void stc_logstats(long secs)
+{
+	if (secs > 0)
+		syslog(LOG_INFO, "  stat cache - %d entries, %ld lookups (%g/sec), %ld hits (%ld negative), %ld invalidations",
+		       entry_count, lookup_count, (float)lookup_count / secs, hit_count, negative_count, inval_count);
+
+	lookup_count = hit_count = negative_count = inval_count = 0;
+}
@@ -0,0 +1,56 @@
+/* stc.h - stat cache
+**
+** Copyright (C) 2026  agent <agent@local>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef STC_H_
+#define STC_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Cached versions of stat(), lstat() and readlink().  Failed lookups
+** are cached too, with their errno.  Entries expire after a few seconds,
+** and, when inotify is available, when the directory they are in changes.
+** Entries directly in the working directory, and not through a symlink,
+** then live longer.
+*/
+extern int     stc_stat(const char *path, struct stat *sbP);
+extern int     stc_lstat(const char *path, struct stat *sbP);
+extern ssize_t stc_readlink(const char *path, char *buf, size_t len);
+
+/* Clean up the stc package, dropping expired entries.
+** This should be called periodically, say every five minutes.
+** If you have the current time, pass it in, otherwise pass 0.
+*/
+extern void stc_cleanup(struct timeval *nowP);
+
+/* Free all storage, usually in preparation for exitting. */
+extern void stc_destroy(void);
+
+/* Generate debugging statistics syslog message. */
+extern void stc_logstats(long secs);
+
+#endif /* STC_H_ */
@@ -35,11 +35,21 @@
 #include "timers.h"
 
 
-#define HASH_SIZE 67
-static Timer *timers[HASH_SIZE];
+/* Active timers are kept in a 4-ary min-heap ordered on trigger time,
+** each timer knows its own index so cancel and reset are O(log n).
+** A wider node means a shallower tree and fewer cache misses than a
+** binary heap, at the cost of a few more compares per level.
+*/
+#define HEAP_ARITY        4
+#define HEAP_INITIAL_SIZE 256
+static Timer **heap;
+static int heap_size;
 static Timer *free_timers;
 static int alloc_count, active_count, free_count;
 
+/* Statistics, reset by tmr_logstats() */
+static long insert_count, cancel_count, run_count, sift_count;
+
 arg_t noarg;
 
 #undef HAVE_CLOCK_MONO
@@ -49,95 +59,129 @@ static int use_monotonic = 0;	/* monotonic clock runtime availability flag */
 static struct timeval tv_diff;	/* system time - monotonic difference at start */
 #endif
 
-static unsigned int hash(Timer *t)
+static int before(Timer *a, Timer *b)
 {
-	/* We can hash on the trigger time, even though it can change over
-	** the life of a timer via either the periodic bit or the tmr_reset()
-	** call.  This is because both of those guys call l_resort(), which
-	** recomputes the hash and moves the timer to the appropriate list.
-	*/
-	return ((unsigned int)t->time.tv_sec ^ (unsigned int)t->time.tv_usec) % HASH_SIZE;
+	return timercmp(&a->time, &b->time, <);
 }
 
+static void h_place(Timer *t, int i)
+{
+	heap[i] = t;
+	t->index = i;
+}
 
-static void l_add(Timer *t)
+static void h_up(Timer *t, int i)
 {
-	int h = t->hash;
-	Timer *t2;
-	Timer *t2prev;
-
-	t2 = timers[h];
-	if (!t2) {
-		/* The list is empty. */
-		timers[h] = t;
-		t->prev = t->next = NULL;
-	} else {
-		if ( t->time.tv_sec   < t2->time.tv_sec ||
-		    (t->time.tv_sec  == t2->time.tv_sec &&
-		     t->time.tv_usec <= t2->time.tv_usec)) {
-			/* The new timer goes at the head of the list. */
-			timers[h] = t;
-			t->prev   = NULL;
-			t->next   = t2;
-			t2->prev  = t;
-		} else {
-			/* Walk the list to find the insertion point. */
-			for (t2prev = t2, t2 = t2->next; t2; t2prev = t2, t2 = t2->next) {
-				if (t->time.tv_sec < t2->time.tv_sec ||
-				    (t->time.tv_sec  == t2->time.tv_sec &&
-				     t->time.tv_usec <= t2->time.tv_usec)) {
-					/* Found it. */
-					t2prev->next = t;
-					t->prev      = t2prev;
-					t->next      = t2;
-					t2->prev     = t;
-					return;
-				}
-			}
-
-			/* Oops, got to the end of the list.  Add to tail. */
-			t2prev->next = t;
-			t->prev     = t2prev;
-			t->next     = NULL;
-		}
+	while (i > 0) {
+		int parent = (i - 1) / HEAP_ARITY;
+
+		if (!before(t, heap[parent]))
+			break;
+
+		h_place(heap[parent], i);
+		i = parent;
+		++sift_count;
 	}
+	h_place(t, i);
 }
 
+static void h_down(Timer *t, int i)
+{
+	for (;;) {
+		int child = i * HEAP_ARITY + 1;
+		int last  = child + HEAP_ARITY;
+		int min   = -1;
+
+		if (last > active_count)
+			last = active_count;
+		for (; child < last; child++) {
+			if (min < 0 || before(heap[child], heap[min]))
+				min = child;
+		}
+
+		if (min < 0 || !before(heap[min], t))
+			break;
+
+		h_place(heap[min], i);
+		i = min;
+		++sift_count;
+	}
+	h_place(t, i);
+}
 
-static void l_remove(Timer *t)
+/* Restore heap order after the trigger time of t has changed. */
+static void h_update(Timer *t)
 {
-	if (!t)
-		return;
+	int i = t->index;
 
-	if (!t->prev)
-		timers[t->hash] = t->next;
+	if (i > 0 && before(t, heap[(i - 1) / HEAP_ARITY]))
+		h_up(t, i);
 	else
-		t->prev->next = t->next;
+		h_down(t, i);
+}
 
-	if (t->next)
-		t->next->prev = t->prev;
+static int h_add(Timer *t)
+{
+	if (active_count >= heap_size) {
+		int size = heap_size ? heap_size * 2 : HEAP_INITIAL_SIZE;
+		Timer **h;
+
+		h = realloc(heap, sizeof(Timer *) * size);
+		if (!h)
+			return -1;
+
+		heap = h;
+		heap_size = size;
+	}
+
+	h_up(t, active_count++);
+	++insert_count;
+
+	return 0;
 }
 
+static void h_remove(Timer *t)
+{
+	Timer *last;
+	int i = t->index;
+
+	last = heap[--active_count];
+	if (last != t) {
+		last->index = i;
+		heap[i] = last;
+		h_update(last);
+	}
+	t->index = -1;
+}
 
-static void l_resort(Timer *t)
+/* Expired, cancelled or destroyed, only the second counts as a cancel */
+static void release(Timer *t)
 {
-	/* Remove the timer from its old list. */
-	l_remove(t);
+	/* Remove it from the heap. */
+	h_remove(t);
 
-	/* Recompute the hash. */
-	t->hash = hash(t);
+	/* And put it on the free list. */
+	t->next     = free_timers;
+	free_timers = t;
 
-	/* And add it back in to its new list, sorted correctly. */
-	l_add(t);
+	++free_count;
+}
+
+static void add_msecs(struct timeval *tv, long msecs)
+{
+	tv->tv_sec  +=  msecs / 1000L;
+	tv->tv_usec += (msecs % 1000L) * 1000L;
+	if (tv->tv_usec >= 1000000L) {
+		tv->tv_sec += tv->tv_usec / 1000000L;
+		tv->tv_usec %= 1000000L;
+	}
 }
 
 
 void tmr_init(void)
 {
-	int h;
-
-	for (h = 0; h < HASH_SIZE; ++h)
-		timers[h] = NULL;
+	heap = NULL;
+	heap_size = 0;
 	free_timers = NULL;
 	alloc_count = active_count = free_count = 0;
 
@@ -184,24 +228,22 @@ Timer *tmr_create(struct timeval *nowP, TimerProc *timer_proc, arg_t arg, long m
 	t->arg = arg;
 	t->msecs       = msecs;
 	t->periodic    = periodic;
+	t->next        = NULL;
 	if (nowP)
 		t->time = *nowP;
 	else
 		tmr_prepare_timeval(&t->time);
-
-	t->time.tv_sec  +=  msecs / 1000L;
-	t->time.tv_usec += (msecs % 1000L) * 1000L;
-	if (t->time.tv_usec >= 1000000L) {
-		t->time.tv_sec += t->time.tv_usec / 1000000L;
-		t->time.tv_usec %= 1000000L;
+	add_msecs(&t->time, msecs);
+
+	/* Add the new timer to the heap. */
+	if (h_add(t)) {
+		t->index    = -1;
+		t->next     = free_timers;
+		free_timers = t;
+		++free_count;
+		return NULL;
 	}
 
-	t->hash = hash(t);
-
-	/* Add the new timer to the proper active list. */
-	l_add(t);
-	++active_count;
-
 	return t;
 }
 
@@ -224,35 +266,17 @@ struct timeval *tmr_timeout(struct timeval *nowP)
 
 long tmr_mstimeout(struct timeval *nowP)
 {
-	int h;
-	int gotone;
-	long msecs, m;
+	long msecs;
 	Timer *t;
 
-	gotone = 0;
-	msecs  = 0;
-
-	/* Since the lists are sorted, we only need to look at
-	** the first timer on each one.
-	*/
-	for (h = 0; h < HASH_SIZE; ++h) {
-		t = timers[h];
-		if (t) {
-			m = (t->time.tv_sec - nowP->tv_sec) * 1000L + (t->time.tv_usec - nowP->tv_usec) / 1000L;
-			if (!gotone) {
-				msecs = m;
-				gotone = 1;
-			} else if (m < msecs) {
-				msecs = m;
-			}
-		}
-	}
-
-	if (!gotone)
+	/* The heap root is always the next timer to trigger. */
+	if (!active_count)
 		return INFTIM;
 
+	t = heap[0];
+	msecs = (t->time.tv_sec - nowP->tv_sec) * 1000L + (t->time.tv_usec - nowP->tv_usec + 999) / 1000L;
 	if (msecs <= 0)
-		msecs = 500; /* Was 0, but we should never poll() < 500 msec */
+		msecs = 1; /* Throttled connections wait in millisecond steps */
 
 	return msecs;
 }
@@ -260,67 +284,52 @@ long tmr_mstimeout(struct timeval *nowP)
 
 void tmr_run(struct timeval *nowP)
 {
-	int h;
 	Timer *t;
-	Timer *next;
-
-	for (h = 0; h < HASH_SIZE; ++h)
-		for (t = timers[h]; t; t = next) {
-			next = t->next;
-			/* Since the lists are sorted, as soon as we find a timer
-			** that isn't ready yet, we can go on to the next list.
-			*/
-			if (t->time.tv_sec > nowP->tv_sec || (t->time.tv_sec == nowP->tv_sec &&
-							      t->time.tv_usec > nowP->tv_usec))
-				break;
 
+	while (active_count) {
+		t = heap[0];
+		if (timercmp(&t->time, nowP, >))
+			break;
+
+		++run_count;
+
+		/* The callback may cancel its own timer, and create new ones,
+		** reusing this one from the free list.  So settle it first: a
+		** one-shot timer is freed, a periodic one rescheduled.
+		*/
+		if (t->periodic) {
+			add_msecs(&t->time, t->msecs);
+			h_update(t);
 			(t->timer_proc) (t->arg, nowP);
-			if (t->periodic) {
-				/* Reschedule. */
-				t->time.tv_sec  +=  t->msecs / 1000L;
-				t->time.tv_usec += (t->msecs % 1000L) * 1000L;
-				if (t->time.tv_usec >= 1000000L) {
-					t->time.tv_sec += t->time.tv_usec / 1000000L;
-					t->time.tv_usec %= 1000000L;
-				}
-				l_resort(t);
-			} else
-				tmr_cancel(t);
+		} else {
+			TimerProc *proc = t->timer_proc;
+			arg_t arg = t->arg;
+
+			release(t);
+			(proc) (arg, nowP);
 		}
+	}
 }
 
 
 void tmr_reset(struct timeval *nowP, Timer *t)
 {
-	if (!t)
+	if (!t || t->index < 0)
 		return;
 
 	t->time = *nowP;
-	t->time.tv_sec  +=  t->msecs / 1000L;
-	t->time.tv_usec += (t->msecs % 1000L) * 1000L;
-	if (t->time.tv_usec >= 1000000L) {
-		t->time.tv_sec += t->time.tv_usec / 1000000L;
-		t->time.tv_usec %= 1000000L;
-	}
-	l_resort(t);
+	add_msecs(&t->time, t->msecs);
+	h_update(t);
 }
 
 
 void tmr_cancel(Timer *t)
 {
-	if (!t)
+	if (!t || t->index < 0)
 		return;
 
-	/* Remove it from its active list. */
-	l_remove(t);
-	--active_count;
-
-	/* And put it on the free list. */
-	t->prev     = NULL;
-	t->next     = free_timers;
-	free_timers = t;
-
-	++free_count;
+	release(t);
+	++cancel_count;
 }
 
 
@@ -342,22 +351,38 @@ void tmr_cleanup(void)
 
 void tmr_destroy(void)
 {
-	int h;
-
-	for (h = 0; h < HASH_SIZE; ++h) {
-		while (timers[h])
-			tmr_cancel(timers[h]);
-	}
+	while (active_count)
+		release(heap[active_count - 1]);
 	tmr_cleanup();
+
+	free(heap);
+	heap = NULL;
+	heap_size = 0;
+}
+
+
+void tmr_getstats(struct tmr_stats *st)
+{
+	st->allocated = alloc_count;
+	st->active = active_count;
+	st->free = free_count;
 }
 
 
 /* Generate debugging statistics syslog message. */
 void tmr_logstats(long secs)
 {
+	long ops = insert_count + cancel_count;
+
 	syslog(LOG_INFO, "  timers - %d allocated, %d active, %d free", alloc_count, active_count, free_count);
+	if (secs > 0)
+		syslog(LOG_INFO, "  timers - %ld inserts, %ld cancels, %ld runs (%g/sec), %g sifts per op, heap size %d",
+		       insert_count, cancel_count, run_count, (float)run_count / secs,
+		       ops > 0 ? (float)sift_count / ops : 0.0, heap_size);
 	if (active_count + free_count != alloc_count)
 		syslog(LOG_ERR, "timer counts don't add up!");
+
+	insert_count = cancel_count = run_count = sift_count = 0;
 }
 
 /* Fill timeval structure for further usage by the package. */
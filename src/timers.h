@@ -60,9 +60,8 @@ typedef struct TimerStruct {
 	long msecs;
 	int periodic;
 	struct timeval time;
-	struct TimerStruct *prev;
-	struct TimerStruct *next;
-	int hash;
+	struct TimerStruct *next;	/* free list */
+	int index;			/* position in heap, -1 when inactive */
 } Timer;
 
 /* Initialize the timer package. */
@@ -102,6 +101,14 @@ extern void tmr_cleanup(void);
 /* Cancel all timers and free storage, usually in preparation for exitting. */
 extern void tmr_destroy(void);
 
+/* Current timer counts, for the stats endpoint. */
+struct tmr_stats {
+	int allocated;
+	int active;
+	int free;
+};
+extern void tmr_getstats(struct tmr_stats *st);
+
 /* Generate debugging statistics syslog message. */
 extern void tmr_logstats(long secs);
 
@@ -0,0 +1,100 @@
+#!/bin/sh
+# End-to-end benchmark, run with `make bench`.  Starts merecat on a
+# generated www tree and drives it with load, reporting requests per
+# second, p50/p99 latency and the resident size of the server after each
+# workload.  Set DURATION, CONNS or PORT in the environment to change
+# the defaults, MERECAT to benchmark another binary.
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+
+DURATION=${DURATION:-5}
+CONNS=${CONNS:-32}
+PORT=${PORT:-8087}
+MERECAT=${MERECAT:-../src/merecat}
+
+dir=`mktemp -d /tmp/merecat-bench.XXXXXX` || exit 1
+chmod 755 $dir
+pid=
+trap 'stop; rm -rf $dir' EXIT
+trap 'exit 1' INT TERM
+
+start()
+{
+    $MERECAT -n -l none -p $PORT "$@" $dir/www 2>>$dir/merecat.log &
+    pid=$!
+    sleep 1
+}
+
+stop()
+{
+    [ -n "$pid" ] && kill $pid 2>/dev/null && wait $pid 2>/dev/null
+    pid=
+}
+
+rss()
+{
+    echo "RSS `ps -o rss= -p $pid | tr -d ' '` KiB"
+}
+
+run()
+{
+    name=$1
+    shift
+    printf "%-12s " $name
+    result=`./load -c $CONNS -d $DURATION "$@" $PORT $files`
+    echo "$result, `rss`"
+}
+
+# The tree: small pages, a stylesheet worth compressing, a large file
+mkdir -p $dir/www/css $dir/www/img
+pages=
+i=0
+while [ $i -lt 100 ]; do
+    printf '<html><body><h1>Page %d</h1><p>Benchmark</p></body></html>\n' $i > $dir/www/page$i.html
+    pages="$pages /page$i.html"
+    i=$((i + 1))
+done
+awk 'BEGIN { for (i = 0; i < 2000; i++) printf ".c%d { margin: %dpx; padding: 0 }\n", i, i % 17 }' \
+    > $dir/www/css/main.css
+dd if=/dev/urandom of=$dir/www/img/big.bin bs=1024 count=16384 2>/dev/null
+
+echo "merecat `$MERECAT -V 2>&1`, $CONNS connections, $DURATION seconds per workload"
+start
+if ! kill -0 $pid 2>/dev/null; then
+    echo "Failed starting $MERECAT"
+    exit 1
+fi
+
+files=$pages
+run keepalive
+run close -C
+run pipelined -p 16
+files=/css/main.css
+run gzip -H "Accept-Encoding: gzip"
+files=/img/big.bin
+run range -H "Range: bytes=1000000-1065535"
+run multirange -H "Range: bytes=0-999,500000-500999,9000000-9000999"
+stop
+
+# HTTPS needs a config file, and openssl for the certificate and s_time
+if ! command -v openssl >/dev/null || ! $MERECAT -h 2>&1 | grep -q -- "-f FILE"; then
+    echo "tls          skipped, needs openssl and merecat built with libconfuse"
+    exit 0
+fi
+
+openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -days 1 \
+	-keyout $dir/key.pem -out $dir/cert.pem 2>/dev/null
+cat > $dir/merecat.conf <<EOC
+ssl      = true
+certfile = $dir/cert.pem
+keyfile  = $dir/key.pem
+EOC
+start -f $dir/merecat.conf
+for mode in new reuse; do
+    printf "%-12s " tls-$mode
+    result=`openssl s_time -connect 127.0.0.1:$PORT -www /page0.html -$mode -time $DURATION 2>/dev/null \
+	| awk '/connections in .* real seconds/ { printf "%s", $0 }'`
+    echo "${result:-failed}, `rss`"
+done
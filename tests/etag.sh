@@ -0,0 +1,8 @@
+#!/bin/sh
+# https://tools.ietf.org/html/rfc7232#section-3.2
+
+URL=http://localhost:8086/index.html
+ETAG=`curl -s -D - -o /dev/null $URL 2>/dev/null | sed -n 's/^ETag: \(.*\)\r$/\1/p'`
+[ -n "$ETAG" ] || exit 1
+
+curl -H "If-None-Match: W/\"foo\", $ETAG" -I $URL 2>/dev/null | grep "304 Not Modified"
@@ -1,5 +1,30 @@
 #!/bin/sh
 # https://en.wikipedia.org/wiki/HTTP_compression
 
-curl -H "Accept-Encoding: gzip" -I http://localhost:8086/main.css 2>/dev/null |grep gzip
+curl -H "Accept-Encoding: gzip" -I http://localhost:8086/main.css 2>/dev/null |grep gzip || exit 1
 
+# CGI output without a Content-Length is deflated on the fly, and chunked
+CGI=http://localhost:8086/cgi-bin/printenv
+curl -s -D - -o /dev/null -H "Accept-Encoding: gzip" $CGI |grep -i "^Transfer-Encoding: chunked" || exit 1
+curl -s --compressed $CGI |grep "^CGI printenv" || exit 1
+
+# No precompressed sibling, served from the cached gzip copy, which is
+# another representation with an ETag of its own.  Served from a docroot
+# of its own, so the test never writes into the tree
+dir=`mktemp -d /tmp/merecat-gzip.XXXXXX` || exit 1
+chmod 755 $dir
+seq 1 2000 > $dir/gzip.txt
+../src/merecat -n -l none -p 8087 $dir &
+pid=$!
+trap 'kill $pid; rm -rf $dir' EXIT
+sleep 1
+URL=http://localhost:8087/gzip.txt
+
+PLAIN=`curl -s -D - -o /dev/null $URL 2>/dev/null | sed -n 's/^ETag: \(.*\)\r$/\1/p'`
+GZIP=`curl -s -D - -o /dev/null -H "Accept-Encoding: gzip" $URL 2>/dev/null | sed -n 's/^ETag: \(.*\)\r$/\1/p'`
+[ -n "$PLAIN" ] && [ "$GZIP" != "$PLAIN" ] || exit 1
+echo "$GZIP" | grep -- '-gz"$' || exit 1
+
+# An unsatisfiable range gets the whole body, not an empty 200
+LEN=`curl -s -o /dev/null -w '%{size_download}' -H "Accept-Encoding: gzip" -H "Range: bytes=99999-" $URL`
+[ "$LEN" -gt 0 ]
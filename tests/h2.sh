@@ -0,0 +1,26 @@
+#!/bin/sh
+# HTTP/2 over cleartext, with prior knowledge, needs --with-http2
+
+grep -q "define ENABLE_HTTP2" ../config.h 2>/dev/null || exit 77
+curl -V | grep -q HTTP2 || exit 77
+
+URL=http://localhost:8086
+H2="curl -s --http2-prior-knowledge"
+
+$H2 -I $URL/main.css 2>/dev/null |grep "^HTTP/2 200" || exit 1
+
+# Ranges and gzip, as for HTTP/1.1
+$H2 -r 10-19 -o /dev/null -w "%{http_code} %{size_download}\n" $URL/index.html |grep "^206 10$" || exit 1
+$H2 -H "Accept-Encoding: gzip" -D - -o /dev/null $URL/main.css |grep -i "^content-encoding: gzip" || exit 1
+
+# CGI is refused, the client retries it with HTTP/1.1
+$H2 -v -o /dev/null $URL/cgi-bin/printenv 2>&1 |grep HTTP_1_1_REQUIRED || exit 1
+
+# Request headers are limited, as for HTTP/1.1, the stream is reset
+BIG=`head -c 6000 /dev/zero | tr '\0' a`
+$H2 -H "X-Big: $BIG" -o /dev/null -w "%{http_code}\n" $URL/main.css |grep "^000$" || exit 1
+
+# Several streams on one connection, curl only runs one at a time
+if command -v nghttp >/dev/null; then
+    nghttp -ns $URL/ $URL/main.css $URL/index.html |grep -c " 200 " |grep "^3$" || exit 1
+fi
@@ -0,0 +1,381 @@
+/* load.c - HTTP load generator for the benchmark harness
+**
+** Copyright (C) 2018  Joachim Nilsson <troglobit@gmail.com>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* Drives a number of concurrent connections against one server, with
+** keep-alive, optionally pipelining several requests at a time, for a
+** given number of seconds.  Reports requests per second and the 50th
+** and 99th percentile latency, from sending a request until the whole
+** response has been read.  Used by bench.sh, see `make bench`.
+*/
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_DEPTH 64
+
+struct conn {
+	int     fd;
+	char   *out;		/* Requests not yet written */
+	size_t  outlen, outoff;
+	char    in[16384];	/* Response headers being read */
+	size_t  inlen;
+	long    body;		/* Body bytes left, -1 in headers, -2 until EOF */
+	int     inflight;
+	int     closing;	/* Server said Connection: close */
+	double  sent[MAX_DEPTH];
+	int     head;
+};
+
+static struct addrinfo *ai;
+static char  *host = "127.0.0.1";
+static char **paths;
+static int    npaths, next_path;
+static char   headers[4096];
+static int    depth = 1, do_close = 0;
+
+static double *lat;
+static long    nlat, maxlat;
+static long    errors;
+static long long bytes;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record(double t)
+{
+	if (nlat == maxlat) {
+		maxlat = maxlat ? maxlat * 2 : 65536;
+		lat = realloc(lat, maxlat * sizeof(double));
+		if (!lat)
+			err(1, "realloc");
+	}
+	lat[nlat++] = t;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void disconnect(struct conn *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->inflight = 0;
+	c->closing = 0;
+	c->outlen = c->outoff = c->inlen = 0;
+	c->body = -1;
+}
+
+static int reconnect(struct conn *c)
+{
+	int one = 1;
+
+	disconnect(c);
+	c->fd = socket(ai->ai_family, SOCK_STREAM, 0);
+	if (c->fd < 0)
+		err(1, "socket");
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, ai->ai_addr, ai->ai_addrlen)) {
+		errors++;
+		disconnect(c);
+		return -1;
+	}
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+	return 0;
+}
+
+/* Queue the next batch of requests, one unless pipelining */
+static void queue(struct conn *c)
+{
+	size_t len;
+	double t = now();
+	int i;
+
+	c->outlen = c->outoff = 0;
+	for (i = 0; i < depth; i++) {
+		char req[8192];
+
+		len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n",
+			       paths[next_path++ % npaths], host, headers,
+			       do_close ? "Connection: close\r\n" : "Connection: keep-alive\r\n");
+		c->out = realloc(c->out, c->outlen + len);
+		if (!c->out)
+			err(1, "realloc");
+		memcpy(&c->out[c->outlen], req, len);
+		c->outlen += len;
+		c->sent[(c->head + c->inflight++) % MAX_DEPTH] = t;
+	}
+}
+
+static void done(struct conn *c)
+{
+	record(now() - c->sent[c->head]);
+	c->head = (c->head + 1) % MAX_DEPTH;
+	c->inflight--;
+	c->body = -1;
+}
+
+/* Parse response headers in c->in, returns 1 when complete */
+static int response(struct conn *c)
+{
+	char *end, *p;
+	size_t len;
+	int status;
+
+	end = memmem(c->in, c->inlen, "\r\n\r\n", 4);
+	if (!end) {
+		if (c->inlen == sizeof(c->in))
+			errx(1, "Response headers too large");
+		return 0;
+	}
+	*end = 0;
+	len = end + 4 - c->in;
+
+	if (sscanf(c->in, "HTTP/%*d.%*d %d", &status) != 1)
+		errx(1, "Bad response: %.40s", c->in);
+	if (status >= 400)
+		errors++;
+
+	c->body = -2;
+	p = strcasestr(c->in, "\r\nContent-Length:");
+	if (p)
+		c->body = atol(p + 17);
+	else if (status == 304 || status == 204)
+		c->body = 0;
+	if (strcasestr(c->in, "\r\nConnection: close"))
+		c->closing = 1;
+
+	/* Leftovers are body, or the next pipelined response */
+	memmove(c->in, &c->in[len], c->inlen - len);
+	c->inlen -= len;
+
+	return 1;
+}
+
+static void input(struct conn *c, char *buf, size_t len)
+{
+	while (len > 0 || (c->body == 0 && c->inflight)) {
+		if (c->body == -1) {
+			size_t n = sizeof(c->in) - c->inlen;
+
+			if (n > len)
+				n = len;
+			memcpy(&c->in[c->inlen], buf, n);
+			c->inlen += n;
+			buf += n;
+			len -= n;
+			if (!response(c))
+				continue;
+
+			/* Body already read along with the headers */
+			if (c->inlen) {
+				char tmp[sizeof(c->in)];
+				size_t left = c->inlen;
+
+				memcpy(tmp, c->in, left);
+				c->inlen = 0;
+				input(c, tmp, left);
+			}
+			continue;
+		}
+
+		if (c->body == -2) {
+			len = 0;	/* Read until EOF */
+			break;
+		}
+
+		if ((long)len >= c->body) {
+			buf += c->body;
+			len -= c->body;
+			done(c);
+		} else {
+			c->body -= len;
+			len = 0;
+		}
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: load [-C] [-c CONNS] [-d SEC] [-H HEADER] [-h HOST] [-p DEPTH] PORT PATH [PATH ...]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+	struct pollfd *pfd;
+	struct conn *conn;
+	double start, end, elapsed;
+	int nconn = 16, duration = 5;
+	int i, c, rc;
+
+	while ((c = getopt(argc, argv, "Cc:d:H:h:p:")) != EOF) {
+		switch (c) {
+		case 'C':
+			do_close = 1;
+			break;
+		case 'c':
+			nconn = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'H':
+			strncat(headers, optarg, sizeof(headers) - strlen(headers) - 3);
+			strcat(headers, "\r\n");
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			depth = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 2 || nconn < 1 || depth < 1 || depth > MAX_DEPTH)
+		usage();
+
+	rc = getaddrinfo(host, argv[optind], &hints, &ai);
+	if (rc)
+		errx(1, "%s: %s", host, gai_strerror(rc));
+	paths = &argv[optind + 1];
+	npaths = argc - optind - 1;
+	if (do_close)
+		depth = 1;
+
+	conn = calloc(nconn, sizeof(*conn));
+	pfd = calloc(nconn, sizeof(*pfd));
+	if (!conn || !pfd)
+		err(1, "calloc");
+	for (i = 0; i < nconn; i++) {
+		conn[i].fd = -1;
+		conn[i].body = -1;
+	}
+
+	start = now();
+	end = start + duration;
+	while (1) {
+		double t = now();
+		int active = 0;
+
+		for (i = 0; i < nconn; i++) {
+			struct conn *cn = &conn[i];
+
+			if (!cn->inflight && t < end) {
+				if (cn->fd < 0 && reconnect(cn))
+					continue;
+				queue(cn);
+			}
+
+			pfd[i].fd = cn->inflight ? cn->fd : -1;
+			pfd[i].events = cn->outoff < cn->outlen ? POLLOUT : POLLIN;
+			active += cn->inflight > 0;
+		}
+		if (!active)
+			break;
+
+		if (poll(pfd, nconn, 1000) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		for (i = 0; i < nconn; i++) {
+			struct conn *cn = &conn[i];
+			char buf[65536];
+			ssize_t n;
+
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+
+			if (pfd[i].events & POLLOUT) {
+				n = write(cn->fd, &cn->out[cn->outoff], cn->outlen - cn->outoff);
+				if (n > 0)
+					cn->outoff += n;
+				else if (errno != EAGAIN) {
+					errors++;
+					disconnect(cn);
+				}
+				continue;
+			}
+
+			n = read(cn->fd, buf, sizeof(buf));
+			if (n > 0) {
+				bytes += n;
+				input(cn, buf, n);
+				if (cn->closing && !cn->inflight)
+					disconnect(cn);
+			} else if (n == 0) {
+				/* Server closed, fine if we were reading until EOF */
+				if (cn->body == -2 && cn->inflight)
+					done(cn);
+				if (cn->inflight)
+					errors++;
+				disconnect(cn);
+			} else if (errno != EAGAIN) {
+				errors++;
+				disconnect(cn);
+			}
+		}
+	}
+	elapsed = now() - start;
+
+	if (!nlat)
+		errx(1, "No responses, errors %ld", errors);
+	qsort(lat, nlat, sizeof(double), cmp);
+	printf("%ld requests in %.1f s, %.0f req/s, %.1f MiB/s, p50 %.2f ms, p99 %.2f ms, %ld errors\n",
+	       nlat, elapsed, nlat / elapsed, bytes / elapsed / 1048576, lat[nlat / 2] * 1e3,
+	       lat[(long)(nlat * 0.99)] * 1e3, errors);
+
+	return 0;
+}
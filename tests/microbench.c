@@ -0,0 +1,273 @@
+/* microbench.c - microbenchmarks of the core subsystems
+**
+** Copyright (C) 2018  Joachim Nilsson <troglobit@gmail.com>
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNERS OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+** INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+** CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+** THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* Run with `make bench`, each benchmark is repeated until it has run for
+** a while, then the time per operation is reported.  The request parser,
+** MIME lookup, matcher, timers and map cache are run on synthetic input
+** in a scratch directory, without any network I/O.
+*/
+
+/* The parser is used through its public API, but figure_mime() and the
+** other helpers are static, so we build libhttpd.c as part of this file.
+*/
+#include "libhttpd.c"
+
+#include <err.h>
+#include <time.h>
+
+char *prognm = "microbench";
+
+static struct httpd_server bench_hs;
+static struct httpd_conn   bench_hc;
+
+static const char *request =
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:58.0) Gecko/20100101 Firefox/58.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://localhost/\r\n"
+	"Connection: keep-alive\r\n"
+	"If-Modified-Since: Sat, 01 Jan 2000 00:00:00 GMT\r\n"
+	"\r\n";
+
+static char *files[] = {
+	"index.html", "style.css", "app.js", "photo.jpeg", "logo.png", "archive.tar.gz",
+	"README", "font.woff2", "data.json", "video.mp4", "doc.pdf", "app.js.br",
+};
+
+static char *paths[] = {
+	"/index.html", "/cgi-bin/test.cgi", "/img/logo.png", "/tools/admin.php",
+	"/a/b/c/d/e/f/g.txt", "/cgi-bin/", "/docs/manual/index.html", "/x.cgi.bak",
+};
+
+#define PATTERN "**.cgi|**.php|/cgi-bin/*"
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void load_request(struct httpd_conn *hc)
+{
+	size_t len = strlen(request);
+
+	httpd_init_conn_content(hc);
+	memcpy(hc->read_buf, request, len);
+	hc->read_idx = len;
+}
+
+static void got_request(long n)
+{
+	while (n--) {
+		load_request(&bench_hc);
+		if (httpd_got_request(&bench_hc) != GR_GOT_REQUEST)
+			errx(1, "httpd_got_request() failed");
+	}
+}
+
+static void parse_request(long n)
+{
+	while (n--) {
+		load_request(&bench_hc);
+		if (httpd_got_request(&bench_hc) != GR_GOT_REQUEST || httpd_parse_request(&bench_hc) < 0)
+			errx(1, "httpd_parse_request() failed");
+	}
+}
+
+static void mime(long n)
+{
+	struct httpd_conn *hc = &bench_hc;
+	size_t i;
+
+	while (n--) {
+		i = n % NELEMS(files);
+		httpd_realloc_str(&hc->expnfilename, &hc->maxexpnfilename, strlen(files[i]));
+		strcpy(hc->expnfilename, files[i]);
+		figure_mime(hc);
+	}
+}
+
+static void match_plain(long n)
+{
+	while (n--)
+		match(PATTERN, paths[n % NELEMS(paths)]);
+}
+
+static void match_compiled(long n)
+{
+	static struct pattern *p;
+
+	if (!p)
+		p = match_compile(PATTERN);
+	while (n--)
+		match_exec(p, paths[n % NELEMS(paths)]);
+}
+
+static void timer_cb(arg_t arg, struct timeval *now)
+{
+}
+
+/* Connections arm and cancel a timer or two per request */
+static void timers(long n)
+{
+	static Timer *t[1000];
+	struct timeval tv;
+	long i;
+
+	gettimeofday(&tv, NULL);
+	while (n > 0) {
+		for (i = 0; i < (long)NELEMS(t); i++)
+			t[i] = tmr_create(&tv, timer_cb, noarg, 1000 + (i * 7919) % 60000, 0);
+		for (i = 0; i < (long)NELEMS(t); i++)
+			tmr_cancel(t[i]);
+		tmr_cleanup();
+		n -= NELEMS(t);
+	}
+}
+
+static void timers_run(long n)
+{
+	struct timeval tv;
+	long i;
+
+	gettimeofday(&tv, NULL);
+	while (n > 0) {
+		for (i = 0; i < 1000; i++)
+			tmr_create(&tv, timer_cb, noarg, 0, 0);
+		tmr_run(&tv);
+		n -= 1000;
+	}
+}
+
+/* A cached file, what most requests end up doing */
+static void mmc_hit(long n)
+{
+	struct timeval tv;
+	struct stat st;
+	void *addr;
+
+	gettimeofday(&tv, NULL);
+	while (n--) {
+		if (stc_stat(files[n % 3], &st))
+			err(1, "stat %s", files[n % 3]);
+		addr = mmc_map(files[n % 3], &st, &tv);
+		if (!addr)
+			errx(1, "mmc_map() failed");
+		mmc_unmap(addr, &st, &tv);
+	}
+}
+
+static void bench(const char *name, void (*fn)(long))
+{
+	double start, elapsed;
+	long n = 1000;
+
+	fn(n);			/* Warm up caches */
+	while (1) {
+		start = now_ns();
+		fn(n);
+		elapsed = now_ns() - start;
+		if (elapsed > 2e8 || n > 1000000000L)
+			break;
+		n *= 2;
+	}
+
+	printf("%-20s %12ld %12.1f ns/op\n", name, n, elapsed / n);
+}
+
+static void setup(char *dir)
+{
+	size_t i;
+
+	if (!mkdtemp(dir) || chdir(dir))
+		err(1, "Failed creating scratch directory");
+
+	for (i = 0; i < NELEMS(files); i++) {
+		FILE *fp;
+		int j;
+
+		fp = fopen(files[i], "w");
+		if (!fp)
+			err(1, "Failed creating %s", files[i]);
+		for (j = 0; j < 100; j++)
+			fprintf(fp, "<p>Line %d of %s, some text to fill the file.</p>\n", j, files[i]);
+		fclose(fp);
+	}
+
+	bench_hs.cwd = dir;
+	bench_hs.charset = DEFAULT_CHARSET;
+	bench_hs.max_age = -1;
+	bench_hs.etag_limit = -1;
+	bench_hs.listen4_fd = bench_hs.listen6_fd = -1;
+
+	httpd_init_conn_mem(&bench_hc);
+	bench_hc.hs = &bench_hs;
+	bench_hc.conn_fd = -1;
+}
+
+static void cleanup(char *dir)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(files); i++)
+		unlink(files[i]);
+	if (chdir("/") || rmdir(dir))
+		warn("Failed removing %s", dir);
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/merecat-bench.XXXXXX";
+
+	openlog(prognm, LOG_PERROR, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_ERR));
+	setup(dir);
+	tmr_init();
+	mmc_init(0);
+
+	printf("%-20s %12s %12s\n", "benchmark", "iterations", "time");
+	bench("got_request", got_request);
+	bench("parse_request", parse_request);
+	bench("figure_mime", mime);
+	bench("match", match_plain);
+	bench("match_exec", match_compiled);
+	bench("tmr_create/cancel", timers);
+	bench("tmr_run", timers_run);
+	bench("mmc_map/unmap", mmc_hit);
+
+	mmc_destroy();
+	tmr_destroy();
+	cleanup(dir);
+
+	return 0;
+}
@@ -6,7 +6,7 @@ fi
 
 cd ../www
 
-../src/merecat -n -l none -p 8086 &
+../src/merecat -n -l none -p 8086 -m /.stats &
 echo $! >/tmp/merecat.test
 
 if [ ! -e main.css ]; then
@@ -0,0 +1,5 @@
+#!/bin/sh
+# Built-in stats endpoint, Prometheus text format
+
+curl -s -o /dev/null http://localhost:8086/index.html
+curl -s http://localhost:8086/.stats 2>/dev/null | grep 'merecat_requests_total{.*code="2xx"}'